@@ -54,6 +54,15 @@ inline void operator delete[](void* p)
 #endif
 
 #include <HashTrie.h>
+#include <HashTrieParallel.h>
+#include <HashTrieFile.h>
+#include <HashTrieStore.h>
+#include <HashTrieLog.h>
+#include <HashTrieSnapshot.h>
+#include <HashTrieCodec.h>
+#include <HashTrieShared.h>
+#include <HashTrieCompact.h>
+#include <HashTrieInline.h>
 
 typedef unsigned char u8;
 typedef uint16_t u16;
@@ -97,6 +106,47 @@ u64 GetMicroTime()
 
 #endif
 
+void PrintStats(const CHashTrieStats& stats)
+{
+    printf("   Stats: %u leaves, %u nodes (%u dense, %u skipping %u levels), %u KB nodes, max depth %u, avg probe %.2f, %u collision buckets\n",
+        stats.leafCount,
+        stats.nodeCount,
+        stats.denseNodeCount,
+        stats.skipNodeCount,
+        stats.skippedLevelCount,
+        uint32(stats.nodeBytes / 1024),
+        stats.maxLeafDepth,
+        stats.averageProbeLength,
+        stats.collisionBucketCount);
+}
+
+void PrintCounters()
+{
+#if HAMT_PERF_COUNTERS
+    CHashTrieCounters counters = GetHashTrieCounters();
+    printf("   Counters: find %llu levels %llu compares %llu miss(empty %llu, mismatch %llu)\n",
+        (unsigned long long)counters.findCount,
+        (unsigned long long)counters.findLevels,
+        (unsigned long long)counters.findLeafCompares,
+        (unsigned long long)counters.findMissEmptySlot,
+        (unsigned long long)counters.findMissKeyMismatch);
+    printf("             add %llu alloc1 chains %llu (nodes %llu, max %llu, skipped %llu, splits %llu) resize %llu (%llu KB moved, dense %llu/%llu) remove %llu fold-ups %llu\n",
+        (unsigned long long)counters.addCount,
+        (unsigned long long)counters.addAlloc1Chains,
+        (unsigned long long)counters.addAlloc1Nodes,
+        (unsigned long long)counters.addMaxAlloc1Chain,
+        (unsigned long long)counters.addSkippedLevels,
+        (unsigned long long)counters.addSkipSplits,
+        (unsigned long long)counters.resizeCount,
+        (unsigned long long)(counters.resizeBytesMoved / 1024),
+        (unsigned long long)counters.resizeDenseGrows,
+        (unsigned long long)counters.resizeDenseShrinks,
+        (unsigned long long)counters.removeCount,
+        (unsigned long long)counters.removeFoldUps);
+    ResetHashTrieCounters();
+#endif
+}
+
 void TestHashTrie()
 {
     // uint32 to uint32 key/vaue pair example
@@ -127,6 +177,7 @@ void TestHashTrie()
         test_uint32.Add(test);
     }
     printf("   %10u usec\n", int(GetMicroTime() - t0));
+    PrintStats(test_uint32.GetStats());
 
     printf("2) Find %d entries:   ", MAX_TEST_ENTRIES);
     t0 = GetMicroTime();
@@ -138,6 +189,78 @@ void TestHashTrie()
     }
     printf("   %10u usec\n", int(GetMicroTime() - t0));
 
+    printf("   FindBatch:         ");
+    {
+        constexpr uint32 BATCH = 256;
+        THashKey32<uint32> keys[BATCH];
+        Test* results[BATCH];
+        t0 = GetMicroTime();
+        for (uint32 i = 0; i < MAX_TEST_ENTRIES; i += BATCH)
+        {
+            uint32 count = (MAX_TEST_ENTRIES - i < BATCH) ? MAX_TEST_ENTRIES - i : BATCH;
+            for (uint32 j = 0; j < count; j++)
+                keys[j].Set(i + j);
+            test_uint32.FindBatch(keys, count, results);
+            for (uint32 j = 0; j < count; j++)
+                assert(results[j] != nullptr && results[j]->Get() == i + j);
+        }
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+    }
+
+    {
+        // Delta update: merge a batch of new entries into the trie and take it out again
+        constexpr uint32 DELTA = MAX_TEST_ENTRIES / 10;
+        Test** nodes = new Test*[DELTA];
+        THashKey32<uint32>* keys = new THashKey32<uint32>[DELTA];
+        for (uint32 i = 0; i < DELTA; i++)
+        {
+            nodes[i] = new Test(MAX_TEST_ENTRIES + i);
+            keys[i].Set(MAX_TEST_ENTRIES + i);
+        }
+
+        printf("   AddBatch %d:    ", DELTA);
+        t0 = GetMicroTime();
+        test_uint32.AddBatch(nodes, DELTA);
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+        assert(test_uint32.GetCount() == MAX_TEST_ENTRIES + DELTA);
+
+        printf("   RemoveBatch %d: ", DELTA);
+        t0 = GetMicroTime();
+        uint32 removed = test_uint32.RemoveBatch(keys, DELTA, nodes);
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+        assert(removed == DELTA);
+
+        for (uint32 i = 0; i < DELTA; i++)
+            delete nodes[i];
+        delete[] nodes;
+        delete[] keys;
+    }
+
+    {
+        // Batch remove of mostly absent keys from a small trie, whose nodes
+        // skip levels (path compression)
+        constexpr uint32 SMALL = 2000;
+        constexpr uint32 ABSENT = 200000;
+        THashTrie<Test, THashKey32<uint32>> small;
+        for (uint32 i = 0; i < SMALL; i++)
+            small.Add(new Test(i));
+
+        Test** nodes = new Test*[ABSENT];
+        THashKey32<uint32>* keys = new THashKey32<uint32>[ABSENT];
+        for (uint32 i = 0; i < ABSENT; i++)
+            keys[i].Set(SMALL / 2 + i);
+        uint32 removed = small.RemoveBatch(keys, ABSENT, nodes);
+        assert(removed == SMALL / 2 && small.GetCount() == SMALL / 2);
+        (void)removed;
+        for (uint32 i = 0; i < ABSENT; i++)
+            delete nodes[i];
+        for (uint32 i = 0; i < SMALL / 2; i++)
+            assert(small.Find(THashKey32<uint32>(i)) != nullptr);
+        small.Destroy();
+        delete[] nodes;
+        delete[] keys;
+    }
+
     printf("3) Remove %d entries: ", MAX_TEST_ENTRIES);
     t0 = GetMicroTime();
     for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
@@ -147,7 +270,494 @@ void TestHashTrie()
         assert(removed->Get() == i);
         delete removed;
     }
-    printf("   %10u usec\n\n", int(GetMicroTime() - t0));
+    printf("   %10u usec\n", int(GetMicroTime() - t0));
+    PrintCounters();
+    printf("\n");
+
+    //
+    // parallel build test
+    //
+    printf("32 bit integer parallel build test...\n");
+    {
+        Test** nodes = new Test*[MAX_TEST_ENTRIES];
+        for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+            nodes[i] = new Test(i);
+
+        printf("1) Build %d entries:  ", MAX_TEST_ENTRIES);
+        t0 = GetMicroTime();
+        ParallelBuild(test_uint32, nodes, MAX_TEST_ENTRIES);
+        printf("   %10u usec (%u threads)\n", int(GetMicroTime() - t0), GetDefaultThreadCount());
+        assert(test_uint32.GetCount() == MAX_TEST_ENTRIES);
+        PrintStats(test_uint32.GetStats());
+
+        printf("2) Find %d entries:   ", MAX_TEST_ENTRIES);
+        t0 = GetMicroTime();
+        for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+        {
+            auto find = test_uint32.Find(THashKey32<uint32>(i));
+            assert(find == nodes[i]);
+            (void)find;
+        }
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+
+        printf("3) ForEach:                ");
+        t0 = GetMicroTime();
+        ParallelForEach(test_uint32, [](Test* test) { test->value = test->Get() + 1; });
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+        for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+            assert(nodes[i]->value == i + 1);
+
+        printf("4) TransformReduce:        ");
+        t0 = GetMicroTime();
+        u64 sum = ParallelTransformReduce(test_uint32, u64(0),
+            [](u64 a, u64 b) { return a + b; },
+            [](Test* test) { return u64(test->value); });
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+        assert(sum == u64(MAX_TEST_ENTRIES) * (MAX_TEST_ENTRIES + 1) / 2);
+        (void)sum;
+
+        printf("5) Teardown in steps:      ");
+        t0 = GetMicroTime();
+        {
+            // Detach in O(1), then free the trie nodes (not the entries) 4096 at a time
+            THashTrieTeardown<Test, THashKey32<uint32>> teardown(test_uint32, false);
+            assert(test_uint32.Empty() && test_uint32.GetCount() == 0);
+            uint32 steps = 1;
+            while (!teardown.Step(4096))
+                steps++;
+            printf("   %10u usec (%u steps)\n", int(GetMicroTime() - t0), steps);
+        }
+
+        ParallelBuild(test_uint32, nodes, MAX_TEST_ENTRIES);
+        printf("6) Destroy:                ");
+        t0 = GetMicroTime();
+        ParallelDestroy(test_uint32);
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+        assert(test_uint32.Empty() && test_uint32.GetCount() == 0);
+        delete[] nodes;
+    }
+    printf("\n");
+
+    //
+    // image file test
+    //
+    printf("32 bit integer image file test...\n");
+    {
+        const char path[] = "HashTrieTest.img";
+        for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+        {
+            auto test = new Test(i);
+            test->value = i * 3;
+            test_uint32.Add(test);
+        }
+
+        printf("1) Write %d entries:  ", MAX_TEST_ENTRIES);
+        t0 = GetMicroTime();
+        bool written = WriteHashTrieImage(test_uint32, path,
+            [](const Test& test) { return CByteRange(&test.value, sizeof(test.value)); });
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+        assert(written);
+        (void)written;
+        test_uint32.Destroy();
+
+        printf("2) Open and find %d:  ", MAX_TEST_ENTRIES);
+        t0 = GetMicroTime();
+        CHashTrieImage image;
+        bool opened = image.Open(path);
+        assert(opened && image.GetCount() == MAX_TEST_ENTRIES);
+        (void)opened;
+        for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+        {
+            const CHashTrieRecord* record = image.Find(THashKey32<uint32>(i));
+            assert(record != nullptr && record->GetValue().size == sizeof(uint32));
+            assert(*(const uint32 *)record->GetValue().data == i * 3);
+            (void)record;
+        }
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+        assert(image.Find(THashKey32<uint32>(MAX_TEST_ENTRIES)) == nullptr);
+
+        image.Close();
+        remove(path);
+    }
+    printf("\n");
+
+    //
+    // persistent store test
+    //
+    printf("32 bit integer persistent store test...\n");
+    {
+        const char path[] = "HashTrieTest.kvs";
+        remove(path);
+        CHashTrieStore store;
+        bool opened = store.Open(path);
+        assert(opened);
+
+        printf("1) Put %d and commit:  ", MAX_TEST_ENTRIES);
+        t0 = GetMicroTime();
+        for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+        {
+            uint32 value = i * 3;
+            store.Put(THashKey32<uint32>(i), CByteRange(&value, sizeof(value)));
+        }
+        bool committed = store.Commit();
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+        assert(committed && store.GetCount() == MAX_TEST_ENTRIES);
+
+        printf("2) Remove half, roll back:  ");
+        t0 = GetMicroTime();
+        for (uint32 i = 0; i < MAX_TEST_ENTRIES; i += 2)
+            store.Remove(THashKey32<uint32>(i));
+        assert(store.GetCount() == MAX_TEST_ENTRIES / 2);
+        store.Rollback();
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+        assert(store.GetCount() == MAX_TEST_ENTRIES);
+
+        printf("3) Remove half, compact:  ");
+        t0 = GetMicroTime();
+        for (uint32 i = 0; i < MAX_TEST_ENTRIES; i += 2)
+            store.Remove(THashKey32<uint32>(i));
+        uint64 liveSize = store.GetSize() - store.GetDeadBytes();
+        bool compacted = store.Compact();
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+        assert(compacted && store.GetSize() <= liveSize);
+
+        printf("4) Reopen and find %d:  ", MAX_TEST_ENTRIES);
+        t0 = GetMicroTime();
+        store.Close();
+        opened = store.Open(path);
+        assert(opened && store.GetCount() == MAX_TEST_ENTRIES / 2);
+        for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+        {
+            const CHashTrieRecord* record = store.Find(THashKey32<uint32>(i));
+            assert((record != nullptr) == (i % 2 == 1));
+            assert(record == nullptr || *(const uint32 *)record->GetValue().data == i * 3);
+            (void)record;
+        }
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+        (void)opened;
+        (void)committed;
+        (void)compacted;
+        (void)liveSize;
+
+        store.Close();
+        remove(path);
+    }
+    printf("\n");
+
+    //
+    // write-ahead log test
+    //
+    printf("32 bit integer write-ahead log test...\n");
+    {
+        struct GetTestValue
+        {
+            CByteRange operator()(const Test& test) const noexcept { return CByteRange(&test.value, sizeof(test.value)); }
+        };
+        auto makeTest = [](CByteRange key, CByteRange value) {
+            auto test = new Test(*(const uint32 *)key.data);
+            test->value = *(const uint32 *)value.data;
+            return test;
+        };
+        const char path[] = "HashTrieTest";
+        remove("HashTrieTest.snap");
+        remove("HashTrieTest.log");
+
+        THashTrieLog<Test, THashKey32<uint32>, GetTestValue> log(test_uint32);
+        log.SetSnapshotLogSize(0);
+        bool opened = log.Open(path, makeTest);
+        assert(opened);
+
+        printf("1) Put %d and sync:  ", MAX_TEST_ENTRIES);
+        t0 = GetMicroTime();
+        for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+        {
+            auto test = new Test(i);
+            test->value = i * 3;
+            log.Put(test);
+        }
+        bool synced = log.Sync();
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+        assert(synced);
+
+        printf("2) Snapshot:  ");
+        t0 = GetMicroTime();
+        synced = log.Snapshot();
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+        assert(synced);
+
+        printf("3) Remove half and sync:  ");
+        t0 = GetMicroTime();
+        for (uint32 i = 0; i < MAX_TEST_ENTRIES; i += 2)
+            log.Remove(THashKey32<uint32>(i));
+        synced = log.Sync();
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+        assert(synced);
+        log.Close();
+        test_uint32.Destroy();
+
+        printf("4) Recover %d entries:  ", MAX_TEST_ENTRIES / 2);
+        t0 = GetMicroTime();
+        opened = log.Open(path, makeTest);
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+        assert(opened && test_uint32.GetCount() == MAX_TEST_ENTRIES / 2);
+        for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+        {
+            Test* test = test_uint32.Find(THashKey32<uint32>(i));
+            assert((test != nullptr) == (i % 2 == 1));
+            assert(test == nullptr || test->value == i * 3);
+            (void)test;
+        }
+        (void)opened;
+        (void)synced;
+
+        log.Close();
+        test_uint32.Destroy();
+        remove("HashTrieTest.snap");
+        remove("HashTrieTest.log");
+    }
+    printf("\n");
+
+    //
+    // parallel snapshot test
+    //
+    printf("32 bit integer parallel snapshot test...\n");
+    {
+        const char path[] = "HashTrieTest.snp";
+        for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+        {
+            auto test = new Test(i);
+            test->value = i * 3;
+            test_uint32.Add(test);
+        }
+
+        printf("1) Write %d entries:  ", MAX_TEST_ENTRIES);
+        t0 = GetMicroTime();
+        bool written = WriteHashTrieSnapshot(test_uint32, path,
+            [](const Test& test) { return CByteRange(&test.value, sizeof(test.value)); });
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+        assert(written);
+        (void)written;
+        test_uint32.Destroy();
+
+        printf("2) Load %d entries:  ", MAX_TEST_ENTRIES);
+        t0 = GetMicroTime();
+        bool loaded = LoadHashTrieSnapshot(test_uint32, path, [](CByteRange key, CByteRange value) {
+            auto test = new Test(*(const uint32 *)key.data);
+            test->value = *(const uint32 *)value.data;
+            return test;
+        });
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+        assert(loaded && test_uint32.GetCount() == MAX_TEST_ENTRIES);
+        (void)loaded;
+        for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+        {
+            Test* test = test_uint32.Find(THashKey32<uint32>(i));
+            assert(test != nullptr && test->value == i * 3);
+            (void)test;
+        }
+
+        ParallelDestroy(test_uint32);
+        remove(path);
+    }
+    printf("\n");
+
+    //
+    // Shared memory test
+    //
+    printf("32 bit integer shared memory test...\n");
+    {
+        const char name[] = "/HashTrieTest";
+        CHashTrieSharedWriter writer;
+        bool created = writer.Create(name, (uint64)MAX_TEST_ENTRIES * 128);
+        assert(created);
+        (void)created;
+        CHashTrieSharedReader reader;
+        bool opened = reader.Open(name);
+        assert(opened);
+        (void)opened;
+
+        printf("1) Put %d and publish: ", MAX_TEST_ENTRIES);
+        t0 = GetMicroTime();
+        for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+            writer.Put(THashKey32<uint32>(i), CByteRange(&i, sizeof(i)));
+        assert(reader.GetCount() == 0);
+        writer.Publish();
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+
+        printf("2) Reader find %d:   ", MAX_TEST_ENTRIES);
+        t0 = GetMicroTime();
+        for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+        {
+            const CHashTrieRecord* record = reader.Find(THashKey32<uint32>(i));
+            assert(record != nullptr && *(const uint32 *)record->GetValue().data == i);
+            (void)record;
+        }
+        reader.Release();
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+
+        // Blocks of replaced versions are reused once the reader moved on
+        printf("3) Update, publish x4:");
+        const uint64 used = writer.GetUsedSize();
+        t0 = GetMicroTime();
+        for (uint32 round = 1; round <= 4; round++)
+        {
+            for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+            {
+                uint32 value = i * round;
+                writer.Put(THashKey32<uint32>(i), CByteRange(&value, sizeof(value)));
+                if (i % 65536 == 65535)
+                    writer.Publish();
+            }
+            writer.Publish();
+            const CHashTrieRecord* record = reader.Find(THashKey32<uint32>(MAX_TEST_ENTRIES - 1));
+            assert(record != nullptr && *(const uint32 *)record->GetValue().data == (MAX_TEST_ENTRIES - 1) * round);
+            (void)record;
+            reader.Release();
+        }
+        printf("   %10u usec (%u -> %u bytes)\n", int(GetMicroTime() - t0), uint32(used), uint32(writer.GetUsedSize()));
+        assert(writer.GetUsedSize() < used + used / 2);
+
+        // Idle slots of reader processes that are gone are freed as well
+        reader.Close();
+        {
+            CSharedMemory memory;
+            opened = memory.Open(name);
+            assert(opened);
+            CHashTrieSharedHeader* header = (CHashTrieSharedHeader *)memory.GetData();
+            for (CHashTrieSharedReaderSlot& slot : header->readers)
+                slot.owner.store(0x7FFFFFF0);   // Beyond any process id
+        }
+        opened = reader.Open(name);
+        assert(!opened);
+        for (uint32 i = 0; i < 64; i++)
+        {
+            writer.Put(THashKey32<uint32>(i), CByteRange(&i, sizeof(i)));
+            writer.Publish();
+        }
+        opened = reader.Open(name);
+        assert(opened);
+
+        reader.Close();
+        writer.Close();
+        CSharedMemory::Remove(name);
+
+        // Fill small segments with keys in one collision bucket. The Put
+        // that does not fit throws before it changes anything. (The sizes
+        // vary where in the last update the segment runs out.)
+        struct CHasherCollide
+        {
+            static uint32 Hash(uint32) noexcept { return 0; }
+        };
+        typedef THashKey32<uint32, CHasherCollide> CollideKey;
+        for (uint32 extra = 0; extra < 4096; extra += 512)
+        {
+            created = writer.Create(name, 1024 * 1024 + extra);
+            assert(created);
+            opened = reader.Open(name);
+            assert(opened);
+            uint32 added = 0;
+            uint64 usedBefore = 0;
+            try
+            {
+                for (;; added++)
+                {
+                    usedBefore = writer.GetUsedSize();
+                    writer.Put(CollideKey(added), CByteRange(&added, sizeof(added)));
+                    writer.Publish();
+                }
+            }
+            catch (const std::bad_alloc&)
+            {
+            }
+            writer.Publish();
+            assert(added > 256 && writer.GetUsedSize() == usedBefore && reader.GetCount() == added);
+            for (uint32 i = 0; i < added; i++)
+            {
+                const CHashTrieRecord* record = reader.Find(CollideKey(i));
+                assert(record != nullptr && *(const uint32 *)record->GetValue().data == i);
+                (void)record;
+            }
+            reader.Close();
+            writer.Close();
+            CSharedMemory::Remove(name);
+        }
+    }
+    printf("\n");
+
+    //
+    // Compact trie test
+    //
+    printf("32 bit integer compact trie test...\n");
+    {
+        THashTrieCompact<Test, THashKey32<uint32>> test_compact;
+
+        printf("1) Add %d entries:    ", MAX_TEST_ENTRIES);
+        t0 = GetMicroTime();
+        for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+        {
+            auto added = test_compact.TryEmplace(THashKey32<uint32>(i), i);
+            assert(added.second);
+            added.first->value = i;
+        }
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+        PrintStats(test_compact.GetStats());
+
+        printf("2) Find %d entries:   ", MAX_TEST_ENTRIES);
+        t0 = GetMicroTime();
+        for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+        {
+            Test* find = test_compact.Find(i);
+            assert(find != nullptr && find->value == i);
+            (void)find;
+        }
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+
+        printf("3) Remove %d entries: ", MAX_TEST_ENTRIES);
+        t0 = GetMicroTime();
+        for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+        {
+            bool removed = test_compact.Remove(i);
+            assert(removed);
+            (void)removed;
+        }
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+        assert(test_compact.GetCount() == 0);
+    }
+    printf("\n");
+
+    printf("32 bit integer inline entries test...\n");
+    {
+        THashTrieIntInline<int32> test_inline;
+
+        printf("1) Add %d entries:    ", MAX_TEST_ENTRIES);
+        t0 = GetMicroTime();
+        for (int32 i = 0; i < MAX_TEST_ENTRIES; i++)
+            *test_inline.Add(i) = i;
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+        PrintStats(test_inline.GetStats());
+
+        printf("2) Find %d entries:   ", MAX_TEST_ENTRIES);
+        t0 = GetMicroTime();
+        for (int32 i = 0; i < MAX_TEST_ENTRIES; i++)
+        {
+            int32* find = test_inline.Find(i);
+            assert(find != nullptr && *find == i);
+            (void)find;
+        }
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+
+        printf("3) Remove %d entries: ", MAX_TEST_ENTRIES);
+        t0 = GetMicroTime();
+        for (int32 i = 0; i < MAX_TEST_ENTRIES; i++)
+        {
+            bool removed = test_inline.Remove(i);
+            assert(removed);
+            (void)removed;
+        }
+        printf("   %10u usec\n", int(GetMicroTime() - t0));
+        assert(test_inline.GetCount() == 0);
+    }
+    printf("\n");
 
     // THashTrieInt test
     THashTrieInt<int32> test_hashTrieInt;
@@ -171,14 +781,119 @@ void TestHashTrie()
     }
     printf("   %10u usec\n", int(GetMicroTime() - t0));
 
-    printf("3) Remove %d entries: ", MAX_TEST_ENTRIES);
+    printf("   FindOrAdd:         ");
     t0 = GetMicroTime();
-    for (int32 i = 0; i < MAX_TEST_ENTRIES; i++)
+    for (int32 i = 0; i < MAX_TEST_ENTRIES * 2; i++)
+    {
+        // Count or create: the first half exists, the second half is added
+        auto found = test_hashTrieInt.FindOrAdd(i);
+        assert(found.second == (i >= MAX_TEST_ENTRIES));
+        found.first->value++;
+    }
+    printf("   %10u usec\n", int(GetMicroTime() - t0));
+
+    printf("   Merge:             ");
+    t0 = GetMicroTime();
+    for (int32 i = 0; i < MAX_TEST_ENTRIES * 2; i++)
+    {
+        auto merged = test_hashTrieInt.Merge(i, 1, [](int32 value, int32 delta) { return value + delta; });
+        assert(merged->value == ((i < MAX_TEST_ENTRIES) ? i + 2 : 2));
+    }
+    printf("   %10u usec\n", int(GetMicroTime() - t0));
+
+    printf("3) Remove %d entries: ", MAX_TEST_ENTRIES * 2);
+    t0 = GetMicroTime();
+    for (int32 i = 0; i < MAX_TEST_ENTRIES * 2; i++)
     {
         bool removed = test_hashTrieInt.Remove(i);
         assert(removed);
     }
-    printf("   %10u usec\n\n", int(GetMicroTime() - t0));
+    printf("   %10u usec\n", int(GetMicroTime() - t0));
+    PrintCounters();
+    printf("\n");
+
+    //
+    // Encoded snapshot test
+    //
+    printf("32 bit integer encoded snapshot test...\n");
+    {
+        const char path[] = "HashTrieTest.enc";
+        THashTrieInt<int32> test_encoded;
+        for (int32 i = 0; i < MAX_TEST_ENTRIES; i++)
+            test_encoded.Add(i * 3 - MAX_TEST_ENTRIES)->value = i % 100;
+
+        for (int compress = 0; compress < 2; compress++)
+        {
+            printf("%d) Write %d entries: ", compress * 2 + 1, MAX_TEST_ENTRIES);
+            t0 = GetMicroTime();
+            bool written = WriteEncodedHashTrie(test_encoded, path, compress != 0);
+            uint64 size = 0;
+            GetFileSize(path, size);
+            printf("   %10u usec (%s, %u bytes)\n", int(GetMicroTime() - t0), compress ? "compressed" : "varint", uint32(size));
+            assert(written);
+            (void)written;
+
+            printf("%d) Load %d entries:  ", compress * 2 + 2, MAX_TEST_ENTRIES);
+            THashTrieInt<int32> loaded_encoded;
+            t0 = GetMicroTime();
+            bool loaded = LoadEncodedHashTrie(loaded_encoded, path);
+            printf("   %10u usec\n", int(GetMicroTime() - t0));
+            assert(loaded && loaded_encoded.GetCount() == MAX_TEST_ENTRIES);
+            (void)loaded;
+            for (int32 i = 0; i < MAX_TEST_ENTRIES; i++)
+            {
+                auto* find = loaded_encoded.Find(i * 3 - MAX_TEST_ENTRIES);
+                assert(find != nullptr && find->value == i % 100);
+                (void)find;
+            }
+            loaded_encoded.Destroy();
+        }
+
+        test_encoded.Destroy();
+
+        // Compressed round trip where the first entry's value is too large
+        // for a compressed block and the later blocks are compressed
+        struct TestBlob : THashKey32<uint32>
+        {
+            TestBlob(uint32 key) : THashKey32<uint32>(key) { }
+            std::vector<uint8> value;
+        };
+        constexpr uint32 BLOB_ENTRIES = 100000;
+        constexpr uint32 BLOB_SIZE = 2 * 1024 * 1024;
+        THashTrie<TestBlob, THashKey32<uint32>> test_blob;
+        for (uint32 i = 0; i < BLOB_ENTRIES; i++)
+        {
+            TestBlob* blob = new TestBlob(i);
+            blob->value.assign((i == 0) ? BLOB_SIZE : i % 8, uint8(i));
+            test_blob.Add(blob);
+        }
+        bool written = WriteEncodedHashTrie(test_blob, path,
+            [](const TestBlob& blob) { return CByteRange(blob.value.data(), blob.value.size()); }, true);
+        assert(written);
+        (void)written;
+
+        THashTrie<TestBlob, THashKey32<uint32>> loaded_blob;
+        bool loaded = LoadEncodedHashTrie(loaded_blob, path, [](CByteRange key, CByteRange value) -> TestBlob* {
+            uint32 k;
+            memcpy(&k, key.data, sizeof(k));
+            TestBlob* blob = new TestBlob(k);
+            blob->value.assign((const uint8 *)value.data, (const uint8 *)value.data + value.size);
+            return blob;
+        });
+        assert(loaded && loaded_blob.GetCount() == BLOB_ENTRIES);
+        (void)loaded;
+        for (uint32 i = 0; i < BLOB_ENTRIES; i++)
+        {
+            auto* find = loaded_blob.Find(THashKey32<uint32>(i));
+            assert(find != nullptr && find->value.size() == ((i == 0) ? BLOB_SIZE : i % 8));
+            assert(find->value.empty() || find->value.back() == uint8(i));
+            (void)find;
+        }
+        loaded_blob.Destroy();
+        test_blob.Destroy();
+        remove(path);
+    }
+    printf("\n");
 
     //
     // String hash test
@@ -196,14 +911,15 @@ void TestHashTrie()
         test_str.Add(test);
     }
     printf("   %10u usec\n", int(GetMicroTime() - t0));
+    PrintStats(test_str.GetStats());
 
     printf("2) Find %d entries:   ", MAX_TEST_ENTRIES);
     t0 = GetMicroTime();
     for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
     {
         char buffer[16];
-        sprintf_s(buffer, "%d", i);
-        TestStr* find = test_str.Find(CHashKeyStrAnsiChar(buffer));
+        int len = sprintf_s(buffer, "%d", i);
+        TestStr* find = test_str.Find(CHashKeyStrViewAnsiChar(buffer, len));
         assert(strcmp(find->GetString(), buffer) == 0);
     }
     printf("   %10u usec\n", int(GetMicroTime() - t0));
@@ -213,17 +929,310 @@ void TestHashTrie()
     for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
     {
         char buffer[16];
-        sprintf_s(buffer, "%d", i);
-        TestStr *removed2 = test_str.Remove(CHashKeyStrAnsiChar(buffer));
+        int len = sprintf_s(buffer, "%d", i);
+        TestStr *removed2 = test_str.Remove(CHashKeyStrViewAnsiChar(buffer, len));
         assert(removed2 != 0);
         assert(strcmp(removed2->GetString(), buffer) == 0);
         delete removed2;
     }
-    printf("   %10u usec\n\n", int(GetMicroTime() - t0));
+    printf("   %10u usec\n", int(GetMicroTime() - t0));
+    PrintCounters();
+    printf("\n");
+
+    //
+    // Length-carrying string key test
+    //
+    struct TestStrLen : CHashKeyStrLenAnsiChar
+    {
+        TestStrLen(const char key[], size_t len) : CHashKeyStrLenAnsiChar(key, len) { }
+        uint32 value{ 0 };
+    };
+
+    THashTrie<TestStrLen, CHashKeyStrViewAnsiChar> test_strLen;
+
+    printf("ANSI string test with length-carrying keys...\n");
+    printf("1) Add %d entries:    ", MAX_TEST_ENTRIES);
+    t0 = GetMicroTime();
+    for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+    {
+        char buffer[16];
+        int len = sprintf_s(buffer, "%d", i);
+        test_strLen.Add(new TestStrLen(buffer, len));
+    }
+    printf("   %10u usec\n", int(GetMicroTime() - t0));
+
+    printf("2) Find %d entries:   ", MAX_TEST_ENTRIES);
+    t0 = GetMicroTime();
+    for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+    {
+        char buffer[16];
+        int len = sprintf_s(buffer, "%d", i);
+        TestStrLen* find = test_strLen.Find(CHashKeyStrViewAnsiChar(buffer, len));
+        assert(strcmp(find->GetString(), buffer) == 0);
+    }
+    printf("   %10u usec\n", int(GetMicroTime() - t0));
+
+    printf("3) Remove %d entries: ", MAX_TEST_ENTRIES);
+    t0 = GetMicroTime();
+    for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+    {
+        char buffer[16];
+        int len = sprintf_s(buffer, "%d", i);
+        TestStrLen* removed = test_strLen.Remove(CHashKeyStrViewAnsiChar(buffer, len));
+        assert(removed != 0);
+        delete removed;
+    }
+    printf("   %10u usec\n", int(GetMicroTime() - t0));
+    PrintCounters();
+    printf("\n");
+
+    //
+    // Pooled string key test
+    //
+    struct TestStrPool : THashKeyStrPool<char>
+    {
+        TestStrPool(TStringPool<char>& pool, const char key[], size_t len) : THashKeyStrPool<char>(pool, key, len) { }
+        uint32 value{ 0 };
+    };
+
+    TStringPool<char> pool;
+    THashTrie<TestStrPool, CHashKeyStrViewAnsiChar> test_strPool;
+
+    printf("ANSI string test with pooled keys...\n");
+    printf("1) Add %d entries:    ", MAX_TEST_ENTRIES);
+    t0 = GetMicroTime();
+    for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+    {
+        char buffer[16];
+        int len = sprintf_s(buffer, "%d", i);
+        test_strPool.Add(new TestStrPool(pool, buffer, len));
+    }
+    printf("   %10u usec\n", int(GetMicroTime() - t0));
+
+    printf("2) Remove %d entries: ", MAX_TEST_ENTRIES / 2);
+    t0 = GetMicroTime();
+    for (uint32 i = 0; i < MAX_TEST_ENTRIES; i += 2)
+    {
+        char buffer[16];
+        int len = sprintf_s(buffer, "%d", i);
+        delete test_strPool.Remove(CHashKeyStrViewAnsiChar(buffer, len));
+    }
+    printf("   %10u usec\n", int(GetMicroTime() - t0));
+
+    printf("3) Compact pool:           ");
+    size_t usedBytes = pool.GetUsedBytes();
+    t0 = GetMicroTime();
+    pool.Compact(test_strPool);
+    printf("   %10u usec (%u -> %u bytes)\n", int(GetMicroTime() - t0), uint32(usedBytes), uint32(pool.GetUsedBytes()));
+
+    printf("4) Find %d entries:   ", MAX_TEST_ENTRIES / 2);
+    t0 = GetMicroTime();
+    for (uint32 i = 1; i < MAX_TEST_ENTRIES; i += 2)
+    {
+        char buffer[16];
+        int len = sprintf_s(buffer, "%d", i);
+        TestStrPool* find = test_strPool.Find(CHashKeyStrViewAnsiChar(buffer, len));
+        assert(strcmp(find->GetString(), buffer) == 0);
+    }
+    printf("   %10u usec\n", int(GetMicroTime() - t0));
+    test_strPool.Destroy();
+    printf("\n");
+
+    //
+    // Small-string-optimized inline key test
+    //
+    struct TestStrInline : CHashKeyStrInlineAnsiChar
+    {
+        TestStrInline(const char key[], size_t len) : CHashKeyStrInlineAnsiChar(key, len) { }
+        uint32 value{ 0 };
+    };
+
+    THashTrie<TestStrInline, CHashKeyStrInlineAnsiChar> test_strInline;
+
+    printf("ANSI string test with inline keys...\n");
+    printf("1) Add %d entries:    ", MAX_TEST_ENTRIES);
+    t0 = GetMicroTime();
+    for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+    {
+        char buffer[16];
+        int len = sprintf_s(buffer, "%d", i);
+        test_strInline.Add(new TestStrInline(buffer, len));
+    }
+    printf("   %10u usec\n", int(GetMicroTime() - t0));
+
+    printf("2) Find %d entries:   ", MAX_TEST_ENTRIES);
+    t0 = GetMicroTime();
+    for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+    {
+        char buffer[16];
+        int len = sprintf_s(buffer, "%d", i);
+        TestStrInline* find = test_strInline.Find(CHashKeyStrInlineAnsiChar(buffer, len));
+        assert(strcmp(find->GetString(), buffer) == 0);
+    }
+    printf("   %10u usec\n", int(GetMicroTime() - t0));
+
+    printf("3) Remove %d entries: ", MAX_TEST_ENTRIES);
+    t0 = GetMicroTime();
+    for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+    {
+        char buffer[16];
+        int len = sprintf_s(buffer, "%d", i);
+        TestStrInline* removed = test_strInline.Remove(CHashKeyStrInlineAnsiChar(buffer, len));
+        assert(removed != 0);
+        delete removed;
+    }
+    printf("   %10u usec\n", int(GetMicroTime() - t0));
+    printf("\n");
+
+    //
+    // Case-insensitive string key test
+    //
+    struct TestStrI : CHashKeyStrLenAnsiCharI
+    {
+        TestStrI(const char key[], size_t len) : CHashKeyStrLenAnsiCharI(key, len) { }
+        uint32 value{ 0 };
+    };
+
+    THashTrie<TestStrI, CHashKeyStrViewAnsiCharI> test_strI;
+
+    printf("ANSI case-insensitive string test...\n");
+    printf("1) Add %d entries:    ", MAX_TEST_ENTRIES);
+    t0 = GetMicroTime();
+    for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+    {
+        char buffer[32];
+        int len = sprintf_s(buffer, "Host-%d.Example.COM", i);
+        test_strI.Add(new TestStrI(buffer, len));
+    }
+    printf("   %10u usec\n", int(GetMicroTime() - t0));
+
+    printf("2) Find %d entries:   ", MAX_TEST_ENTRIES);
+    t0 = GetMicroTime();
+    for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+    {
+        char buffer[32];
+        int len = sprintf_s(buffer, "hOST-%d.eXAMPLE.com", i);
+        TestStrI* find = test_strI.Find(CHashKeyStrViewAnsiCharI(buffer, len));
+        assert(StrCmpI(find->GetString(), buffer) == 0);
+    }
+    printf("   %10u usec\n", int(GetMicroTime() - t0));
+
+    printf("3) Remove %d entries: ", MAX_TEST_ENTRIES);
+    t0 = GetMicroTime();
+    for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+    {
+        char buffer[32];
+        int len = sprintf_s(buffer, "host-%d.example.com", i);
+        TestStrI* removed = test_strI.Remove(CHashKeyStrViewAnsiCharI(buffer, len));
+        assert(removed != 0);
+        delete removed;
+    }
+    printf("   %10u usec\n", int(GetMicroTime() - t0));
+
+    {
+        // Long wide keys are hashed in chunks. Null terminated keys, views
+        // and both cases hash and compare alike.
+        struct TestStrWideI : CHashKeyStrI
+        {
+            TestStrWideI(const wchar_t key[]) : CHashKeyStrI(key) { }
+        };
+        THashTrie<TestStrWideI, CHashKeyStrI> test_wideI;
+        std::vector<wchar_t> upper(1000), lower(1000);
+        for (uint32 i = 0; i < 100; i++)
+        {
+            for (uint32 j = 0; j + 1 < upper.size(); j++)
+                upper[j] = wchar_t('A' + (i + j) % 26);
+            upper.back() = 0;
+            upper[i] = L'#';
+            test_wideI.Add(new TestStrWideI(upper.data()));
+        }
+        assert(test_wideI.GetCount() == 100);
+        for (uint32 i = 0; i < 100; i++)
+        {
+            for (uint32 j = 0; j + 1 < lower.size(); j++)
+                lower[j] = wchar_t('a' + (i + j) % 26);
+            lower.back() = 0;
+            lower[i] = L'#';
+            TestStrWideI* find = test_wideI.Find(CHashKeyStrPtrI(lower.data()));
+            assert(find != nullptr && find == test_wideI.Find(CHashKeyStrViewI(lower.data(), lower.size() - 1)));
+            (void)find;
+        }
+        test_wideI.Destroy();
+    }
+    printf("\n");
+}
+
+//===========================================================================
+// Hash policy benchmark: hash throughput and resulting trie shape
+//===========================================================================
+template <class Hasher>
+void BenchHasher(const char name[], const char (*keys)[16])
+{
+    struct TestInt : THashKey32<uint32, Hasher>
+    {
+        TestInt(uint32 key) : THashKey32<uint32, Hasher>(key) { }
+    };
+
+    struct TestStr : THashKeyStrPtr<char, TStrCmp<char>, Hasher>
+    {
+        TestStr(const char key[]) : THashKeyStrPtr<char, TStrCmp<char>, Hasher>(key) { }
+    };
+
+    volatile uint32 sink = 0;
+
+    u64 t0 = GetMicroTime();
+    for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+        sink += Hasher::Hash(i);
+    int intHashTime = int(GetMicroTime() - t0);
+
+    t0 = GetMicroTime();
+    for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+        sink += Hasher::Hash(keys[i], strlen(keys[i]), 0);
+    int strHashTime = int(GetMicroTime() - t0);
+
+    THashTrie<TestInt, THashKey32<uint32, Hasher>> intTrie;
+    for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+        intTrie.Add(new TestInt(i));
+    CHashTrieStats intStats = intTrie.GetStats();
+    intTrie.Destroy();
+
+    THashTrie<TestStr, THashKeyStr<char, TStrCmp<char>, Hasher>> strTrie;
+    for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+        strTrie.Add(new TestStr(keys[i]));
+    CHashTrieStats strStats = strTrie.GetStats();
+    strTrie.Destroy();
+
+    printf("%-8s int: %7u usec, depth %u, probe %.2f | str: %7u usec, depth %u, probe %.2f, %u buckets\n",
+        name,
+        intHashTime,
+        intStats.maxLeafDepth,
+        intStats.averageProbeLength,
+        strHashTime,
+        strStats.maxLeafDepth,
+        strStats.averageProbeLength,
+        strStats.collisionBucketCount);
+}
+
+void TestHashPolicies()
+{
+    auto keys = new char[MAX_TEST_ENTRIES][16];
+    for (uint32 i = 0; i < MAX_TEST_ENTRIES; i++)
+        sprintf_s(keys[i], "%d", i);
+
+    printf("Hash policy test (%d keys)...\n", MAX_TEST_ENTRIES);
+    BenchHasher<CHasherDefault>("Default", keys);
+    BenchHasher<CHasherWy>("wyhash", keys);
+    BenchHasher<CHasherXxh64>("XXH64", keys);
+    BenchHasher<CHasherCrc32c>("CRC32C", keys);
+    BenchHasher<CHasherAes>("AES", keys);
+    printf("\n");
+
+    delete[] keys;
 }
 
 int main()
 {
     TestHashTrie();
+    TestHashPolicies();
     return 0;
 }
@@ -15,13 +15,20 @@
 #define __HASH_TRIE_H__
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <wchar.h>
+#include <wctype.h>
 #include <exception>
+#include <new>
+#include <utility>
+#include <algorithm>
 
 #if _MSC_VER
 #include <intrin.h>
+#else
+#include <strings.h>
 #endif
 
 #ifdef _MSC_VER
@@ -30,6 +37,14 @@
     #define COMPILER_CHECK(expr, msg)  typedef char COMPILE_ERROR_##msg[1][(expr)?1:-1]
 #endif
 
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    #define HAMT_PREFETCH(ptr)  _mm_prefetch((const char *)(ptr), _MM_HINT_T0)
+#elif defined(__GNUC__)
+    #define HAMT_PREFETCH(ptr)  __builtin_prefetch((const void *)(ptr))
+#else
+    #define HAMT_PREFETCH(ptr)  ((void)0)
+#endif
+
 //===========================================================================
 // Typedefs
 //===========================================================================
@@ -106,110 +121,310 @@ inline T ClearNthSetBit(T v, int idx) noexcept
     return v;
 }
 
+// Index of the lowest set bit. v must not be 0.
+inline uint32 GetLowestBitIndex(uint32 v) noexcept
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, v);
+    return index;
+#else
+    return (uint32)__builtin_ctz(v);
+#endif
+}
+
 //===========================================================================
 //    Hash function foward declarations
 //===========================================================================
 // MurmurHash3
 uint32 MurmurHash3_x86_32(const void* key, int len, uint32_t seed) noexcept;
 
+// wyhash (final version 4)
+uint64 WyHash64(const void* key, size_t len, uint64 seed) noexcept;
+
+// xxHash (XXH64)
+uint64 XXHash64(const void* key, size_t len, uint64 seed) noexcept;
+
+// CRC32C (Castagnoli). Uses SSE4.2 crc32 instruction if the CPU supports it.
+uint32 Crc32c(const void* key, size_t len, uint32 crc) noexcept;
+uint32 Crc32c(uint32 key, uint32 crc) noexcept;
+uint32 Crc32c(uint64 key, uint32 crc) noexcept;
+
+// AES-NI based hash. Falls back to WyHash64 if the CPU doesn't support AES-NI
+// so hash values are only stable on the same kind of CPU.
+uint64 AesHash64(const void* key, size_t len, uint64 seed) noexcept;
+
+// Batch hash functions. Hash 16 (AVX-512) or 8 (AVX2) keys at a time,
+// scalar code on other CPUs. Results are identical to CHasherDefault.
+void WangHashBatch(const uint32 keys[], uint32 hashes[], size_t count) noexcept;
+void WangHashBatch(const uint64 keys[], uint32 hashes[], size_t count) noexcept;
+void MurmurHash3_x86_32_Batch(
+    const void* const   keys[],
+    const int           lens[],
+    const uint32        seeds[],
+    uint32              hashes[],
+    size_t              count) noexcept;
+
+// ASCII case folding ('A'-'Z' to 'a'-'z', other bytes unchanged), SSE2 16 bytes at a time.
+// MurmurHash3_x86_32_FoldCase(key, len, seed) == MurmurHash3_x86_32(folded key, len, seed)
+void StrFoldCase(char dest[], const char src[], size_t len) noexcept;
+bool StrEqualFoldCase(const char str1[], const char str2[], size_t len) noexcept;
+uint32 MurmurHash3_x86_32_FoldCase(const void* key, int len, uint32 seed) noexcept;
+
 //===========================================================================
-//    THashKey32
-//    (Helper template class to get 32bit integer hash key value used for POD types)
+//    CPU features detected at runtime (used for hash function dispatch)
 //===========================================================================
-template <typename T>
-class THashKey32
+enum ECpuFeature
 {
-    static const uint32 MURMUR_HASH3_SEED = sizeof(T);
-public:
-    THashKey32() noexcept : m_key(0) { }
-    THashKey32(const T & key) noexcept : m_key(key) { }
-    inline bool operator==(const THashKey32 & rhs) const noexcept { return m_key == rhs.m_key; }
-    inline operator T () const noexcept { return m_key; }
-    inline uint32 GetHash() const noexcept;
-    inline const T & Get() const noexcept { return m_key; }
-    inline void Set(const T & key) noexcept { m_key = key; }
-
-protected:
-    T m_key;
+    CPU_FEATURE_SSE42       = 1 << 0,
+    CPU_FEATURE_AES         = 1 << 1,
+    CPU_FEATURE_AVX2        = 1 << 2,
+    CPU_FEATURE_AVX512      = 1 << 3,   // AVX-512F with OS support for ZMM state
 };
 
+uint32 GetCpuFeatures() noexcept;
+
+
+/****************************************************************************
+*
+*   Hash policies
+*
+*   Hasher template parameter of THashKey32 and THashKeyStr.
+*   A hash policy provides the following static functions:
+*
+*       static uint32 Hash(uint32 key);
+*       static uint32 Hash(uint64 key);
+*       static uint32 Hash(const void* data, size_t len, uint32 seed);
+*
+**/
+
+// 64 x 64 -> 128 bit multiply (lo in *a, hi in *b) used by wyhash
+inline void Mul128(uint64* a, uint64* b) noexcept
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    *a = _umul128(*a, *b, b);
+#elif defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64)r;
+    *b = (uint64)(r >> 64);
+#else
+    uint64 ha = *a >> 32, hb = *b >> 32, la = (uint32)*a, lb = (uint32)*b;
+    uint64 rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64 t = rl + (rm0 << 32), c = t < rl;
+    uint64 lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+inline uint32 FoldHash64(uint64 h) noexcept
+{
+    return (uint32)(h ^ (h >> 32));
+}
+
 /**
- * Generic Hash function for POD types
+ * Default hash policy
+ *  - Thomas Wang's integer mix functions for 32/64 bit integers
+ *  - MurmurHash3_x86_32 for everything else
  */
-template <typename T>
-inline uint32 THashKey32<T>::GetHash() const noexcept
+struct CHasherDefault
 {
-    return MurmurHash3_x86_32((const void *)&m_key, sizeof(m_key), MURMUR_HASH3_SEED);
-}
+    // Integer hash functions based on Thomas Wang's Mix Functions:
+    //  http://www.cris.com/~Ttwang/tech/inthash.htm (unavailable)
+    //  https://gist.github.com/badboy/6267743
+    static uint32 Hash(uint32 key) noexcept
+    {
+        key = ~key + (key << 15); // key = (key << 15) - key - 1;
+        key ^= (key >> 12);
+        key += (key << 2);
+        key ^= (key >> 4);
+        key *= 2057; // key = (key + (key << 3)) + (key << 11);
+        key ^= (key >> 16);
+        return key;
+    }
+
+    // 64 bit to 32 bit hash
+    static uint32 Hash(uint64 key) noexcept
+    {
+        key = (~key) + (key << 18); // key = (key << 18) - key - 1;
+        key ^= (key >> 31);
+        key *= 21; // key = (key + (key << 2)) + (key << 4);
+        key ^= (key >> 11);
+        key += (key << 6);
+        key ^= (key >> 22);
+        return (uint32)key;
+    }
 
-// Integer hash functions based on Thomas Wang's Mix Functions:
-//  http://www.cris.com/~Ttwang/tech/inthash.htm (unavailable)
-//  https://gist.github.com/badboy/6267743
+    static uint32 Hash(const void* data, size_t len, uint32 seed) noexcept
+    {
+        return MurmurHash3_x86_32(data, (int)len, seed);
+    }
+};
 
 /**
- * Specialization for 32 bit interger key
+ * wyhash policy. Integer hashes are identical to WyHash64 of the key bytes.
  */
-template <>
-inline uint32 THashKey32<int32>::GetHash() const noexcept
+struct CHasherWy
 {
-    uint32 key = (uint32)m_key;
-    key = ~key + (key << 15); // key = (key << 15) - key - 1;
-    key ^= (key >> 12);
-    key += (key << 2);
-    key ^= (key >> 4);
-    key *= 2057; // key = (key + (key << 3)) + (key << 11);
-    key ^= (key >> 16);
-    return key;
-}
+    static constexpr uint64 P0 = 0x2d358dccaa6c78a5ull;
+    static constexpr uint64 P1 = 0x8bb84b93962eacc9ull;
+
+    static uint32 Hash(uint32 key) noexcept
+    {
+        uint64 a = ((uint64)key << 32) | key;
+        return Finalize(a, a, sizeof(key));
+    }
+
+    static uint32 Hash(uint64 key) noexcept
+    {
+        uint64 a = (key << 32) | (key >> 32);
+        return Finalize(a, key, sizeof(key));
+    }
+
+    static uint32 Hash(const void* data, size_t len, uint32 seed) noexcept
+    {
+        return FoldHash64(WyHash64(data, len, seed));
+    }
+
+private:
+    static uint32 Finalize(uint64 a, uint64 b, uint64 len) noexcept
+    {
+        // seed = 0 mixed with the secret
+        uint64 seed = P0, seedHi = P1;
+        Mul128(&seed, &seedHi);
+        seed ^= seedHi;
+
+        a ^= P1;
+        b ^= seed;
+        Mul128(&a, &b);
+        a ^= P0 ^ len;
+        b ^= P1;
+        Mul128(&a, &b);
+        return FoldHash64(a ^ b);
+    }
+};
 
 /**
- * Specialization for 32 bit unsigned int key
+ * xxHash policy. Integer hashes are identical to XXHash64 of the key bytes.
  */
-template <>
-inline uint32 THashKey32<uint32>::GetHash() const noexcept
+struct CHasherXxh64
 {
-    uint32 key = m_key;
-    key = ~key + (key << 15); // key = (key << 15) - key - 1;
-    key ^= (key >> 12);
-    key += (key << 2);
-    key ^= (key >> 4);
-    key *= 2057; // key = (key + (key << 3)) + (key << 11);
-    key ^= (key >> 16);
-    return key;
-}
+    static constexpr uint64 P1 = 0x9E3779B185EBCA87ull;
+    static constexpr uint64 P2 = 0xC2B2AE3D27D4EB4Full;
+    static constexpr uint64 P3 = 0x165667B19E3779F9ull;
+    static constexpr uint64 P4 = 0x85EBCA77C2B2AE63ull;
+    static constexpr uint64 P5 = 0x27D4EB2F165667C5ull;
+
+    static uint32 Hash(uint32 key) noexcept
+    {
+        uint64 h = P5 + sizeof(key);
+        h ^= (uint64)key * P1;
+        h = Rotl(h, 23) * P2 + P3;
+        return Avalanche(h);
+    }
+
+    static uint32 Hash(uint64 key) noexcept
+    {
+        uint64 h = P5 + sizeof(key);
+        h ^= Rotl(key * P2, 31) * P1;
+        h = Rotl(h, 27) * P1 + P4;
+        return Avalanche(h);
+    }
+
+    static uint32 Hash(const void* data, size_t len, uint32 seed) noexcept
+    {
+        return FoldHash64(XXHash64(data, len, seed));
+    }
+
+private:
+    static uint64 Rotl(uint64 x, int r) noexcept { return (x << r) | (x >> (64 - r)); }
+    static uint32 Avalanche(uint64 h) noexcept
+    {
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        h ^= h >> 32;
+        return FoldHash64(h);
+    }
+};
 
 /**
- * Specialization for 64 bit interger key (64 bit to 32 bit hash)
+ * CRC32C policy (hardware crc32 instruction, table driven fallback)
  */
-template <>
-inline uint32 THashKey32<int64>::GetHash() const noexcept
+struct CHasherCrc32c
 {
-    uint64 key = (uint64)m_key;
-    key = (~key) + (key << 18); // key = (key << 18) - key - 1;
-    key ^= (key >> 31);
-    key *= 21; // key = (key + (key << 2)) + (key << 4);
-    key ^= (key >> 11);
-    key += (key << 6);
-    key ^= (key >> 22);
-    return (uint32)key;
-}
+    // CRC is linear, so sequential integer keys leave patterns in the low bits
+    // that the trie indexes first. One multiply/xor-shift spreads them.
+    static uint32 Hash(uint32 key) noexcept { return Finalize(Crc32c(key, 0xFFFFFFFF)); }
+    static uint32 Hash(uint64 key) noexcept { return Finalize(Crc32c(key, 0xFFFFFFFF)); }
+    static uint32 Hash(const void* data, size_t len, uint32 seed) noexcept
+    {
+        return Crc32c(data, len, ~seed);
+    }
+
+private:
+    static uint32 Finalize(uint32 h) noexcept
+    {
+        h *= 0x9E3779B1;
+        return h ^ (h >> 16);
+    }
+};
 
 /**
- * Specialization for 64 bit uint key (64 bit to 32 bit hash)
+ * AES-NI policy
  */
-template <>
-inline uint32 THashKey32<uint64>::GetHash() const noexcept
+struct CHasherAes
+{
+    static uint32 Hash(uint32 key) noexcept { return FoldHash64(AesHash64(&key, sizeof(key), 0)); }
+    static uint32 Hash(uint64 key) noexcept { return FoldHash64(AesHash64(&key, sizeof(key), 0)); }
+    static uint32 Hash(const void* data, size_t len, uint32 seed) noexcept
+    {
+        return FoldHash64(AesHash64(data, len, seed));
+    }
+};
+
+// Hash POD key using hash policy. 32/64 bit integers use integer hash functions.
+template <class Hasher, typename T>
+inline uint32 HashPod(const T& key) noexcept
 {
-    uint64 key = m_key;
-    key = (~key) + (key << 18); // key = (key << 18) - key - 1;
-    key ^= (key >> 31);
-    key *= 21; // key = (key + (key << 2)) + (key << 4);
-    key ^= (key >> 11);
-    key += (key << 6);
-    key ^= (key >> 22);
-    return (uint32)key;
+    return Hasher::Hash((const void *)&key, sizeof(key), sizeof(key));
 }
 
+template <class Hasher>
+inline uint32 HashPod(const int32& key) noexcept { return Hasher::Hash((uint32)key); }
+
+template <class Hasher>
+inline uint32 HashPod(const uint32& key) noexcept { return Hasher::Hash(key); }
+
+template <class Hasher>
+inline uint32 HashPod(const int64& key) noexcept { return Hasher::Hash((uint64)key); }
+
+template <class Hasher>
+inline uint32 HashPod(const uint64& key) noexcept { return Hasher::Hash(key); }
+
+
+//===========================================================================
+//    THashKey32
+//    (Helper template class to get 32bit integer hash key value used for POD types)
+//===========================================================================
+template <typename T, class Hasher = CHasherDefault>
+class THashKey32
+{
+public:
+    THashKey32() noexcept : m_key(0) { }
+    THashKey32(const T & key) noexcept : m_key(key) { }
+    inline bool operator==(const THashKey32 & rhs) const noexcept { return m_key == rhs.m_key; }
+    inline operator T () const noexcept { return m_key; }
+    inline uint32 GetHash() const noexcept { return HashPod<Hasher>(m_key); }
+    inline const T & Get() const noexcept { return m_key; }
+    inline void Set(const T & key) noexcept { m_key = key; }
+
+protected:
+    T m_key;
+};
+
 //===========================================================================
 //    String Helper functions
 //===========================================================================
@@ -235,12 +450,73 @@ inline int StrCmp(const wchar_t str1[], const wchar_t str2[])
 
 inline int StrCmpI(const char str1[], const char str2[])
 {
+#if _MSC_VER
     return _stricmp(str1, str2);
+#else
+    return strcasecmp(str1, str2);
+#endif
 }
 
 inline int StrCmpI(const wchar_t str1[], const wchar_t str2[])
 {
+#if _MSC_VER
     return _wcsicmp (str1, str2);
+#else
+    return wcscasecmp(str1, str2);
+#endif
+}
+
+inline char FoldCase(char ch)
+{
+    return ((uint8)(ch - 'A') < 26) ? (char)(ch | 0x20) : ch;
+}
+
+inline wchar_t FoldCase(wchar_t ch)
+{
+    return (wchar_t)towlower(ch);
+}
+
+inline void StrFoldCase(wchar_t dest[], const wchar_t src[], size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        dest[i] = FoldCase(src[i]);
+}
+
+inline bool StrEqualFoldCase(const wchar_t str1[], const wchar_t str2[], size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (str1[i] != str2[i] && FoldCase(str1[i]) != FoldCase(str2[i]))
+            return false;
+    }
+    return true;
+}
+
+// Hash of the case folded string. The string is folded on the stack; longer
+// strings are folded and hashed in chunks, each seeded with the hash so far,
+// so hashing never allocates.
+template <class Hasher, class CharType>
+inline uint32 HashFoldCase(const CharType str[], size_t len) noexcept
+{
+    CharType folded[256 / sizeof(CharType)];
+    const size_t chunk = sizeof(folded) / sizeof(CharType);
+    uint32 hash = (uint32)len;
+    size_t pos = 0;
+    do
+    {
+        const size_t count = (len - pos < chunk) ? len - pos : chunk;
+        StrFoldCase(folded, str + pos, count);
+        hash = Hasher::Hash((const void *)folded, sizeof(CharType) * count, hash);
+        pos += count;
+    } while (pos < len);
+    return hash;
+}
+
+// Default policy folds and hashes ANSI strings in a single pass
+template <>
+inline uint32 HashFoldCase<CHasherDefault, char>(const char str[], size_t len) noexcept
+{
+    return MurmurHash3_x86_32_FoldCase(str, (int)len, (uint32)len);
 }
 
 inline char* StrDup(const char str[])
@@ -264,7 +540,7 @@ inline wchar_t * StrDup(const wchar_t str[])
         return nullptr;
 
     size_t const size = wcslen(str) + 1;
-    wchar_t * const memory = static_cast<wchar_t *>(malloc(size));
+    wchar_t * const memory = static_cast<wchar_t *>(malloc(size * sizeof(wchar_t)));
 
     if (memory == nullptr)
         return nullptr;
@@ -285,6 +561,35 @@ public:
     {
         return ::StrCmp(str1, str2);
     }
+
+    // Are the null terminated strings equal?
+    static bool StrEqual(const CharType str1[], const CharType str2[])
+    {
+        return ::StrCmp(str1, str2) == 0;
+    }
+
+    // Compare two strings of the same length
+    static bool Equal(const CharType str1[], const CharType str2[], size_t len)
+    {
+        return memcmp(str1, str2, len * sizeof(CharType)) == 0;
+    }
+
+    template <class Hasher>
+    static uint32 Hash(const CharType str[], size_t len)
+    {
+        return Hasher::Hash((const void *)str, sizeof(CharType) * len, (uint32)len);  // use string length as seed value
+    }
+
+    // Is the null terminated str equal to the first len characters of chars?
+    static bool StrEqual(const CharType str[], const CharType chars[], size_t len)
+    {
+        for (size_t i = 0; i < len; i++)
+        {
+            if (str[i] == 0 || str[i] != chars[i])
+                return false;
+        }
+        return str[len] == 0;
+    }
 };
 
 template<class CharType>
@@ -295,38 +600,77 @@ public:
     {
         return ::StrCmpI(str1, str2);
     }
+
+    // Are the null terminated strings equal ignoring case? Folds as Hash
+    // does (not with the locale dependent StrCmpI), so equal keys always
+    // hash the same.
+    static bool StrEqual(const CharType str1[], const CharType str2[])
+    {
+        for (; *str1 == *str2 || FoldCase(*str1) == FoldCase(*str2); str1++, str2++)
+        {
+            if (*str1 == 0)
+                return true;
+        }
+        return false;
+    }
+
+    static bool StrEqual(const CharType str[], const CharType chars[], size_t len)
+    {
+        for (size_t i = 0; i < len; i++)
+        {
+            if (str[i] == 0 || FoldCase(str[i]) != FoldCase(chars[i]))
+                return false;
+        }
+        return str[len] == 0;
+    }
+
+    static bool Equal(const CharType str1[], const CharType str2[], size_t len)
+    {
+        return StrEqualFoldCase(str1, str2, len);
+    }
+
+    // Keys equal ignoring case must hash the same
+    template <class Hasher>
+    static uint32 Hash(const CharType str[], size_t len)
+    {
+        return HashFoldCase<Hasher>(str, len);
+    }
 };
 
 
 //===========================================================================
 //    THashKeyStr
 //===========================================================================
-template<class CharType, class Cmp>
+template<class CharType, class Cmp, class Hasher>
 class THashKeyStrPtr;
 
-template<class CharType, class Cmp = TStrCmp<CharType> >
+template <class CharType, class Hasher, bool CacheHash, class Cmp>
+class THashKeyStrView;
+
+template<class CharType, class Cmp = TStrCmp<CharType>, class Hasher = CHasherDefault>
 class THashKeyStr
 {
 public:
     bool operator==(const THashKeyStr& rhs) const
     {
-        return (Cmp::StrCmp(m_str, rhs.m_str) == 0);
+        return Cmp::StrEqual(m_str, rhs.m_str);
+    }
+
+    // Heterogeneous lookup with a (pointer, length) view. No allocation.
+    template <bool CacheHash>
+    bool operator==(const THashKeyStrView<CharType, Hasher, CacheHash, Cmp>& rhs) const
+    {
+        if (m_str == nullptr || rhs.GetString() == nullptr)
+            return m_str == rhs.GetString();
+        return Cmp::StrEqual(m_str, rhs.GetString(), rhs.GetLength());
     }
 
     uint32 GetHash() const
     {
         if (m_str != nullptr)
-        {
-            auto strLen = StrLen(m_str);
-            return MurmurHash3_x86_32(
-                (const void *)m_str,
-                (int)(sizeof(CharType) * strLen),
-                (int)strLen);    // use string length as seed value
-        }
+            return Cmp::template Hash<Hasher>(m_str, StrLen(m_str));
         else
-        {
-          return 0;
-        }
+            return 0;
     }
     const CharType* GetString () const { return m_str; }
 
@@ -336,652 +680,2600 @@ protected:
 
     const CharType* m_str{ nullptr };
 
-    friend class THashKeyStrPtr<CharType, Cmp>;
+    friend class THashKeyStrPtr<CharType, Cmp, Hasher>;
 };
 
-template<class CharType, class Cmp = TStrCmp<CharType> >
-class THashKeyStrCopy : public THashKeyStr<CharType, Cmp>
+template<class CharType, class Cmp = TStrCmp<CharType>, class Hasher = CHasherDefault>
+class THashKeyStrCopy : public THashKeyStr<CharType, Cmp, Hasher>
 {
+    typedef THashKeyStr<CharType, Cmp, Hasher> Base;
 public:
     THashKeyStrCopy() noexcept { }
     THashKeyStrCopy(const CharType str[]) noexcept { SetString(str); }
     ~THashKeyStrCopy() noexcept
     {
-        free(const_cast<CharType *>(THashKeyStr<CharType>::m_str));
+        free(const_cast<CharType *>(Base::m_str));
     }
 
     void SetString(const CharType str[])
     {
-        free(const_cast<CharType *>(THashKeyStr<CharType>::m_str));
-        THashKeyStr<CharType>::m_str = str ? StrDup(str) : nullptr;
+        free(const_cast<CharType *>(Base::m_str));
+        Base::m_str = str ? StrDup(str) : nullptr;
     }
 };
 
-template<class CharType, class Cmp = TStrCmp<CharType> >
-class THashKeyStrPtr : public THashKeyStr<CharType, Cmp>
+template<class CharType, class Cmp = TStrCmp<CharType>, class Hasher = CHasherDefault>
+class THashKeyStrPtr : public THashKeyStr<CharType, Cmp, Hasher>
 {
+    typedef THashKeyStr<CharType, Cmp, Hasher> Base;
 public:
     THashKeyStrPtr() noexcept { }
     THashKeyStrPtr(const CharType str[]) noexcept { SetString(str); }
-    THashKeyStrPtr(const THashKeyStr<CharType, Cmp>& rhs) noexcept
+    THashKeyStrPtr(const Base& rhs) noexcept
     {
-        THashKeyStr<CharType, Cmp>::m_str = rhs.m_str;
+        Base::m_str = rhs.m_str;
     }
 
-    THashKeyStrPtr& operator=(const THashKeyStr<CharType, Cmp>& rhs) noexcept
+    THashKeyStrPtr& operator=(const Base& rhs) noexcept
     {
-        THashKeyStr<CharType, Cmp>::m_str = rhs.m_str;
+        Base::m_str = rhs.m_str;
         return *this;
     }
-    THashKeyStrPtr& operator=(const THashKeyStrPtr<CharType, Cmp>& rhs) noexcept
+    THashKeyStrPtr& operator=(const THashKeyStrPtr& rhs) noexcept
     {
-        THashKeyStr<CharType, Cmp>::m_str = rhs.m_str;
+        Base::m_str = rhs.m_str;
         return *this;
     }
 
     void SetString(const CharType str[]) noexcept
     {
-        THashKeyStr<CharType, Cmp>::m_str = str;
+        Base::m_str = str;
     }
 };
 
-// Typedefs for convenience
-typedef THashKeyStrCopy<wchar_t>                        CHashKeyStr;
-typedef THashKeyStrPtr <wchar_t>                        CHashKeyStrPtr;
-typedef THashKeyStrCopy<char>                           CHashKeyStrAnsiChar;
-typedef THashKeyStrPtr <char>                           CHashKeyStrPtrAnsiChar;
-
-typedef THashKeyStrCopy<wchar_t, TStrCmpI<wchar_t>>     CHashKeyStrI;
-typedef THashKeyStrPtr <wchar_t, TStrCmpI<wchar_t>>     CHashKeyStrPtrI;
-typedef THashKeyStrCopy<char, TStrCmpI<char>>           CHashKeyStrAnsiCharI;
-typedef THashKeyStrPtr <char, TStrCmpI<char>>           CHashKeyStrPtrAnsiCharI;
+//===========================================================================
+//    THashKeyStrView and THashKeyStrLen
+//    (String keys carrying their length and optionally the cached hash.
+//     Compared by hash and length first, then memcmp (or a case folded
+//     compare with TStrCmpI). No strlen calls.)
+//===========================================================================
+template <bool CacheHash>
+struct THashCache
+{
+    static constexpr bool CACHED = false;
+    void SetCachedHash(uint32) noexcept { }
+    uint32 GetCachedHash() const noexcept { return 0; }
+};
 
+template <>
+struct THashCache<true>
+{
+    static constexpr bool CACHED = true;
+    void SetCachedHash(uint32 hash) noexcept { m_hash = hash; }
+    uint32 GetCachedHash() const noexcept { return m_hash; }
 
-/****************************************************************************
-*
-*   THashTrie
-*
-*   Template class for HAMT (Hash Array Mapped Trie)
-*
-**/
+    uint32 m_hash{ 0 };
+};
 
-template <class T, class K>
-class THashTrie final
+// Non-owning string key (pointer + length). Use as K to look up
+// THashKeyStrLen entries without allocations.
+template <class CharType, class Hasher = CHasherDefault, bool CacheHash = true, class Cmp = TStrCmp<CharType>>
+class THashKeyStrView
 {
-private:
-    // Use the least significant bit as reference marker
-    static constexpr uint_ptr   AMT_MARK_BIT    = 1; // Using LSB for marking AMT (sub-trie) data structure
-    static constexpr uint32     HASH_INDEX_BITS = 5;
-    static constexpr uint32     HASH_INDEX_MASK = (1 << HASH_INDEX_BITS) - 1;
-    // Ceiling to 8 bits boundary to use all 32 bits.
-    static constexpr uint32     MAX_HASH_BITS   = ((sizeof(uint32) * 8 + 7) / HASH_INDEX_BITS) * HASH_INDEX_BITS; // 35
-    static constexpr uint32     MAX_HAMT_DEPTH  = MAX_HASH_BITS / HASH_INDEX_BITS;  // = 7
+    typedef THashCache<CacheHash> Cache;
+public:
+    THashKeyStrView() noexcept { SetString(nullptr, 0); }
+    THashKeyStrView(const CharType str[]) noexcept { SetString(str, str ? StrLen(str) : 0); }
+    THashKeyStrView(const CharType str[], size_t len) noexcept { SetString(str, len); }
 
-private:
-    // Each Node entry in the hash table is either terminal (leaf) node
-    // (a T pointer) or AMT data structure.
-    //
-    //        If a node pointer's LSB == 1 then AMT
-    //            else T object pointer
-    //
-    // A one bit in the bit map represents a valid arc, while a zero an empty arc.
-    // The pointers in the table are kept in sorted order and correspond to
-    // the order of each one bit in the bit map.
+    // Any string type with data() and size() (std::basic_string, std::basic_string_view, ...)
+    template <class S, class = decltype(std::declval<const S&>().data() + std::declval<const S&>().size())>
+    THashKeyStrView(const S& str) noexcept { SetString(str.data(), str.size()); }
 
-    struct ArrayMappedTrie
+    bool operator==(const THashKeyStrView& rhs) const noexcept
     {
-        uint32  m_bitmap;
-        T*      m_subHash[1];
-        // Do not add more data below
-        // New data should be added before m_subHash
+        return m_len == rhs.m_len
+            && (!Cache::CACHED || m_cache.GetCachedHash() == rhs.m_cache.GetCachedHash())
+            && Cmp::Equal(m_str, rhs.m_str, m_len);
+    }
 
-        inline T** Lookup(uint32 hashIndex);
-        inline T** LookupLinear(const K& key);
+    uint32 GetHash() const noexcept
+    {
+        return Cache::CACHED ? m_cache.GetCachedHash() : ComputeHash();
+    }
 
-        static T** Alloc1(uint32 bitIndex, T** slotToReplace);
-        static T** Alloc2(uint32 hashIndex, T* node, uint32  oldHashIndex, T* oldNode, T** slotToReplace);
-        static T** Alloc2Linear(T* node, T* oldNode, T** slotToReplace);
+    const CharType* GetString() const noexcept { return m_str; }
+    size_t GetLength() const noexcept { return m_len; }
 
-        static ArrayMappedTrie* Insert(ArrayMappedTrie* amt, uint32 hashIndex, T* node, T** slotToReplace) noexcept;
-        static ArrayMappedTrie* AppendLinear(ArrayMappedTrie* amt, T* node, T** slotToReplace) noexcept;
-        static ArrayMappedTrie* Resize(ArrayMappedTrie* amt, int oldSize, int deltasize, int idx) noexcept;
+protected:
+    void SetString(const CharType str[], size_t len) noexcept
+    {
+        assert(len <= UINT32_MAX);
+        m_str = str;
+        m_len = (uint32)len;
+        m_cache.SetCachedHash(ComputeHash());
+    }
 
-        static void ClearAll(ArrayMappedTrie* amt, uint32 depth=0) noexcept;
-        static void DestroyAll(ArrayMappedTrie* amt, uint32 depth=0) noexcept;
-    };
+    uint32 ComputeHash() const noexcept
+    {
+        // Same hash as THashKeyStr for the same string
+        return Cmp::template Hash<Hasher>(m_str, m_len);
+    }
 
-    // Root Hash Table
-    T* m_root{ nullptr };
-    uint32 m_count{ 0 };
+    const CharType* m_str;
+    uint32          m_len;
+    Cache           m_cache;    // Packs next to m_len
+};
 
+// Owning string key. Copies the string (with a null terminator) once and
+// keeps the length, so GetHash and operator== never scan for the terminator.
+template <class CharType, class Hasher = CHasherDefault, bool CacheHash = true, class Cmp = TStrCmp<CharType>>
+class THashKeyStrLen : public THashKeyStrView<CharType, Hasher, CacheHash, Cmp>
+{
+    typedef THashKeyStrView<CharType, Hasher, CacheHash, Cmp> Base;
 public:
-    THashTrie() = default;
-    ~THashTrie() noexcept { Clear(); }
-    THashTrie(THashTrie&&) = delete;
-    THashTrie(THashTrie const&) = delete;
-    THashTrie& operator=(THashTrie const&) = delete;
+    THashKeyStrLen() noexcept { }
+    THashKeyStrLen(const CharType str[]) { SetString(str, str ? StrLen(str) : 0); }
+    THashKeyStrLen(const CharType str[], size_t len) { SetString(str, len); }
+    THashKeyStrLen(const Base& view) { SetString(view.GetString(), view.GetLength()); }
+    template <class S, class = decltype(std::declval<const S&>().data() + std::declval<const S&>().size())>
+    THashKeyStrLen(const S& str) { SetString(str.data(), str.size()); }
+
+    THashKeyStrLen(const THashKeyStrLen&) = delete;
+    THashKeyStrLen& operator=(const THashKeyStrLen&) = delete;
+
+    ~THashKeyStrLen() noexcept
+    {
+        free(const_cast<CharType *>(Base::m_str));
+    }
+
+    void SetString(const CharType str[], size_t len)
+    {
+        CharType* copy = nullptr;
+        if (str != nullptr)
+        {
+            copy = static_cast<CharType *>(malloc((len + 1) * sizeof(CharType)));
+            if (copy == nullptr)
+                throw std::bad_alloc();
+            memcpy(copy, str, len * sizeof(CharType));
+            copy[len] = 0;
+        }
+
+        free(const_cast<CharType *>(Base::m_str));
+        Base::SetString(copy, len);
+    }
+};
 
+// Small-string-optimized owning key. Strings up to INLINE_LENGTH characters
+// are stored inside the key object itself, so comparing against an entry
+// does not chase a pointer to a separate buffer. Longer strings go to the heap.
+// Hash matches THashKeyStrView for the same string.
+template <class CharType, class Hasher = CHasherDefault, size_t InlineBytes = 24>
+class THashKeyStrInline
+{
 public:
-    void Add(T* node);
-    T* Find(const K& key) noexcept;
-    T* Remove(const K& key) noexcept;
-    bool Empty() noexcept;
-    uint32 GetCount() noexcept { return m_count; }
-    void Clear() noexcept;        // Destruct HAMT data structures only
-    void Destroy();    // Destruct HAMT data structures as well as containing objects
+    static constexpr size_t INLINE_CAPACITY = InlineBytes / sizeof(CharType);
+    static constexpr size_t INLINE_LENGTH   = INLINE_CAPACITY - 1;    // Excluding null terminator
+    COMPILER_CHECK(InlineBytes >= sizeof(CharType *) && InlineBytes % sizeof(CharType) == 0, InvalidInlineBytes);
+
+    THashKeyStrInline() noexcept { m_chars[0] = 0; m_len = 0; m_hash = ComputeHash(m_chars, 0); }
+    THashKeyStrInline(const CharType str[]) { Init(str, str ? StrLen(str) : 0); }
+    THashKeyStrInline(const CharType str[], size_t len) { Init(str, len); }
+    THashKeyStrInline(const THashKeyStrView<CharType, Hasher>& view) { Init(view.GetString(), view.GetLength()); }
+    template <class S, class = decltype(std::declval<const S&>().data() + std::declval<const S&>().size())>
+    THashKeyStrInline(const S& str) { Init(str.data(), str.size()); }
+
+    THashKeyStrInline(const THashKeyStrInline&) = delete;
+    THashKeyStrInline& operator=(const THashKeyStrInline&) = delete;
+
+    ~THashKeyStrInline() noexcept
+    {
+        if (!IsInline())
+            free(m_heap);
+    }
+
+    bool operator==(const THashKeyStrInline& rhs) const noexcept
+    {
+        return m_len == rhs.m_len
+            && m_hash == rhs.m_hash
+            && memcmp(GetString(), rhs.GetString(), m_len * sizeof(CharType)) == 0;
+    }
+
+    bool operator==(const THashKeyStrView<CharType, Hasher>& rhs) const noexcept
+    {
+        return m_len == rhs.GetLength()
+            && m_hash == rhs.GetHash()
+            && memcmp(GetString(), rhs.GetString(), m_len * sizeof(CharType)) == 0;
+    }
+
+    uint32 GetHash() const noexcept { return m_hash; }
+    const CharType* GetString() const noexcept { return IsInline() ? m_chars : m_heap; }
+    size_t GetLength() const noexcept { return m_len; }
+    bool IsInline() const noexcept { return m_len <= INLINE_LENGTH; }
+
+    void SetString(const CharType str[], size_t len)
+    {
+        if (!IsInline())
+            free(m_heap);
+        m_len = 0;
+        Init(str, len);
+    }
+
+private:
+    void Init(const CharType str[], size_t len)
+    {
+        assert(len <= UINT32_MAX);
+        CharType* dest = m_chars;
+        if (len > INLINE_LENGTH)
+        {
+            dest = static_cast<CharType *>(malloc((len + 1) * sizeof(CharType)));
+            if (dest == nullptr)
+                throw std::bad_alloc();
+            m_heap = dest;
+        }
+        if (len != 0)
+            memcpy(dest, str, len * sizeof(CharType));
+        dest[len] = 0;
+        m_len = (uint32)len;
+        m_hash = ComputeHash(dest, len);
+    }
+
+    static uint32 ComputeHash(const CharType str[], size_t len) noexcept
+    {
+        return Hasher::Hash((const void *)str, sizeof(CharType) * len, (uint32)len);
+    }
+
+    union
+    {
+        CharType    m_chars[INLINE_CAPACITY];
+        CharType*   m_heap;
+    };
+    uint32          m_len;
+    uint32          m_hash;
+};
+
+// Typedefs for convenience
+typedef THashKeyStrCopy<wchar_t>                        CHashKeyStr;
+typedef THashKeyStrPtr <wchar_t>                        CHashKeyStrPtr;
+typedef THashKeyStrCopy<char>                           CHashKeyStrAnsiChar;
+typedef THashKeyStrPtr <char>                           CHashKeyStrPtrAnsiChar;
+
+typedef THashKeyStrCopy<wchar_t, TStrCmpI<wchar_t>>     CHashKeyStrI;
+typedef THashKeyStrPtr <wchar_t, TStrCmpI<wchar_t>>     CHashKeyStrPtrI;
+typedef THashKeyStrCopy<char, TStrCmpI<char>>           CHashKeyStrAnsiCharI;
+typedef THashKeyStrPtr <char, TStrCmpI<char>>           CHashKeyStrPtrAnsiCharI;
+
+typedef THashKeyStrLen <wchar_t>                        CHashKeyStrLen;
+typedef THashKeyStrView<wchar_t>                        CHashKeyStrView;
+typedef THashKeyStrLen <char>                           CHashKeyStrLenAnsiChar;
+typedef THashKeyStrView<char>                           CHashKeyStrViewAnsiChar;
+
+typedef THashKeyStrLen <wchar_t, CHasherDefault, true, TStrCmpI<wchar_t>>  CHashKeyStrLenI;
+typedef THashKeyStrView<wchar_t, CHasherDefault, true, TStrCmpI<wchar_t>>  CHashKeyStrViewI;
+typedef THashKeyStrLen <char, CHasherDefault, true, TStrCmpI<char>>        CHashKeyStrLenAnsiCharI;
+typedef THashKeyStrView<char, CHasherDefault, true, TStrCmpI<char>>        CHashKeyStrViewAnsiCharI;
+
+typedef THashKeyStrInline<wchar_t>                      CHashKeyStrInline;
+typedef THashKeyStrInline<char>                         CHashKeyStrInlineAnsiChar;
+
+
+//===========================================================================
+//    TStringPool
+//    (Append-only chunked arena for string key bytes. Allocation is a pointer
+//     bump and destroying the pool frees a handful of chunks. Space of removed
+//     keys is reclaimed by Compact.)
+//===========================================================================
+template <class T, class K>
+class THashTrie;
+
+template <class CharType>
+class TStringPool
+{
+public:
+    static constexpr size_t DEFAULT_CHUNK_SIZE = 64 * 1024;   // bytes
+
+    explicit TStringPool(size_t chunkSize = DEFAULT_CHUNK_SIZE) noexcept
+        : m_chunkLength(chunkSize / sizeof(CharType)) { }
+    ~TStringPool() noexcept { Clear(); }
+    TStringPool(TStringPool const&) = delete;
+    TStringPool& operator=(TStringPool const&) = delete;
+
+    // Copy str (len chars) with a null terminator into the pool
+    const CharType* Intern(const CharType str[], size_t len);
+
+    // Account the string as dead. Its space is reclaimed by Compact.
+    void Release(const CharType str[], size_t len) noexcept;
+
+    // Move strings of all entries of trie into new chunks and free the old
+    // chunks. Every string in the pool must belong to an entry of trie.
+    // T must derive from THashKeyStrPool<CharType, ...>.
+    template <class T, class K>
+    void Compact(THashTrie<T, K>& trie);
+
+    void Clear() noexcept;
+
+    size_t GetUsedBytes() const noexcept { return m_usedLength * sizeof(CharType); }
+    size_t GetDeadBytes() const noexcept { return m_deadLength * sizeof(CharType); }
+    size_t GetChunkCount() const noexcept { return m_chunkCount; }
+
+private:
+    struct Chunk
+    {
+        Chunk*      m_next;
+        size_t      m_size;     // capacity in CharType units
+        size_t      m_used;
+        CharType    m_data[1];
+        // Do not add more data below
+    };
+
+    Chunk*  m_chunks{ nullptr };    // Current chunk first
+    size_t  m_chunkLength;
+    size_t  m_chunkCount{ 0 };
+    size_t  m_usedLength{ 0 };      // Including null terminators
+    size_t  m_deadLength{ 0 };
+};
+
+template <class CharType>
+const CharType* TStringPool<CharType>::Intern(const CharType str[], size_t len)
+{
+    const size_t need = len + 1;
+    Chunk* chunk = m_chunks;
+    if (chunk == nullptr || chunk->m_size - chunk->m_used < need)
+    {
+        // Strings longer than a chunk get a chunk of their own
+        size_t size = (need > m_chunkLength) ? need : m_chunkLength;
+        chunk = (Chunk *)malloc(sizeof(Chunk) + (size - 1) * sizeof(CharType));
+        if (chunk == nullptr)
+            throw std::bad_alloc();
+
+        chunk->m_size = size;
+        chunk->m_used = 0;
+        if (m_chunks != nullptr && size != m_chunkLength)
+        {
+            // Keep bumping in the current chunk
+            chunk->m_next = m_chunks->m_next;
+            m_chunks->m_next = chunk;
+        }
+        else
+        {
+            chunk->m_next = m_chunks;
+            m_chunks = chunk;
+        }
+        m_chunkCount++;
+    }
+
+    CharType* copy = chunk->m_data + chunk->m_used;
+    memcpy(copy, str, len * sizeof(CharType));
+    copy[len] = 0;
+    chunk->m_used += need;
+    m_usedLength += need;
+    return copy;
+}
+
+template <class CharType>
+inline void TStringPool<CharType>::Release(const CharType str[], size_t len) noexcept
+{
+    if (str != nullptr)
+        m_deadLength += len + 1;
+}
+
+template <class CharType>
+template <class T, class K>
+void TStringPool<CharType>::Compact(THashTrie<T, K>& trie)
+{
+    Chunk* oldChunks = m_chunks;
+    m_chunks = nullptr;
+    m_chunkCount = 0;
+    m_usedLength = 0;
+    m_deadLength = 0;
+
+    trie.ForEach([this](T* node) { node->Relocate(*this); });
+
+    while (oldChunks != nullptr)
+    {
+        Chunk* next = oldChunks->m_next;
+        free(oldChunks);
+        oldChunks = next;
+    }
+}
+
+template <class CharType>
+void TStringPool<CharType>::Clear() noexcept
+{
+    while (m_chunks != nullptr)
+    {
+        Chunk* next = m_chunks->m_next;
+        free(m_chunks);
+        m_chunks = next;
+    }
+    m_chunkCount = 0;
+    m_usedLength = 0;
+    m_deadLength = 0;
+}
+
+// String key whose bytes live in a TStringPool. The pool must outlive the key.
+template <class CharType, class Hasher = CHasherDefault>
+class THashKeyStrPool : public THashKeyStrView<CharType, Hasher>
+{
+    typedef THashKeyStrView<CharType, Hasher> Base;
+public:
+    THashKeyStrPool(TStringPool<CharType>& pool, const CharType str[])
+        : m_pool(&pool) { SetString(str, str ? StrLen(str) : 0); }
+    THashKeyStrPool(TStringPool<CharType>& pool, const CharType str[], size_t len)
+        : m_pool(&pool) { SetString(str, len); }
+    THashKeyStrPool(TStringPool<CharType>& pool, const Base& view)
+        : m_pool(&pool) { SetString(view.GetString(), view.GetLength()); }
+
+    THashKeyStrPool(const THashKeyStrPool&) = delete;
+    THashKeyStrPool& operator=(const THashKeyStrPool&) = delete;
+
+    ~THashKeyStrPool() noexcept
+    {
+        m_pool->Release(Base::m_str, Base::m_len);
+    }
+
+    void SetString(const CharType str[], size_t len)
+    {
+        const CharType* copy = (str != nullptr) ? m_pool->Intern(str, len) : nullptr;
+        m_pool->Release(Base::m_str, Base::m_len);
+        Base::SetString(copy, len);
+    }
+
+protected:
+    // Called by TStringPool::Compact. Hash is unchanged.
+    void Relocate(TStringPool<CharType>& pool)
+    {
+        if (Base::m_str != nullptr)
+            Base::m_str = pool.Intern(Base::m_str, Base::m_len);
+    }
+
+    TStringPool<CharType>* m_pool;
+
+    friend class TStringPool<CharType>;
 };
 
 
+//===========================================================================
+//    THashBatch
+//    (Computes hashes of up to HASH_BATCH_SIZE keys at once. Keys hashed by
+//     CHasherDefault use the SIMD batch hash functions.)
+//===========================================================================
+static constexpr uint32 HASH_BATCH_SIZE = 16;
+
+template <class K>
+struct THashBatch
+{
+    static void GetHashes(const K* const keys[], uint32 count, uint32 hashes[]) noexcept
+    {
+        for (uint32 i = 0; i < count; i++)
+            hashes[i] = keys[i]->GetHash();
+    }
+};
+
+template <typename T, typename IntType>
+struct THashBatchInt
+{
+    static void GetHashes(const THashKey32<T>* const keys[], uint32 count, uint32 hashes[]) noexcept
+    {
+        assert(count <= HASH_BATCH_SIZE);
+        IntType ints[HASH_BATCH_SIZE];
+        for (uint32 i = 0; i < count; i++)
+            ints[i] = (IntType)keys[i]->Get();
+        WangHashBatch(ints, hashes, count);
+    }
+};
+
+template <> struct THashBatch<THashKey32<int32>>  : THashBatchInt<int32,  uint32> { };
+template <> struct THashBatch<THashKey32<uint32>> : THashBatchInt<uint32, uint32> { };
+template <> struct THashBatch<THashKey32<int64>>  : THashBatchInt<int64,  uint64> { };
+template <> struct THashBatch<THashKey32<uint64>> : THashBatchInt<uint64, uint64> { };
+
+template <class K, class CharType>
+struct THashBatchStr
+{
+    static void GetHashes(const K* const keys[], uint32 count, uint32 hashes[]) noexcept
+    {
+        assert(count <= HASH_BATCH_SIZE);
+        const void* strs[HASH_BATCH_SIZE];
+        int         lens[HASH_BATCH_SIZE];
+        uint32      seeds[HASH_BATCH_SIZE];
+        for (uint32 i = 0; i < count; i++)
+        {
+            const CharType* str = keys[i]->GetString();
+            size_t strLen = (str != nullptr) ? StrLen(str) : 0;
+            strs[i]  = str;
+            lens[i]  = (int)(sizeof(CharType) * strLen);
+            seeds[i] = (uint32)strLen;    // use string length as seed value
+        }
+        MurmurHash3_x86_32_Batch(strs, lens, seeds, hashes, count);
+
+        // Null strings hash to 0 (see THashKeyStr::GetHash)
+        for (uint32 i = 0; i < count; i++)
+        {
+            if (strs[i] == nullptr)
+                hashes[i] = 0;
+        }
+    }
+};
+
+template <class CharType>
+struct THashBatch<THashKeyStr<CharType>> : THashBatchStr<THashKeyStr<CharType>, CharType> { };
+template <class CharType>
+struct THashBatch<THashKeyStrCopy<CharType>> : THashBatchStr<THashKeyStrCopy<CharType>, CharType> { };
+template <class CharType>
+struct THashBatch<THashKeyStrPtr<CharType>> : THashBatchStr<THashKeyStrPtr<CharType>, CharType> { };
+
+
+//===========================================================================
+//    CHashTrieStats
+//    (Structural statistics of a THashTrie collected by THashTrie::GetStats)
+//===========================================================================
+struct CHashTrieStats
+{
+    // Leaves can live at depth 0 (root) up to depth 8 (inside a collision bucket)
+    static constexpr uint32 MAX_LEAF_DEPTH          = 8;
+    // Collision buckets bigger than this are counted in the last histogram entry
+    static constexpr uint32 MAX_BUCKET_HISTOGRAM    = 16;
+
+    uint32  leafCount;                                      // Number of entries
+    uint32  nodeCount;                                      // Number of AMT nodes (including collision buckets)
+    uint32  maxLeafDepth;                                   // Depth of the deepest leaf
+    uint32  leafDepth[MAX_LEAF_DEPTH + 1];                  // Number of leaves per depth
+    uint32  nodePopCount[33];                               // Number of AMT nodes per used slot count (1..32)
+    uint32  denseNodeCount;                                 // Number of dense (directly indexed) AMT nodes
+    uint32  skipNodeCount;                                  // Number of AMT nodes with skipped levels (path compression)
+    uint32  skippedLevelCount;                              // Single slot levels saved by them
+    uint32  collisionBucketCount;                           // Number of linear search (collision) buckets
+    uint32  collisionEntryCount;                            // Number of entries stored in collision buckets
+    uint32  collisionBucketSize[MAX_BUCKET_HISTOGRAM + 1];  // Number of collision buckets per size (2..16+)
+    uint64  nodeBytes;                                      // Bytes allocated for AMT nodes (excluding leaves)
+    uint64  totalProbeLength;                               // Sum of slots read to reach every entry
+    double  averageProbeLength;                             // totalProbeLength / leafCount
+
+    CHashTrieStats() noexcept { memset(this, 0, sizeof(*this)); }
+};
+
+
+//===========================================================================
+//    CHashTrieCounters
+//    (Hot-path counters of all THashTrie instances used by the calling thread.
+//     Only updated when compiled with HAMT_PERF_COUNTERS=1)
+//===========================================================================
+
+// HAMT_PERF_COUNTERS changes the inline code of THashTrie, so it must be
+// the same in every translation unit: set it for the whole build (the
+// CMake option defines it for all targets), never in a single file.
+#ifndef HAMT_PERF_COUNTERS
+#define HAMT_PERF_COUNTERS 0
+#endif
+
+struct CHashTrieCounters
+{
+    // Find
+    uint64  findCount;
+    uint64  findLevels;             // AMT levels traversed
+    uint64  findLeafCompares;       // Key compares (leaves and collision buckets)
+    uint64  findMissEmptySlot;      // Negative lookups stopped at an empty bitmap bit
+    uint64  findMissKeyMismatch;    // Negative lookups stopped at a leaf with different key
+
+    // Add
+    uint64  addCount;
+    uint64  addAlloc1Chains;        // Number of Alloc1 loops that created at least one node
+    uint64  addAlloc1Nodes;         // Total single slot AMT nodes created by Alloc1 loops
+    uint64  addMaxAlloc1Chain;      // Longest Alloc1 chain
+    uint64  addSkippedLevels;       // Single slot AMT nodes not created thanks to path compression
+    uint64  addSkipSplits;          // Skipped levels split by a key with other hash indices
+
+    // Resize
+    uint64  resizeCount;
+    uint64  resizeBytesMoved;       // memmove bytes plus bytes copied when realloc relocated a node
+    uint64  resizeDenseGrows;       // Sparse nodes turned into dense nodes on insert
+    uint64  resizeDenseShrinks;     // Dense nodes turned back into sparse nodes on remove
+
+    // Remove
+    uint64  removeCount;
+    uint64  removeFoldUps;          // Single remaining leaves folded into the parent slot
+};
+
+#if HAMT_PERF_COUNTERS
+
+// Zero initialized without dynamic initialization, so access is a plain TLS load
+inline CHashTrieCounters& HashTrieCounters() noexcept
+{
+    static thread_local CHashTrieCounters s_counters;
+    return s_counters;
+}
+
+#define HAMT_PERF_COUNT(counter, n)     (HashTrieCounters().counter += (n))
+
+#else
+
+#define HAMT_PERF_COUNT(counter, n)     ((void)0)
+
+#endif
+
+// Returns a snapshot of the calling thread's counters (all zero if HAMT_PERF_COUNTERS is off)
+inline CHashTrieCounters GetHashTrieCounters() noexcept
+{
+#if HAMT_PERF_COUNTERS
+    return HashTrieCounters();
+#else
+    CHashTrieCounters counters;
+    memset(&counters, 0, sizeof(counters));
+    return counters;
+#endif
+}
+
+inline void ResetHashTrieCounters() noexcept
+{
+#if HAMT_PERF_COUNTERS
+    memset(&HashTrieCounters(), 0, sizeof(CHashTrieCounters));
+#endif
+}
+
+
 /****************************************************************************
 *
 *   THashTrie
 *
-*   Specialized HashTrie template for int type key/value pair.
-*   Add/Find methods returns Cell data type.
+*   Template class for HAMT (Hash Array Mapped Trie)
 *
 **/
 
-template <typename T>
-class THashTrieInt final
-{
-public:
-    // Cell contains both key and value (int)
-    struct Cell : THashKey32<T>
+template <class T, class K>
+class THashTrieParallel;
+template <class T, class K>
+class THashTrieTeardown;
+template <class T, class K>
+class THashTrieFile;
+template <class T, class K>
+class THashTrieSnapshot;
+
+template <class T, class K>
+class THashTrie final
+{
+    friend class THashTrieParallel<T, K>;
+    friend class THashTrieTeardown<T, K>;
+    friend class THashTrieFile<T, K>;
+    friend class THashTrieSnapshot<T, K>;
+
+private:
+    // Use the least significant bit as reference marker
+    static constexpr uint_ptr   AMT_MARK_BIT    = 1; // Using LSB for marking AMT (sub-trie) data structure
+    static constexpr uint32     HASH_INDEX_BITS = 5;
+    static constexpr uint32     HASH_INDEX_MASK = (1 << HASH_INDEX_BITS) - 1;
+    // Ceiling to 8 bits boundary to use all 32 bits.
+    static constexpr uint32     MAX_HASH_BITS   = ((sizeof(uint32) * 8 + 7) / HASH_INDEX_BITS) * HASH_INDEX_BITS; // 35
+    static constexpr uint32     MAX_HAMT_DEPTH  = MAX_HASH_BITS / HASH_INDEX_BITS;  // = 7
+
+    // Nodes with DENSE_NODE_MIN or more arcs are dense: all 32 slots directly
+    // indexed by the hash index. They go back to sparse when they drop below
+    // SPARSE_NODE_MAX arcs, so a node at the boundary doesn't switch on every
+    // add and remove.
+    static constexpr uint32     DENSE_BITMAP    = 0xFFFFFFFF;
+    static constexpr uint32     DENSE_NODE_MIN  = 24;
+    static constexpr uint32     SPARSE_NODE_MAX = 16;
+
+    // Path compression: a node can skip up to MAX_SKIP_LEVELS levels where
+    // all its keys have the same hash index, instead of hanging below a
+    // chain of single slot nodes. m_skip holds the number of skipped levels
+    // in the low SKIP_LEVEL_BITS and their hash indices above them.
+    static constexpr uint32     SKIP_LEVEL_BITS = 3;
+    static constexpr uint32     SKIP_LEVEL_MASK = (1 << SKIP_LEVEL_BITS) - 1;
+    static constexpr uint32     MAX_SKIP_LEVELS = 5;
+
+private:
+    // Each Node entry in the hash table is either terminal (leaf) node
+    // (a T pointer) or AMT data structure.
+    //
+    //        If a node pointer's LSB == 1 then AMT
+    //            else T object pointer
+    //
+    // A one bit in the bit map represents a valid arc, while a zero an empty arc.
+    // The pointers in the table are kept in sorted order and correspond to
+    // the order of each one bit in the bit map.
+    //
+    // Dense nodes have all bits set and 32 slots. Their empty arcs are nullptr
+    // slots, so the slot of a hash index is the index itself. Sparse nodes
+    // never hold nullptr.
+    //
+    // A node with skipped levels is reached from a slot at level d, but maps
+    // the hash index at level d + skipped levels. The keys below it have the
+    // skipped hash indices at levels d up to there.
+
+    struct ArrayMappedTrie
+    {
+        uint32  m_bitmap;
+        uint32  m_skip;         // Skipped levels and their hash indices (path compression)
+        T*      m_subHash[1];
+        // Do not add more data below
+        // New data should be added before m_subHash
+
+        inline T** Lookup(uint32 hashIndex);
+        template <class Q>
+        inline T** LookupLinear(const Q& key);
+
+        uint32 GetSkipLevels() const noexcept { return m_skip & SKIP_LEVEL_MASK; }
+        uint32 GetSkipPrefix() const noexcept { return m_skip >> SKIP_LEVEL_BITS; }
+        // Number of skipped levels, from the first, where hash (the hash bits
+        // from the level of the slot on) has the skipped hash indices
+        uint32 GetMatchLevels(uint32 hash) const noexcept
+        {
+            uint32 diff = hash ^ GetSkipPrefix();
+            uint32 levels = 0;
+            while (levels < GetSkipLevels() && (diff & HASH_INDEX_MASK) == 0)
+            {
+                diff >>= HASH_INDEX_BITS;
+                levels++;
+            }
+            return levels;
+        }
+        static uint32 MakeSkip(uint32 levels, uint32 prefix) noexcept
+        {
+            return ((prefix & (((uint32)1 << (levels * HASH_INDEX_BITS)) - 1)) << SKIP_LEVEL_BITS) | levels;
+        }
+
+        static T** Alloc1(uint32 bitIndex, T** slotToReplace);
+        static T** Alloc2(uint32 hashIndex, T* node, uint32  oldHashIndex, T* oldNode, T** slotToReplace, uint32 skip = 0);
+        static T** Alloc2Linear(T* node, T* oldNode, T** slotToReplace, uint32 skip = 0);
+        static ArrayMappedTrie* Collapse(ArrayMappedTrie* amt) noexcept;
+
+        static ArrayMappedTrie* Insert(ArrayMappedTrie* amt, uint32 hashIndex, T* node, T** slotToReplace) noexcept;
+        static ArrayMappedTrie* AppendLinear(ArrayMappedTrie* amt, T* node, T** slotToReplace) noexcept;
+        static ArrayMappedTrie* Resize(ArrayMappedTrie* amt, int oldSize, int deltasize, int idx) noexcept;
+        static ArrayMappedTrie* MakeDense(ArrayMappedTrie* amt) noexcept;
+        static ArrayMappedTrie* MakeSparse(ArrayMappedTrie* amt) noexcept;
+        static uint32 GetArcCount(const ArrayMappedTrie* amt) noexcept;
+
+        static ArrayMappedTrie* Alloc(uint32 size);
+
+        static void ClearAll(ArrayMappedTrie* amt, uint32 depth=0) noexcept;
+        static void DestroyAll(ArrayMappedTrie* amt, uint32 depth=0) noexcept;
+        static void CollectStats(const ArrayMappedTrie* amt, uint32 depth, uint32 level, CHashTrieStats& stats) noexcept;
+        template <class F>
+        static void ForEachLeaf(ArrayMappedTrie* amt, uint32 depth, F& fn);
+    };
+
+    static_assert(MAX_HAMT_DEPTH + 1 <= CHashTrieStats::MAX_LEAF_DEPTH, "Leaf depth histogram is too small.");
+    static_assert(SPARSE_NODE_MAX > 2 && SPARSE_NODE_MAX < DENSE_NODE_MIN && DENSE_NODE_MIN <= HASH_INDEX_MASK + 1,
+        "Dense nodes must not need folding and must have hysteresis.");
+    static_assert(MAX_SKIP_LEVELS <= SKIP_LEVEL_MASK && MAX_SKIP_LEVELS * HASH_INDEX_BITS + SKIP_LEVEL_BITS <= 32,
+        "Skipped levels must fit in m_skip.");
+
+    // Root Hash Table
+    T* m_root{ nullptr };
+    uint32 m_count{ 0 };
+
+    // Where Locate stopped: the slot to insert at and the remaining hash bits
+    struct InsertPos
+    {
+        T**     slot;
+        uint32  bitShifts;
+        uint32  hash;
+    };
+
+    void AddWithHash(T* node, uint32 hash);
+    template <class Q>
+    T** Locate(const Q& key, uint32 hash, InsertPos& pos) noexcept;
+    void InsertAt(const InsertPos& pos, T* node);
+
+    // Slots and AMT nodes from the root down to a leaf
+    struct NodePath
+    {
+        T**                 slots[MAX_HAMT_DEPTH + 2];
+        ArrayMappedTrie*    amts[MAX_HAMT_DEPTH + 2];
+        uint32              levels[MAX_HAMT_DEPTH + 2];     // Hash level of amts (with skipped levels)
+        int                 depth;      // of the leaf
+    };
+
+    template <class Q>
+    T** LocatePath(const Q& key, uint32 hash, NodePath& path, InsertPos& pos) noexcept;
+    void RemoveAt(NodePath& path) noexcept;
+
+    // Batch entry sorted in trie order: by the 5 bit hash index of the root
+    // level first, then of the next level and so on.
+    struct BatchItem
+    {
+        uint64  order;
+        uint32  hash;
+        uint32  index;  // into the nodes / keys array of the batch
+
+        bool operator<(const BatchItem& rhs) const noexcept
+        {
+            return order < rhs.order || (order == rhs.order && index < rhs.index);
+        }
+    };
+
+    static constexpr uint32 MIN_MERGE_BATCH = 64;   // Smaller batches are added one by one
+
+    static uint64 GetTrieOrder(uint32 hash) noexcept;
+    static uint32 GetHashIndex(uint32 hash, uint32 depth) noexcept { return (hash >> (depth * HASH_INDEX_BITS)) & HASH_INDEX_MASK; }
+    template <class GetKey>
+    static BatchItem* SortBatch(uint32 count, GetKey getKey) noexcept;
+    static uint32 DedupeBatch(BatchItem items[], uint32 count, T* const nodes[]) noexcept;
+    static uint32 SplitByHashIndex(const BatchItem items[], uint32 count, uint32 depth, uint32 ends[], uint32 hashIndices[]) noexcept;
+    static T* BuildSubtrie(const BatchItem items[], uint32 count, T* const nodes[], uint32 depth, T* extra);
+    void MergeAdd(T** slot, uint32 depth, const BatchItem items[], uint32 count, T* const nodes[]);
+    void MergeRemove(T** slot, uint32 depth, const BatchItem items[], uint32 count, const K keys[], T* removed[], uint32& removedCount) noexcept;
+    template <class Q>
+    T* FindWithHash(const Q& key, uint32 hash) noexcept;
+    template <class Q>
+    T* RemoveKey(const Q& key) noexcept;
+
+public:
+    THashTrie() = default;
+    ~THashTrie() noexcept { Clear(); }
+    THashTrie(THashTrie&&) = delete;
+    THashTrie(THashTrie const&) = delete;
+    THashTrie& operator=(THashTrie const&) = delete;
+
+public:
+    void Add(T* node);
+    T* Find(const K& key) noexcept { return Find<K>(key); }
+    T* Remove(const K& key) noexcept { return RemoveKey(key); }
+
+    // Heterogeneous lookup with any Q that provides GetHash() and that T
+    // compares equal to (T == Q), e.g. THashKeyStrView for string entries.
+    // Q must hash equal keys to the same value as K does.
+    template <class Q, class = decltype(std::declval<const Q&>().GetHash())>
+    T* Find(const Q& key) noexcept;
+    template <class Q, class = decltype(std::declval<const Q&>().GetHash())>
+    T* Remove(const Q& key) noexcept { return RemoveKey(key); }
+
+    // Find the entry with key, or add the entry returned by create() if there
+    // is none, in a single walk. create() must return a new'ed T with the same
+    // key; it is deleted again if the trie fails to grow (std::bad_alloc).
+    // Returns the entry and whether it was added.
+    template <class Q, class F>
+    std::pair<T*, bool> FindOrAdd(const Q& key, F create);
+
+    // FindOrAdd constructing the entry with new T(args...)
+    template <class Q, class... Args>
+    std::pair<T*, bool> TryEmplace(const Q& key, Args&&... args);
+
+    // Update, add or remove the entry with key in a single walk.
+    // fn(T* entry) gets the entry or nullptr and returns the entry to keep:
+    // the same entry, a replacement, or nullptr to remove it. The trie does
+    // not touch a replaced or removed entry afterwards, so fn may delete it.
+    // fn must not modify the trie. Returns the entry kept for key.
+    template <class Q, class F>
+    T* Compute(const Q& key, F fn);
+
+    // Adds create() if key doesn't exist. Otherwise calls merge(T* entry),
+    // which removes the entry if it returns false. merge then owns the
+    // removed entry: the trie does not touch it again, so merge should
+    // delete it (or keep it elsewhere). Returns the entry kept for key.
+    template <class Q, class C, class M>
+    T* Merge(const Q& key, C create, M merge);
+
+    // Batch entry points. Hashes are computed HASH_BATCH_SIZE keys at a time (see THashBatch)
+    // Large batches are sorted by hash and merged into the trie top-down, so
+    // every affected AMT node is visited and resized once.
+    void AddBatch(T* const nodes[], uint32 count);
+    void FindBatch(const K keys[], uint32 count, T* results[]) noexcept;
+    // removed[i] is the entry removed for keys[i] or nullptr. Returns the number removed.
+    uint32 RemoveBatch(const K keys[], uint32 count, T* removed[]) noexcept;
+
+    bool Empty() noexcept;
+    uint32 GetCount() noexcept { return m_count; }
+    void Clear() noexcept;        // Destruct HAMT data structures only
+    void Destroy();    // Destruct HAMT data structures as well as containing objects
+    CHashTrieStats GetStats() const noexcept;   // Walk the whole trie and collect structural statistics
+
+    // Call fn(T*) for every entry. fn must not add or remove entries.
+    template <class F>
+    void ForEach(F fn);
+};
+
+
+/****************************************************************************
+*
+*   THashTrie
+*
+*   Specialized HashTrie template for int type key/value pair.
+*   Add/Find methods returns Cell data type.
+*
+**/
+
+template <typename T, class Hasher = CHasherDefault>
+class THashTrieInt final
+{
+    static_assert(std::is_integral<T>::value, "Integer required.");
+
+public:
+    typedef THashKey32<T, Hasher> Key;
+
+    // Cell contains both key and value (int)
+    struct Cell : Key
+    {
+        Cell(T key) noexcept : Key(key) { }
+        T value{ 0 };
+    };
+
+private:
+    THashTrie<Cell, Key> m_hashtable;
+
+public:
+    THashTrieInt() noexcept = default;
+    ~THashTrieInt() noexcept = default;
+
+public:
+    Cell* Add(T key) { return FindOrAdd(key).first; }   // Returns the existing cell if key was added before
+    std::pair<Cell*, bool> FindOrAdd(T key) { return m_hashtable.TryEmplace(Key(key), key); }
+
+    // fn(T& value, bool found) updates the value in place and returns false
+    // to remove the key. A new key (value 0) is only allocated if fn keeps it.
+    template <class F>
+    Cell* Compute(T key, F fn);
+
+    // Adds key with value or sets value = fn(oldValue, value)
+    template <class F>
+    Cell* Merge(T key, T value, F fn);
+    Cell* Find(T key) noexcept { return m_hashtable.Find(key); }
+    bool Remove(T key) noexcept;
+    // Add cells new'ed by the caller in bulk (see THashTrie::AddBatch)
+    void AddBatch(Cell* const cells[], uint32 count) { m_hashtable.AddBatch(cells, count); }
+    // Call fn(Cell*) for every cell
+    template <class F>
+    void ForEach(F fn) { m_hashtable.ForEach(fn); }
+    uint32 GetCount() noexcept { return m_hashtable.GetCount(); }
+    void Clear() noexcept { m_hashtable.Clear(); }
+    void Destroy() { m_hashtable.Destroy(); }
+    CHashTrieStats GetStats() const noexcept { return m_hashtable.GetStats(); }
+};
+
+template <typename T, class Hasher>
+template <class F>
+typename THashTrieInt<T, Hasher>::Cell* THashTrieInt<T, Hasher>::Compute(T key, F fn)
+{
+    return m_hashtable.Compute(Key(key), [&](Cell* cell) -> Cell* {
+        if (cell != nullptr)
+        {
+            if (fn(cell->value, true))
+                return cell;
+            delete cell;
+            return nullptr;
+        }
+
+        T value = 0;
+        if (!fn(value, false))
+            return nullptr;
+        cell = new Cell(key);
+        cell->value = value;
+        return cell;
+    });
+}
+
+template <typename T, class Hasher>
+template <class F>
+inline typename THashTrieInt<T, Hasher>::Cell* THashTrieInt<T, Hasher>::Merge(T key, T value, F fn)
+{
+    return Compute(key, [&](T& current, bool found) {
+        current = found ? fn(current, value) : value;
+        return true;
+    });
+}
+
+template <typename T, class Hasher>
+bool THashTrieInt<T, Hasher>::Remove(T key) noexcept
+{
+    auto removed = m_hashtable.Remove(Key(key));
+    delete removed;
+    return removed != nullptr;
+}
+
+
+//===========================================================================
+//    THashTrie<T, K>::ArrayMappedTrie Implementation
+//===========================================================================
+
+// helpers to search for a given entry
+// this function counts bits in order to return the correct slot for a given hash
+template<class T, class K>
+T** THashTrie<T, K>::ArrayMappedTrie::Lookup(uint32 hashIndex)
+{
+    assert(hashIndex < (1 << HASH_INDEX_BITS));
+    if (m_bitmap == DENSE_BITMAP)
+        return (m_subHash[hashIndex] != nullptr) ? &m_subHash[hashIndex] : nullptr;
+
+    const uint32 bitPos = (uint32)1 << hashIndex;
+    if ((m_bitmap & bitPos) == 0)
+        return nullptr;
+    else
+        return &m_subHash[GetBitCount(m_bitmap & (bitPos - 1))];
+}
+
+template<class T, class K>
+template<class Q>
+T** THashTrie<T, K>::ArrayMappedTrie::LookupLinear(const Q & key)
+{
+    // Linear search
+    T** cur = m_subHash;
+    T** end = m_subHash + m_bitmap;
+    for (; cur < end; cur++)
+    {
+        if (**cur == key)
+            return cur;
+    }
+    // Not found
+    return nullptr;
+}
+
+template<class T, class K>
+T** THashTrie<T, K>::ArrayMappedTrie::Alloc1(uint32 bitIndex, T** slotToReplace)
+{
+    // Assert (0 <= bitIndex && bitIndex < 31);
+    ArrayMappedTrie * amt = (ArrayMappedTrie *)malloc(sizeof(ArrayMappedTrie));
+    if (!amt)
+        throw std::bad_alloc();
+
+    amt->m_bitmap = 1 << bitIndex;
+    amt->m_skip = 0;
+    amt->m_subHash[0] = *slotToReplace;     // Keeps the trie valid if the next allocation fails
+    *slotToReplace = (T *)((uint_ptr)amt | AMT_MARK_BIT);
+    return amt->m_subHash;
+}
+
+template<class T, class K>
+T** THashTrie<T, K>::ArrayMappedTrie::Alloc2(
+    uint32      hashIndex,
+    T*          node,
+    uint32      oldHashIndex,
+    T*          oldNode,
+    T**         slotToReplace,
+    uint32      skip)
+{
+    // Allocates a node with room for 2 elements
+    ArrayMappedTrie* amt = (ArrayMappedTrie *)malloc(sizeof(ArrayMappedTrie) + sizeof(T*));
+    if (!amt)
+        throw std::bad_alloc();
+
+    amt->m_bitmap = ((uint32)1 << hashIndex) | ((uint32)1 << oldHashIndex);
+    amt->m_skip = skip;
+
+    // Sort them in order and return new node
+    if (hashIndex < oldHashIndex)
+    {
+        amt->m_subHash[0] = node;
+        amt->m_subHash[1] = oldNode;
+    }
+    else
+    {
+        amt->m_subHash[0] = oldNode;
+        amt->m_subHash[1] = node;
+    }
+
+    *slotToReplace = (T *)((uint_ptr)amt | AMT_MARK_BIT);;
+    return amt->m_subHash;
+}
+
+template<class T, class K>
+T** THashTrie<T, K>::ArrayMappedTrie::Alloc2Linear(T* node, T* oldNode, T** slotToReplace, uint32 skip)
+{
+    // Allocates a node with room for 2 elements
+    ArrayMappedTrie* amt = (ArrayMappedTrie *)malloc(sizeof(ArrayMappedTrie) + sizeof(T *));
+    if (amt == nullptr)
+        throw std::bad_alloc();
+
+    amt->m_bitmap = 2;    // Number of entry in the linear search array
+    amt->m_skip = skip;
+    amt->m_subHash[0] = node;
+    amt->m_subHash[1] = oldNode;
+    *slotToReplace = (T *)((uint_ptr)amt | AMT_MARK_BIT);
+    return amt->m_subHash;
+}
+
+template<class T, class K>
+typename THashTrie<T, K>::ArrayMappedTrie*
+THashTrie<T, K>::ArrayMappedTrie::Alloc(uint32 size)
+{
+    ArrayMappedTrie* amt = (ArrayMappedTrie *)malloc(sizeof(ArrayMappedTrie) + (size - 1) * sizeof(T *));
+    if (amt == nullptr)
+        throw std::bad_alloc();
+    amt->m_skip = 0;
+    return amt;
+}
+
+// Merge a node with a single arc to a child node into the child, which then
+// skips the levels of both. Returns the child, or amt if the levels don't fit.
+template<class T, class K>
+typename THashTrie<T, K>::ArrayMappedTrie*
+THashTrie<T, K>::ArrayMappedTrie::Collapse(ArrayMappedTrie* amt) noexcept
+{
+    if (amt->m_bitmap == DENSE_BITMAP || GetBitCount(amt->m_bitmap) != 1 || ((uint_ptr)amt->m_subHash[0] & AMT_MARK_BIT) == 0)
+        return amt;
+
+    ArrayMappedTrie* child = (ArrayMappedTrie *)((uint_ptr)amt->m_subHash[0] & (~AMT_MARK_BIT));
+    const uint32 levels = amt->GetSkipLevels() + 1 + child->GetSkipLevels();
+    if (levels > MAX_SKIP_LEVELS)
+        return amt;
+
+    const uint32 prefixBits = amt->GetSkipLevels() * HASH_INDEX_BITS;
+    child->m_skip = MakeSkip(levels, amt->GetSkipPrefix()
+        | (GetLowestBitIndex(amt->m_bitmap) << prefixBits)
+        | (child->GetSkipPrefix() << (prefixBits + HASH_INDEX_BITS)));
+    free(amt);
+    return child;
+}
+
+template<class T, class K>
+typename THashTrie<T, K>::ArrayMappedTrie*
+THashTrie<T, K>::ArrayMappedTrie::Insert(ArrayMappedTrie* amt, uint32 hashIndex, T* node, T** slotToReplace) noexcept
+{
+    if (amt->m_bitmap != DENSE_BITMAP && GetBitCount(amt->m_bitmap) + 1 >= DENSE_NODE_MIN)
+    {
+        amt = MakeDense(amt);
+        if (amt == nullptr)
+            return nullptr;
+        *slotToReplace = (T *)((uint_ptr)amt | AMT_MARK_BIT);
+    }
+
+    if (amt->m_bitmap == DENSE_BITMAP)
+    {
+        assert(amt->m_subHash[hashIndex] == nullptr);
+        amt->m_subHash[hashIndex] = node;
+        return amt;
+    }
+
+    uint32 bitPos = (uint32)1 << hashIndex;
+    assert((amt->m_bitmap & bitPos) == 0);
+
+    uint32 numBitsBelow = GetBitCount(amt->m_bitmap & (bitPos - 1));
+    ArrayMappedTrie* newAmt = Resize(amt, GetBitCount(amt->m_bitmap), 1, numBitsBelow);
+    if (newAmt == nullptr)
+        return nullptr;
+    amt = newAmt;
+    amt->m_bitmap |= bitPos;
+    amt->m_subHash[numBitsBelow] = node;
+    *slotToReplace = (T *)((uint_ptr)amt | AMT_MARK_BIT);
+    return amt;
+}
+
+template<class T, class K>
+typename THashTrie<T, K>::ArrayMappedTrie*
+THashTrie<T, K>::ArrayMappedTrie::AppendLinear(ArrayMappedTrie* amt, T* node, T** slotToReplace) noexcept
+{
+    ArrayMappedTrie* newAmt = Resize(amt, amt->m_bitmap, 1, amt->m_bitmap);
+    if (newAmt == nullptr)
+        return nullptr;
+    amt = newAmt;
+    amt->m_subHash[amt->m_bitmap] = node;
+    amt->m_bitmap++;
+    *slotToReplace = (T *)((uint_ptr)amt | AMT_MARK_BIT);
+    return amt;
+}
+
+// memory allocation all in this function. (re)allocates n,
+// copies old m_data, and inserts space at index 'idx'
+template<class T, class K>
+typename THashTrie<T, K>::ArrayMappedTrie*
+THashTrie<T,K>::ArrayMappedTrie::Resize(ArrayMappedTrie* amt, int oldSize, int deltaSize, int idx) noexcept
+{
+    assert(deltaSize != 0);
+    int newSize = oldSize + deltaSize;
+    assert(newSize > 0);
+
+    HAMT_PERF_COUNT(resizeCount, 1);
+
+    // if it shrinks then (idx + deltasize, idx) will be removed
+    if (deltaSize < 0)
+    {
+        memmove(amt->m_subHash + idx, amt->m_subHash + idx - deltaSize, (newSize - idx) * sizeof(T *));
+        HAMT_PERF_COUNT(resizeBytesMoved, (newSize - idx) * sizeof(T *));
+    }
+
+    ArrayMappedTrie* newAmt = (ArrayMappedTrie *)realloc(amt, sizeof(ArrayMappedTrie) + (newSize - 1) * sizeof(T*));
+    if (newAmt != nullptr)
+    {
+        if (newAmt != amt)
+            HAMT_PERF_COUNT(resizeBytesMoved, sizeof(ArrayMappedTrie) + ((deltaSize < 0 ? newSize : oldSize) - 1) * sizeof(T*));
+        amt = newAmt;
+    }
+    else
+    {
+        // if it tried to shrink amt memory and that failed then keep using original memory.
+        if (deltaSize > 0)
+            return nullptr;
+    }
+
+    // If it grows then (idx, idx + deltasize) will be inserted
+    if (deltaSize > 0)
+    {
+        memmove(amt->m_subHash + idx + deltaSize, amt->m_subHash + idx, (oldSize - idx) * sizeof(T *)); // shuffle tail to make room
+        HAMT_PERF_COUNT(resizeBytesMoved, (oldSize - idx) * sizeof(T *));
+    }
+
+    return amt;
+}
+
+// Copy a sparse node to a new dense node and free it. Returns nullptr, with
+// amt unchanged, if out of memory.
+template<class T, class K>
+typename THashTrie<T, K>::ArrayMappedTrie*
+THashTrie<T, K>::ArrayMappedTrie::MakeDense(ArrayMappedTrie* amt) noexcept
+{
+    ArrayMappedTrie* dense = (ArrayMappedTrie *)malloc(sizeof(ArrayMappedTrie) + HASH_INDEX_MASK * sizeof(T *));
+    if (dense == nullptr)
+        return nullptr;
+
+    HAMT_PERF_COUNT(resizeDenseGrows, 1);
+    memset(dense->m_subHash, 0, (HASH_INDEX_MASK + 1) * sizeof(T *));
+    T** cur = amt->m_subHash;
+    for (uint32 bits = amt->m_bitmap; bits != 0; bits &= bits - 1)
+        dense->m_subHash[GetLowestBitIndex(bits)] = *cur++;
+    dense->m_bitmap = DENSE_BITMAP;
+    dense->m_skip = amt->m_skip;
+    free(amt);
+    return dense;
+}
+
+// Turn a dense node with fewer than SPARSE_NODE_MAX arcs back into a sparse
+// node. The slots are compacted in place, so this won't fail.
+template<class T, class K>
+typename THashTrie<T, K>::ArrayMappedTrie*
+THashTrie<T, K>::ArrayMappedTrie::MakeSparse(ArrayMappedTrie* amt) noexcept
+{
+    assert(amt->m_bitmap == DENSE_BITMAP);
+    if (GetArcCount(amt) >= SPARSE_NODE_MAX)
+        return amt;
+
+    HAMT_PERF_COUNT(resizeDenseShrinks, 1);
+    uint32 bitmap = 0;
+    uint32 size = 0;
+    for (uint32 i = 0; i <= HASH_INDEX_MASK; i++)
+    {
+        if (amt->m_subHash[i] != nullptr)
+        {
+            amt->m_subHash[size++] = amt->m_subHash[i];
+            bitmap |= (uint32)1 << i;
+        }
+    }
+    amt->m_bitmap = bitmap;
+
+    // Shrinking won't fail. Keep the original memory if realloc does.
+    ArrayMappedTrie* newAmt = (ArrayMappedTrie *)realloc(amt, sizeof(ArrayMappedTrie) + (size - 1) * sizeof(T *));
+    return (newAmt != nullptr) ? newAmt : amt;
+}
+
+// Number of non-empty arcs of a node above MAX_HAMT_DEPTH
+template<class T, class K>
+uint32 THashTrie<T, K>::ArrayMappedTrie::GetArcCount(const ArrayMappedTrie* amt) noexcept
+{
+    if (amt->m_bitmap != DENSE_BITMAP)
+        return GetBitCount(amt->m_bitmap);
+
+    uint32 count = 0;
+    for (uint32 i = 0; i <= HASH_INDEX_MASK; i++)
+        count += (amt->m_subHash[i] != nullptr);
+    return count;
+}
+
+
+/*
+ * Destroy HashTrie including pertaining sub-tries
+ * NOTE: It does NOT destroy the objects in leaf nodes.
+ */
+template<class T, class K>
+void THashTrie<T, K>::ArrayMappedTrie::ClearAll(
+    ArrayMappedTrie* amt,
+    uint32 depth) noexcept
+{
+    // If this is a leaf node, do nothing
+    if (((uint_ptr)amt & AMT_MARK_BIT) == 0)
+        return;
+
+    amt = (ArrayMappedTrie *)((uint_ptr)amt & (~AMT_MARK_BIT));
+    depth += amt->GetSkipLevels();
+    if (depth < MAX_HAMT_DEPTH)
+    {
+        T** cur = amt->m_subHash;
+        T** end = amt->m_subHash + GetBitCount(amt->m_bitmap);
+        for (; cur < end; cur++)
+            ClearAll((ArrayMappedTrie *)*cur, depth + 1);   // Empty dense slots have no mark bit
+    }
+
+    free(amt);
+}
+
+/*
+ * Destroy HashTrie including pertaining sub-tries and containing objects
+ * NOTE: It DOES destory (delete) the objects in leaf nodes.
+ */
+template<class T, class K>
+void THashTrie<T, K>::ArrayMappedTrie::DestroyAll(ArrayMappedTrie* amt, uint32 depth) noexcept
+{
+    // If this is a leaf node just destroy the conatining object T
+    if (((uint_ptr)amt & AMT_MARK_BIT) == 0)
+    {
+        delete ((T *)amt);
+        return;
+    }
+
+    amt = (ArrayMappedTrie *)((uint_ptr)amt & (~AMT_MARK_BIT));
+    depth += amt->GetSkipLevels();
+    if (depth < MAX_HAMT_DEPTH)
+    {
+        T** cur = amt->m_subHash;
+        T** end = amt->m_subHash + GetBitCount(amt->m_bitmap);
+        for (; cur < end; cur++)
+            DestroyAll((ArrayMappedTrie *)*cur, depth + 1);     // Deletes nullptr of empty dense slots
+    }
+    else
+    {
+        T** cur = amt->m_subHash;
+        T** end = amt->m_subHash + amt->m_bitmap;
+        for (; cur < end; cur++)
+            delete ((T *)*cur);
+    }
+
+    free(amt);
+}
+
+/*
+ * Accumulate structural statistics of the sub-trie into stats. depth counts
+ * the nodes above, level the hash levels (which differ below skipped levels).
+ * NOTE: averageProbeLength is computed by THashTrie::GetStats.
+ */
+template<class T, class K>
+void THashTrie<T, K>::ArrayMappedTrie::CollectStats(
+    const ArrayMappedTrie*  amt,
+    uint32                  depth,
+    uint32                  level,
+    CHashTrieStats&         stats) noexcept
+{
+    // If this is a leaf node, count it at this depth
+    if (((uint_ptr)amt & AMT_MARK_BIT) == 0)
+    {
+        stats.leafCount++;
+        stats.leafDepth[depth]++;
+        stats.totalProbeLength += depth + 1;
+        if (depth > stats.maxLeafDepth)
+            stats.maxLeafDepth = depth;
+        return;
+    }
+
+    amt = (const ArrayMappedTrie *)((uint_ptr)amt & (~AMT_MARK_BIT));
+    stats.nodeCount++;
+    if (amt->GetSkipLevels() != 0)
+    {
+        stats.skipNodeCount++;
+        stats.skippedLevelCount += amt->GetSkipLevels();
+        level += amt->GetSkipLevels();
+    }
+    if (level < MAX_HAMT_DEPTH)
+    {
+        uint32 size = GetBitCount(amt->m_bitmap);
+        stats.nodePopCount[GetArcCount(amt)]++;
+        stats.nodeBytes += sizeof(ArrayMappedTrie) + (size - 1) * sizeof(T *);
+        if (amt->m_bitmap == DENSE_BITMAP)
+            stats.denseNodeCount++;
+
+        T* const* cur = amt->m_subHash;
+        T* const* end = amt->m_subHash + size;
+        for (; cur < end; cur++)
+        {
+            if (*cur != nullptr)
+                CollectStats((const ArrayMappedTrie *)*cur, depth + 1, level + 1, stats);
+        }
+    }
+    else
+    {
+        // Linear search (collision) bucket. i-th entry takes i more compares to reach.
+        uint32 size = amt->m_bitmap;
+        stats.collisionBucketCount++;
+        stats.collisionEntryCount += size;
+        stats.collisionBucketSize[size < CHashTrieStats::MAX_BUCKET_HISTOGRAM ? size : CHashTrieStats::MAX_BUCKET_HISTOGRAM]++;
+        stats.nodeBytes += sizeof(ArrayMappedTrie) + (size - 1) * sizeof(T *);
+
+        stats.leafCount += size;
+        stats.leafDepth[depth + 1] += size;
+        stats.totalProbeLength += (uint64)size * (depth + 2) + (uint64)size * (size - 1) / 2;
+        if (depth + 1 > stats.maxLeafDepth)
+            stats.maxLeafDepth = depth + 1;
+    }
+}
+
+
+#if _MSC_VER
+inline bool HasAMTMarkBit(uint_ptr ptr) noexcept
+{
+    return _bittest((const long *)&ptr, 0) != 0;
+}
+#else
+inline bool HasAMTMarkBit(uint_ptr ptr) {
+    return (ptr & 1) != 0;
+}
+#endif
+
+//===========================================================================
+//    THashTrie<T, K> Implementation
+//===========================================================================
+
+template<class T, class K>
+inline void THashTrie<T, K>::Add(T* node)
+{
+    AddWithHash(node, node->GetHash());
+}
+
+template<class T, class K>
+void THashTrie<T, K>::AddWithHash(T* node, uint32 hash)
+{
+    HAMT_PERF_COUNT(addCount, 1);
+
+    InsertPos pos;
+    T** found = Locate(*node, hash, pos);
+    if (found != nullptr)
+    {
+        // Replace if a node already exists with same key.
+        // Caller is responsible for checking if a different object
+        // with same key already exists and prevent memory leak.
+        *found = node;
+        return;
+    }
+
+    InsertAt(pos, node);
+}
+
+// Walk down to key. Returns the slot holding the entry with the key, or
+// nullptr and the position where such an entry has to be inserted.
+template<class T, class K>
+template<class Q>
+T** THashTrie<T, K>::Locate(const Q& key, uint32 hash, InsertPos& pos) noexcept
+{
+    pos.slot      = &m_root;    // First slot is the root node
+    pos.bitShifts = 0;
+    pos.hash      = hash;
+
+    // Empty hash trie. The root slot is the insert position.
+    if (Empty())
+        return nullptr;
+
+    for (;;)
+    {
+        // Leaf node (a T node pointer)?
+        if (!HasAMTMarkBit((uint_ptr)*pos.slot))
+            return (**pos.slot == key) ? pos.slot : nullptr;
+
+        //
+        // It's an Array Mapped Trie (sub-trie). pos stays at its slot if the
+        // key is not below it (InsertAt goes over the skipped levels again).
+        //
+        ArrayMappedTrie* amt = (ArrayMappedTrie *)((uint_ptr)*pos.slot & (~AMT_MARK_BIT));
+        uint32 bitShifts = pos.bitShifts;
+        uint32 hash = pos.hash;
+        const uint32 levels = amt->GetSkipLevels();
+        if (levels != 0)
+        {
+            if (amt->GetMatchLevels(hash) != levels)
+                return nullptr;
+            bitShifts += levels * HASH_INDEX_BITS;
+            hash     >>= levels * HASH_INDEX_BITS;
+        }
+
+        // Consumed all hash bits. Search the linear search array.
+        if (bitShifts >= MAX_HASH_BITS)
+            return amt->LookupLinear(key);
+
+        T** childSlot = amt->Lookup(hash & HASH_INDEX_MASK);
+        if (childSlot == nullptr)
+            return nullptr;
+
+        // Go to next sub-trie level
+        pos.slot      = childSlot;
+        pos.bitShifts = bitShifts + HASH_INDEX_BITS;
+        pos.hash      = hash >> HASH_INDEX_BITS;
+    }
+}
+
+// Insert node at the position found by Locate
+template<class T, class K>
+void THashTrie<T, K>::InsertAt(const InsertPos& pos, T* node)
+{
+    T** slot = pos.slot;
+    uint32 bitShifts = pos.bitShifts;
+    uint32 hash = pos.hash;
+
+    // If hash trie is empty just add value/pair node and set it as root
+    if (*slot == nullptr)
+    {
+        *slot = node;
+        m_count++;
+        return;
+    }
+
+    // Leaf node (a T node pointer)?
+    if (!HasAMTMarkBit((uint_ptr)*slot))
+    {
+        // Hash collision detected:
+        //    Replace this leaf with an AMT node to resolve the collision.
+        //    The existing key must be replaced with a sub-hash table and
+        //    the next 5 bit hash of the existing key computed. If there is still
+        //    a collision then this process is repeated until no collision occurs.
+        //    The existing key is then inserted in the new sub-hash table and
+        //    the new key added.
+
+        T* oldNode = *slot;
+        uint32 oldHash = (bitShifts < 32) ? oldNode->GetHash() >> bitShifts : 0;
+
+        // Count the levels where the hashes match. The new node skips up to
+        // MAX_SKIP_LEVELS of them, and single element AMT internal nodes are
+        // created for the rest. this loop is hopefully nearly always run 0 time.
+        uint32 matchLevels = 0;
+        for (uint32 shifts = bitShifts, diff = oldHash ^ hash;
+             shifts < MAX_HASH_BITS && (diff & HASH_INDEX_MASK) == 0;
+             shifts += HASH_INDEX_BITS, diff >>= HASH_INDEX_BITS)
+        {
+            matchLevels++;
+        }
+
+#if HAMT_PERF_COUNTERS
+        const uint32 chainStart = bitShifts;
+#endif
+        for (; matchLevels > MAX_SKIP_LEVELS; matchLevels--)
+        {
+            slot = ArrayMappedTrie::Alloc1(hash & HASH_INDEX_MASK, slot);
+            bitShifts += HASH_INDEX_BITS;
+            hash     >>= HASH_INDEX_BITS;
+            oldHash  >>= HASH_INDEX_BITS;
+        }
+
+        const uint32 skip = ArrayMappedTrie::MakeSkip(matchLevels, hash);
+        HAMT_PERF_COUNT(addSkippedLevels, matchLevels);
+        bitShifts += matchLevels * HASH_INDEX_BITS;
+        hash     >>= matchLevels * HASH_INDEX_BITS;
+        oldHash  >>= matchLevels * HASH_INDEX_BITS;
+#if HAMT_PERF_COUNTERS
+        if (bitShifts != chainStart + matchLevels * HASH_INDEX_BITS)
+        {
+            CHashTrieCounters& counters = HashTrieCounters();
+            const uint32 chain = (bitShifts - chainStart) / HASH_INDEX_BITS - matchLevels;
+            counters.addAlloc1Chains++;
+            counters.addAlloc1Nodes += chain;
+            if (chain > counters.addMaxAlloc1Chain)
+                counters.addMaxAlloc1Chain = chain;
+        }
+#endif
+
+        if (bitShifts < MAX_HASH_BITS)
+        {
+            ArrayMappedTrie::Alloc2(
+                hash & HASH_INDEX_MASK,
+                node,
+                oldHash & HASH_INDEX_MASK,
+                oldNode,
+                slot,
+                skip);
+        }
+        else
+        {
+            // Consumed all hash bits, alloc and init a linear search table
+            ArrayMappedTrie::Alloc2Linear(node, oldNode, slot, skip);
+        }
+
+        m_count++;
+        return;
+    }
+
+    //
+    // It's an Array Mapped Trie (sub-trie) without the hash index
+    //
+    ArrayMappedTrie* amt = (ArrayMappedTrie *)((uint_ptr)*slot & (~AMT_MARK_BIT));
+    const uint32 levels = amt->GetSkipLevels();
+    if (levels != 0)
+    {
+        const uint32 matchLevels = amt->GetMatchLevels(hash);
+        if (matchLevels != levels)
+        {
+            // The key leaves the skipped levels. Split them with a new node
+            // for the matching levels, holding the key and this node.
+            const uint32 shifts = matchLevels * HASH_INDEX_BITS;
+            const uint32 prefix = amt->GetSkipPrefix() >> shifts;
+            ArrayMappedTrie::Alloc2(
+                (hash >> shifts) & HASH_INDEX_MASK,
+                node,
+                prefix & HASH_INDEX_MASK,
+                *slot,
+                slot,
+                ArrayMappedTrie::MakeSkip(matchLevels, hash));
+            amt->m_skip = ArrayMappedTrie::MakeSkip(levels - matchLevels - 1, prefix >> HASH_INDEX_BITS);
+            HAMT_PERF_COUNT(addSkipSplits, 1);
+            m_count++;
+            return;
+        }
+        bitShifts += levels * HASH_INDEX_BITS;
+        hash     >>= levels * HASH_INDEX_BITS;
+    }
+
+    if (bitShifts >= MAX_HASH_BITS)
+    {
+        // Consumed all hash bits. Add to the linear search array.
+        amt = ArrayMappedTrie::AppendLinear(amt, node, slot);
+    }
+    else
+    {
+        amt = ArrayMappedTrie::Insert(
+            amt,
+            hash & HASH_INDEX_MASK,
+            node,
+            slot);
+    }
+
+    if (amt == nullptr)
+        throw std::bad_alloc();
+    m_count++;
+}
+
+template<class T, class K>
+template<class Q, class F>
+std::pair<T*, bool> THashTrie<T, K>::FindOrAdd(const Q& key, F create)
+{
+    HAMT_PERF_COUNT(addCount, 1);
+
+    InsertPos pos;
+    T** found = Locate(key, key.GetHash(), pos);
+    if (found != nullptr)
+        return std::pair<T*, bool>(*found, false);
+
+    T* node = create();
+    assert(*node == key);
+    try
+    {
+        InsertAt(pos, node);
+    }
+    catch (...)
+    {
+        delete node;
+        throw;
+    }
+    return std::pair<T*, bool>(node, true);
+}
+
+template<class T, class K>
+template<class Q, class... Args>
+inline std::pair<T*, bool> THashTrie<T, K>::TryEmplace(const Q& key, Args&&... args)
+{
+    return FindOrAdd(key, [&]() { return new T(std::forward<Args>(args)...); });
+}
+
+template<class T, class K>
+template<class Q, class>
+inline T* THashTrie<T, K>::Find(const Q & key) noexcept
+{
+    // Hash trie is empty?
+    if (Empty())
+        return nullptr;
+
+    return FindWithHash(key, key.GetHash());
+}
+
+template<class T, class K>
+template<class Q>
+T* THashTrie<T, K>::FindWithHash(const Q & key, uint32 hash) noexcept
+{
+    HAMT_PERF_COUNT(findCount, 1);
+
+    // Hash trie is empty?
+    if (Empty())
+        return nullptr;
+
+    uint32 bitShifts = 0;
+    const T* slot = m_root;    // First slot is the root node
+    for (;;)
+    {
+        // Leaf node (a T node pointer)?
+        if (((uint_ptr)slot & AMT_MARK_BIT) == 0)
+        {
+            HAMT_PERF_COUNT(findLeafCompares, 1);
+            if (*slot == key)
+                return (T *)slot;
+            HAMT_PERF_COUNT(findMissKeyMismatch, 1);
+            return nullptr;
+        }
+        HAMT_PERF_COUNT(findLevels, 1);
+
+        //
+        // It's an Array Mapped Trie (sub-trie)
+        //
+        ArrayMappedTrie * amt = (ArrayMappedTrie *)((uint_ptr)slot & (~AMT_MARK_BIT));
+        const uint32 levels = amt->GetSkipLevels();
+        if (levels != 0)
+        {
+            if (((hash ^ amt->GetSkipPrefix()) & (((uint32)1 << (levels * HASH_INDEX_BITS)) - 1)) != 0)
+            {
+                HAMT_PERF_COUNT(findMissEmptySlot, 1);
+                return nullptr;
+            }
+            bitShifts += levels * HASH_INDEX_BITS;
+            hash     >>= levels * HASH_INDEX_BITS;
+        }
+
+        if (bitShifts >= MAX_HASH_BITS)
+        {
+            // Consumed all hash bits. Run linear search.
+            T** linearSlot = amt->LookupLinear(key);
+            HAMT_PERF_COUNT(findLeafCompares, (linearSlot != nullptr) ? (linearSlot - amt->m_subHash + 1) : amt->m_bitmap);
+            HAMT_PERF_COUNT(findMissKeyMismatch, (linearSlot == nullptr) ? 1 : 0);
+            return (linearSlot != nullptr) ? *(linearSlot) : nullptr;
+        }
+
+        T** childSlot = amt->Lookup(hash & HASH_INDEX_MASK);
+        if (childSlot == nullptr)
+        {
+            HAMT_PERF_COUNT(findMissEmptySlot, 1);
+            return nullptr;
+        }
+
+        // Go to next sub-trie level
+        slot = *childSlot;
+        bitShifts += HASH_INDEX_BITS;
+        hash     >>= HASH_INDEX_BITS;
+    }
+}
+
+template<class T, class K>
+template<class Q>
+T* THashTrie<T, K>::RemoveKey(const Q & key) noexcept
+{
+    HAMT_PERF_COUNT(removeCount, 1);
+
+    //
+    // First find the leaf node that we want to delete
+    //
+    NodePath path;
+    InsertPos pos;
+    T** found = LocatePath(key, key.GetHash(), path, pos);
+    if (found == nullptr)
+        return nullptr;
+
+    // Get the node will be returned
+    T* ret = *found;
+    RemoveAt(path);
+    return ret;
+}
+
+// Locate that also records the slots and AMT nodes on the way, for RemoveAt
+template<class T, class K>
+template<class Q>
+T** THashTrie<T, K>::LocatePath(const Q& key, uint32 hash, NodePath& path, InsertPos& pos) noexcept
+{
+    path.slots[0] = &m_root;
+    path.depth    = 0;
+    pos.slot      = &m_root;
+    pos.bitShifts = 0;
+    pos.hash      = hash;
+
+    if (Empty())
+        return nullptr;
+
+    for (int depth = 0; ; ++depth)
     {
-        Cell(T key) noexcept : THashKey32<T>(key) { }
-        T value{ 0 };
-    };
+        T** slot = path.slots[depth];
 
-private:
-    THashTrie<Cell, THashKey32<T>> m_hashtable;
+        // Leaf node?
+        if (((uint_ptr)*slot & AMT_MARK_BIT) == 0)
+        {
+            path.amts[depth] = nullptr;
+            path.depth = depth;
+            return (**slot == key) ? slot : nullptr;
+        }
 
-public:
-    THashTrieInt() noexcept = default;
-    ~THashTrieInt() noexcept = default;
+        // It's an AMT node. pos stays at its slot if the key is not below it.
+        ArrayMappedTrie* amt = path.amts[depth] = (ArrayMappedTrie *)((uint_ptr)*slot & (~AMT_MARK_BIT));
+        uint32 hash = pos.hash;
+        const uint32 levels = amt->GetSkipLevels();
+        if (levels != 0)
+        {
+            if (amt->GetMatchLevels(hash) != levels)
+                return nullptr;
+            hash >>= levels * HASH_INDEX_BITS;
+        }
 
-public:
-    Cell* Add(T key);
-    Cell* Find(T key) noexcept { return m_hashtable.Find(key); }
-    bool Remove(T key) noexcept;
-    uint32 GetCount() noexcept { return m_hashtable.GetCount(); }
-    void Clear() noexcept { m_hashtable.Clear(); }
-    void Destroy() { m_hashtable.Destroy(); }
-};
+        const uint32 level = path.levels[depth] = pos.bitShifts / HASH_INDEX_BITS + levels;
+        T** childSlot = (level >= MAX_HAMT_DEPTH) ? amt->LookupLinear(key) : amt->Lookup(hash & HASH_INDEX_MASK);
+        if (childSlot == nullptr)
+            return nullptr;
 
-template <typename T>
-typename THashTrieInt<T>::Cell* THashTrieInt<T>::Add(T key)
-{
-    static_assert(std::is_integral<T>::value, "Integer required.");
+        path.slots[depth + 1] = childSlot;
+        if (level >= MAX_HAMT_DEPTH)
+        {
+            // Found in the linear search array
+            path.amts[depth + 1] = nullptr;
+            path.depth = depth + 1;
+            return childSlot;
+        }
 
-    auto cell = new Cell(key);
-    m_hashtable.Add(cell);
-    return cell;
+        pos.slot      = childSlot;
+        pos.bitShifts = (level + 1) * HASH_INDEX_BITS;
+        pos.hash      = hash >> HASH_INDEX_BITS;
+    }
 }
 
-template <typename T>
-bool THashTrieInt<T>::Remove(T key) noexcept
+// Remove the leaf at the end of path and shrink or free the AMT nodes above it
+template<class T, class K>
+void THashTrie<T, K>::RemoveAt(NodePath& path) noexcept
 {
-    auto removed = m_hashtable.Remove(THashKey32<T>(key));
-    delete removed;
-    return removed != nullptr;
-}
+    T*** slots = path.slots;
+    ArrayMappedTrie** amts = path.amts;
+    int depth = path.depth;
 
+    // we are going to have to delete an entry from the internal node at amts[depth]
+    while (--depth >= 0)
+    {
+        const bool linear = path.levels[depth] >= MAX_HAMT_DEPTH;
+        if (!linear && amts[depth]->m_bitmap == DENSE_BITMAP)
+        {
+            // Empty the slot. Dense nodes have too many arcs to be freed or folded.
+            *(slots[depth + 1]) = nullptr;
+            ArrayMappedTrie* amt = ArrayMappedTrie::MakeSparse(amts[depth]);
+            *(slots[depth]) = (T *)((uint_ptr)amt | AMT_MARK_BIT);
+            break;
+        }
 
-//===========================================================================
-//    THashTrie<T, K>::ArrayMappedTrie Implementation
-//===========================================================================
+        int oldsize = linear ? (int)(amts[depth]->m_bitmap) : (int)(GetBitCount(amts[depth]->m_bitmap));
+        int oldidx  = (int)(slots[depth + 1] - amts[depth]->m_subHash);
 
-// helpers to search for a given entry
-// this function counts bits in order to return the correct slot for a given hash
-template<class T, class K>
-T** THashTrie<T, K>::ArrayMappedTrie::Lookup(uint32 hashIndex)
-{
-    assert(hashIndex < (1 << HASH_INDEX_BITS));
-    const uint32 bitPos = (uint32)1 << hashIndex;
-    if ((m_bitmap & bitPos) == 0)
-        return nullptr;
-    else
-        return &m_subHash[GetBitCount(m_bitmap & (bitPos - 1))];
+        // the second condition is that the remaining entry is a leaf
+        if (oldsize == 2 && ((uint_ptr)(amts[depth]->m_subHash[!oldidx]) & AMT_MARK_BIT) == 0)
+        {
+            // we no longer need this node; just fold the remaining entry,
+            // which must be a leaf, into the parent and free this node
+            *(slots[depth]) = amts[depth]->m_subHash[!oldidx];
+            free(amts[depth]);
+            HAMT_PERF_COUNT(removeFoldUps, 1);
+            break;
+        }
+
+        // resize this node down by a bit, and update the m_usedBitMap bitfield
+        if (oldsize > 1)
+        {
+            // Shrinking AMT won't fail.
+            ArrayMappedTrie * amt = ArrayMappedTrie::Resize(amts[depth], oldsize, -1, oldidx);
+            amt->m_bitmap = linear ? (amt->m_bitmap - 1) : ClearNthSetBit(amt->m_bitmap, oldidx);
+            if (!linear && oldsize == 2)
+                amt = ArrayMappedTrie::Collapse(amt);   // The remaining arc is a node. Skip this level in it.
+            *(slots[depth]) = (T *)((uint_ptr)amt | AMT_MARK_BIT);    // update the parent slot to point to the resized node
+            break;
+        }
+        
+        free(amts[depth]);    // oldsize==1. delete this node, and then loop to kill the parent too!
+    }
+
+    // No node exists in the HashTrie any more
+    if (depth < 0)
+        m_root = nullptr;
+
+    m_count--;
 }
 
 template<class T, class K>
-T** THashTrie<T, K>::ArrayMappedTrie::LookupLinear(const K & key)
+template<class Q, class F>
+T* THashTrie<T, K>::Compute(const Q& key, F fn)
 {
-    // Linear search
-    T** cur = m_subHash;
-    T** end = m_subHash + m_bitmap;
-    for (; cur < end; cur++)
+    NodePath path;
+    InsertPos pos;
+    T** found = LocatePath(key, key.GetHash(), path, pos);
+    T* entry = (found != nullptr) ? *found : nullptr;
+
+    T* node = fn(entry);
+    if (found != nullptr)
     {
-        if (**cur == key)
-            return cur;
+        if (node == nullptr)
+            RemoveAt(path);
+        else
+            *found = node;
+        return node;
     }
-    // Not found
-    return nullptr;
+
+    if (node != nullptr)
+    {
+        assert(*node == key);
+        try
+        {
+            InsertAt(pos, node);
+        }
+        catch (...)
+        {
+            delete node;
+            throw;
+        }
+    }
+    return node;
 }
 
 template<class T, class K>
-T** THashTrie<T, K>::ArrayMappedTrie::Alloc1(uint32 bitIndex, T** slotToReplace)
+template<class Q, class C, class M>
+inline T* THashTrie<T, K>::Merge(const Q& key, C create, M merge)
 {
-    // Assert (0 <= bitIndex && bitIndex < 31);
-    ArrayMappedTrie * amt = (ArrayMappedTrie *)malloc(sizeof(ArrayMappedTrie));
-    if (!amt)
-        throw std::bad_alloc();
-
-    amt->m_bitmap = 1 << bitIndex;
-    *slotToReplace = (T *)((uint_ptr)amt | AMT_MARK_BIT);
-    return amt->m_subHash;
+    return Compute(key, [&](T* entry) -> T* {
+        if (entry == nullptr)
+            return create();
+        return merge(entry) ? entry : nullptr;
+    });
 }
 
 template<class T, class K>
-T** THashTrie<T, K>::ArrayMappedTrie::Alloc2(
-    uint32      hashIndex,
-    T*          node,
-    uint32      oldHashIndex,
-    T*          oldNode,
-    T**         slotToReplace)
+void THashTrie<T, K>::AddBatch(T* const nodes[], uint32 count)
 {
-    // Allocates a node with room for 2 elements
-    ArrayMappedTrie* amt = (ArrayMappedTrie *)malloc(sizeof(ArrayMappedTrie) + sizeof(T*));
-    if (!amt)
-        throw std::bad_alloc();
+    BatchItem* items = nullptr;
+    if (count >= MIN_MERGE_BATCH)
+        items = SortBatch(count, [nodes](uint32 i) -> const K* { return nodes[i]; });
+    if (items == nullptr)
+    {
+        // Small batch (or no memory for sorting): add one by one
+        const K* keys[HASH_BATCH_SIZE];
+        uint32 hashes[HASH_BATCH_SIZE];
+        for (uint32 i = 0; i < count; i += HASH_BATCH_SIZE)
+        {
+            uint32 n = (count - i < HASH_BATCH_SIZE) ? count - i : HASH_BATCH_SIZE;
+            for (uint32 j = 0; j < n; j++)
+                keys[j] = nodes[i + j];
 
-    amt->m_bitmap = ((uint32)1 << hashIndex) | ((uint32)1 << oldHashIndex);
+            THashBatch<K>::GetHashes(keys, n, hashes);
+            for (uint32 j = 0; j < n; j++)
+                AddWithHash(nodes[i + j], hashes[j]);
+        }
+        return;
+    }
 
-    // Sort them in order and return new node
-    if (hashIndex < oldHashIndex)
+    uint32 unique = DedupeBatch(items, count, nodes);
+    try
     {
-        amt->m_subHash[0] = node;
-        amt->m_subHash[1] = oldNode;
+        MergeAdd(&m_root, 0, items, unique, nodes);
     }
-    else
+    catch (...)
     {
-        amt->m_subHash[0] = oldNode;
-        amt->m_subHash[1] = node;
+        free(items);
+        throw;
     }
-
-    *slotToReplace = (T *)((uint_ptr)amt | AMT_MARK_BIT);;
-    return amt->m_subHash;
+    free(items);
 }
 
+/*
+ * Looks up keys HASH_BATCH_SIZE at a time. The walks of a batch advance
+ * one level together and prefetch the next node, so cache misses of
+ * different keys overlap instead of being serialized. The perf counters
+ * are updated as Find updates them for each key.
+ */
 template<class T, class K>
-T** THashTrie<T, K>::ArrayMappedTrie::Alloc2Linear(T* node, T* oldNode, T** slotToReplace)
+void THashTrie<T, K>::FindBatch(const K keys[], uint32 count, T* results[]) noexcept
 {
-    // Allocates a node with room for 2 elements
-    ArrayMappedTrie* amt = (ArrayMappedTrie *)malloc(sizeof(ArrayMappedTrie) + sizeof(T *));
-    if (amt == nullptr)
-        throw std::bad_alloc();
+    const K* keyPtrs[HASH_BATCH_SIZE];
+    uint32 hashes[HASH_BATCH_SIZE];
+    const T* slots[HASH_BATCH_SIZE];
+    for (uint32 i = 0; i < count; i += HASH_BATCH_SIZE)
+    {
+        uint32 n = (count - i < HASH_BATCH_SIZE) ? count - i : HASH_BATCH_SIZE;
+        HAMT_PERF_COUNT(findCount, n);
+        if (Empty())
+        {
+            for (uint32 j = 0; j < n; j++)
+                results[i + j] = nullptr;
+            continue;
+        }
 
-    amt->m_bitmap = 2;    // Number of entry in the linear search array
-    amt->m_subHash[0] = node;
-    amt->m_subHash[1] = oldNode;
-    *slotToReplace = (T *)((uint_ptr)amt | AMT_MARK_BIT);
-    return amt->m_subHash;
+        for (uint32 j = 0; j < n; j++)
+            keyPtrs[j] = &keys[i + j];
+        THashBatch<K>::GetHashes(keyPtrs, n, hashes);
+
+        uint32 active = 0;  // walks still in progress are kept in [0, active)
+        uint32 index[HASH_BATCH_SIZE];
+        uint32 shifts[HASH_BATCH_SIZE];     // Walks advance by a node, which may skip levels
+        for (uint32 j = 0; j < n; j++)
+        {
+            slots[active] = m_root;
+            hashes[active] = hashes[j];
+            shifts[active] = 0;
+            index[active++] = j;
+        }
+
+        while (active > 0)
+        {
+            uint32 next = 0;
+            for (uint32 j = 0; j < active; j++)
+            {
+                const T* slot = slots[j];
+                const K& key = keys[i + index[j]];
+                T*& result = results[i + index[j]];
+
+                // Leaf node (a T node pointer)?
+                if (((uint_ptr)slot & AMT_MARK_BIT) == 0)
+                {
+                    HAMT_PERF_COUNT(findLeafCompares, 1);
+                    result = (*slot == key) ? (T *)slot : nullptr;
+                    HAMT_PERF_COUNT(findMissKeyMismatch, (result == nullptr) ? 1 : 0);
+                    continue;
+                }
+                HAMT_PERF_COUNT(findLevels, 1);
+
+                ArrayMappedTrie * amt = (ArrayMappedTrie *)((uint_ptr)slot & (~AMT_MARK_BIT));
+                uint32 hash = hashes[j];
+                uint32 bitShifts = shifts[j];
+                const uint32 levels = amt->GetSkipLevels();
+                if (levels != 0)
+                {
+                    if (amt->GetMatchLevels(hash) != levels)
+                    {
+                        HAMT_PERF_COUNT(findMissEmptySlot, 1);
+                        result = nullptr;
+                        continue;
+                    }
+                    bitShifts += levels * HASH_INDEX_BITS;
+                    hash     >>= levels * HASH_INDEX_BITS;
+                }
+
+                if (bitShifts >= MAX_HASH_BITS)
+                {
+                    // Consumed all hash bits. Run linear search.
+                    T** linearSlot = amt->LookupLinear(key);
+                    HAMT_PERF_COUNT(findLeafCompares, (linearSlot != nullptr) ? (linearSlot - amt->m_subHash + 1) : amt->m_bitmap);
+                    HAMT_PERF_COUNT(findMissKeyMismatch, (linearSlot == nullptr) ? 1 : 0);
+                    result = (linearSlot != nullptr) ? *(linearSlot) : nullptr;
+                    continue;
+                }
+
+                T** childSlot = amt->Lookup(hash & HASH_INDEX_MASK);
+                if (childSlot == nullptr)
+                {
+                    HAMT_PERF_COUNT(findMissEmptySlot, 1);
+                    result = nullptr;
+                    continue;
+                }
+
+                // Go to next sub-trie level
+                slots[next]  = *childSlot;
+                hashes[next] = hash >> HASH_INDEX_BITS;
+                shifts[next] = bitShifts + HASH_INDEX_BITS;
+                index[next]  = index[j];
+                HAMT_PREFETCH((uint_ptr)*childSlot & (~AMT_MARK_BIT));
+                next++;
+            }
+            active = next;
+        }
+    }
 }
 
 template<class T, class K>
-typename THashTrie<T, K>::ArrayMappedTrie*
-THashTrie<T, K>::ArrayMappedTrie::Insert(ArrayMappedTrie* amt, uint32 hashIndex, T* node, T** slotToReplace) noexcept
+uint32 THashTrie<T, K>::RemoveBatch(const K keys[], uint32 count, T* removed[]) noexcept
 {
-    uint32 bitPos = (uint32)1 << hashIndex;
-    assert((amt->m_bitmap & bitPos) == 0);
+    for (uint32 i = 0; i < count; i++)
+        removed[i] = nullptr;
 
-    uint32 numBitsBelow = GetBitCount(amt->m_bitmap & (bitPos - 1));
-    ArrayMappedTrie* newAmt = Resize(amt, GetBitCount(amt->m_bitmap), 1, numBitsBelow);
-    if (newAmt == nullptr)
-        return nullptr;
-    amt = newAmt;
-    amt->m_bitmap |= bitPos;
-    amt->m_subHash[numBitsBelow] = node;
-    *slotToReplace = (T *)((uint_ptr)amt | AMT_MARK_BIT);
-    return amt;
+    BatchItem* items = nullptr;
+    if (count >= MIN_MERGE_BATCH)
+        items = SortBatch(count, [keys](uint32 i) -> const K* { return &keys[i]; });
+
+    uint32 removedCount = 0;
+    if (items == nullptr)
+    {
+        // Small batch (or no memory for sorting): remove one by one
+        for (uint32 i = 0; i < count; i++)
+        {
+            removed[i] = RemoveKey(keys[i]);
+            if (removed[i] != nullptr)
+                removedCount++;
+        }
+        return removedCount;
+    }
+
+    MergeRemove(&m_root, 0, items, count, keys, removed, removedCount);
+    m_count -= removedCount;
+    free(items);
+    return removedCount;
 }
 
+// Interleave the 5 bit hash indices so that sorting by the result orders
+// entries the way a depth first walk of the trie visits them.
 template<class T, class K>
-typename THashTrie<T, K>::ArrayMappedTrie*
-THashTrie<T, K>::ArrayMappedTrie::AppendLinear(ArrayMappedTrie* amt, T* node, T** slotToReplace) noexcept
+uint64 THashTrie<T, K>::GetTrieOrder(uint32 hash) noexcept
 {
-    ArrayMappedTrie* newAmt = Resize(amt, amt->m_bitmap, 1, amt->m_bitmap);
-    if (newAmt == nullptr)
-        return nullptr;
-    amt = newAmt;
-    amt->m_subHash[amt->m_bitmap] = node;
-    amt->m_bitmap++;
-    *slotToReplace = (T *)((uint_ptr)amt | AMT_MARK_BIT);
-    return amt;
+    uint64 order = 0;
+    for (uint32 depth = 0; depth < MAX_HAMT_DEPTH; depth++)
+        order = (order << HASH_INDEX_BITS) | GetHashIndex(hash, depth);
+    return order;
 }
 
-// memory allocation all in this function. (re)allocates n,
-// copies old m_data, and inserts space at index 'idx'
+// Hash the keys getKey(0 .. count-1) and sort them in trie order.
+// Returns nullptr if out of memory.
 template<class T, class K>
-typename THashTrie<T, K>::ArrayMappedTrie*
-THashTrie<T,K>::ArrayMappedTrie::Resize(ArrayMappedTrie* amt, int oldSize, int deltaSize, int idx) noexcept
+template<class GetKey>
+typename THashTrie<T, K>::BatchItem* THashTrie<T, K>::SortBatch(uint32 count, GetKey getKey) noexcept
 {
-    assert(deltaSize != 0);
-    int newSize = oldSize + deltaSize;
-    assert(newSize > 0);
+    BatchItem* items = (BatchItem *)malloc(count * sizeof(BatchItem));
+    if (items == nullptr)
+        return nullptr;
 
-    // if it shrinks then (idx + deltasize, idx) will be removed
-    if (deltaSize < 0)
+    const K* keys[HASH_BATCH_SIZE];
+    uint32 hashes[HASH_BATCH_SIZE];
+    for (uint32 i = 0; i < count; i += HASH_BATCH_SIZE)
     {
-        memmove(amt->m_subHash + idx, amt->m_subHash + idx - deltaSize, (newSize - idx) * sizeof(T *));
+        uint32 n = (count - i < HASH_BATCH_SIZE) ? count - i : HASH_BATCH_SIZE;
+        for (uint32 j = 0; j < n; j++)
+            keys[j] = getKey(i + j);
+
+        THashBatch<K>::GetHashes(keys, n, hashes);
+        for (uint32 j = 0; j < n; j++)
+        {
+            items[i + j].order = GetTrieOrder(hashes[j]);
+            items[i + j].hash  = hashes[j];
+            items[i + j].index = i + j;
+        }
     }
 
-    ArrayMappedTrie* newAmt = (ArrayMappedTrie *)realloc(amt, sizeof(ArrayMappedTrie) + (newSize - 1) * sizeof(T*));
-    if (newAmt != nullptr)
+    // LSD radix sort on the 35 bit order for large batches. It is stable,
+    // so equal orders stay in index order.
+    constexpr uint32 RADIX_BITS = 12;
+    constexpr uint32 RADIX_SIZE = 1 << RADIX_BITS;
+    BatchItem* temp = (count >= RADIX_SIZE) ? (BatchItem *)malloc(count * sizeof(BatchItem)) : nullptr;
+    if (temp == nullptr)
     {
-        amt = newAmt;
+        std::sort(items, items + count);
+        return items;
     }
-    else
+
+    uint32 offsets[RADIX_SIZE];
+    for (uint32 shift = 0; shift < MAX_HASH_BITS; shift += RADIX_BITS)
     {
-        // if it tried to shrink amt memory and that failed then keep using original memory.
-        if (deltaSize > 0)
-            return nullptr;
+        memset(offsets, 0, sizeof(offsets));
+        for (uint32 i = 0; i < count; i++)
+            offsets[(items[i].order >> shift) & (RADIX_SIZE - 1)]++;
+        for (uint32 i = 0, sum = 0; i < RADIX_SIZE; i++)
+        {
+            uint32 n = offsets[i];
+            offsets[i] = sum;
+            sum += n;
+        }
+        for (uint32 i = 0; i < count; i++)
+            temp[offsets[(items[i].order >> shift) & (RADIX_SIZE - 1)]++] = items[i];
+        std::swap(items, temp);
     }
+    free(temp);
+    return items;
+}
 
-    // If it grows then (idx, idx + deltasize) will be inserted
-    if (deltaSize > 0)
+// Drop all but the last of the sorted nodes with the same key (as if added
+// one by one). Equal keys have the same hash so they are next to each other.
+template<class T, class K>
+uint32 THashTrie<T, K>::DedupeBatch(BatchItem items[], uint32 count, T* const nodes[]) noexcept
+{
+    uint32 unique = 0;
+    for (uint32 i = 0; i < count; i++)
     {
-        memmove(amt->m_subHash + idx + deltaSize, amt->m_subHash + idx, (oldSize - idx) * sizeof(T *)); // shuffle tail to make room
+        bool replaced = false;
+        for (uint32 j = i + 1; j < count && items[j].hash == items[i].hash; j++)
+        {
+            if (*nodes[items[j].index] == *nodes[items[i].index])
+            {
+                replaced = true;
+                break;
+            }
+        }
+        if (!replaced)
+            items[unique++] = items[i];
     }
-
-    return amt;
+    return unique;
 }
 
-
-/*
- * Destroy HashTrie including pertaining sub-tries
- * NOTE: It does NOT destroy the objects in leaf nodes.
- */
+// Split sorted items into runs with the same hash index at depth.
+// Returns the number of runs (at most 32).
 template<class T, class K>
-void THashTrie<T, K>::ArrayMappedTrie::ClearAll(
-    ArrayMappedTrie* amt,
-    uint32 depth) noexcept
+uint32 THashTrie<T, K>::SplitByHashIndex(
+    const BatchItem     items[],
+    uint32              count,
+    uint32              depth,
+    uint32              ends[],
+    uint32              hashIndices[]) noexcept
 {
-    // If this is a leaf node, do nothing
-    if (((uint_ptr)amt & AMT_MARK_BIT) == 0)
-        return;
-
-    amt = (ArrayMappedTrie *)((uint_ptr)amt & (~AMT_MARK_BIT));
-    if (depth < MAX_HAMT_DEPTH)
+    uint32 runs = 0;
+    for (uint32 i = 0; i < count; )
     {
-        T** cur = amt->m_subHash;
-        T** end = amt->m_subHash + GetBitCount(amt->m_bitmap);
-        for (; cur < end; cur++)
-            ClearAll((ArrayMappedTrie *)*cur, depth + 1);
+        uint32 hashIndex = GetHashIndex(items[i].hash, depth);
+        uint32 end = i + 1;
+        while (end < count && GetHashIndex(items[end].hash, depth) == hashIndex)
+            end++;
+        hashIndices[runs] = hashIndex;
+        ends[runs++] = end;
+        i = end;
     }
-
-    free(amt);
+    return runs;
 }
 
-/*
- * Destroy HashTrie including pertaining sub-tries and containing objects
- * NOTE: It DOES destory (delete) the objects in leaf nodes.
- */
+// Build a new subtrie at depth from sorted items (with distinct keys) and
+// optionally one more existing leaf. Returns the leaf or the marked AMT pointer.
 template<class T, class K>
-void THashTrie<T, K>::ArrayMappedTrie::DestroyAll(ArrayMappedTrie* amt, uint32 depth) noexcept
+T* THashTrie<T, K>::BuildSubtrie(const BatchItem items[], uint32 count, T* const nodes[], uint32 depth, T* extra)
 {
-    // If this is a leaf node just destroy the conatining object T
-    if (((uint_ptr)amt & AMT_MARK_BIT) == 0)
+    if (count == 0)
+        return extra;
+    if (count == 1 && extra == nullptr)
+        return nodes[items[0].index];
+
+    ArrayMappedTrie* amt;
+    if (depth >= MAX_HAMT_DEPTH)
     {
-        delete ((T *)amt);
-        return;
+        // Consumed all hash bits. Linear search array.
+        uint32 size = count + (extra != nullptr);
+        amt = ArrayMappedTrie::Alloc(size);
+        for (uint32 i = 0; i < count; i++)
+            amt->m_subHash[i] = nodes[items[i].index];
+        if (extra != nullptr)
+            amt->m_subHash[count] = extra;
+        amt->m_bitmap = size;
+        return (T *)((uint_ptr)amt | AMT_MARK_BIT);
+    }
+
+    const uint32 extraIndex = (extra != nullptr) ? GetHashIndex(extra->GetHash(), depth) : HASH_INDEX_MASK + 1;
+    uint32 bitmap = (extra != nullptr) ? ((uint32)1 << extraIndex) : 0;
+    for (uint32 i = 0; i < count; i++)
+        bitmap |= (uint32)1 << GetHashIndex(items[i].hash, depth);
+
+    if (GetBitCount(bitmap) == 1)
+    {
+        // All keys have the same hash index here. The node below skips this
+        // level unless it skips as many as it can already.
+        T* child = BuildSubtrie(items, count, nodes, depth + 1, extra);
+        ArrayMappedTrie* childAmt = (ArrayMappedTrie *)((uint_ptr)child & (~AMT_MARK_BIT));
+        const uint32 levels = childAmt->GetSkipLevels();
+        if (levels < MAX_SKIP_LEVELS)
+        {
+            childAmt->m_skip = ArrayMappedTrie::MakeSkip(levels + 1, GetLowestBitIndex(bitmap) | (childAmt->GetSkipPrefix() << HASH_INDEX_BITS));
+            return child;
+        }
+
+        try
+        {
+            amt = ArrayMappedTrie::Alloc(1);
+        }
+        catch (...)
+        {
+            ArrayMappedTrie::ClearAll((ArrayMappedTrie *)child, depth + 1);
+            throw;
+        }
+        amt->m_bitmap = bitmap;
+        amt->m_subHash[0] = child;
+        return (T *)((uint_ptr)amt | AMT_MARK_BIT);
     }
 
-    amt = (ArrayMappedTrie *)((uint_ptr)amt & (~AMT_MARK_BIT));
-    if (depth < MAX_HAMT_DEPTH)
+    const bool dense = GetBitCount(bitmap) >= DENSE_NODE_MIN;
+    if (dense)
     {
-        T** cur = amt->m_subHash;
-        T** end = amt->m_subHash + GetBitCount(amt->m_bitmap);
-        for (; cur < end; cur++)
-            DestroyAll((ArrayMappedTrie *)*cur, depth + 1);
+        amt = ArrayMappedTrie::Alloc(HASH_INDEX_MASK + 1);
+        memset(amt->m_subHash, 0, (HASH_INDEX_MASK + 1) * sizeof(T *));
+        amt->m_bitmap = DENSE_BITMAP;
     }
     else
     {
-        T** cur = amt->m_subHash;
-        T** end = amt->m_subHash + amt->m_bitmap;
-        for (; cur < end; cur++)
-            delete ((T *)*cur);
+        amt = ArrayMappedTrie::Alloc(GetBitCount(bitmap));
+        amt->m_bitmap = bitmap;
     }
 
-    free(amt);
-}
-
+    uint32 slot = 0;
+    uint32 i = 0;
+    try
+    {
+        for (uint32 bits = bitmap; bits != 0; bits &= bits - 1, slot++)
+        {
+            uint32 hashIndex = GetLowestBitIndex(bits);
+            uint32 end = i;
+            while (end < count && GetHashIndex(items[end].hash, depth) == hashIndex)
+                end++;
 
-#if _MSC_VER
-inline bool HasAMTMarkBit(uint_ptr ptr) noexcept
-{
-    return _bittest((const long *)&ptr, 0) != 0;
-}
-#else
-inline bool HasAMTMarkBit(uint_ptr ptr) {
-    return (ptr & 1) != 0;
+            amt->m_subHash[dense ? hashIndex : slot] = BuildSubtrie(items + i, end - i, nodes, depth + 1, (hashIndex == extraIndex) ? extra : nullptr);
+            i = end;
+        }
+    }
+    catch (...)
+    {
+        // Slots of dense nodes not built yet are nullptr
+        if (dense)
+            slot = HASH_INDEX_MASK + 1;
+        while (slot-- > 0)
+            ArrayMappedTrie::ClearAll((ArrayMappedTrie *)amt->m_subHash[slot], depth + 1);
+        free(amt);
+        throw;
+    }
+    return (T *)((uint_ptr)amt | AMT_MARK_BIT);
 }
-#endif
-
-//===========================================================================
-//    THashTrie<T, K> Implementation
-//===========================================================================
 
 template<class T, class K>
-inline void THashTrie<T, K>::Add(T* node)
+void THashTrie<T, K>::MergeAdd(T** slot, uint32 depth, const BatchItem items[], uint32 count, T* const nodes[])
 {
-    // If hash trie is empty just add value/pair node and set it as root
-    if (Empty())
+    if (*slot == nullptr)
     {
-        m_root = node;
-        m_count++;
+        // Empty trie
+        *slot = BuildSubtrie(items, count, nodes, depth, nullptr);
+        m_count += count;
         return;
     }
 
-    // Get hash value
-    uint32 hash = node->GetHash();
-    uint32 bitShifts = 0;
-    T** slot = &m_root;    // First slot is the root node
-    for (;;)
+    if (!HasAMTMarkBit((uint_ptr)*slot))
     {
-        // Leaf node (a T node pointer)?
-        if (!HasAMTMarkBit((uint_ptr)*slot))
+        // Existing leaf. It stays unless one of the items has the same key.
+        T* leaf = *slot;
+        BatchItem probe;
+        probe.order = GetTrieOrder(leaf->GetHash());
+        probe.index = 0;
+        for (const BatchItem* it = std::lower_bound(items, items + count, probe); it < items + count && it->order == probe.order; it++)
         {
-            // Replace if a node already exists with same key.
-            // Caller is responsible for checking if a different object
-            // with same key already exists and prevent memory leak.
-            if (**slot == *node)
+            if (*nodes[it->index] == *leaf)
             {
-                *slot = node;
-                return;
+                leaf = nullptr;
+                break;
             }
+        }
 
-            // Hash collision detected:
-            //    Replace this leaf with an AMT node to resolve the collision.
-            //    The existing key must be replaced with a sub-hash table and
-            //    the next 5 bit hash of the existing key computed. If there is still
-            //    a collision then this process is repeated until no collision occurs.
-            //    The existing key is then inserted in the new sub-hash table and
-            //    the new key added.
+        *slot = BuildSubtrie(items, count, nodes, depth, leaf);
+        m_count += count - (leaf == nullptr);
+        return;
+    }
 
-            T* oldNode = *slot;
-            uint32 oldHash = oldNode->GetHash() >> bitShifts;
+    ArrayMappedTrie* amt = (ArrayMappedTrie *)((uint_ptr)*slot & (~AMT_MARK_BIT));
+    const uint32 levels = amt->GetSkipLevels();
+    if (levels != 0)
+    {
+        uint32 matchLevels = levels;
+        for (uint32 i = 0; i < count && matchLevels != 0; i++)
+        {
+            uint32 match = amt->GetMatchLevels(items[i].hash >> (depth * HASH_INDEX_BITS));
+            if (match < matchLevels)
+                matchLevels = match;
+        }
 
-            // As long as the hashes match, we have to create single element
-            // AMT internal nodes. this loop is hopefully nearly always run 0 time.
-            while (bitShifts < MAX_HASH_BITS && (oldHash & HASH_INDEX_MASK) == (hash & HASH_INDEX_MASK))
-            {
-                slot = ArrayMappedTrie::Alloc1(hash & HASH_INDEX_MASK, slot);
-                bitShifts += HASH_INDEX_BITS;
-                hash     >>= HASH_INDEX_BITS;
-                oldHash  >>= HASH_INDEX_BITS;
-            }
+        if (matchLevels != levels)
+        {
+            // Some keys leave the skipped levels. Put a node for the matching
+            // levels above this one and merge into it.
+            const uint32 prefix = amt->GetSkipPrefix();
+            const uint32 shifts = matchLevels * HASH_INDEX_BITS;
+            ArrayMappedTrie::Alloc1((prefix >> shifts) & HASH_INDEX_MASK, slot);
+            ((ArrayMappedTrie *)((uint_ptr)*slot & (~AMT_MARK_BIT)))->m_skip = ArrayMappedTrie::MakeSkip(matchLevels, prefix);
+            amt->m_skip = ArrayMappedTrie::MakeSkip(levels - matchLevels - 1, prefix >> (shifts + HASH_INDEX_BITS));
+            HAMT_PERF_COUNT(addSkipSplits, 1);
+            MergeAdd(slot, depth, items, count, nodes);
+            return;
+        }
+        depth += levels;
+    }
 
-            if (bitShifts < MAX_HASH_BITS)
-            {
-                ArrayMappedTrie::Alloc2(
-                    hash & HASH_INDEX_MASK,
-                    node,
-                    oldHash & HASH_INDEX_MASK,
-                    oldNode,
-                    slot);
-            }
+    if (depth >= MAX_HAMT_DEPTH)
+    {
+        // Linear search array. Replace existing keys, then append the rest at once.
+        const uint32 oldSize = amt->m_bitmap;
+        uint32 appendCount = 0;
+        for (uint32 i = 0; i < count; i++)
+        {
+            T** found = amt->LookupLinear(*nodes[items[i].index]);
+            if (found != nullptr)
+                *found = nodes[items[i].index];
             else
-            {
-                // Consumed all hash bits, alloc and init a linear search table
-                ArrayMappedTrie::Alloc2Linear(node, oldNode, slot);
-            }
+                appendCount++;
+        }
+        if (appendCount == 0)
+            return;
 
-            m_count++;
-            break;
+        ArrayMappedTrie* newAmt = ArrayMappedTrie::Resize(amt, oldSize, appendCount, oldSize);
+        if (newAmt == nullptr)
+            throw std::bad_alloc();
+        amt = newAmt;
+        *slot = (T *)((uint_ptr)amt | AMT_MARK_BIT);
+        for (uint32 i = 0; i < count; i++)
+        {
+            T* node = nodes[items[i].index];
+            T** cur = amt->m_subHash;
+            T** end = amt->m_subHash + oldSize;
+            while (cur < end && *cur != node)
+                cur++;
+            if (cur == end)
+                amt->m_subHash[amt->m_bitmap++] = node;
         }
+        m_count += appendCount;
+        return;
+    }
 
-        //
-        // It's an Array Mapped Trie (sub-trie)
-        //
-        ArrayMappedTrie* amt = (ArrayMappedTrie *)((uint_ptr)*slot & (~AMT_MARK_BIT));
-        T** childSlot;
-        if (bitShifts >= MAX_HASH_BITS)
+    // Build subtries for the hash indices not in this node yet, then grow
+    // this node once to its final size. Prefetch the existing children
+    // to merge into, so their cache misses overlap.
+    uint32 ends[HASH_INDEX_MASK + 1];
+    uint32 hashIndices[HASH_INDEX_MASK + 1];
+    const uint32 runs = SplitByHashIndex(items, count, depth, ends, hashIndices);
+
+    T* built[HASH_INDEX_MASK + 1];
+    uint32 newBitmap = 0;
+    uint32 newCount = 0;
+    try
+    {
+        for (uint32 r = 0, i = 0; r < runs; i = ends[r++])
         {
-            // Consumed all hash bits. Add to the linear search array.
-            childSlot = amt->LookupLinear(*node);
-            if (childSlot == nullptr)
+            T** child = amt->Lookup(hashIndices[r]);
+            if (child != nullptr)
             {
-                ArrayMappedTrie::AppendLinear(amt, node, slot);
-                m_count++;
+                HAMT_PREFETCH((uint_ptr)*child & (~AMT_MARK_BIT));
+                continue;
             }
-            else
+            built[hashIndices[r]] = BuildSubtrie(items + i, ends[r] - i, nodes, depth + 1, nullptr);
+            newBitmap |= (uint32)1 << hashIndices[r];
+            newCount += ends[r] - i;
+        }
+
+        if (newBitmap != 0 && amt->m_bitmap == DENSE_BITMAP)
+        {
+            for (uint32 bits = newBitmap; bits != 0; bits &= bits - 1)
             {
-                *slot = node;     // If the same key node already exists then replace
+                uint32 hashIndex = GetLowestBitIndex(bits);
+                amt->m_subHash[hashIndex] = built[hashIndex];
             }
-            break;
+            m_count += newCount;
         }
-
-        childSlot = amt->Lookup(hash & HASH_INDEX_MASK);
-        if (childSlot == nullptr)
+        else if (newBitmap != 0)
         {
-            amt = ArrayMappedTrie::Insert(
-                amt,
-                hash & HASH_INDEX_MASK,
-                node,
-                slot);
-            m_count++;
-            break;
+            uint32 bitmap = amt->m_bitmap | newBitmap;
+            const bool dense = GetBitCount(bitmap) >= DENSE_NODE_MIN;
+            ArrayMappedTrie* newAmt = ArrayMappedTrie::Alloc(dense ? HASH_INDEX_MASK + 1 : GetBitCount(bitmap));
+            if (dense)
+                memset(newAmt->m_subHash, 0, (HASH_INDEX_MASK + 1) * sizeof(T *));
+            T** src = amt->m_subHash;
+            T** dst = newAmt->m_subHash;
+            for (uint32 bits = bitmap; bits != 0; bits &= bits - 1)
+            {
+                uint32 hashIndex = GetLowestBitIndex(bits);
+                if (dense)
+                    dst = newAmt->m_subHash + hashIndex;
+                if (newBitmap & ((uint32)1 << hashIndex))
+                    *dst++ = built[hashIndex];
+                else
+                    *dst++ = *src++;
+            }
+            newAmt->m_bitmap = dense ? DENSE_BITMAP : bitmap;
+            newAmt->m_skip = amt->m_skip;
+            free(amt);
+            amt = newAmt;
+            *slot = (T *)((uint_ptr)amt | AMT_MARK_BIT);
+            m_count += newCount;
         }
+    }
+    catch (...)
+    {
+        for (uint32 bits = newBitmap; bits != 0; bits &= bits - 1)
+            ArrayMappedTrie::ClearAll((ArrayMappedTrie *)built[GetLowestBitIndex(bits)], depth + 1);
+        throw;
+    }
 
-        // Go to next sub-trie level
-        slot = childSlot;
-        bitShifts += HASH_INDEX_BITS;
-        hash     >>= HASH_INDEX_BITS;
-    } // for (;;)
+    // Merge into the existing children
+    for (uint32 r = 0, i = 0; r < runs; i = ends[r++])
+    {
+        if ((newBitmap & ((uint32)1 << hashIndices[r])) == 0)
+            MergeAdd(amt->Lookup(hashIndices[r]), depth + 1, items + i, ends[r] - i, nodes);
+    }
 }
 
+// Remove the keys of sorted items under slot, then shrink this node once.
+// Empty nodes are freed and a node left with a single leaf is folded into
+// its parent slot, like Remove does.
 template<class T, class K>
-T* THashTrie<T, K>::Find(const K & key) noexcept
+void THashTrie<T, K>::MergeRemove(
+    T**                 slot,
+    uint32              depth,
+    const BatchItem     items[],
+    uint32              count,
+    const K             keys[],
+    T*                  removed[],
+    uint32&             removedCount) noexcept
 {
-    // Hash trie is empty?
-    if (Empty())
-        return nullptr;
+    if (*slot == nullptr)
+        return;
 
-    // Get hash value
-    uint32 hash = key.GetHash();
-    uint32 bitShifts = 0;
-    const T* slot = m_root;    // First slot is the root node
-    for (;;)
+    if (!HasAMTMarkBit((uint_ptr)*slot))
     {
-        // Leaf node (a T node pointer)?
-        if (((uint_ptr)slot & AMT_MARK_BIT) == 0)
-            return (*slot == key) ? (T *)slot : nullptr;
-
-        //
-        // It's an Array Mapped Trie (sub-trie)
-        //
-        ArrayMappedTrie * amt = (ArrayMappedTrie *)((uint_ptr)slot & (~AMT_MARK_BIT));
-        if (bitShifts >= MAX_HASH_BITS)
+        for (uint32 i = 0; i < count; i++)
         {
-            // Consumed all hash bits. Run linear search.
-            T** linearSlot = amt->LookupLinear(key);
-            return (linearSlot != nullptr) ? *(linearSlot) : nullptr;
+            if (**slot == keys[items[i].index])
+            {
+                removed[items[i].index] = *slot;
+                removedCount++;
+                *slot = nullptr;
+                return;
+            }
         }
-
-        T** childSlot = amt->Lookup(hash & HASH_INDEX_MASK);
-        if (childSlot == nullptr)
-            return nullptr;
-
-        // Go to next sub-trie level
-        slot = *childSlot;
-        bitShifts += HASH_INDEX_BITS;
-        hash     >>= HASH_INDEX_BITS;
+        return;
     }
-}
-
-template<class T, class K>
-T* THashTrie<T, K>::Remove(const K & key) noexcept
-{
-    T** slots[MAX_HAMT_DEPTH + 2];
-    slots[0] = &m_root;
 
-    ArrayMappedTrie* amts[MAX_HAMT_DEPTH + 2];
-    amts[0] = nullptr;
-
-    uint32 hash = key.GetHash();
-    //
-    // First find the leaf node that we want to delete
-    //
-    int depth = 0;
-    for (; depth <= MAX_HAMT_DEPTH; ++depth, hash >>= HASH_INDEX_BITS)
+    // Keys without the skipped hash indices are not found below. The others
+    // are contiguous in trie order; narrow items to them.
+    ArrayMappedTrie* amt = (ArrayMappedTrie *)((uint_ptr)*slot & (~AMT_MARK_BIT));
+    const uint32 levels = amt->GetSkipLevels();
+    if (levels != 0)
     {
-        // Leaf node?
-        if (((uint_ptr)*slots[depth] & AMT_MARK_BIT) == 0)
-        {
-            amts[depth] = nullptr;
-            if (!(**slots[depth] == key))
-                return nullptr;
-            break;
-        }
-        else
+        uint32 first = 0;
+        while (first < count && amt->GetMatchLevels(items[first].hash >> (depth * HASH_INDEX_BITS)) != levels)
+            first++;
+        uint32 end = first;
+        while (end < count && amt->GetMatchLevels(items[end].hash >> (depth * HASH_INDEX_BITS)) == levels)
+            end++;
+        if (first == end)
+            return;
+        items += first;
+        count = end - first;
+        depth += levels;
+    }
+    uint32 size;
+    if (depth >= MAX_HAMT_DEPTH)
+    {
+        size = amt->m_bitmap;
+        for (uint32 i = 0; i < count; i++)
         {
-            // It's an AMT node
-            ArrayMappedTrie* amt = amts[depth] = (ArrayMappedTrie *)((uint_ptr)*slots[depth] & (~AMT_MARK_BIT));
-            slots[depth + 1] = (depth >= MAX_HAMT_DEPTH) ? amt->LookupLinear(key) : amt->Lookup(hash & HASH_INDEX_MASK);
-            if (slots[depth + 1] == nullptr)
-                return nullptr;
+            T** found = amt->LookupLinear(keys[items[i].index]);
+            if (found != nullptr)
+            {
+                removed[items[i].index] = *found;
+                removedCount++;
+                *found = amt->m_subHash[--size];    // Order doesn't matter in the linear search array
+                amt->m_bitmap = size;
+            }
         }
     }
-
-    // Get the node will be returned
-    T* ret = *slots[depth];
-
-    // we are going to have to delete an entry from the internal node at amts[depth]
-    while (--depth >= 0)
+    else
     {
-        int oldsize = depth >= MAX_HAMT_DEPTH ? (int)(amts[depth]->m_bitmap) : (int)(GetBitCount(amts[depth]->m_bitmap));
-        int oldidx  = (int)(slots[depth + 1] - amts[depth]->m_subHash);
-
-        // the second condition is that the remaining entry is a leaf
-        if (oldsize == 2 && ((uint_ptr)(amts[depth]->m_subHash[!oldidx]) & AMT_MARK_BIT) == 0)
+        uint32 ends[HASH_INDEX_MASK + 1];
+        uint32 hashIndices[HASH_INDEX_MASK + 1];
+        T** children[HASH_INDEX_MASK + 1];
+        const uint32 runs = SplitByHashIndex(items, count, depth, ends, hashIndices);
+        for (uint32 r = 0; r < runs; r++)
         {
-            // we no longer need this node; just fold the remaining entry,
-            // which must be a leaf, into the parent and free this node
-            *(slots[depth]) = amts[depth]->m_subHash[!oldidx];
-            free(amts[depth]);
-            break;
+            children[r] = amt->Lookup(hashIndices[r]);
+            if (children[r] != nullptr)
+                HAMT_PREFETCH((uint_ptr)*children[r] & (~AMT_MARK_BIT));
         }
 
-        // resize this node down by a bit, and update the m_usedBitMap bitfield
-        if (oldsize > 1)
+        uint32 before = removedCount;
+        for (uint32 r = 0, i = 0; r < runs; i = ends[r++])
         {
-            // Shrinking AMT won't fail.
-            ArrayMappedTrie * amt = ArrayMappedTrie::Resize(amts[depth], oldsize, -1, oldidx);
-            amt->m_bitmap = (depth >= MAX_HAMT_DEPTH) ? (amt->m_bitmap - 1) : ClearNthSetBit(amt->m_bitmap, oldidx);
-            *(slots[depth]) = (T *)((uint_ptr)amt | AMT_MARK_BIT);    // update the parent slot to point to the resized node
-            break;
+            if (children[r] != nullptr)
+                MergeRemove(children[r], depth + 1, items + i, ends[r] - i, keys, removed, removedCount);
         }
-        
-        free(amts[depth]);    // oldsize==1. delete this node, and then loop to kill the parent too!
+        if (removedCount == before)
+            return;
+
+        // Dense nodes keep their emptied slots until they get too sparse
+        if (amt->m_bitmap == DENSE_BITMAP && ArrayMappedTrie::GetArcCount(amt) >= SPARSE_NODE_MAX)
+            return;
+
+        // Compact the remaining children
+        const uint32 oldSize = GetBitCount(amt->m_bitmap);
+        uint32 bitmap = 0;
+        size = 0;
+        uint32 idx = 0;
+        for (uint32 bits = amt->m_bitmap; bits != 0; bits &= bits - 1, idx++)
+        {
+            if (amt->m_subHash[idx] != nullptr)
+            {
+                amt->m_subHash[size++] = amt->m_subHash[idx];
+                bitmap |= bits & (0 - bits);
+            }
+        }
+        amt->m_bitmap = bitmap;
+        if (size == oldSize)
+            return;
     }
 
-    // No node exists in the HashTrie any more
-    if (depth < 0)
-        m_root = nullptr;
-
-    m_count--;
-    return ret;
+    if (size == 0)
+    {
+        free(amt);
+        *slot = nullptr;
+    }
+    else if (size == 1 && !HasAMTMarkBit((uint_ptr)amt->m_subHash[0]))
+    {
+        *slot = amt->m_subHash[0];
+        free(amt);
+    }
+    else
+    {
+        // Shrinking won't fail. Keep the original memory if realloc does.
+        ArrayMappedTrie* newAmt = (ArrayMappedTrie *)realloc(amt, sizeof(ArrayMappedTrie) + (size - 1) * sizeof(T *));
+        if (newAmt != nullptr)
+            amt = newAmt;
+        if (size == 1 && depth < MAX_HAMT_DEPTH)
+            amt = ArrayMappedTrie::Collapse(amt);   // The remaining arc is a node. Skip this level in it.
+        *slot = (T *)((uint_ptr)amt | AMT_MARK_BIT);
+    }
 }
 
 template<class T, class K>
@@ -999,6 +3291,7 @@ inline void THashTrie<T, K>::Clear() noexcept
 
         // HashTrie is now empty
         m_root = nullptr;
+        m_count = 0;
     }
 }
 
@@ -1011,7 +3304,169 @@ inline void THashTrie<T, K>::Destroy()
 
         // HashTrie is now empty
         m_root = nullptr;
+        m_count = 0;
+    }
+}
+
+template<class T, class K>
+template<class F>
+void THashTrie<T, K>::ArrayMappedTrie::ForEachLeaf(ArrayMappedTrie* amt, uint32 depth, F& fn)
+{
+    if (((uint_ptr)amt & AMT_MARK_BIT) == 0)
+    {
+        fn((T *)amt);
+        return;
+    }
+
+    amt = (ArrayMappedTrie *)((uint_ptr)amt & (~AMT_MARK_BIT));
+    depth += amt->GetSkipLevels();
+    T** cur = amt->m_subHash;
+    T** end = amt->m_subHash + ((depth < MAX_HAMT_DEPTH) ? GetBitCount(amt->m_bitmap) : amt->m_bitmap);
+    for (; cur < end; cur++)
+    {
+        if (*cur != nullptr)
+            ForEachLeaf((ArrayMappedTrie *)*cur, depth + 1, fn);
+    }
+}
+
+template<class T, class K>
+template<class F>
+inline void THashTrie<T, K>::ForEach(F fn)
+{
+    if (!Empty())
+        ArrayMappedTrie::ForEachLeaf((ArrayMappedTrie *)m_root, 0, fn);
+}
+
+template<class T, class K>
+CHashTrieStats THashTrie<T, K>::GetStats() const noexcept
+{
+    CHashTrieStats stats;
+    if (m_root != nullptr)
+    {
+        ArrayMappedTrie::CollectStats((const ArrayMappedTrie *)m_root, 0, 0, stats);
+        stats.averageProbeLength = (double)stats.totalProbeLength / stats.leafCount;
+    }
+    return stats;
+}
+
+
+/****************************************************************************
+*
+*   THashTrieTeardown
+*
+*   Takes over all entries of a THashTrie in O(1), leaving it empty, and
+*   frees them a bounded number at a time. Used to spread the teardown of a
+*   large trie over e.g. idle loop iterations instead of one long Destroy().
+*
+**/
+
+template <class T, class K>
+class THashTrieTeardown final
+{
+private:
+    typedef THashTrie<T, K>                 Trie;
+    typedef typename Trie::ArrayMappedTrie  ArrayMappedTrie;
+
+    // Walk position in one AMT node on the way down
+    struct Frame
+    {
+        ArrayMappedTrie*    amt;
+        uint32              next;   // child to visit next
+        uint32              size;   // number of children
+        uint32              level;  // hash level of amt (with skipped levels)
+    };
+
+    Frame   m_frames[Trie::MAX_HAMT_DEPTH + 1];
+    uint32  m_depth{ 0 };           // number of frames in use
+    T*      m_leaf{ nullptr };      // root that is a single leaf
+    bool    m_destroyEntries{ true };
+
+    void Push(T* node, uint32 level) noexcept;
+
+public:
+    THashTrieTeardown() noexcept = default;
+    // Take over the entries of trie (see Start)
+    THashTrieTeardown(Trie& trie, bool destroyEntries = true) noexcept { Start(trie, destroyEntries); }
+    ~THashTrieTeardown() noexcept { Finish(); }
+    THashTrieTeardown(THashTrieTeardown const&) = delete;
+    THashTrieTeardown& operator=(THashTrieTeardown const&) = delete;
+
+public:
+    // Detach the entries of trie, which is empty afterwards. They are deleted
+    // as Destroy() does if destroyEntries, otherwise only the trie nodes are
+    // freed as Clear() does. Finishes any earlier teardown first.
+    void Start(Trie& trie, bool destroyEntries = true) noexcept;
+
+    // Free up to budget entries and nodes. Returns true when all are freed.
+    bool Step(uint32 budget) noexcept;
+    void Finish() noexcept { while (!Step(UINT32_MAX)) { } }
+    bool Done() const noexcept { return m_depth == 0 && m_leaf == nullptr; }
+};
+
+template <class T, class K>
+void THashTrieTeardown<T, K>::Push(T* node, uint32 level) noexcept
+{
+    ArrayMappedTrie* amt = (ArrayMappedTrie *)((uint_ptr)node & ~Trie::AMT_MARK_BIT);
+    Frame& frame = m_frames[m_depth];
+    frame.amt   = amt;
+    frame.next  = 0;
+    frame.level = level + amt->GetSkipLevels();
+    frame.size  = (frame.level < Trie::MAX_HAMT_DEPTH) ? GetBitCount(amt->m_bitmap) : amt->m_bitmap;
+    m_depth++;
+}
+
+template <class T, class K>
+void THashTrieTeardown<T, K>::Start(Trie& trie, bool destroyEntries) noexcept
+{
+    Finish();
+
+    m_destroyEntries = destroyEntries;
+    T* root = trie.m_root;
+    trie.m_root = nullptr;
+    trie.m_count = 0;
+
+    if (root == nullptr)
+        return;
+    if (HasAMTMarkBit((uint_ptr)root))
+        Push(root, 0);
+    else
+        m_leaf = root;
+}
+
+template <class T, class K>
+bool THashTrieTeardown<T, K>::Step(uint32 budget) noexcept
+{
+    if (m_leaf != nullptr && budget > 0)
+    {
+        if (m_destroyEntries)
+            delete m_leaf;
+        m_leaf = nullptr;
+        budget--;
+    }
+
+    while (m_depth > 0 && budget > 0)
+    {
+        Frame& frame = m_frames[m_depth - 1];
+        if (frame.next == frame.size)
+        {
+            // All children are gone
+            free(frame.amt);
+            m_depth--;
+            budget--;
+            continue;
+        }
+
+        T* child = frame.amt->m_subHash[frame.next++];
+        if (HasAMTMarkBit((uint_ptr)child))
+            Push(child, frame.level + 1);
+        else if (child != nullptr)  // Empty slots of dense nodes are nullptr
+        {
+            if (m_destroyEntries)
+                delete child;
+            budget--;
+        }
     }
+    return Done();
 }
 
 #endif // if __HASH_TRIE_H__
@@ -0,0 +1,457 @@
+/**
+ *      File: HashTrieCodec.h
+ *    Author: CS Lim
+ *   Purpose: Compact encoded snapshots of THashTrie and THashTrieInt
+ *   History:
+ *
+ *  The trie structure follows from the keys, so an encoded snapshot holds
+ *  only the entries, sorted by key: THashTrieInt keys as varint deltas, other
+ *  keys as the bytes not shared with the previous key, and all sizes and
+ *  integer values as varints. Entries are grouped in blocks that decode on
+ *  their own and can be compressed. Loading decodes block by block and adds
+ *  the entries with AddBatch as it goes.
+ */
+
+#ifndef __HASH_TRIE_CODEC_H__
+#define __HASH_TRIE_CODEC_H__
+
+#include <HashTrieFile.h>
+#include <algorithm>
+
+//===========================================================================
+//    Varints
+//    (7 bits per byte, low bits first, the high bit set on all but the
+//     last byte)
+//===========================================================================
+static constexpr uint32 MAX_VARINT_SIZE = 10;
+
+inline uint8* PutVarint(uint8* p, uint64 value) noexcept
+{
+    while (value >= 0x80)
+    {
+        *p++ = (uint8)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (uint8)value;
+    return p;
+}
+
+// Returns false if the varint runs past end or is too long
+inline bool GetVarint(const uint8*& p, const uint8* end, uint64& value) noexcept
+{
+    value = 0;
+    for (uint32 shift = 0; shift < 64 && p < end; shift += 7)
+    {
+        uint8 byte = *p++;
+        value |= (uint64)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Signed values with a small magnitude get short varints
+inline uint64 ZigZagEncode(uint64 value) noexcept { return (value << 1) ^ (uint64)((int64)value >> 63); }
+inline uint64 ZigZagDecode(uint64 value) noexcept { return (value >> 1) ^ (0 - (value & 1)); }
+
+
+//===========================================================================
+//    Block compression
+//    (Byte-oriented LZ77: a token with the literal run and match lengths,
+//     the literals, and a 16 bit distance to the match. Fast rather than
+//     small, for the repetition varint encoded blocks still have.)
+//===========================================================================
+
+// Compress size bytes of src to dst, which has room for capacity bytes.
+// Returns the compressed size, or 0 if it would not be smaller.
+uint32 CompressBlock(const uint8 src[], uint32 size, uint8 dst[], uint32 capacity) noexcept;
+// Returns false unless src decompresses to exactly size bytes
+bool DecompressBlock(const uint8 src[], uint32 srcSize, uint8 dst[], uint32 size) noexcept;
+
+
+//===========================================================================
+//    Encoded snapshot format
+//
+//    CHashTrieCodecHeader, then blocks of a CHashTrieCodecBlock and the
+//    block data. The checksum is of the data before compression.
+//===========================================================================
+struct CHashTrieCodecHeader
+{
+    static constexpr uint32 VERSION = 1;
+
+    enum EKeyType : uint32
+    {
+        KEY_BYTES,          // Front-coded key bytes, then value size and bytes
+        KEY_UINT,           // THashTrieInt: key deltas and zigzag values
+        KEY_INT,            // Same with the sign bit of the keys flipped
+    };
+
+    char    magic[8];       // HASH_TRIE_CODEC_MAGIC
+    uint32  version;
+    uint32  keyType;
+    uint32  keySize;        // of THashTrieInt keys
+    uint32  count;          // of entries
+};
+
+struct CHashTrieCodecBlock
+{
+    uint32  size;           // of the encoded entries
+    uint32  storedSize;     // == size if not compressed
+    uint32  count;          // of entries
+    uint32  checksum;
+};
+
+static constexpr char HASH_TRIE_CODEC_MAGIC[8] = { 'H', 'A', 'M', 'T', 'E', 'N', 'C', 0 };
+
+
+//===========================================================================
+//    CHashTrieBlockWriter / CHashTrieBlockReader
+//===========================================================================
+class CHashTrieBlockWriter
+{
+public:
+    static constexpr uint32 BLOCK_SIZE = 64 * 1024;     // Entries are added until a block is this large
+    static constexpr uint32 MAX_COMPRESSED_SIZE = 16 * BLOCK_SIZE;  // Larger blocks (with large values) are stored as they are
+
+    bool Open(const char path[], uint32 keyType, uint32 keySize, bool compress) noexcept;
+    // Write the last block and the entry count
+    bool Close() noexcept;
+
+    // Room for size more bytes of the current entry
+    uint8* Reserve(size_t size);
+    void Commit(uint8* end) noexcept { m_size = (uint32)(end - m_block.data()); }
+    // The current entry is complete. Returns false on I/O errors.
+    bool EndEntry() noexcept
+    {
+        m_blockCount++;
+        m_header.count++;
+        return m_size < BLOCK_SIZE || WriteBlock();
+    }
+    // The next entry starts a block, so it must not refer to earlier ones
+    bool IsBlockStart() const noexcept { return m_blockCount == 0; }
+
+private:
+    bool WriteBlock() noexcept;
+
+    CFileWriter             m_file;
+    CHashTrieCodecHeader    m_header{};
+    std::vector<uint8>      m_block;
+    std::vector<uint8>      m_compressed;
+    uint32                  m_size{ 0 };        // of the block so far
+    uint32                  m_blockCount{ 0 };  // of entries in the block
+    bool                    m_compress{ false };
+};
+
+class CHashTrieBlockReader
+{
+public:
+    bool Open(const char path[]) noexcept;
+    const CHashTrieCodecHeader& GetHeader() const noexcept { return m_header; }
+
+    // Read and check the next block. Returns false at the end or if the
+    // block is damaged; IsDone() tells which.
+    bool NextBlock(const uint8*& data, uint32& size, uint32& count);
+    bool IsDone() const noexcept { return m_done; }
+
+private:
+    CFileReader             m_file;
+    CHashTrieCodecHeader    m_header{};
+    std::vector<uint8>      m_block;
+    std::vector<uint8>      m_compressed;
+    uint64                  m_fileSize{ 0 };
+    uint32                  m_count{ 0 };       // of entries read
+    bool                    m_done{ false };
+};
+
+
+//===========================================================================
+//    THashTrieCodec
+//===========================================================================
+template <class T, class K>
+class THashTrieCodec
+{
+private:
+    static constexpr uint32 DECODE_BATCH = 64 * 1024;   // Entries added with one AddBatch
+
+    static bool KeyLess(const T* a, const T* b) noexcept
+    {
+        CByteRange keyA = GetKeyBytes(static_cast<const K&>(*a));
+        CByteRange keyB = GetKeyBytes(static_cast<const K&>(*b));
+        const uint32 size = std::min(keyA.size, keyB.size);
+        int cmp = (size != 0) ? memcmp(keyA.data, keyB.data, size) : 0;
+        return cmp < 0 || (cmp == 0 && keyA.size < keyB.size);
+    }
+
+public:
+    // Write the entries of trie to an encoded snapshot at path, compressing
+    // the blocks if compress. getValue(const T&) returns the CByteRange of an
+    // entry's value. Returns false on I/O errors.
+    template <class GetValue>
+    static bool Write(THashTrie<T, K>& trie, const char path[], GetValue getValue, bool compress);
+
+    // Add the entries of an encoded snapshot to the empty trie.
+    // make(CByteRange key, CByteRange value) returns a new'ed T for the
+    // bytes. Returns false if the file cannot be read or is damaged, with
+    // the trie left empty.
+    template <class Make>
+    static bool Load(THashTrie<T, K>& trie, const char path[], Make make);
+};
+
+template <class T, class K>
+template <class GetValue>
+bool THashTrieCodec<T, K>::Write(THashTrie<T, K>& trie, const char path[], GetValue getValue, bool compress)
+{
+    std::vector<const T *> entries;
+    entries.reserve(trie.GetCount());
+    trie.ForEach([&entries](T* entry) { entries.push_back(entry); });
+    std::sort(entries.begin(), entries.end(), KeyLess);
+
+    CHashTrieBlockWriter writer;
+    if (!writer.Open(path, CHashTrieCodecHeader::KEY_BYTES, 0, compress))
+        return false;
+
+    CByteRange prev;
+    for (const T* entry : entries)
+    {
+        const CByteRange key = GetKeyBytes(static_cast<const K&>(*entry));
+        const CByteRange value = getValue(*entry);
+        uint32 shared = 0;
+        if (!writer.IsBlockStart())
+        {
+            const uint32 max = std::min(key.size, prev.size);
+            while (shared < max && ((const uint8 *)key.data)[shared] == ((const uint8 *)prev.data)[shared])
+                shared++;
+        }
+
+        uint8* p = writer.Reserve(4 * MAX_VARINT_SIZE + (key.size - shared) + value.size);
+        p = PutVarint(p, shared);
+        p = PutVarint(p, key.size - shared);
+        memcpy(p, (const uint8 *)key.data + shared, key.size - shared);
+        p += key.size - shared;
+        p = PutVarint(p, value.size);
+        if (value.size != 0)
+            memcpy(p, value.data, value.size);
+        writer.Commit(p + value.size);
+        if (!writer.EndEntry())
+            return false;
+        prev = key;
+    }
+    return writer.Close();
+}
+
+template <class T, class K>
+template <class Make>
+bool THashTrieCodec<T, K>::Load(THashTrie<T, K>& trie, const char path[], Make make)
+{
+    assert(trie.GetCount() == 0);
+    CHashTrieBlockReader reader;
+    if (!reader.Open(path) || reader.GetHeader().keyType != CHashTrieCodecHeader::KEY_BYTES)
+        return false;
+
+    std::vector<T *> batch;
+    std::vector<uint8> key;
+    bool damaged = false;
+    try
+    {
+        const uint8* data;
+        uint32 size, count;
+        while (!damaged && reader.NextBlock(data, size, count))
+        {
+            const uint8* p = data;
+            const uint8* end = data + size;
+            key.clear();
+            for (uint32 i = 0; i < count && !damaged; i++)
+            {
+                uint64 shared, suffix, valueSize;
+                if (!GetVarint(p, end, shared) || shared > key.size()
+                    || !GetVarint(p, end, suffix) || suffix > (uint64)(end - p))
+                {
+                    damaged = true;
+                    break;
+                }
+                key.resize((size_t)shared);
+                key.insert(key.end(), p, p + suffix);
+                p += suffix;
+                if (!GetVarint(p, end, valueSize) || valueSize > (uint64)(end - p))
+                {
+                    damaged = true;
+                    break;
+                }
+                batch.push_back(nullptr);
+                batch.back() = make(CByteRange(key.data(), key.size()), CByteRange(p, (size_t)valueSize));
+                p += valueSize;
+            }
+            if (p != end)
+                damaged = true;
+
+            if (batch.size() >= DECODE_BATCH && !damaged)
+            {
+                trie.AddBatch(batch.data(), (uint32)batch.size());
+                batch.clear();
+            }
+        }
+        if (!damaged && reader.IsDone())
+        {
+            trie.AddBatch(batch.data(), (uint32)batch.size());
+            return true;
+        }
+    }
+    catch (...)
+    {
+        for (T* entry : batch)
+            delete entry;
+        trie.Destroy();
+        throw;
+    }
+
+    for (T* entry : batch)
+        delete entry;
+    trie.Destroy();
+    return false;
+}
+
+
+//===========================================================================
+//    THashTrieIntCodec
+//===========================================================================
+template <typename T, class Hasher>
+class THashTrieIntCodec
+{
+private:
+    typedef THashTrieInt<T, Hasher>                 Trie;
+    typedef typename Trie::Cell                     Cell;
+    typedef typename std::make_unsigned<T>::type    UT;
+
+    static constexpr uint32 DECODE_BATCH = 64 * 1024;
+    static constexpr uint32 KEY_TYPE = std::is_signed<T>::value ? CHashTrieCodecHeader::KEY_INT : CHashTrieCodecHeader::KEY_UINT;
+    // Keys in unsigned order: negative keys before positive ones
+    static constexpr UT KEY_FLIP = std::is_signed<T>::value ? (UT)1 << (sizeof(T) * 8 - 1) : 0;
+
+public:
+    // Write the cells of trie to an encoded snapshot at path, compressing
+    // the blocks if compress. Returns false on I/O errors.
+    static bool Write(Trie& trie, const char path[], bool compress);
+
+    // Add the cells of an encoded snapshot to the empty trie. Returns false
+    // if the file cannot be read or is damaged, with the trie left empty.
+    static bool Load(Trie& trie, const char path[]);
+};
+
+template <typename T, class Hasher>
+bool THashTrieIntCodec<T, Hasher>::Write(Trie& trie, const char path[], bool compress)
+{
+    std::vector<std::pair<UT, T>> cells;
+    cells.reserve(trie.GetCount());
+    trie.ForEach([&cells](Cell* cell) { cells.push_back(std::make_pair((UT)((UT)cell->Get() ^ KEY_FLIP), cell->value)); });
+    std::sort(cells.begin(), cells.end());
+
+    CHashTrieBlockWriter writer;
+    if (!writer.Open(path, KEY_TYPE, sizeof(T), compress))
+        return false;
+
+    UT prev = 0;
+    for (const auto& cell : cells)
+    {
+        if (writer.IsBlockStart())
+            prev = 0;
+        uint8* p = writer.Reserve(2 * MAX_VARINT_SIZE);
+        p = PutVarint(p, (uint64)(UT)(cell.first - prev));
+        p = PutVarint(p, ZigZagEncode((uint64)(int64)cell.second));
+        writer.Commit(p);
+        if (!writer.EndEntry())
+            return false;
+        prev = cell.first;
+    }
+    return writer.Close();
+}
+
+template <typename T, class Hasher>
+bool THashTrieIntCodec<T, Hasher>::Load(Trie& trie, const char path[])
+{
+    assert(trie.GetCount() == 0);
+    CHashTrieBlockReader reader;
+    if (!reader.Open(path) || reader.GetHeader().keyType != KEY_TYPE || reader.GetHeader().keySize != sizeof(T))
+        return false;
+
+    std::vector<Cell *> batch;
+    bool damaged = false;
+    try
+    {
+        const uint8* data;
+        uint32 size, count;
+        while (!damaged && reader.NextBlock(data, size, count))
+        {
+            const uint8* p = data;
+            const uint8* end = data + size;
+            UT key = 0;
+            for (uint32 i = 0; i < count; i++)
+            {
+                uint64 delta, value;
+                if (!GetVarint(p, end, delta) || !GetVarint(p, end, value))
+                {
+                    damaged = true;
+                    break;
+                }
+                key = (UT)(key + delta);
+                batch.push_back(nullptr);
+                batch.back() = new Cell((T)(key ^ KEY_FLIP));
+                batch.back()->value = (T)ZigZagDecode(value);
+            }
+            if (p != end)
+                damaged = true;
+
+            if (batch.size() >= DECODE_BATCH && !damaged)
+            {
+                trie.AddBatch(batch.data(), (uint32)batch.size());
+                batch.clear();
+            }
+        }
+        if (!damaged && reader.IsDone())
+        {
+            trie.AddBatch(batch.data(), (uint32)batch.size());
+            return true;
+        }
+    }
+    catch (...)
+    {
+        for (Cell* cell : batch)
+            delete cell;
+        trie.Destroy();
+        throw;
+    }
+
+    for (Cell* cell : batch)
+        delete cell;
+    trie.Destroy();
+    return false;
+}
+
+
+//===========================================================================
+//    Helpers
+//===========================================================================
+template <class T, class K, class GetValue>
+inline bool WriteEncodedHashTrie(THashTrie<T, K>& trie, const char path[], GetValue getValue, bool compress = false)
+{
+    return THashTrieCodec<T, K>::Write(trie, path, getValue, compress);
+}
+
+template <class T, class K, class Make>
+inline bool LoadEncodedHashTrie(THashTrie<T, K>& trie, const char path[], Make make)
+{
+    return THashTrieCodec<T, K>::Load(trie, path, make);
+}
+
+template <typename T, class Hasher>
+inline bool WriteEncodedHashTrie(THashTrieInt<T, Hasher>& trie, const char path[], bool compress = false)
+{
+    return THashTrieIntCodec<T, Hasher>::Write(trie, path, compress);
+}
+
+template <typename T, class Hasher>
+inline bool LoadEncodedHashTrie(THashTrieInt<T, Hasher>& trie, const char path[])
+{
+    return THashTrieIntCodec<T, Hasher>::Load(trie, path);
+}
+
+#endif // __HASH_TRIE_CODEC_H__
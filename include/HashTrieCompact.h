@@ -0,0 +1,643 @@
+/**
+ *      File: HashTrieCompact.h
+ *    Author: CS Lim
+ *   Purpose: HAMT with 32 bit slots referring to pooled nodes and entries
+ *   History:
+ *
+ *  THashTrie slots are tagged pointers, 8 bytes each on 64 bit targets.
+ *  THashTrieCompact keeps its AMT nodes in a word arena and its entries in
+ *  a pool, and refers to both by 32 bit index with the LSB set for nodes
+ *  (as AMT_MARK_BIT), so a node takes 4 bytes per slot instead of 8.
+ *  Entries are stored by value and stay at the same address until removed.
+ */
+
+#ifndef __HASH_TRIE_COMPACT_H__
+#define __HASH_TRIE_COMPACT_H__
+
+#include <HashTrie.h>
+#include <vector>
+
+//===========================================================================
+//    CCompactNodeArena
+//    (32 bit words in fixed-size chunks, addressed by word index. A node
+//     is a bitmap word and a word per slot. Freed nodes are kept on a free
+//     list per size.)
+//===========================================================================
+class CCompactNodeArena
+{
+public:
+    static constexpr uint32 CHUNK_BITS      = 16;
+    static constexpr uint32 CHUNK_WORDS     = 1 << CHUNK_BITS;
+    static constexpr uint32 MAX_FREE_WORDS  = 64;           // Larger freed nodes are not reused
+    static constexpr uint32 MAX_CHUNKS      = (uint32)1 << (31 - CHUNK_BITS);   // Indices fit in 31 bits
+
+    CCompactNodeArena() noexcept { memset(m_freeLists, 0, sizeof(m_freeLists)); }
+    ~CCompactNodeArena() noexcept { Clear(); }
+    CCompactNodeArena(CCompactNodeArena const&) = delete;
+    CCompactNodeArena& operator=(CCompactNodeArena const&) = delete;
+
+    uint32* At(uint32 index) const noexcept { return m_chunks[index >> CHUNK_BITS] + (index & (CHUNK_WORDS - 1)); }
+
+    // Allocate a node of words words. Throws std::bad_alloc.
+    uint32 Alloc(uint32 words)
+    {
+        uint32 index = TryAlloc(words);
+        if (index == 0)
+            throw std::bad_alloc();
+        return index;
+    }
+
+    // Returns 0 if a new chunk is needed and cannot be allocated
+    uint32 TryAlloc(uint32 words) noexcept
+    {
+        assert(words >= 2 && words <= CHUNK_WORDS);
+        if (words <= MAX_FREE_WORDS && m_freeLists[words] != 0)
+        {
+            uint32 index = m_freeLists[words];
+            m_freeLists[words] = *At(index);
+            return index;
+        }
+
+        if ((uint64)m_end + words > (uint64)m_chunks.size() << CHUNK_BITS)
+        {
+            // The rest of the last chunk is left unused
+            if (m_chunks.size() >= MAX_CHUNKS || (m_chunks.size() == m_chunks.capacity() && !GrowChunkTable()))
+                return 0;
+            uint32* chunk = (uint32 *)malloc(CHUNK_WORDS * sizeof(uint32));
+            if (chunk == nullptr)
+                return 0;
+            m_end = (uint32)m_chunks.size() << CHUNK_BITS;
+            m_chunks.push_back(chunk);
+            if (m_end == 0)
+                m_end = 1;      // 0 is no index
+        }
+        uint32 index = m_end;
+        m_end += words;
+        return index;
+    }
+
+    void Free(uint32 index, uint32 words) noexcept
+    {
+        if (words > MAX_FREE_WORDS)
+            return;
+        *At(index) = m_freeLists[words];
+        m_freeLists[words] = index;
+    }
+
+    void Clear() noexcept
+    {
+        for (uint32* chunk : m_chunks)
+            free(chunk);
+        std::vector<uint32*>().swap(m_chunks);
+        memset(m_freeLists, 0, sizeof(m_freeLists));
+        m_end = 0;
+    }
+
+    // Bytes allocated for chunks
+    uint64 GetSize() const noexcept { return (uint64)m_chunks.size() * CHUNK_WORDS * sizeof(uint32); }
+
+private:
+    bool GrowChunkTable() noexcept
+    {
+        try
+        {
+            m_chunks.reserve(m_chunks.empty() ? 16 : m_chunks.size() * 2);
+            return true;
+        }
+        catch (...)
+        {
+            return false;
+        }
+    }
+
+    std::vector<uint32*>    m_chunks;
+    uint32                  m_freeLists[MAX_FREE_WORDS + 1];    // Index of the first free node per size, 0 if none
+    uint32                  m_end{ 0 };                         // Next unused word
+};
+
+
+//===========================================================================
+//    TCompactEntryPool
+//    (Entries in fixed-size chunks, addressed by index from 1. Entries do
+//     not move. Free items hold the index of the next free one.)
+//===========================================================================
+template <class T>
+class TCompactEntryPool
+{
+public:
+    static constexpr uint32 CHUNK_BITS  = 10;
+    static constexpr uint32 CHUNK_SIZE  = 1 << CHUNK_BITS;
+    static constexpr uint32 MAX_CHUNKS  = (uint32)1 << (31 - CHUNK_BITS);
+
+    TCompactEntryPool() noexcept = default;
+    ~TCompactEntryPool() noexcept { Clear(); }
+    TCompactEntryPool(TCompactEntryPool const&) = delete;
+    TCompactEntryPool& operator=(TCompactEntryPool const&) = delete;
+
+    T* Get(uint32 index) const noexcept { return &m_chunks[index >> CHUNK_BITS][index & (CHUNK_SIZE - 1)].value; }
+
+    // Construct an entry with T(args...). Returns its index.
+    template <class... Args>
+    uint32 New(Args&&... args);
+    // Destroy the entry and reuse its item
+    void Delete(uint32 index) noexcept
+    {
+        Item& item = m_chunks[index >> CHUNK_BITS][index & (CHUNK_SIZE - 1)];
+        item.value.~T();
+        item.nextFree = m_freeHead;
+        m_freeHead = index;
+    }
+
+    // Free all chunks. The entries must have been destroyed.
+    void Clear() noexcept
+    {
+        for (Item* chunk : m_chunks)
+            free(chunk);
+        std::vector<Item*>().swap(m_chunks);
+        m_freeHead = 0;
+        m_end = 0;
+    }
+
+    uint64 GetSize() const noexcept { return (uint64)m_chunks.size() * CHUNK_SIZE * sizeof(Item); }
+
+private:
+    union Item
+    {
+        T       value;
+        uint32  nextFree;
+
+        Item() noexcept { }
+        ~Item() noexcept { }
+    };
+
+    std::vector<Item*>  m_chunks;
+    uint32              m_freeHead{ 0 };    // 0 if none
+    uint32              m_end{ 0 };         // Next unused item
+};
+
+template <class T>
+template <class... Args>
+uint32 TCompactEntryPool<T>::New(Args&&... args)
+{
+    uint32 index = m_freeHead;
+    if (index == 0)
+    {
+        if ((m_end & (CHUNK_SIZE - 1)) == 0)
+        {
+            if (m_chunks.size() >= MAX_CHUNKS)
+                throw std::bad_alloc();
+            if (m_chunks.size() == m_chunks.capacity())
+                m_chunks.reserve(m_chunks.empty() ? 16 : m_chunks.size() * 2);
+            Item* chunk = (Item *)malloc(CHUNK_SIZE * sizeof(Item));
+            if (chunk == nullptr)
+                throw std::bad_alloc();
+            m_chunks.push_back(chunk);
+            if (m_end == 0)
+                m_end = 1;      // 0 is no index
+        }
+        index = m_end;
+        new (Get(index)) T(std::forward<Args>(args)...);
+        m_end++;
+        return index;
+    }
+
+    const uint32 next = m_chunks[index >> CHUNK_BITS][index & (CHUNK_SIZE - 1)].nextFree;
+    new (Get(index)) T(std::forward<Args>(args)...);
+    m_freeHead = next;
+    return index;
+}
+
+
+/****************************************************************************
+*
+*   THashTrieCompact
+*
+*   HAMT with 32 bit slots. T derives from K as for THashTrie, but the trie
+*   owns its entries: they are constructed in place and destroyed on
+*   removal.
+*
+**/
+
+template <class T, class K>
+class THashTrieCompact final
+{
+private:
+    static constexpr uint32     NODE_BIT        = 1;    // As AMT_MARK_BIT
+    static constexpr uint32     HASH_INDEX_BITS = 5;
+    static constexpr uint32     HASH_INDEX_MASK = (1 << HASH_INDEX_BITS) - 1;
+    static constexpr uint32     MAX_HAMT_DEPTH  = 7;    // Nodes at this depth are collision buckets
+
+    static bool IsNode(uint32 slot) noexcept { return (slot & NODE_BIT) != 0; }
+    static uint32 GetHashIndex(uint32 hash, uint32 depth) noexcept { return (hash >> (depth * HASH_INDEX_BITS)) & HASH_INDEX_MASK; }
+    // Slots of the node, after the bitmap (the entry count for collision buckets)
+    static uint32 GetSlotCount(const uint32 node[], uint32 depth) noexcept { return (depth < MAX_HAMT_DEPTH) ? GetBitCount(node[0]) : node[0]; }
+
+    uint32* GetNode(uint32 slot) const noexcept { return m_nodes.At(slot >> 1); }
+    T* GetEntry(uint32 slot) const noexcept { return m_entries.Get(slot >> 1); }
+
+    uint32 NewNode(uint32 bitmap, uint32 slotCount, uint32*& node);
+    uint32 MakeNode2(uint32 slot1, uint32 hash1, uint32 slot2, uint32 hash2, uint32 depth);
+    void InsertSlot(uint32* slot, uint32 depth, uint32 pos, uint32 bit, uint32 child);
+    void RemoveSlot(uint32* slot, uint32 depth, uint32 pos) noexcept;
+    template <class F>
+    void ForEachSlot(uint32 slot, uint32 depth, F& fn);
+    void DestroyAll(uint32 slot, uint32 depth) noexcept;
+    void CollectStats(uint32 slot, uint32 depth, CHashTrieStats& stats) const noexcept;
+
+    uint32                  m_root{ 0 };    // 0 if empty
+    uint32                  m_count{ 0 };
+    CCompactNodeArena       m_nodes;
+    TCompactEntryPool<T>    m_entries;
+
+public:
+    THashTrieCompact() = default;
+    ~THashTrieCompact() noexcept { Clear(); }
+    THashTrieCompact(THashTrieCompact const&) = delete;
+    THashTrieCompact& operator=(THashTrieCompact const&) = delete;
+
+    T* Find(const K& key) noexcept { return Find<K>(key); }
+    template <class Q, class = decltype(std::declval<const Q&>().GetHash())>
+    T* Find(const Q& key) noexcept;
+
+    // Find the entry with key, or construct one with T(args...) in a single
+    // walk. Returns the entry and whether it was added.
+    template <class Q, class... Args>
+    std::pair<T*, bool> TryEmplace(const Q& key, Args&&... args);
+
+    // Returns true if key was removed
+    bool Remove(const K& key) noexcept { return Remove<K>(key); }
+    template <class Q, class = decltype(std::declval<const Q&>().GetHash())>
+    bool Remove(const Q& key) noexcept;
+
+    uint32 GetCount() const noexcept { return m_count; }
+    // Destroy all entries
+    void Clear() noexcept;
+    CHashTrieStats GetStats() const noexcept;
+    // Bytes allocated for nodes and entries
+    uint64 GetMemorySize() const noexcept { return m_nodes.GetSize() + m_entries.GetSize(); }
+
+    // Call fn(T*) for every entry. fn must not add or remove entries.
+    template <class F>
+    void ForEach(F fn)
+    {
+        if (m_root != 0)
+            ForEachSlot(m_root, 0, fn);
+    }
+};
+
+template <class T, class K>
+template <class Q, class>
+T* THashTrieCompact<T, K>::Find(const Q& key) noexcept
+{
+    if (m_root == 0)
+        return nullptr;
+
+    const uint32 hash = key.GetHash();
+    uint32 slot = m_root;
+    for (uint32 depth = 0; IsNode(slot); depth++)
+    {
+        const uint32* node = GetNode(slot);
+        if (depth >= MAX_HAMT_DEPTH)
+        {
+            // Consumed all hash bits. Run linear search.
+            for (uint32 i = 1; i <= node[0]; i++)
+            {
+                T* entry = GetEntry(node[i]);
+                if (*entry == key)
+                    return entry;
+            }
+            return nullptr;
+        }
+
+        const uint32 bit = (uint32)1 << GetHashIndex(hash, depth);
+        if ((node[0] & bit) == 0)
+            return nullptr;
+        slot = node[1 + GetBitCount(node[0] & (bit - 1))];
+    }
+
+    T* entry = GetEntry(slot);
+    return (*entry == key) ? entry : nullptr;
+}
+
+template <class T, class K>
+template <class Q, class... Args>
+std::pair<T*, bool> THashTrieCompact<T, K>::TryEmplace(const Q& key, Args&&... args)
+{
+    const uint32 hash = key.GetHash();
+    uint32* slot = &m_root;
+    uint32 depth = 0;
+    uint32 pos = 0;
+    uint32 bit = 0;
+    for (; *slot != 0; depth++)
+    {
+        if (!IsNode(*slot))
+        {
+            T* entry = GetEntry(*slot);
+            if (*entry == key)
+                return std::make_pair(entry, false);
+            break;
+        }
+
+        uint32* node = GetNode(*slot);
+        if (depth >= MAX_HAMT_DEPTH)
+        {
+            for (pos = 1; pos <= node[0]; pos++)
+            {
+                T* entry = GetEntry(node[pos]);
+                if (*entry == key)
+                    return std::make_pair(entry, false);
+            }
+            pos--;
+            break;
+        }
+
+        bit = (uint32)1 << GetHashIndex(hash, depth);
+        pos = GetBitCount(node[0] & (bit - 1));
+        if ((node[0] & bit) == 0)
+            break;
+        slot = node + 1 + pos;
+    }
+
+    const uint32 leaf = m_entries.New(std::forward<Args>(args)...) << 1;
+    T* entry = GetEntry(leaf);
+    assert(*entry == key);
+    try
+    {
+        if (*slot == 0)
+            *slot = leaf;
+        else if (!IsNode(*slot))
+            *slot = MakeNode2(*slot, GetEntry(*slot)->GetHash(), leaf, hash, depth);
+        else
+            InsertSlot(slot, depth, pos, bit, leaf);
+    }
+    catch (...)
+    {
+        m_entries.Delete(leaf >> 1);
+        throw;
+    }
+    m_count++;
+    return std::make_pair(entry, true);
+}
+
+template <class T, class K>
+template <class Q, class>
+bool THashTrieCompact<T, K>::Remove(const Q& key) noexcept
+{
+    // Slots from the root down to the entry
+    uint32* slots[MAX_HAMT_DEPTH + 2];
+    uint32 positions[MAX_HAMT_DEPTH + 2];
+    const uint32 hash = key.GetHash();
+    uint32* slot = &m_root;
+    int depth = 0;
+    for (;; depth++)
+    {
+        slots[depth] = slot;
+        if (*slot == 0)
+            return false;
+        if (!IsNode(*slot))
+        {
+            if (!(*GetEntry(*slot) == key))
+                return false;
+            break;
+        }
+
+        uint32* node = GetNode(*slot);
+        uint32 pos;
+        if ((uint32)depth >= MAX_HAMT_DEPTH)
+        {
+            for (pos = 0; pos < node[0] && !(*GetEntry(node[1 + pos]) == key); pos++)
+                ;
+            if (pos == node[0])
+                return false;
+        }
+        else
+        {
+            const uint32 bit = (uint32)1 << GetHashIndex(hash, depth);
+            if ((node[0] & bit) == 0)
+                return false;
+            pos = GetBitCount(node[0] & (bit - 1));
+        }
+        positions[depth] = pos;
+        slot = node + 1 + pos;
+    }
+
+    m_entries.Delete(*slot >> 1);
+    m_count--;
+
+    // Remove the slot from its node. A node left with a single entry is
+    // folded into the parent slot, and an empty node is removed as well.
+    while (--depth >= 0)
+    {
+        uint32* node = GetNode(*slots[depth]);
+        const uint32 size = GetSlotCount(node, depth);
+        const uint32 pos = positions[depth];
+        if (size == 2 && !IsNode(node[1 + !pos]))
+        {
+            const uint32 other = node[1 + !pos];
+            m_nodes.Free(*slots[depth] >> 1, 3);
+            *slots[depth] = other;
+            return true;
+        }
+        if (size > 1)
+        {
+            RemoveSlot(slots[depth], depth, pos);
+            return true;
+        }
+        m_nodes.Free(*slots[depth] >> 1, 2);
+    }
+    m_root = 0;
+    return true;
+}
+
+// New node with slotCount slots to fill in. Returns its slot.
+template <class T, class K>
+inline uint32 THashTrieCompact<T, K>::NewNode(uint32 bitmap, uint32 slotCount, uint32*& node)
+{
+    const uint32 index = m_nodes.Alloc(1 + slotCount);
+    node = m_nodes.At(index);
+    node[0] = bitmap;
+    return (index << 1) | NODE_BIT;
+}
+
+// Nodes for two entries (or subtries) whose hashes agree up to depth
+template <class T, class K>
+uint32 THashTrieCompact<T, K>::MakeNode2(uint32 slot1, uint32 hash1, uint32 slot2, uint32 hash2, uint32 depth)
+{
+    // Single slot nodes down to the depth where the hashes differ
+    uint32 chain[MAX_HAMT_DEPTH + 1];
+    uint32 chainLength = 0;
+    uint32* parent = nullptr;
+    try
+    {
+        for (; depth < MAX_HAMT_DEPTH && GetHashIndex(hash1, depth) == GetHashIndex(hash2, depth); depth++)
+        {
+            uint32* node;
+            chain[chainLength] = NewNode((uint32)1 << GetHashIndex(hash1, depth), 1, node);
+            if (parent != nullptr)
+                parent[1] = chain[chainLength];
+            parent = node;
+            chainLength++;
+        }
+
+        uint32* node;
+        uint32 last;
+        if (depth >= MAX_HAMT_DEPTH)
+        {
+            // Consumed all hash bits. Collision bucket.
+            last = NewNode(2, 2, node);
+            node[1] = slot1;
+            node[2] = slot2;
+        }
+        else
+        {
+            const uint32 index1 = GetHashIndex(hash1, depth);
+            const uint32 index2 = GetHashIndex(hash2, depth);
+            last = NewNode(((uint32)1 << index1) | ((uint32)1 << index2), 2, node);
+            node[1 + (index1 > index2)] = slot1;
+            node[1 + (index1 < index2)] = slot2;
+        }
+        if (parent != nullptr)
+            parent[1] = last;
+        return (chainLength != 0) ? chain[0] : last;
+    }
+    catch (...)
+    {
+        for (uint32 i = 0; i < chainLength; i++)
+            m_nodes.Free(chain[i] >> 1, 2);
+        throw;
+    }
+}
+
+// Replace the node at *slot with a copy that has child inserted at pos
+template <class T, class K>
+void THashTrieCompact<T, K>::InsertSlot(uint32* slot, uint32 depth, uint32 pos, uint32 bit, uint32 child)
+{
+    const uint32* node = GetNode(*slot);
+    const uint32 size = GetSlotCount(node, depth);
+    uint32* copy;
+    const uint32 copySlot = NewNode((depth < MAX_HAMT_DEPTH) ? (node[0] | bit) : node[0] + 1, size + 1, copy);
+    memcpy(copy + 1, node + 1, pos * sizeof(uint32));
+    copy[1 + pos] = child;
+    memcpy(copy + 2 + pos, node + 1 + pos, (size - pos) * sizeof(uint32));
+    m_nodes.Free(*slot >> 1, 1 + size);
+    *slot = copySlot;
+}
+
+// Replace the node at *slot with a copy without slot pos. If no memory is
+// left for the copy the node shrinks in place, leaving its last word unused.
+template <class T, class K>
+void THashTrieCompact<T, K>::RemoveSlot(uint32* slot, uint32 depth, uint32 pos) noexcept
+{
+    uint32* node = GetNode(*slot);
+    const uint32 size = GetSlotCount(node, depth);
+    const uint32 bitmap = (depth < MAX_HAMT_DEPTH) ? ClearNthSetBit(node[0], pos) : node[0] - 1;
+    const uint32 index = m_nodes.TryAlloc(size);
+    if (index == 0)
+    {
+        memmove(node + 1 + pos, node + 2 + pos, (size - pos - 1) * sizeof(uint32));
+        node[0] = bitmap;
+        return;
+    }
+
+    uint32* copy = m_nodes.At(index);
+    copy[0] = bitmap;
+    memcpy(copy + 1, node + 1, pos * sizeof(uint32));
+    memcpy(copy + 1 + pos, node + 2 + pos, (size - pos - 1) * sizeof(uint32));
+    m_nodes.Free(*slot >> 1, 1 + size);
+    *slot = (index << 1) | NODE_BIT;
+}
+
+template <class T, class K>
+template <class F>
+void THashTrieCompact<T, K>::ForEachSlot(uint32 slot, uint32 depth, F& fn)
+{
+    if (!IsNode(slot))
+    {
+        fn(GetEntry(slot));
+        return;
+    }
+
+    const uint32* node = GetNode(slot);
+    const uint32 size = GetSlotCount(node, depth);
+    for (uint32 i = 1; i <= size; i++)
+        ForEachSlot(node[i], depth + 1, fn);
+}
+
+template <class T, class K>
+void THashTrieCompact<T, K>::DestroyAll(uint32 slot, uint32 depth) noexcept
+{
+    if (!IsNode(slot))
+    {
+        GetEntry(slot)->~T();
+        return;
+    }
+
+    const uint32* node = GetNode(slot);
+    const uint32 size = GetSlotCount(node, depth);
+    for (uint32 i = 1; i <= size; i++)
+        DestroyAll(node[i], depth + 1);
+}
+
+template <class T, class K>
+void THashTrieCompact<T, K>::Clear() noexcept
+{
+    // The pools are freed as a whole, so only the entries are visited
+    if (m_root != 0)
+        DestroyAll(m_root, 0);
+    m_entries.Clear();
+    m_nodes.Clear();
+    m_root = 0;
+    m_count = 0;
+}
+
+template <class T, class K>
+void THashTrieCompact<T, K>::CollectStats(uint32 slot, uint32 depth, CHashTrieStats& stats) const noexcept
+{
+    if (!IsNode(slot))
+    {
+        stats.leafCount++;
+        stats.leafDepth[depth]++;
+        stats.totalProbeLength += depth + 1;
+        if (depth > stats.maxLeafDepth)
+            stats.maxLeafDepth = depth;
+        return;
+    }
+
+    const uint32* node = GetNode(slot);
+    const uint32 size = GetSlotCount(node, depth);
+    stats.nodeCount++;
+    stats.nodeBytes += (1 + size) * sizeof(uint32);
+    if (depth < MAX_HAMT_DEPTH)
+    {
+        stats.nodePopCount[size]++;
+        for (uint32 i = 1; i <= size; i++)
+            CollectStats(node[i], depth + 1, stats);
+    }
+    else
+    {
+        // Linear search (collision) bucket. i-th entry takes i more compares to reach.
+        stats.collisionBucketCount++;
+        stats.collisionEntryCount += size;
+        stats.collisionBucketSize[size < CHashTrieStats::MAX_BUCKET_HISTOGRAM ? size : CHashTrieStats::MAX_BUCKET_HISTOGRAM]++;
+
+        stats.leafCount += size;
+        stats.leafDepth[depth + 1] += size;
+        stats.totalProbeLength += (uint64)size * (depth + 2) + (uint64)size * (size - 1) / 2;
+        if (depth + 1 > stats.maxLeafDepth)
+            stats.maxLeafDepth = depth + 1;
+    }
+}
+
+template <class T, class K>
+CHashTrieStats THashTrieCompact<T, K>::GetStats() const noexcept
+{
+    CHashTrieStats stats;
+    if (m_root != 0)
+    {
+        CollectStats(m_root, 0, stats);
+        stats.averageProbeLength = (double)stats.totalProbeLength / stats.leafCount;
+    }
+    return stats;
+}
+
+#endif // __HASH_TRIE_COMPACT_H__
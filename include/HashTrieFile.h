@@ -0,0 +1,500 @@
+/**
+ *      File: HashTrieFile.h
+ *    Author: CS Lim
+ *   Purpose: Files for THashTrie: a memory-mappable read-only image
+ *   History:
+ *
+ *  Entries are written as records of plain key and value bytes, so any
+ *  process can read them back without the types of the trie.
+ */
+
+#ifndef __HASH_TRIE_FILE_H__
+#define __HASH_TRIE_FILE_H__
+
+#include <stdio.h>
+#include <HashTrie.h>
+#include <vector>
+
+//===========================================================================
+//    CByteRange
+//===========================================================================
+struct CByteRange
+{
+    const void* data{ nullptr };
+    uint32      size{ 0 };
+
+    CByteRange() noexcept = default;
+    CByteRange(const void* data_, size_t size_) noexcept : data(data_), size((uint32)size_) { assert(size_ <= UINT32_MAX); }
+};
+
+//===========================================================================
+//    Key bytes
+//    (Keys are stored as plain bytes: the integer of THashKey32 and the
+//     characters of string keys without the null terminator. KeyBytesEqual
+//     compares a key with stored bytes the way the key's operator== does.)
+//===========================================================================
+template <typename T, class Hasher>
+inline CByteRange GetKeyBytes(const THashKey32<T, Hasher>& key) noexcept
+{
+    return CByteRange(&key.Get(), sizeof(T));
+}
+
+template <class CharType, class Cmp, class Hasher>
+inline CByteRange GetKeyBytes(const THashKeyStr<CharType, Cmp, Hasher>& key) noexcept
+{
+    const CharType* str = key.GetString();
+    return CByteRange(str, (str != nullptr) ? StrLen(str) * sizeof(CharType) : 0);
+}
+
+template <class CharType, class Hasher, bool CacheHash, class Cmp>
+inline CByteRange GetKeyBytes(const THashKeyStrView<CharType, Hasher, CacheHash, Cmp>& key) noexcept
+{
+    return CByteRange(key.GetString(), key.GetLength() * sizeof(CharType));
+}
+
+template <class CharType, class Hasher, size_t InlineBytes>
+inline CByteRange GetKeyBytes(const THashKeyStrInline<CharType, Hasher, InlineBytes>& key) noexcept
+{
+    return CByteRange(key.GetString(), key.GetLength() * sizeof(CharType));
+}
+
+template <typename T, class Hasher>
+inline bool KeyBytesEqual(const THashKey32<T, Hasher>& key, CByteRange bytes) noexcept
+{
+    return bytes.size == sizeof(T) && memcmp(&key.Get(), bytes.data, sizeof(T)) == 0;
+}
+
+template <class CharType, class Cmp, class Hasher>
+inline bool KeyBytesEqual(const THashKeyStr<CharType, Cmp, Hasher>& key, CByteRange bytes) noexcept
+{
+    if (key.GetString() == nullptr)
+        return bytes.size == 0;
+    return bytes.size % sizeof(CharType) == 0
+        && Cmp::StrEqual(key.GetString(), (const CharType *)bytes.data, bytes.size / sizeof(CharType));
+}
+
+template <class CharType, class Hasher, bool CacheHash, class Cmp>
+inline bool KeyBytesEqual(const THashKeyStrView<CharType, Hasher, CacheHash, Cmp>& key, CByteRange bytes) noexcept
+{
+    return bytes.size == key.GetLength() * sizeof(CharType)
+        && Cmp::Equal(key.GetString(), (const CharType *)bytes.data, key.GetLength());
+}
+
+template <class CharType, class Hasher, size_t InlineBytes>
+inline bool KeyBytesEqual(const THashKeyStrInline<CharType, Hasher, InlineBytes>& key, CByteRange bytes) noexcept
+{
+    return bytes.size == key.GetLength() * sizeof(CharType)
+        && memcmp(key.GetString(), bytes.data, bytes.size) == 0;
+}
+
+// Entries without a value (sets)
+struct CNoValue
+{
+    template <class T>
+    CByteRange operator()(const T&) const noexcept { return CByteRange(); }
+};
+
+
+//===========================================================================
+//    CMappedFile
+//    (Whole file mapped read-only)
+//===========================================================================
+class CMappedFile
+{
+public:
+    CMappedFile() noexcept = default;
+    ~CMappedFile() noexcept { Close(); }
+    CMappedFile(CMappedFile const&) = delete;
+    CMappedFile& operator=(CMappedFile const&) = delete;
+
+    bool Open(const char path[]) noexcept;
+    void Close() noexcept;
+
+    const uint8* GetData() const noexcept { return m_data; }
+    uint64 GetSize() const noexcept { return m_size; }
+
+private:
+    const uint8*    m_data{ nullptr };
+    uint64          m_size{ 0 };
+#if _MSC_VER
+    void*           m_mapping{ nullptr };
+#endif
+};
+
+
+//===========================================================================
+//    CFileWriter
+//    (Buffered sequential file output. Errors are sticky: once a write
+//     fails all later calls fail too, so callers can check once at the end.)
+//===========================================================================
+class CFileWriter
+{
+public:
+    CFileWriter() noexcept = default;
+    ~CFileWriter() noexcept { Close(); }
+    CFileWriter(CFileWriter const&) = delete;
+    CFileWriter& operator=(CFileWriter const&) = delete;
+
+    // Create or truncate the file, or with truncate == false open an
+    // existing file for writing at its end
+    bool Open(const char path[], bool truncate = true) noexcept;
+    bool Close() noexcept;
+
+    bool Write(const void* data, size_t size) noexcept;
+    bool WriteZeros(size_t size) noexcept;
+    bool Seek(uint64 offset) noexcept;      // For patching headers
+    bool Flush() noexcept;
+    bool Sync() noexcept;                   // Flush and wait until the data is on disk
+
+    uint64 GetOffset() const noexcept { return m_offset; }
+    bool IsOk() const noexcept { return m_file != nullptr && !m_failed; }
+
+private:
+    FILE*   m_file{ nullptr };
+    uint64  m_offset{ 0 };
+    bool    m_failed{ false };
+};
+
+//===========================================================================
+//    CFileReader
+//    (Large sequential file reads. Errors are sticky as for CFileWriter.)
+//===========================================================================
+class CFileReader
+{
+public:
+    CFileReader() noexcept = default;
+    ~CFileReader() noexcept { Close(); }
+    CFileReader(CFileReader const&) = delete;
+    CFileReader& operator=(CFileReader const&) = delete;
+
+    bool Open(const char path[]) noexcept;
+    void Close() noexcept;
+
+    // Read exactly size bytes. Fails at the end of the file.
+    bool Read(void* data, size_t size) noexcept;
+    bool Seek(uint64 offset) noexcept;
+
+    uint64 GetOffset() const noexcept { return m_offset; }
+    bool IsOk() const noexcept { return m_file != nullptr && !m_failed; }
+
+private:
+    FILE*   m_file{ nullptr };
+    uint64  m_offset{ 0 };
+    bool    m_failed{ false };
+};
+
+// Rename from to to, replacing to. Atomic on POSIX file systems.
+bool RenameFile(const char from[], const char to[]) noexcept;
+// Size of the file at path. Returns false if there is no such file.
+bool GetFileSize(const char path[], uint64& size) noexcept;
+// Cut the file at path to size bytes
+bool TruncateFile(const char path[], uint64 size) noexcept;
+
+
+//===========================================================================
+//    Image format
+//
+//    CHashTrieImageHeader at offset 0, then the entry records and then all
+//    trie nodes. A slot refers to a record or node by its offset from the
+//    start of the file, with the LSB set for nodes (as AMT_MARK_BIT in
+//    memory). Records and nodes are 8 byte aligned. Slot 0 is empty.
+//===========================================================================
+struct CHashTrieImageHeader
+{
+    static constexpr uint32 VERSION = 1;
+
+    char    magic[8];       // HASH_TRIE_IMAGE_MAGIC
+    uint32  version;
+    uint32  count;          // of entries
+    uint64  root;           // slot
+    uint64  size;           // of the file
+};
+
+static constexpr char HASH_TRIE_IMAGE_MAGIC[8] = { 'H', 'A', 'M', 'T', 'I', 'M', 'G', 0 };
+
+// Entry record: key bytes, then value bytes, then padding
+struct CHashTrieRecord
+{
+    uint32  hash;
+    uint32  keySize;
+    uint32  valueSize;
+    uint32  reserved;
+
+    CByteRange GetKey() const noexcept { return CByteRange(this + 1, keySize); }
+    CByteRange GetValue() const noexcept { return CByteRange((const uint8 *)(this + 1) + keySize, valueSize); }
+    static uint64 GetSize(uint32 keySize, uint32 valueSize) noexcept { return (sizeof(CHashTrieRecord) + (uint64)keySize + valueSize + 7) & ~(uint64)7; }
+};
+
+// Trie node: bitmap as in memory (the entry count for collision buckets)
+struct CHashTrieImageNode
+{
+    static constexpr uint32 HASH_INDEX_BITS = 5;
+    static constexpr uint32 HASH_INDEX_MASK = (1 << HASH_INDEX_BITS) - 1;
+    static constexpr uint32 MAX_DEPTH       = 7;    // Nodes at this depth are collision buckets
+
+    uint32  bitmap;
+    uint32  count;          // of slots
+    uint64  slots[1];
+
+    static uint64 GetSize(uint32 count) noexcept { return sizeof(uint64) * (1 + (uint64)count); }
+    static uint32 GetHashIndex(uint32 hash, uint32 depth) noexcept { return (hash >> (depth * HASH_INDEX_BITS)) & HASH_INDEX_MASK; }
+};
+
+static constexpr uint64 HASH_TRIE_IMAGE_NODE_BIT = 1;
+
+// Find the record with key in the image trie under root. at(offset) returns
+// the address of the record or node at offset.
+template <class Q, class At>
+const CHashTrieRecord* FindHashTrieRecord(uint64 root, const Q& key, const At& at) noexcept
+{
+    if (root == 0)
+        return nullptr;
+
+    const uint32 hash = key.GetHash();
+    uint64 slot = root;
+    for (uint32 depth = 0; slot & HASH_TRIE_IMAGE_NODE_BIT; depth++)
+    {
+        const CHashTrieImageNode* node = (const CHashTrieImageNode *)at(slot & ~HASH_TRIE_IMAGE_NODE_BIT);
+        if (depth >= CHashTrieImageNode::MAX_DEPTH)
+        {
+            // Collision bucket
+            for (uint32 i = 0; i < node->count; i++)
+            {
+                const CHashTrieRecord* record = (const CHashTrieRecord *)at(node->slots[i]);
+                if (record->hash == hash && KeyBytesEqual(key, record->GetKey()))
+                    return record;
+            }
+            return nullptr;
+        }
+
+        uint32 bit = (uint32)1 << CHashTrieImageNode::GetHashIndex(hash, depth);
+        if ((node->bitmap & bit) == 0)
+            return nullptr;
+        slot = node->slots[GetBitCount(node->bitmap & (bit - 1))];
+    }
+
+    const CHashTrieRecord* record = (const CHashTrieRecord *)at(slot);
+    return (record->hash == hash && KeyBytesEqual(key, record->GetKey())) ? record : nullptr;
+}
+
+// Call fn(const CHashTrieRecord&) for every record under slot
+template <class At, class F>
+void ForEachHashTrieRecord(uint64 slot, const At& at, F& fn)
+{
+    if (slot == 0)
+        return;
+    if ((slot & HASH_TRIE_IMAGE_NODE_BIT) == 0)
+    {
+        fn(*(const CHashTrieRecord *)at(slot));
+        return;
+    }
+
+    const CHashTrieImageNode* node = (const CHashTrieImageNode *)at(slot & ~HASH_TRIE_IMAGE_NODE_BIT);
+    for (uint32 i = 0; i < node->count; i++)
+        ForEachHashTrieRecord(node->slots[i], at, fn);
+}
+
+
+//===========================================================================
+//    CHashTrieImage
+//    (Read-only view of an image file. Find walks the mapped nodes directly.)
+//===========================================================================
+class CHashTrieImage
+{
+public:
+    CHashTrieImage() noexcept = default;
+    CHashTrieImage(CHashTrieImage const&) = delete;
+    CHashTrieImage& operator=(CHashTrieImage const&) = delete;
+
+    // Map the file and check its header. Returns false if the file could
+    // not be mapped or is not an image.
+    bool Open(const char path[]) noexcept;
+    void Close() noexcept;
+
+    uint32 GetCount() const noexcept { return (m_header != nullptr) ? m_header->count : 0; }
+
+    // Record with the key (any key type with GetHash and KeyBytesEqual) or nullptr
+    template <class Q>
+    const CHashTrieRecord* Find(const Q& key) const noexcept
+    {
+        return (m_header != nullptr) ? FindHashTrieRecord(m_header->root, key, Resolver{ m_file.GetData() }) : nullptr;
+    }
+
+    // Call fn(const CHashTrieRecord&) for every record
+    template <class F>
+    void ForEach(F fn) const
+    {
+        if (m_header != nullptr)
+            ForEachHashTrieRecord(m_header->root, Resolver{ m_file.GetData() }, fn);
+    }
+
+private:
+    struct Resolver
+    {
+        const uint8* data;
+        const void* operator()(uint64 offset) const noexcept { return data + offset; }
+    };
+
+    CMappedFile                 m_file;
+    const CHashTrieImageHeader* m_header{ nullptr };
+};
+
+
+//===========================================================================
+//    THashTrieFile
+//    (Writes THashTrie contents to files)
+//===========================================================================
+template <class T, class K>
+class THashTrieFile
+{
+private:
+    typedef THashTrie<T, K>                     Trie;
+    typedef typename Trie::ArrayMappedTrie      ArrayMappedTrie;
+
+    static_assert(Trie::HASH_INDEX_BITS == CHashTrieImageNode::HASH_INDEX_BITS && Trie::MAX_HAMT_DEPTH == CHashTrieImageNode::MAX_DEPTH,
+        "Image layout must match the trie.");
+
+    template <class GetValue>
+    static bool WriteRecord(CFileWriter& file, const T& entry, GetValue& getValue) noexcept;
+    template <class GetValue>
+    static uint64 WriteImageNode(CFileWriter& file, T* node, uint32 depth, std::vector<uint64>& nodes, GetValue& getValue);
+
+public:
+    // Write the entries of trie to an image file at path and wait until it is
+    // on disk. getValue(const T&) returns the CByteRange of an entry's value.
+    // Returns false on I/O errors.
+    template <class GetValue>
+    static bool WriteImage(Trie& trie, const char path[], GetValue getValue);
+};
+
+template <class T, class K>
+template <class GetValue>
+bool THashTrieFile<T, K>::WriteRecord(CFileWriter& file, const T& entry, GetValue& getValue) noexcept
+{
+    CByteRange key = GetKeyBytes(static_cast<const K&>(entry));
+    CByteRange value = getValue(entry);
+
+    CHashTrieRecord record;
+    record.hash      = entry.GetHash();
+    record.keySize   = key.size;
+    record.valueSize = value.size;
+    record.reserved  = 0;
+
+    uint64 size = CHashTrieRecord::GetSize(key.size, value.size);
+    file.Write(&record, sizeof(record));
+    file.Write(key.data, key.size);
+    file.Write(value.data, value.size);
+    return file.WriteZeros((size_t)(size - sizeof(record) - key.size - value.size));
+}
+
+// Write the records under node and append its image nodes to nodes. Node slots
+// are offsets into nodes until the final location of the nodes is known.
+// Returns the slot of node.
+template <class T, class K>
+template <class GetValue>
+uint64 THashTrieFile<T, K>::WriteImageNode(CFileWriter& file, T* node, uint32 depth, std::vector<uint64>& nodes, GetValue& getValue)
+{
+    if (!HasAMTMarkBit((uint_ptr)node))
+    {
+        uint64 slot = file.GetOffset();
+        WriteRecord(file, *node, getValue);
+        return slot;
+    }
+
+    ArrayMappedTrie* amt = (ArrayMappedTrie *)((uint_ptr)node & ~Trie::AMT_MARK_BIT);
+    const uint32 skipLevels = amt->GetSkipLevels();
+    depth += skipLevels;
+    uint32 count = (depth < Trie::MAX_HAMT_DEPTH) ? GetBitCount(amt->m_bitmap) : amt->m_bitmap;
+    uint64 slots[Trie::HASH_INDEX_MASK + 1];
+    std::vector<uint64> bucket;
+    uint64* childSlots = slots;
+    if (count > Trie::HASH_INDEX_MASK + 1)
+    {
+        bucket.resize(count);
+        childSlots = bucket.data();
+    }
+    // Images have sparse nodes only. Empty slots of dense nodes are dropped.
+    uint32 bitmap = amt->m_bitmap;
+    uint32 size = 0;
+    for (uint32 i = 0; i < count; i++)
+    {
+        if (amt->m_subHash[i] != nullptr)
+            childSlots[size++] = WriteImageNode(file, amt->m_subHash[i], depth + 1, nodes, getValue);
+        else
+            bitmap &= ~((uint32)1 << i);
+    }
+    count = size;
+
+    uint64 slot = (nodes.size() * sizeof(uint64)) | HASH_TRIE_IMAGE_NODE_BIT;
+    uint32 head[2] = { bitmap, count };
+    nodes.push_back(0);
+    memcpy(&nodes.back(), head, sizeof(head));
+    nodes.insert(nodes.end(), childSlots, childSlots + count);
+
+    // Images have no skipped levels: add a single slot node for each
+    for (uint32 level = skipLevels; level-- > 0; )
+    {
+        uint32 chain[2] = { (uint32)1 << ((amt->GetSkipPrefix() >> (level * Trie::HASH_INDEX_BITS)) & Trie::HASH_INDEX_MASK), 1 };
+        uint64 child = slot;
+        slot = (nodes.size() * sizeof(uint64)) | HASH_TRIE_IMAGE_NODE_BIT;
+        nodes.push_back(0);
+        memcpy(&nodes.back(), chain, sizeof(chain));
+        nodes.push_back(child);
+    }
+    return slot;
+}
+
+template <class T, class K>
+template <class GetValue>
+bool THashTrieFile<T, K>::WriteImage(Trie& trie, const char path[], GetValue getValue)
+{
+    CFileWriter file;
+    if (!file.Open(path))
+        return false;
+
+    CHashTrieImageHeader header = {};
+    file.Write(&header, sizeof(header));
+
+    std::vector<uint64> nodes;
+    if (trie.m_root != nullptr)
+        header.root = WriteImageNode(file, trie.m_root, 0, nodes, getValue);
+
+    // Move node slots past the records
+    const uint64 nodesOffset = file.GetOffset();
+    for (size_t i = 0; i < nodes.size(); )
+    {
+        uint32 count = ((const CHashTrieImageNode *)&nodes[i])->count;
+        for (size_t j = i + 1; j <= i + count; j++)
+        {
+            if (nodes[j] & HASH_TRIE_IMAGE_NODE_BIT)
+                nodes[j] += nodesOffset;
+        }
+        i += 1 + count;
+    }
+    if (header.root & HASH_TRIE_IMAGE_NODE_BIT)
+        header.root += nodesOffset;
+    file.Write(nodes.data(), nodes.size() * sizeof(uint64));
+
+    memcpy(header.magic, HASH_TRIE_IMAGE_MAGIC, sizeof(header.magic));
+    header.version = CHashTrieImageHeader::VERSION;
+    header.count   = trie.GetCount();
+    header.size    = file.GetOffset();
+    file.Seek(0);
+    file.Write(&header, sizeof(header));
+    bool synced = file.Sync();
+    return file.Close() && synced;
+}
+
+template <class T, class K, class GetValue>
+inline bool WriteHashTrieImage(THashTrie<T, K>& trie, const char path[], GetValue getValue)
+{
+    return THashTrieFile<T, K>::WriteImage(trie, path, getValue);
+}
+
+template <class T, class K>
+inline bool WriteHashTrieImage(THashTrie<T, K>& trie, const char path[])
+{
+    return THashTrieFile<T, K>::WriteImage(trie, path, CNoValue());
+}
+
+#endif // __HASH_TRIE_FILE_H__
@@ -0,0 +1,481 @@
+/**
+ *      File: HashTrieInline.h
+ *    Author: CS Lim
+ *   Purpose: Integer map with keys and values stored in the AMT nodes
+ *   History:
+ *
+ *  THashTrieInt allocates a Cell for every key and stores a pointer to it.
+ *  THashTrieIntInline stores each key and value in the node slot itself. A
+ *  second bitmap per node tells entry slots from child node pointers, so
+ *  there is no allocation per entry and no dependent load to reach it.
+ */
+
+#ifndef __HASH_TRIE_INLINE_H__
+#define __HASH_TRIE_INLINE_H__
+
+#include <HashTrie.h>
+
+/****************************************************************************
+*
+*   THashTrieIntInline
+*
+*   Pointers to values returned by Find, Add and FindOrAdd are valid until
+*   the next change of the map.
+*
+**/
+
+template <typename T, class Hasher = CHasherDefault>
+class THashTrieIntInline final
+{
+    static_assert(std::is_integral<T>::value, "Integer required.");
+
+public:
+    typedef THashKey32<T, Hasher> Key;
+
+private:
+    static constexpr uint32 HASH_INDEX_BITS = 5;
+    static constexpr uint32 HASH_INDEX_MASK = (1 << HASH_INDEX_BITS) - 1;
+    static constexpr uint32 MAX_HAMT_DEPTH  = 7;    // Nodes at this depth are collision buckets
+
+    struct Node;
+
+    struct Entry
+    {
+        T   key;
+        T   value;
+    };
+
+    union Slot
+    {
+        Entry   entry;
+        Node*   child;
+    };
+
+    struct Node
+    {
+        uint32  bitmap;     // Slots in use (the entry count for collision buckets)
+        uint32  entryMap;   // Slots holding an entry rather than a child node
+        Slot    slots[1];
+        // Do not add more data below
+    };
+
+    static uint32 GetHash(T key) noexcept { return Key(key).GetHash(); }
+    static uint32 GetHashIndex(uint32 hash, uint32 depth) noexcept { return (hash >> (depth * HASH_INDEX_BITS)) & HASH_INDEX_MASK; }
+    static uint32 GetSlotCount(const Node* node, uint32 depth) noexcept { return (depth < MAX_HAMT_DEPTH) ? GetBitCount(node->bitmap) : node->bitmap; }
+    static uint32 GetNthBit(uint32 bitmap, uint32 n) noexcept
+    {
+        for (; n != 0; n--)
+            bitmap &= bitmap - 1;
+        return bitmap & (0 - bitmap);
+    }
+    static bool IsEntry(const Node* node, uint32 depth, uint32 pos) noexcept { return depth >= MAX_HAMT_DEPTH || (node->entryMap & GetNthBit(node->bitmap, pos)) != 0; }
+
+    static Node* AllocNode(uint32 size);
+    static Node* ResizeNode(Node* node, uint32 size);
+    static Node* MakeNode2(const Entry& entry1, uint32 hash1, const Entry& entry2, uint32 hash2, uint32 depth, T*& value2);
+    static void FreeAll(Node* node, uint32 depth) noexcept;
+    template <class F>
+    static void ForEachEntry(Node* node, uint32 depth, F& fn);
+    static void CollectStats(const Node* node, uint32 depth, CHashTrieStats& stats) noexcept;
+
+    Node*   m_root{ nullptr };
+    uint32  m_count{ 0 };
+
+public:
+    THashTrieIntInline() noexcept = default;
+    ~THashTrieIntInline() noexcept { Clear(); }
+    THashTrieIntInline(THashTrieIntInline const&) = delete;
+    THashTrieIntInline& operator=(THashTrieIntInline const&) = delete;
+
+public:
+    T* Add(T key) { return FindOrAdd(key).first; }     // Returns the existing value if key was added before
+    // Value of key, added as 0 if key is new, and whether it was added
+    std::pair<T*, bool> FindOrAdd(T key);
+
+    // Adds key with value or sets value = fn(oldValue, value)
+    template <class F>
+    T* Merge(T key, T value, F fn);
+    T* Find(T key) noexcept;
+    bool Remove(T key) noexcept;
+
+    // Call fn(T key, T& value) for every entry
+    template <class F>
+    void ForEach(F fn)
+    {
+        if (m_root != nullptr)
+            ForEachEntry(m_root, 0, fn);
+    }
+    uint32 GetCount() const noexcept { return m_count; }
+    void Clear() noexcept;
+    CHashTrieStats GetStats() const noexcept;
+};
+
+template <typename T, class Hasher>
+typename THashTrieIntInline<T, Hasher>::Node* THashTrieIntInline<T, Hasher>::AllocNode(uint32 size)
+{
+    Node* node = (Node *)malloc(sizeof(Node) + ((size != 0) ? size - 1 : 0) * sizeof(Slot));
+    if (node == nullptr)
+        throw std::bad_alloc();
+    return node;
+}
+
+// Returns the node with room for size slots. The node is unchanged if
+// growing it fails.
+template <typename T, class Hasher>
+typename THashTrieIntInline<T, Hasher>::Node* THashTrieIntInline<T, Hasher>::ResizeNode(Node* node, uint32 size)
+{
+    Node* resized = (Node *)realloc(node, sizeof(Node) + ((size != 0) ? size - 1 : 0) * sizeof(Slot));
+    if (resized == nullptr)
+        throw std::bad_alloc();
+    return resized;
+}
+
+// Nodes for two entries whose hashes agree below depth. value2 is set to
+// the value of entry2 in them.
+template <typename T, class Hasher>
+typename THashTrieIntInline<T, Hasher>::Node* THashTrieIntInline<T, Hasher>::MakeNode2(
+    const Entry&    entry1,
+    uint32          hash1,
+    const Entry&    entry2,
+    uint32          hash2,
+    uint32          depth,
+    T*&             value2)
+{
+    if (depth >= MAX_HAMT_DEPTH)
+    {
+        // Consumed all hash bits. Collision bucket.
+        Node* node = AllocNode(2);
+        node->bitmap = 2;
+        node->entryMap = 0;
+        node->slots[0].entry = entry1;
+        node->slots[1].entry = entry2;
+        value2 = &node->slots[1].entry.value;
+        return node;
+    }
+
+    const uint32 index1 = GetHashIndex(hash1, depth);
+    const uint32 index2 = GetHashIndex(hash2, depth);
+    if (index1 == index2)
+    {
+        Node* child = MakeNode2(entry1, hash1, entry2, hash2, depth + 1, value2);
+        Node* node;
+        try
+        {
+            node = AllocNode(1);
+        }
+        catch (...)
+        {
+            FreeAll(child, depth + 1);
+            throw;
+        }
+        node->bitmap = (uint32)1 << index1;
+        node->entryMap = 0;
+        node->slots[0].child = child;
+        return node;
+    }
+
+    Node* node = AllocNode(2);
+    node->bitmap = ((uint32)1 << index1) | ((uint32)1 << index2);
+    node->entryMap = node->bitmap;
+    node->slots[index1 > index2].entry = entry1;
+    node->slots[index1 < index2].entry = entry2;
+    value2 = &node->slots[index1 < index2].entry.value;
+    return node;
+}
+
+template <typename T, class Hasher>
+T* THashTrieIntInline<T, Hasher>::Find(T key) noexcept
+{
+    Node* node = m_root;
+    if (node == nullptr)
+        return nullptr;
+
+    uint32 hash = GetHash(key);
+    for (uint32 depth = 0; ; depth++)
+    {
+        if (depth >= MAX_HAMT_DEPTH)
+        {
+            // Consumed all hash bits. Run linear search.
+            for (uint32 i = 0; i < node->bitmap; i++)
+            {
+                if (node->slots[i].entry.key == key)
+                    return &node->slots[i].entry.value;
+            }
+            return nullptr;
+        }
+
+        const uint32 bit = (uint32)1 << (hash & HASH_INDEX_MASK);
+        if ((node->bitmap & bit) == 0)
+            return nullptr;
+
+        Slot& slot = node->slots[GetBitCount(node->bitmap & (bit - 1))];
+        if (node->entryMap & bit)
+            return (slot.entry.key == key) ? &slot.entry.value : nullptr;
+
+        node = slot.child;
+        hash >>= HASH_INDEX_BITS;
+    }
+}
+
+template <typename T, class Hasher>
+std::pair<T*, bool> THashTrieIntInline<T, Hasher>::FindOrAdd(T key)
+{
+    const uint32 hash = GetHash(key);
+    if (m_root == nullptr)
+    {
+        m_root = AllocNode(0);
+        m_root->bitmap = 0;
+        m_root->entryMap = 0;
+    }
+
+    const Entry added = { key, 0 };
+    Node** ref = &m_root;
+    for (uint32 depth = 0; ; depth++)
+    {
+        Node* node = *ref;
+        if (depth >= MAX_HAMT_DEPTH)
+        {
+            const uint32 count = node->bitmap;
+            for (uint32 i = 0; i < count; i++)
+            {
+                if (node->slots[i].entry.key == key)
+                    return std::make_pair(&node->slots[i].entry.value, false);
+            }
+
+            node = *ref = ResizeNode(node, count + 1);
+            node->slots[count].entry = added;
+            node->bitmap++;
+            m_count++;
+            return std::make_pair(&node->slots[count].entry.value, true);
+        }
+
+        const uint32 bit = (uint32)1 << GetHashIndex(hash, depth);
+        const uint32 pos = GetBitCount(node->bitmap & (bit - 1));
+        if ((node->bitmap & bit) == 0)
+        {
+            const uint32 count = GetBitCount(node->bitmap);
+            node = *ref = ResizeNode(node, count + 1);
+            memmove(&node->slots[pos + 1], &node->slots[pos], (count - pos) * sizeof(Slot));
+            node->slots[pos].entry = added;
+            node->bitmap |= bit;
+            node->entryMap |= bit;
+            m_count++;
+            return std::make_pair(&node->slots[pos].entry.value, true);
+        }
+
+        Slot& slot = node->slots[pos];
+        if (node->entryMap & bit)
+        {
+            if (slot.entry.key == key)
+                return std::make_pair(&slot.entry.value, false);
+
+            // Push both entries down into a new child node
+            T* value;
+            slot.child = MakeNode2(slot.entry, GetHash(slot.entry.key), added, hash, depth + 1, value);
+            node->entryMap &= ~bit;
+            m_count++;
+            return std::make_pair(value, true);
+        }
+        ref = &slot.child;
+    }
+}
+
+template <typename T, class Hasher>
+template <class F>
+inline T* THashTrieIntInline<T, Hasher>::Merge(T key, T value, F fn)
+{
+    std::pair<T*, bool> found = FindOrAdd(key);
+    *found.first = found.second ? value : fn(*found.first, value);
+    return found.first;
+}
+
+template <typename T, class Hasher>
+bool THashTrieIntInline<T, Hasher>::Remove(T key) noexcept
+{
+    if (m_root == nullptr)
+        return false;
+
+    // Node references and slot positions from the root down to the entry
+    Node** refs[MAX_HAMT_DEPTH + 1];
+    uint32 positions[MAX_HAMT_DEPTH + 1];
+    const uint32 hash = GetHash(key);
+    Node** ref = &m_root;
+    int depth = 0;
+    for (;; depth++)
+    {
+        Node* node = *ref;
+        refs[depth] = ref;
+        if (depth >= (int)MAX_HAMT_DEPTH)
+        {
+            uint32 pos = 0;
+            while (pos < node->bitmap && node->slots[pos].entry.key != key)
+                pos++;
+            if (pos == node->bitmap)
+                return false;
+            positions[depth] = pos;
+            break;
+        }
+
+        const uint32 bit = (uint32)1 << GetHashIndex(hash, depth);
+        if ((node->bitmap & bit) == 0)
+            return false;
+        const uint32 pos = GetBitCount(node->bitmap & (bit - 1));
+        positions[depth] = pos;
+        if (node->entryMap & bit)
+        {
+            if (node->slots[pos].entry.key != key)
+                return false;
+            break;
+        }
+        ref = &node->slots[pos].child;
+    }
+
+    // Remove the slot. Empty nodes are removed from their parent, and a node
+    // left with a single entry is replaced by the entry in its parent, up to
+    // the root.
+    for (;; depth--)
+    {
+        Node* node = *refs[depth];
+        const uint32 count = GetSlotCount(node, depth);
+        const uint32 pos = positions[depth];
+        if (count == 1 && depth > 0)
+        {
+            free(node);
+            continue;
+        }
+
+        memmove(&node->slots[pos], &node->slots[pos + 1], (count - pos - 1) * sizeof(Slot));
+        if (depth >= (int)MAX_HAMT_DEPTH)
+        {
+            node->bitmap--;
+        }
+        else
+        {
+            const uint32 bit = GetNthBit(node->bitmap, pos);
+            node->bitmap &= ~bit;
+            node->entryMap &= ~bit;
+        }
+
+        // Shrinking won't fail
+        Node* resized = (Node *)realloc(node, sizeof(Node) + ((count > 2) ? count - 2 : 0) * sizeof(Slot));
+        if (resized != nullptr)
+            node = *refs[depth] = resized;
+        break;
+    }
+
+    for (; depth > 0 && GetSlotCount(*refs[depth], depth) == 1 && IsEntry(*refs[depth], depth, 0); depth--)
+    {
+        Node* node = *refs[depth];
+        Node* parent = *refs[depth - 1];
+        const uint32 pos = positions[depth - 1];
+        const Entry entry = node->slots[0].entry;
+        free(node);
+        parent->slots[pos].entry = entry;
+        parent->entryMap |= GetNthBit(parent->bitmap, pos);
+    }
+
+    if (--m_count == 0)
+    {
+        free(m_root);
+        m_root = nullptr;
+    }
+    return true;
+}
+
+template <typename T, class Hasher>
+void THashTrieIntInline<T, Hasher>::FreeAll(Node* node, uint32 depth) noexcept
+{
+    if (depth < MAX_HAMT_DEPTH)
+    {
+        uint32 i = 0;
+        for (uint32 bits = node->bitmap; bits != 0; bits &= bits - 1, i++)
+        {
+            if ((node->entryMap & bits & (0 - bits)) == 0)
+                FreeAll(node->slots[i].child, depth + 1);
+        }
+    }
+    free(node);
+}
+
+template <typename T, class Hasher>
+void THashTrieIntInline<T, Hasher>::Clear() noexcept
+{
+    if (m_root != nullptr)
+        FreeAll(m_root, 0);
+    m_root = nullptr;
+    m_count = 0;
+}
+
+template <typename T, class Hasher>
+template <class F>
+void THashTrieIntInline<T, Hasher>::ForEachEntry(Node* node, uint32 depth, F& fn)
+{
+    if (depth >= MAX_HAMT_DEPTH)
+    {
+        for (uint32 i = 0; i < node->bitmap; i++)
+            fn(node->slots[i].entry.key, node->slots[i].entry.value);
+        return;
+    }
+
+    uint32 i = 0;
+    for (uint32 bits = node->bitmap; bits != 0; bits &= bits - 1, i++)
+    {
+        if (node->entryMap & bits & (0 - bits))
+            fn(node->slots[i].entry.key, node->slots[i].entry.value);
+        else
+            ForEachEntry(node->slots[i].child, depth + 1, fn);
+    }
+}
+
+template <typename T, class Hasher>
+void THashTrieIntInline<T, Hasher>::CollectStats(const Node* node, uint32 depth, CHashTrieStats& stats) noexcept
+{
+    const uint32 size = GetSlotCount(node, depth);
+    stats.nodeCount++;
+    stats.nodeBytes += sizeof(Node) + ((size != 0) ? size - 1 : 0) * sizeof(Slot);
+    if (depth >= MAX_HAMT_DEPTH)
+    {
+        // Linear search (collision) bucket. i-th entry takes i more compares to reach.
+        stats.collisionBucketCount++;
+        stats.collisionEntryCount += size;
+        stats.collisionBucketSize[size < CHashTrieStats::MAX_BUCKET_HISTOGRAM ? size : CHashTrieStats::MAX_BUCKET_HISTOGRAM]++;
+
+        stats.leafCount += size;
+        stats.leafDepth[depth + 1] += size;
+        stats.totalProbeLength += (uint64)size * depth + (uint64)size * (size + 1) / 2;
+        if (depth + 1 > stats.maxLeafDepth)
+            stats.maxLeafDepth = depth + 1;
+        return;
+    }
+
+    // Entries are read with the slot that holds them
+    stats.nodePopCount[size]++;
+    uint32 i = 0;
+    for (uint32 bits = node->bitmap; bits != 0; bits &= bits - 1, i++)
+    {
+        if ((node->entryMap & bits & (0 - bits)) == 0)
+        {
+            CollectStats(node->slots[i].child, depth + 1, stats);
+            continue;
+        }
+        stats.leafCount++;
+        stats.leafDepth[depth + 1]++;
+        stats.totalProbeLength += depth + 1;
+        if (depth + 1 > stats.maxLeafDepth)
+            stats.maxLeafDepth = depth + 1;
+    }
+}
+
+template <typename T, class Hasher>
+CHashTrieStats THashTrieIntInline<T, Hasher>::GetStats() const noexcept
+{
+    CHashTrieStats stats;
+    if (m_root != nullptr && m_count != 0)
+    {
+        CollectStats(m_root, 0, stats);
+        stats.averageProbeLength = (double)stats.totalProbeLength / stats.leafCount;
+    }
+    return stats;
+}
+
+#endif // __HASH_TRIE_INLINE_H__
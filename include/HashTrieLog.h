@@ -0,0 +1,410 @@
+/**
+ *      File: HashTrieLog.h
+ *    Author: CS Lim
+ *   Purpose: Write-ahead log and snapshots for THashTrie
+ *   History:
+ *
+ *  Every Put and Remove is appended to a log buffer, and Sync() writes the
+ *  buffer and waits for the disk once for the whole group of changes. When
+ *  the log grows past a limit the trie is written to a snapshot image (see
+ *  HashTrieFile.h) and the log starts over. Recovery loads the snapshot and
+ *  the log tail together: the log is reduced to the last change of each key
+ *  first, so the recovered entries are added in a single bulk AddBatch.
+ */
+
+#ifndef __HASH_TRIE_LOG_H__
+#define __HASH_TRIE_LOG_H__
+
+#include <HashTrieFile.h>
+#include <algorithm>
+#include <string>
+
+//===========================================================================
+//    Log format
+//
+//    CHashTrieLogHeader, then one CHashTrieLogRecord per change, 8 byte
+//    aligned. A record holds the key bytes and, for puts, the value bytes.
+//    Recovery stops at the first record whose checksum does not match,
+//    which is where a crash tore the last group.
+//===========================================================================
+struct CHashTrieLogHeader
+{
+    static constexpr uint32 VERSION = 1;
+
+    char    magic[8];       // HASH_TRIE_LOG_MAGIC
+    uint32  version;
+    uint32  reserved;
+};
+
+static constexpr char HASH_TRIE_LOG_MAGIC[8] = { 'H', 'A', 'M', 'T', 'L', 'O', 'G', 0 };
+
+struct CHashTrieLogRecord
+{
+    enum EOp : uint32 { OP_PUT = 1, OP_REMOVE = 2 };
+
+    uint32          checksum;   // of everything after it
+    uint32          op;
+    CHashTrieRecord record;
+
+    static uint64 GetSize(uint32 keySize, uint32 valueSize) noexcept { return 2 * sizeof(uint32) + CHashTrieRecord::GetSize(keySize, valueSize); }
+    uint64 GetSize() const noexcept { return GetSize(record.keySize, record.valueSize); }
+    uint32 GetChecksum() const noexcept { return MurmurHash3_x86_32(&op, (int)(GetSize() - sizeof(checksum)), 0); }
+};
+
+
+//===========================================================================
+//    THashTrieLog
+//    (Durable THashTrie. The log owns the entries of the trie: replaced and
+//     removed entries are deleted. getValue(const T&) returns the CByteRange
+//     of an entry's value, as for WriteHashTrieImage.)
+//===========================================================================
+template <class T, class K, class GetValue = CNoValue>
+class THashTrieLog
+{
+public:
+    static constexpr uint32 DEFAULT_GROUP_COMMIT_SIZE = 1 << 20;
+    static constexpr uint64 DEFAULT_SNAPSHOT_LOG_SIZE = 64 << 20;
+
+    typedef THashTrie<T, K> Trie;
+
+    explicit THashTrieLog(Trie& trie, GetValue getValue = GetValue()) noexcept
+        : m_trie(trie), m_getValue(getValue) { }
+    ~THashTrieLog() noexcept { Close(); }
+    THashTrieLog(THashTrieLog const&) = delete;
+    THashTrieLog& operator=(THashTrieLog const&) = delete;
+
+    // Recover the empty trie from path + ".snap" and path + ".log" and start
+    // logging. make(CByteRange key, CByteRange value) returns a new'ed T for
+    // the stored bytes. Returns false if the files cannot be read.
+    template <class Make>
+    bool Open(const char path[], Make make);
+    // Sync and stop logging. The trie is left as it is.
+    bool Close() noexcept;
+
+    // Add entry, replacing and deleting the entry with the same key
+    void Put(T* entry);
+    // Remove and delete the entry with key. Returns false if there is none.
+    template <class Q>
+    bool Remove(const Q& key);
+
+    // Write the changes since the last Sync() and wait until they are on
+    // disk, then write a snapshot if the log has grown past the snapshot
+    // size. Put and Remove call it whenever the group commit size of
+    // changes is waiting. Returns false on I/O errors.
+    bool Sync() noexcept;
+    // Write a snapshot of the trie and empty the log
+    bool Snapshot() noexcept;
+
+    void SetGroupCommitSize(uint32 size) noexcept { m_groupCommitSize = size; }
+    void SetSnapshotLogSize(uint64 size) noexcept { m_snapshotLogSize = size; }   // 0 for no automatic snapshots
+    uint64 GetLogSize() const noexcept { return m_logSize + m_buffer.size(); }
+    bool IsOpen() const noexcept { return !m_logPath.empty(); }
+
+private:
+    static int Compare(uint32 hash1, CByteRange key1, const CHashTrieLogRecord* record) noexcept;
+    static bool ReadLog(const CMappedFile& file, std::vector<const CHashTrieLogRecord *>& records, uint64& end) noexcept;
+
+    void Append(uint32 op, uint32 hash, CByteRange key, CByteRange value);
+    bool WriteBuffer() noexcept;
+    bool ResetLog() noexcept;
+
+    Trie&                   m_trie;
+    GetValue                m_getValue;
+    std::string             m_snapshotPath;
+    std::string             m_logPath;
+    CFileWriter             m_writer;
+    std::vector<uint8>      m_buffer;           // Changes not written yet
+    uint64                  m_logSize{ 0 };     // Written to the log file
+    uint32                  m_groupCommitSize{ DEFAULT_GROUP_COMMIT_SIZE };
+    uint64                  m_snapshotLogSize{ DEFAULT_SNAPSHOT_LOG_SIZE };
+};
+
+// Order by hash, then key bytes
+template <class T, class K, class GetValue>
+int THashTrieLog<T, K, GetValue>::Compare(uint32 hash1, CByteRange key1, const CHashTrieLogRecord* record) noexcept
+{
+    const uint32 hash2 = record->record.hash;
+    if (hash1 != hash2)
+        return (hash1 < hash2) ? -1 : 1;
+    const CByteRange key2 = record->record.GetKey();
+    if (key1.size != key2.size)
+        return (key1.size < key2.size) ? -1 : 1;
+    return (key1.size != 0) ? memcmp(key1.data, key2.data, key1.size) : 0;
+}
+
+// Collect the intact records of the log. end is the offset after the last one.
+template <class T, class K, class GetValue>
+bool THashTrieLog<T, K, GetValue>::ReadLog(const CMappedFile& file, std::vector<const CHashTrieLogRecord *>& records, uint64& end) noexcept
+{
+    const CHashTrieLogHeader* header = (const CHashTrieLogHeader *)file.GetData();
+    if (file.GetSize() < sizeof(CHashTrieLogHeader)
+        || memcmp(header->magic, HASH_TRIE_LOG_MAGIC, sizeof(header->magic)) != 0
+        || header->version != CHashTrieLogHeader::VERSION)
+        return false;
+
+    end = sizeof(CHashTrieLogHeader);
+    const uint64 minSize = CHashTrieLogRecord::GetSize(0, 0);
+    while (file.GetSize() - end >= minSize)
+    {
+        const CHashTrieLogRecord* record = (const CHashTrieLogRecord *)(file.GetData() + end);
+        if (file.GetSize() - end < record->GetSize()
+            || (record->op != CHashTrieLogRecord::OP_PUT && record->op != CHashTrieLogRecord::OP_REMOVE)
+            || record->checksum != record->GetChecksum())
+            break;
+        records.push_back(record);
+        end += record->GetSize();
+    }
+    return true;
+}
+
+template <class T, class K, class GetValue>
+template <class Make>
+bool THashTrieLog<T, K, GetValue>::Open(const char path[], Make make)
+{
+    assert(m_trie.GetCount() == 0);
+    Close();
+    const std::string snapshotPath = std::string(path) + ".snap";
+    const std::string logPath = std::string(path) + ".log";
+
+    // An empty file is what a crash during creation leaves behind
+    uint64 fileSize = 0;
+    CHashTrieImage snapshot;
+    if (!snapshot.Open(snapshotPath.c_str()) && GetFileSize(snapshotPath.c_str(), fileSize) && fileSize != 0)
+        return false;
+
+    CMappedFile log;
+    std::vector<const CHashTrieLogRecord *> records;
+    uint64 logEnd = 0;
+    uint64 logSize = 0;
+    if (log.Open(logPath.c_str()))
+    {
+        if (!ReadLog(log, records, logEnd))
+            return false;
+        logSize = log.GetSize();
+    }
+    else if (GetFileSize(logPath.c_str(), fileSize) && fileSize != 0)
+    {
+        return false;
+    }
+
+    // The last change of each key, sorted by hash and key
+    std::stable_sort(records.begin(), records.end(),
+        [](const CHashTrieLogRecord* a, const CHashTrieLogRecord* b) {
+            return Compare(a->record.hash, a->record.GetKey(), b) < 0;
+        });
+    size_t unique = 0;
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        if (i + 1 < records.size() && Compare(records[i]->record.hash, records[i]->record.GetKey(), records[i + 1]) == 0)
+            continue;
+        records[unique++] = records[i];
+    }
+    records.resize(unique);
+
+    // Snapshot entries the log does not change, then the entries the log puts
+    std::vector<T *> entries;
+    entries.reserve(snapshot.GetCount() + unique);
+    try
+    {
+        auto fromSnapshot = [&](const CHashTrieRecord& record) {
+            auto found = std::lower_bound(records.begin(), records.end(), &record,
+                [](const CHashTrieLogRecord* a, const CHashTrieRecord* b) {
+                    return Compare(b->hash, b->GetKey(), a) > 0;
+                });
+            if (found == records.end() || Compare(record.hash, record.GetKey(), *found) != 0)
+                entries.push_back(make(record.GetKey(), record.GetValue()));
+        };
+        snapshot.ForEach(fromSnapshot);
+        for (const CHashTrieLogRecord* record : records)
+        {
+            if (record->op == CHashTrieLogRecord::OP_PUT)
+                entries.push_back(make(record->record.GetKey(), record->record.GetValue()));
+        }
+        m_trie.AddBatch(entries.data(), (uint32)entries.size());
+    }
+    catch (...)
+    {
+        m_trie.Clear();
+        for (T* entry : entries)
+            delete entry;
+        throw;
+    }
+    snapshot.Close();
+    log.Close();
+
+    m_snapshotPath = snapshotPath;
+    m_logPath = logPath;
+    if (logEnd == 0)
+        return ResetLog();
+
+    // Drop a torn group so that new records follow the intact ones
+    if (logEnd != logSize && !TruncateFile(logPath.c_str(), logEnd))
+        return false;
+    m_logSize = logEnd;
+    return m_writer.Open(logPath.c_str(), false);
+}
+
+template <class T, class K, class GetValue>
+bool THashTrieLog<T, K, GetValue>::Close() noexcept
+{
+    if (!IsOpen())
+        return false;
+    bool ok = WriteBuffer();
+    m_writer.Close();
+    m_buffer.clear();
+    m_snapshotPath.clear();
+    m_logPath.clear();
+    m_logSize = 0;
+    return ok;
+}
+
+template <class T, class K, class GetValue>
+void THashTrieLog<T, K, GetValue>::Put(T* entry)
+{
+    assert(IsOpen());
+    T* old = nullptr;
+    m_trie.Compute(static_cast<const K&>(*entry), [&](T* found) { old = found; return entry; });
+
+    // Keys that compare equal may have different bytes, e.g. with
+    // case-insensitive keys. Log the removal of the old bytes then.
+    const CByteRange key = GetKeyBytes(static_cast<const K&>(*entry));
+    if (old != nullptr && old != entry)
+    {
+        const CByteRange oldKey = GetKeyBytes(static_cast<const K&>(*old));
+        if (oldKey.size != key.size || memcmp(oldKey.data, key.data, key.size) != 0)
+            Append(CHashTrieLogRecord::OP_REMOVE, old->GetHash(), oldKey, CByteRange());
+        delete old;
+    }
+    Append(CHashTrieLogRecord::OP_PUT, entry->GetHash(), key, m_getValue(*entry));
+}
+
+template <class T, class K, class GetValue>
+template <class Q>
+bool THashTrieLog<T, K, GetValue>::Remove(const Q& key)
+{
+    assert(IsOpen());
+    T* removed = m_trie.Remove(key);
+    if (removed == nullptr)
+        return false;
+
+    // Logged with the bytes of the removed entry's key
+    try
+    {
+        Append(CHashTrieLogRecord::OP_REMOVE, removed->GetHash(), GetKeyBytes(static_cast<const K&>(*removed)), CByteRange());
+    }
+    catch (...)
+    {
+        delete removed;
+        throw;
+    }
+    delete removed;
+    return true;
+}
+
+template <class T, class K, class GetValue>
+void THashTrieLog<T, K, GetValue>::Append(uint32 op, uint32 hash, CByteRange key, CByteRange value)
+{
+    const size_t offset = m_buffer.size();
+    const uint64 size = CHashTrieLogRecord::GetSize(key.size, value.size);
+    m_buffer.resize(offset + (size_t)size);
+
+    CHashTrieLogRecord* record = (CHashTrieLogRecord *)&m_buffer[offset];
+    record->op               = op;
+    record->record.hash      = hash;
+    record->record.keySize   = key.size;
+    record->record.valueSize = value.size;
+    record->record.reserved  = 0;
+    uint8* data = (uint8 *)(record + 1);
+    if (key.size != 0)
+        memcpy(data, key.data, key.size);
+    if (value.size != 0)
+        memcpy(data + key.size, value.data, value.size);
+    memset(data + key.size + value.size, 0, (size_t)(size - sizeof(CHashTrieLogRecord) - key.size - value.size));
+    record->checksum = record->GetChecksum();
+
+    if (m_buffer.size() >= m_groupCommitSize)
+        Sync();
+}
+
+template <class T, class K, class GetValue>
+bool THashTrieLog<T, K, GetValue>::WriteBuffer() noexcept
+{
+    if (m_buffer.empty())
+        return m_writer.IsOk();
+
+    // After an error the writer is reopened for the retry
+    if (!m_writer.IsOk() && !m_writer.Open(m_logPath.c_str(), false))
+        return false;
+    m_writer.Seek(m_logSize);
+    m_writer.Write(m_buffer.data(), m_buffer.size());
+    if (!m_writer.Sync())
+        return false;
+
+    m_logSize += m_buffer.size();
+    m_buffer.clear();
+    return true;
+}
+
+template <class T, class K, class GetValue>
+bool THashTrieLog<T, K, GetValue>::Sync() noexcept
+{
+    if (!IsOpen() || !WriteBuffer())
+        return false;
+    if (m_snapshotLogSize != 0 && m_logSize >= m_snapshotLogSize)
+        return Snapshot();
+    return true;
+}
+
+template <class T, class K, class GetValue>
+bool THashTrieLog<T, K, GetValue>::Snapshot() noexcept
+{
+    // Write the waiting changes first, so the log holds every change in
+    // the snapshot. Then replace the snapshot and empty the log. A crash in
+    // between replays the whole log onto the snapshot that already has its
+    // changes, which ends in the same state.
+    if (!IsOpen() || !WriteBuffer())
+        return false;
+
+    const std::string temp = m_snapshotPath + ".tmp";
+    try
+    {
+        if (!WriteHashTrieImage(m_trie, temp.c_str(), m_getValue))
+        {
+            remove(temp.c_str());
+            return false;
+        }
+    }
+    catch (...)
+    {
+        remove(temp.c_str());
+        return false;
+    }
+    if (!RenameFile(temp.c_str(), m_snapshotPath.c_str()))
+        return false;
+
+    return ResetLog();
+}
+
+// Start an empty log. It replaces the old one at once, so a crash leaves
+// either log.
+template <class T, class K, class GetValue>
+bool THashTrieLog<T, K, GetValue>::ResetLog() noexcept
+{
+    CHashTrieLogHeader header = {};
+    memcpy(header.magic, HASH_TRIE_LOG_MAGIC, sizeof(header.magic));
+    header.version = CHashTrieLogHeader::VERSION;
+
+    const std::string temp = m_logPath + ".tmp";
+    m_writer.Close();
+    bool written = m_writer.Open(temp.c_str()) && m_writer.Write(&header, sizeof(header)) && m_writer.Sync();
+    if (!m_writer.Close() || !written || !RenameFile(temp.c_str(), m_logPath.c_str()))
+    {
+        remove(temp.c_str());
+        return false;
+    }
+
+    m_logSize = sizeof(header);
+    return m_writer.Open(m_logPath.c_str(), false);
+}
+
+#endif // __HASH_TRIE_LOG_H__
@@ -0,0 +1,663 @@
+/**
+ *      File: HashTrieParallel.h
+ *    Author: CS Lim
+ *   Purpose: Multi-threaded bulk operations on THashTrie
+ *   History:
+ *
+ *  Entries are partitioned by the hash indices of the two top trie levels.
+ *  Each of the 32 * 32 partitions is an independent subtrie at depth 2, so
+ *  threads build them without any synchronization and the root and level 1
+ *  nodes are stitched together at the end. Traversals split the trie the
+ *  same way and hand the subtries out through work-stealing queues, as does
+ *  the parallel teardown.
+ */
+
+#ifndef __HASH_TRIE_PARALLEL_H__
+#define __HASH_TRIE_PARALLEL_H__
+
+#include <HashTrie.h>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <thread>
+#include <vector>
+
+//===========================================================================
+//    Thread helpers
+//===========================================================================
+
+// Number of threads to use when the caller passes 0
+inline uint32 GetDefaultThreadCount() noexcept
+{
+    uint32 count = std::thread::hardware_concurrency();
+    return (count != 0) ? count : 1;
+}
+
+// Call fn(0 .. threadCount-1), each on its own thread. fn(0) runs on the
+// calling thread, as does any index a thread could not be started for.
+// fn must not throw.
+template <class F>
+void RunOnThreads(uint32 threadCount, F& fn) noexcept
+{
+    std::vector<std::thread> threads;
+    uint32 started = 1;
+    try
+    {
+        threads.reserve(threadCount - 1);
+        for (; started < threadCount; started++)
+            threads.emplace_back([&fn, started]() { fn(started); });
+    }
+    catch (...)
+    {
+        // Out of threads or memory: do the rest here
+    }
+
+    fn(0);
+    for (uint32 i = started; i < threadCount; i++)
+        fn(i);
+    for (auto& thread : threads)
+        thread.join();
+}
+
+
+//===========================================================================
+//    TWorkStealingQueues
+//    (A fixed set of tasks dealt out to one queue per thread. A thread pops
+//     tasks from the back of its own queue and, once that runs dry, steals
+//     from the front of the others' so that uneven tasks do not leave
+//     threads idle. Each queue is a [head, tail) range of the task array
+//     packed in one atomic word, so both ends are popped with a CAS.)
+//===========================================================================
+template <class Task>
+class TWorkStealingQueues
+{
+private:
+    struct Queue
+    {
+        std::atomic<uint64> range;  // head | tail << 32
+        char                pad[64 - sizeof(std::atomic<uint64>)];  // One cache line each
+    };
+
+    const Task*                 m_tasks;
+    std::unique_ptr<Queue[]>    m_queues;
+    uint32                      m_queueCount;
+
+    static uint64 MakeRange(uint32 head, uint32 tail) noexcept { return head | ((uint64)tail << 32); }
+
+public:
+    TWorkStealingQueues(const Task tasks[], uint32 taskCount, uint32 queueCount);
+
+    // Take the next task for queue, stealing if it is empty.
+    // Returns false when all queues are empty.
+    bool Pop(uint32 queue, Task& task) noexcept;
+};
+
+template <class Task>
+TWorkStealingQueues<Task>::TWorkStealingQueues(const Task tasks[], uint32 taskCount, uint32 queueCount)
+    : m_tasks(tasks)
+    , m_queues(new Queue[queueCount])
+    , m_queueCount(queueCount)
+{
+    for (uint32 i = 0; i < queueCount; i++)
+    {
+        m_queues[i].range.store(MakeRange(
+            (uint32)((uint64)taskCount * i / queueCount),
+            (uint32)((uint64)taskCount * (i + 1) / queueCount)),
+            std::memory_order_relaxed);
+    }
+}
+
+template <class Task>
+bool TWorkStealingQueues<Task>::Pop(uint32 queue, Task& task) noexcept
+{
+    // Own queue: from the back
+    std::atomic<uint64>& own = m_queues[queue].range;
+    uint64 range = own.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        uint32 head = (uint32)range;
+        uint32 tail = (uint32)(range >> 32);
+        if (head == tail)
+            break;
+        if (own.compare_exchange_weak(range, MakeRange(head, tail - 1), std::memory_order_relaxed))
+        {
+            task = m_tasks[tail - 1];
+            return true;
+        }
+    }
+
+    // Steal from the front of the others, starting with the next one
+    for (uint32 i = 1; i < m_queueCount; i++)
+    {
+        std::atomic<uint64>& other = m_queues[(queue + i) % m_queueCount].range;
+        range = other.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            uint32 head = (uint32)range;
+            uint32 tail = (uint32)(range >> 32);
+            if (head == tail)
+                break;
+            if (other.compare_exchange_weak(range, MakeRange(head + 1, tail), std::memory_order_relaxed))
+            {
+                task = m_tasks[head];
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+
+//===========================================================================
+//    THashTrieParallel
+//===========================================================================
+template <class T, class K>
+class THashTrieSnapshot;
+
+template <class T, class K>
+class THashTrieParallel
+{
+    friend class THashTrieSnapshot<T, K>;
+
+private:
+    typedef THashTrie<T, K>                     Trie;
+    typedef typename Trie::ArrayMappedTrie      ArrayMappedTrie;
+    typedef typename Trie::BatchItem            BatchItem;
+
+    static constexpr uint32 PARTITION_DEPTH     = 2;    // Partitions are subtries at this depth
+    static constexpr uint32 PARTITION_BITS      = PARTITION_DEPTH * Trie::HASH_INDEX_BITS;
+    static constexpr uint32 PARTITION_COUNT     = 1 << PARTITION_BITS;
+    static constexpr uint32 PARTITION_SHIFT     = Trie::MAX_HASH_BITS - PARTITION_BITS; // of the trie order
+    static constexpr uint32 MIN_THREAD_ENTRIES  = 16 * 1024;    // Fewer per thread is not worth the threads
+
+    static uint32 GetPartition(const BatchItem& item) noexcept { return (uint32)(item.order >> PARTITION_SHIFT); }
+
+    static T* Stitch(T* const children[], const uint32 counts[]);
+    static void AttachPartitions(Trie& trie, T* const subtries[], const uint32 counts[], bool destroyEntries);
+
+    // Subtrie under the root and second levels, as handed out to threads
+    struct Subtrie
+    {
+        T*      node;
+        uint32  depth;
+    };
+    static constexpr uint32 MAX_SUBTRIES = PARTITION_COUNT;
+
+    static uint32 SplitTop(T* root, Subtrie subtries[]) noexcept;
+    template <class F>
+    static void RunOnSubtries(const Subtrie subtries[], uint32 count, uint32 threadCount, F& fn);
+
+public:
+    // Add nodes to an empty trie using up to threadCount threads
+    // (0: one per hardware thread). Of the nodes with the same key the last
+    // one is kept, as with AddBatch. A trie that is not empty and small
+    // batches fall back to AddBatch.
+    static void Build(Trie& trie, T* const nodes[], uint32 count, uint32 threadCount = 0);
+
+    // Call fn(T*) for every entry using up to threadCount threads. fn is
+    // called concurrently and must not add or remove entries. If fn throws
+    // the remaining subtries are skipped and the first exception is rethrown.
+    template <class F>
+    static void ForEach(Trie& trie, F& fn, uint32 threadCount = 0);
+
+    // reduce(init, transform(entry), ...) over all entries in no particular
+    // order, so reduce must be associative and commutative.
+    template <class R, class Reduce, class Transform>
+    static R TransformReduce(Trie& trie, R init, Reduce& reduce, Transform& transform, uint32 threadCount = 0);
+
+    // Destroy() / Clear() with the subtries freed on up to threadCount threads
+    static void Destroy(Trie& trie, uint32 threadCount = 0) noexcept { Free(trie, true, threadCount); }
+    static void Clear(Trie& trie, uint32 threadCount = 0) noexcept { Free(trie, false, threadCount); }
+
+private:
+    static void Free(Trie& trie, bool destroyEntries, uint32 threadCount) noexcept;
+};
+
+// Make a node from the HASH_INDEX_MASK + 1 subtries of the next level with
+// counts[i] entries under children[i]. The children are owned by the new
+// node, or left untouched if it throws.
+template <class T, class K>
+T* THashTrieParallel<T, K>::Stitch(T* const children[], const uint32 counts[])
+{
+    uint32 bitmap = 0;
+    uint32 total = 0;
+    for (uint32 i = 0; i <= Trie::HASH_INDEX_MASK; i++)
+    {
+        if (counts[i] != 0)
+        {
+            bitmap |= (uint32)1 << i;
+            total += counts[i];
+        }
+    }
+
+    // A single leaf is not wrapped in an AMT node (see BuildSubtrie)
+    if (total < 2)
+        return (total != 0) ? children[GetLowestBitIndex(bitmap)] : nullptr;
+
+    ArrayMappedTrie* amt = ArrayMappedTrie::Alloc(GetBitCount(bitmap));
+    amt->m_bitmap = bitmap;
+    uint32 slot = 0;
+    for (uint32 bits = bitmap; bits != 0; bits &= bits - 1)
+        amt->m_subHash[slot++] = children[GetLowestBitIndex(bits)];
+    return (T *)((uint_ptr)amt | Trie::AMT_MARK_BIT);
+}
+
+template <class T, class K>
+void THashTrieParallel<T, K>::Build(Trie& trie, T* const nodes[], uint32 count, uint32 threadCount)
+{
+    if (threadCount == 0)
+        threadCount = GetDefaultThreadCount();
+    if (threadCount > count / MIN_THREAD_ENTRIES)
+        threadCount = count / MIN_THREAD_ENTRIES;
+
+    if (trie.m_root != nullptr || threadCount < 2)
+    {
+        trie.AddBatch(nodes, count);
+        return;
+    }
+
+    BatchItem* items = (BatchItem *)malloc(count * sizeof(BatchItem));
+    BatchItem* sorted = (BatchItem *)malloc(count * sizeof(BatchItem));
+    uint32* offsets = (uint32 *)malloc(threadCount * PARTITION_COUNT * sizeof(uint32));
+    T** subtries = (T **)malloc(PARTITION_COUNT * sizeof(T*));
+    uint32* starts = (uint32 *)malloc((PARTITION_COUNT + 1) * sizeof(uint32));
+    uint32* subCounts = (uint32 *)malloc(PARTITION_COUNT * sizeof(uint32));
+    if (items == nullptr || sorted == nullptr || offsets == nullptr || subtries == nullptr || starts == nullptr || subCounts == nullptr)
+    {
+        free(items);
+        free(sorted);
+        free(offsets);
+        free(subtries);
+        free(starts);
+        free(subCounts);
+        trie.AddBatch(nodes, count);
+        return;
+    }
+    memset(offsets, 0, threadCount * PARTITION_COUNT * sizeof(uint32));
+    memset(subtries, 0, PARTITION_COUNT * sizeof(T*));
+    memset(subCounts, 0, PARTITION_COUNT * sizeof(uint32));
+
+    // 1. Hash a contiguous slice per thread and count its entries per partition
+    auto sliceBegin = [count, threadCount](uint32 thread) -> uint32
+    {
+        return (uint32)((uint64)count * thread / threadCount);
+    };
+    auto hashSlice = [&](uint32 thread)
+    {
+        uint32* histogram = offsets + thread * PARTITION_COUNT;
+        const uint32 end = sliceBegin(thread + 1);
+        const K* keys[HASH_BATCH_SIZE];
+        uint32 hashes[HASH_BATCH_SIZE];
+        for (uint32 i = sliceBegin(thread); i < end; i += HASH_BATCH_SIZE)
+        {
+            uint32 n = (end - i < HASH_BATCH_SIZE) ? end - i : HASH_BATCH_SIZE;
+            for (uint32 j = 0; j < n; j++)
+                keys[j] = nodes[i + j];
+
+            THashBatch<K>::GetHashes(keys, n, hashes);
+            for (uint32 j = 0; j < n; j++)
+            {
+                BatchItem& item = items[i + j];
+                item.order = Trie::GetTrieOrder(hashes[j]);
+                item.hash  = hashes[j];
+                item.index = i + j;
+                histogram[GetPartition(item)]++;
+            }
+        }
+    };
+    RunOnThreads(threadCount, hashSlice);
+
+    // 2. Turn the counts into where each thread writes in each partition,
+    //    partition by partition, then scatter. The slices are in index order,
+    //    so every partition stays in index order too.
+    uint32 sum = 0;
+    for (uint32 p = 0; p < PARTITION_COUNT; p++)
+    {
+        starts[p] = sum;
+        for (uint32 thread = 0; thread < threadCount; thread++)
+        {
+            uint32 n = offsets[thread * PARTITION_COUNT + p];
+            offsets[thread * PARTITION_COUNT + p] = sum;
+            sum += n;
+        }
+    }
+    starts[PARTITION_COUNT] = sum;
+
+    auto scatterSlice = [&](uint32 thread)
+    {
+        uint32* cursor = offsets + thread * PARTITION_COUNT;
+        const uint32 end = sliceBegin(thread + 1);
+        for (uint32 i = sliceBegin(thread); i < end; i++)
+            sorted[cursor[GetPartition(items[i])]++] = items[i];
+    };
+    RunOnThreads(threadCount, scatterSlice);
+
+    // 3. Sort and build the partitions, handing them out one at a time
+    std::atomic<uint32> nextPartition(0);
+    std::atomic<bool> failed(false);
+    auto buildPartitions = [&](uint32)
+    {
+        for (;;)
+        {
+            uint32 p = nextPartition.fetch_add(1, std::memory_order_relaxed);
+            if (p >= PARTITION_COUNT || failed.load(std::memory_order_relaxed))
+                break;
+
+            BatchItem* begin = sorted + starts[p];
+            uint32 n = starts[p + 1] - starts[p];
+            std::sort(begin, begin + n);
+            uint32 unique = Trie::DedupeBatch(begin, n, nodes);
+            try
+            {
+                subtries[p] = Trie::BuildSubtrie(begin, unique, nodes, PARTITION_DEPTH, nullptr);
+            }
+            catch (...)
+            {
+                failed = true;
+                break;
+            }
+            subCounts[p] = unique;
+        }
+    };
+    RunOnThreads(threadCount, buildPartitions);
+
+    free(starts);
+    free(sorted);
+    free(offsets);
+    free(items);
+
+    // 4. Stitch level 1 nodes and the root
+    try
+    {
+        if (failed)
+        {
+            for (uint32 p = 0; p < PARTITION_COUNT; p++)
+                ArrayMappedTrie::ClearAll((ArrayMappedTrie *)subtries[p], PARTITION_DEPTH);
+            throw std::bad_alloc();
+        }
+        AttachPartitions(trie, subtries, subCounts, false);
+    }
+    catch (...)
+    {
+        free(subtries);
+        free(subCounts);
+        throw;
+    }
+    free(subtries);
+    free(subCounts);
+}
+
+// Make the PARTITION_COUNT subtries at PARTITION_DEPTH with counts[p] entries
+// the contents of the empty trie. If that throws the subtries are freed, and
+// with destroyEntries their entries too.
+template <class T, class K>
+void THashTrieParallel<T, K>::AttachPartitions(Trie& trie, T* const subtries[], const uint32 counts[], bool destroyEntries)
+{
+    auto freeAll = destroyEntries ? ArrayMappedTrie::DestroyAll : ArrayMappedTrie::ClearAll;
+    T* level1[Trie::HASH_INDEX_MASK + 1] = {};
+    uint32 level1Counts[Trie::HASH_INDEX_MASK + 1] = {};
+    uint32 stitched = 0;
+    try
+    {
+        for (; stitched <= Trie::HASH_INDEX_MASK; stitched++)
+        {
+            const uint32 first = stitched * (Trie::HASH_INDEX_MASK + 1);
+            level1[stitched] = Stitch(subtries + first, counts + first);
+            for (uint32 i = 0; i <= Trie::HASH_INDEX_MASK; i++)
+                level1Counts[stitched] += counts[first + i];
+        }
+        trie.m_root = Stitch(level1, level1Counts);
+    }
+    catch (...)
+    {
+        for (uint32 i = 0; i < stitched; i++)
+            freeAll((ArrayMappedTrie *)level1[i], 1);
+        for (uint32 p = stitched * (Trie::HASH_INDEX_MASK + 1); p < PARTITION_COUNT; p++)
+            freeAll((ArrayMappedTrie *)subtries[p], PARTITION_DEPTH);
+        throw;
+    }
+
+    uint32 total = 0;
+    for (uint32 i = 0; i <= Trie::HASH_INDEX_MASK; i++)
+        total += level1Counts[i];
+    trie.m_count = total;
+}
+
+// Collect the subtries below the root and level 1 nodes (or the nodes
+// themselves where they are leaves). There are at most MAX_SUBTRIES.
+template <class T, class K>
+uint32 THashTrieParallel<T, K>::SplitTop(T* root, Subtrie subtries[]) noexcept
+{
+    if (root == nullptr)
+        return 0;
+
+    uint32 count = 0;
+    if (((uint_ptr)root & Trie::AMT_MARK_BIT) == 0)
+    {
+        subtries[count++] = { root, 0 };
+        return count;
+    }
+
+    // Levels skipped by the nodes move the subtries down. The root skips
+    // at most MAX_SKIP_LEVELS, so it is not a linear search array.
+    const ArrayMappedTrie* amt = (const ArrayMappedTrie *)((uint_ptr)root & ~Trie::AMT_MARK_BIT);
+    const uint32 level = amt->GetSkipLevels();
+    for (uint32 i = 0, n = GetBitCount(amt->m_bitmap); i < n; i++)
+    {
+        T* child = amt->m_subHash[i];
+        if (child == nullptr)
+            continue;   // Empty slot of a dense node
+        if (((uint_ptr)child & Trie::AMT_MARK_BIT) == 0)
+        {
+            subtries[count++] = { child, level + 1 };
+            continue;
+        }
+
+        // Linear search arrays are not split, they can be larger than 32
+        const ArrayMappedTrie* level1 = (const ArrayMappedTrie *)((uint_ptr)child & ~Trie::AMT_MARK_BIT);
+        const uint32 level1Level = level + 1 + level1->GetSkipLevels();
+        if (level1Level >= Trie::MAX_HAMT_DEPTH)
+        {
+            subtries[count++] = { child, level + 1 };
+            continue;
+        }
+
+        for (uint32 j = 0, m = GetBitCount(level1->m_bitmap); j < m; j++)
+        {
+            if (level1->m_subHash[j] != nullptr)
+                subtries[count++] = { level1->m_subHash[j], level1Level + 1 };
+        }
+    }
+    return count;
+}
+
+// Call fn(thread, subtrie) for every subtrie on up to threadCount threads.
+// The first exception thrown by fn stops all threads and is rethrown.
+template <class T, class K>
+template <class F>
+void THashTrieParallel<T, K>::RunOnSubtries(const Subtrie subtries[], uint32 count, uint32 threadCount, F& fn)
+{
+    TWorkStealingQueues<Subtrie> queues(subtries, count, threadCount);
+    std::atomic<bool> failed(false);
+    std::exception_ptr error;
+    auto work = [&](uint32 thread)
+    {
+        try
+        {
+            Subtrie subtrie;
+            while (!failed.load(std::memory_order_relaxed) && queues.Pop(thread, subtrie))
+                fn(thread, subtrie);
+        }
+        catch (...)
+        {
+            if (!failed.exchange(true))
+                error = std::current_exception();
+        }
+    };
+    RunOnThreads(threadCount, work);
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+template <class T, class K>
+template <class F>
+void THashTrieParallel<T, K>::ForEach(Trie& trie, F& fn, uint32 threadCount)
+{
+    Subtrie subtries[MAX_SUBTRIES];
+    uint32 count = SplitTop(trie.m_root, subtries);
+    if (threadCount == 0)
+        threadCount = GetDefaultThreadCount();
+    if (threadCount > count)
+        threadCount = count;
+    if (threadCount < 2)
+    {
+        trie.ForEach([&fn](T* node) { fn(node); });
+        return;
+    }
+
+    auto visit = [&fn](uint32, const Subtrie& subtrie)
+    {
+        ArrayMappedTrie::ForEachLeaf((ArrayMappedTrie *)subtrie.node, subtrie.depth, fn);
+    };
+    RunOnSubtries(subtries, count, threadCount, visit);
+}
+
+template <class T, class K>
+template <class R, class Reduce, class Transform>
+R THashTrieParallel<T, K>::TransformReduce(Trie& trie, R init, Reduce& reduce, Transform& transform, uint32 threadCount)
+{
+    Subtrie subtries[MAX_SUBTRIES];
+    uint32 count = SplitTop(trie.m_root, subtries);
+    if (threadCount == 0)
+        threadCount = GetDefaultThreadCount();
+    if (threadCount > count)
+        threadCount = count;
+    if (threadCount < 2)
+    {
+        trie.ForEach([&](T* node) { init = reduce(init, transform(node)); });
+        return init;
+    }
+
+    // One partial result per subtrie and per thread, each seeded by its first
+    // entry so that init is reduced exactly once
+    std::vector<R> partials(threadCount, init);
+    std::vector<char> seeded(threadCount, 0);
+    auto visit = [&](uint32 thread, const Subtrie& subtrie)
+    {
+        R result = init;
+        bool hasResult = false;
+        auto accumulate = [&](T* node)
+        {
+            if (hasResult)
+                result = reduce(result, transform(node));
+            else
+            {
+                result = transform(node);
+                hasResult = true;
+            }
+        };
+        ArrayMappedTrie::ForEachLeaf((ArrayMappedTrie *)subtrie.node, subtrie.depth, accumulate);
+
+        if (seeded[thread])
+            partials[thread] = reduce(partials[thread], result);
+        else
+        {
+            partials[thread] = result;
+            seeded[thread] = 1;
+        }
+    };
+    RunOnSubtries(subtries, count, threadCount, visit);
+
+    for (uint32 i = 0; i < threadCount; i++)
+    {
+        if (seeded[i])
+            init = reduce(init, partials[i]);
+    }
+    return init;
+}
+
+template <class T, class K>
+void THashTrieParallel<T, K>::Free(Trie& trie, bool destroyEntries, uint32 threadCount) noexcept
+{
+    T* root = trie.m_root;
+    Subtrie subtries[MAX_SUBTRIES];
+    uint32 count = SplitTop(root, subtries);
+    if (threadCount == 0)
+        threadCount = GetDefaultThreadCount();
+    if (threadCount > count)
+        threadCount = count;
+    if (threadCount < 2 || !HasAMTMarkBit((uint_ptr)root))
+    {
+        if (destroyEntries)
+            trie.Destroy();
+        else
+            trie.Clear();
+        return;
+    }
+
+    trie.m_root = nullptr;
+    trie.m_count = 0;
+
+    auto freeSubtrie = [destroyEntries](uint32, const Subtrie& subtrie)
+    {
+        if (destroyEntries)
+            ArrayMappedTrie::DestroyAll((ArrayMappedTrie *)subtrie.node, subtrie.depth);
+        else
+            ArrayMappedTrie::ClearAll((ArrayMappedTrie *)subtrie.node, subtrie.depth);
+    };
+    try
+    {
+        RunOnSubtries(subtries, count, threadCount, freeSubtrie);
+    }
+    catch (...)
+    {
+        // No memory for the queues: free them all here
+        for (uint32 i = 0; i < count; i++)
+            freeSubtrie(0, subtries[i]);
+    }
+
+    // The root and level 1 nodes above the subtries (see SplitTop)
+    ArrayMappedTrie* amt = (ArrayMappedTrie *)((uint_ptr)root & ~Trie::AMT_MARK_BIT);
+    for (uint32 i = 0, n = GetBitCount(amt->m_bitmap); i < n; i++)
+    {
+        if (!HasAMTMarkBit((uint_ptr)amt->m_subHash[i]))
+            continue;
+        ArrayMappedTrie* level1 = (ArrayMappedTrie *)((uint_ptr)amt->m_subHash[i] & ~Trie::AMT_MARK_BIT);
+        if (amt->GetSkipLevels() + 1 + level1->GetSkipLevels() < Trie::MAX_HAMT_DEPTH)
+            free(level1);
+    }
+    free(amt);
+}
+
+template <class T, class K>
+inline void ParallelBuild(THashTrie<T, K>& trie, T* const nodes[], uint32 count, uint32 threadCount = 0)
+{
+    THashTrieParallel<T, K>::Build(trie, nodes, count, threadCount);
+}
+
+template <class T, class K, class F>
+inline void ParallelForEach(THashTrie<T, K>& trie, F fn, uint32 threadCount = 0)
+{
+    THashTrieParallel<T, K>::ForEach(trie, fn, threadCount);
+}
+
+template <class T, class K, class R, class Reduce, class Transform>
+inline R ParallelTransformReduce(THashTrie<T, K>& trie, R init, Reduce reduce, Transform transform, uint32 threadCount = 0)
+{
+    return THashTrieParallel<T, K>::TransformReduce(trie, init, reduce, transform, threadCount);
+}
+
+template <class T, class K>
+inline void ParallelDestroy(THashTrie<T, K>& trie, uint32 threadCount = 0) noexcept
+{
+    THashTrieParallel<T, K>::Destroy(trie, threadCount);
+}
+
+template <class T, class K>
+inline void ParallelClear(THashTrie<T, K>& trie, uint32 threadCount = 0) noexcept
+{
+    THashTrieParallel<T, K>::Clear(trie, threadCount);
+}
+
+#endif // __HASH_TRIE_PARALLEL_H__
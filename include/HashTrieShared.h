@@ -0,0 +1,278 @@
+/**
+ *      File: HashTrieShared.h
+ *    Author: CS Lim
+ *   Purpose: HAMT in shared memory: one writer process, lock-free readers
+ *   History:
+ *
+ *  Records and nodes use the image encoding (see HashTrieFile.h), so slots
+ *  are offsets from the start of the segment and each process can map it at
+ *  any address. The writer updates copy-on-write as CHashTrieStore does and
+ *  Publish() makes the new root visible with a single atomic store. Readers
+ *  never wait: each one announces the root sequence it is reading, and the
+ *  writer reuses the blocks of an old version only once no reader can still
+ *  be reading it.
+ */
+
+#ifndef __HASH_TRIE_SHARED_H__
+#define __HASH_TRIE_SHARED_H__
+
+#include <HashTrieStore.h>
+#include <atomic>
+#include <unordered_map>
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+    "Atomics in shared memory must be lock-free.");
+
+//===========================================================================
+//    CSharedMemory
+//    (Named shared memory segment mapped for reading and writing)
+//===========================================================================
+class CSharedMemory
+{
+public:
+    CSharedMemory() noexcept = default;
+    ~CSharedMemory() noexcept { Close(); }
+    CSharedMemory(CSharedMemory const&) = delete;
+    CSharedMemory& operator=(CSharedMemory const&) = delete;
+
+    // Create a zero filled segment of size bytes, replacing a segment of
+    // the same name. Processes that mapped the old one keep it.
+    bool Create(const char name[], uint64 size) noexcept;
+    bool Open(const char name[]) noexcept;
+    void Close() noexcept;
+    // Remove the name. The segment is freed when the last process unmaps it.
+    static void Remove(const char name[]) noexcept;
+
+    uint8* GetData() const noexcept { return m_data; }
+    uint64 GetSize() const noexcept { return m_size; }
+
+private:
+    uint8*  m_data{ nullptr };
+    uint64  m_size{ 0 };
+#if _MSC_VER
+    void*   m_mapping{ nullptr };
+#endif
+};
+
+// Id of the calling process, and whether the process with the id still runs
+uint32 GetProcessId() noexcept;
+bool IsProcessAlive(uint32 id) noexcept;
+
+
+//===========================================================================
+//    Segment format
+//
+//    CHashTrieSharedHeader, padded to HASH_TRIE_SHARED_DATA_OFFSET, then
+//    records, nodes and CHashTrieSharedRoot blocks. current is the offset
+//    of the root block published last. A reader stores the sequence number
+//    it is about to read in its slot before loading current.
+//===========================================================================
+struct CHashTrieSharedRoot
+{
+    uint64  sequence;
+    uint64  root;           // slot
+    uint32  count;          // of records
+    uint32  reserved;
+};
+
+struct CHashTrieSharedReaderSlot
+{
+    std::atomic<uint32> owner;      // Process id, 0 if the slot is free
+    uint32              reserved;
+    std::atomic<uint64> sequence;   // Root sequence being read, 0 if none
+};
+
+struct CHashTrieSharedHeader
+{
+    static constexpr uint32 VERSION     = 1;
+    static constexpr uint32 MAX_READERS = 64;
+
+    char                        magic[8];   // HASH_TRIE_SHARED_MAGIC
+    uint32                      version;
+    std::atomic<uint32>         writer;     // Process id, 0 if there is no writer
+    uint64                      size;       // of the segment
+    uint64                      used;       // Bytes handed out by the writer
+    std::atomic<uint64>         sequence;   // of the current root
+    std::atomic<uint64>         current;    // Offset of the current CHashTrieSharedRoot
+    CHashTrieSharedReaderSlot   readers[MAX_READERS];
+};
+
+static constexpr char HASH_TRIE_SHARED_MAGIC[8] = { 'H', 'A', 'M', 'T', 'S', 'H', 'M', 0 };
+static constexpr uint64 HASH_TRIE_SHARED_DATA_OFFSET = (sizeof(CHashTrieSharedHeader) + 63) & ~(uint64)63;
+
+
+//===========================================================================
+//    CHashTrieSharedWriter
+//    (Keys are any key type with GetHash and KeyBytesEqual, as for
+//     CHashTrieStore. The segment does not grow: Put and Remove throw
+//     std::bad_alloc, with the trie unchanged, when it may be too full.
+//     The check counts only the never used end of the segment, not the
+//     freed blocks waiting for reuse, so it can throw while enough of
+//     those are free. Size the segment for the live data plus a margin.)
+//===========================================================================
+class CHashTrieSharedWriter : public THashTrieCopyOnWrite<CHashTrieSharedWriter>
+{
+    typedef THashTrieCopyOnWrite<CHashTrieSharedWriter> Base;
+
+public:
+    CHashTrieSharedWriter() noexcept = default;
+    ~CHashTrieSharedWriter() noexcept { Close(); }
+    CHashTrieSharedWriter(CHashTrieSharedWriter const&) = delete;
+    CHashTrieSharedWriter& operator=(CHashTrieSharedWriter const&) = delete;
+
+    // Create an empty trie in a new segment of size bytes
+    bool Create(const char name[], uint64 size);
+    // Become the writer of an existing segment. Fails while another live
+    // process is its writer. Blocks freed by an earlier writer are not reused.
+    bool Open(const char name[]);
+    // Unpublished changes are dropped
+    void Close() noexcept;
+
+    // Find, ForEach and GetCount see unpublished changes, as for CHashTrieStore
+    template <class Q>
+    bool Put(const Q& key, CByteRange value)
+    {
+        CheckRoom(CHashTrieRecord::GetSize(GetKeyBytes(key).size, value.size), key.GetHash());
+        return Base::Put(key, value);
+    }
+    template <class Q>
+    bool Remove(const Q& key)
+    {
+        CheckRoom(0, key.GetHash());
+        return Base::Remove(key);
+    }
+
+    // Make the changes visible to readers, then reuse the blocks no reader
+    // can still see
+    void Publish();
+
+    uint64 GetSize() const noexcept { return m_header->size; }
+    // Bytes in use or waiting to be reused
+    uint64 GetUsedSize() const noexcept { return m_header->used - m_freeBytes; }
+    bool IsOpen() const noexcept { return m_header != nullptr; }
+
+private:
+    friend class THashTrieCopyOnWrite<CHashTrieSharedWriter>;
+
+    struct Retired
+    {
+        uint64  sequence;   // of the first root without the block
+        uint64  offset;
+        uint64  size;
+    };
+
+    // Free blocks up to this size are kept in m_freeBySize
+    static constexpr uint64 MAX_SMALL_BLOCK_SIZE = 4096;
+    // Publishes between checks of all reader slots for processes that are gone
+    static constexpr uint32 READER_SWEEP_INTERVAL = 64;
+    // Room for the path copied by an update, not counting a collision
+    // bucket at the end of it (which has no size limit)
+    static constexpr uint64 MAX_UPDATE_SIZE = (CHashTrieImageNode::MAX_DEPTH + 1) * ((CHashTrieImageNode::HASH_INDEX_MASK + 3) * sizeof(uint64))
+                                            + sizeof(CHashTrieSharedRoot);
+
+    const void* At(uint64 offset) const noexcept { return m_data + offset; }
+    // Blocks appended since the last Publish() are past m_publishedUsed or reused
+    bool IsPending(uint64 offset) const noexcept
+    {
+        const uint64 index = offset / sizeof(uint64);
+        return offset >= m_publishedUsed || (m_reusedBits[(size_t)(index / 64)] >> (index % 64)) & 1;
+    }
+    void SetReused(uint64 offset, bool reused) noexcept
+    {
+        const uint64 index = offset / sizeof(uint64);
+        if (reused)
+            m_reusedBits[(size_t)(index / 64)] |= (uint64)1 << (index % 64);
+        else
+            m_reusedBits[(size_t)(index / 64)] &= ~((uint64)1 << (index % 64));
+    }
+    std::vector<uint64>& GetFreeList(uint64 size);
+    uint64 Append(uint64 size);
+    void Discard(uint64 slot);
+    void Free(uint64 offset, uint64 size);
+    void CheckRoom(uint64 size, uint32 hash) const;
+    uint64 GetOldestReader() noexcept;
+
+    CSharedMemory                                   m_memory;
+    CHashTrieSharedHeader*                          m_header{ nullptr };
+    uint8*                                          m_data{ nullptr };
+    uint64                                          m_current{ 0 };     // Offset of the published root block
+
+    uint64                                          m_publishedUsed{ 0 };
+    std::vector<uint64>                             m_reused;           // Free blocks reused since the last Publish()
+    std::vector<uint64>                             m_reusedBits;       // Bit per 8 bytes of the segment, set for m_reused
+    std::vector<Retired>                            m_discarded;        // Published blocks replaced since then
+    std::vector<Retired>                            m_retired;          // In sequence order
+    size_t                                          m_retiredStart{ 0 };
+    std::vector<std::vector<uint64>>                m_freeBySize;       // Offsets of free blocks, indexed by size / 8
+    std::unordered_map<uint64, std::vector<uint64>> m_free;             // Offsets of larger free blocks by size
+    uint64                                          m_freeBytes{ 0 };
+    uint32                                          m_oldestReaderCalls{ 0 };
+};
+
+
+//===========================================================================
+//    CHashTrieSharedReader
+//    (Lock-free lookups in a segment created by CHashTrieSharedWriter)
+//===========================================================================
+class CHashTrieSharedReader
+{
+public:
+    CHashTrieSharedReader() noexcept = default;
+    ~CHashTrieSharedReader() noexcept { Close(); }
+    CHashTrieSharedReader(CHashTrieSharedReader const&) = delete;
+    CHashTrieSharedReader& operator=(CHashTrieSharedReader const&) = delete;
+
+    // Map the segment and take a reader slot. Returns false if there is no
+    // such segment or all reader slots are in use.
+    bool Open(const char name[]) noexcept;
+    void Close() noexcept;
+
+    // Record with the key in the published trie, or nullptr. The record is
+    // valid until the next call on this reader.
+    template <class Q>
+    const CHashTrieRecord* Find(const Q& key) noexcept
+    {
+        return FindHashTrieRecord(Enter()->root, key, Resolver{ m_data });
+    }
+
+    // Call fn(const CHashTrieRecord&) for every record of the published trie
+    template <class F>
+    void ForEach(F fn)
+    {
+        ForEachHashTrieRecord(Enter()->root, Resolver{ m_data }, fn);
+        Release();
+    }
+
+    uint32 GetCount() noexcept
+    {
+        uint32 count = Enter()->count;
+        Release();
+        return count;
+    }
+
+    // Let the writer reuse the blocks seen so far. Readers that are idle for
+    // long should call this. (A reader process that exits without Close()
+    // holds blocks back until the process is gone.)
+    void Release() noexcept { m_header->readers[m_slot].sequence.store(0); }
+
+private:
+    struct Resolver
+    {
+        const uint8* data;
+        const void* operator()(uint64 offset) const noexcept { return data + offset; }
+    };
+
+    // Announce the current root and return it
+    const CHashTrieSharedRoot* Enter() noexcept
+    {
+        m_header->readers[m_slot].sequence.store(m_header->sequence.load());
+        return (const CHashTrieSharedRoot *)(m_data + m_header->current.load());
+    }
+
+    CSharedMemory           m_memory;
+    CHashTrieSharedHeader*  m_header{ nullptr };
+    const uint8*            m_data{ nullptr };
+    uint32                  m_slot{ 0 };
+};
+
+#endif // __HASH_TRIE_SHARED_H__
@@ -0,0 +1,334 @@
+/**
+ *      File: HashTrieSnapshot.h
+ *    Author: CS Lim
+ *   Purpose: Snapshot files of THashTrie that load in parallel
+ *   History:
+ *
+ *  The records of a snapshot are grouped into chunks by the hash indices of
+ *  the two top trie levels, the partitions of THashTrieParallel. Loading
+ *  gives each thread a contiguous run of chunks that it reads sequentially
+ *  and turns into the independent subtries of those partitions, which are
+ *  attached under a new root at the end.
+ */
+
+#ifndef __HASH_TRIE_SNAPSHOT_H__
+#define __HASH_TRIE_SNAPSHOT_H__
+
+#include <HashTrieFile.h>
+#include <HashTrieParallel.h>
+
+//===========================================================================
+//    Snapshot format
+//
+//    CHashTrieSnapshotHeader, CHUNK_COUNT CHashTrieSnapshotChunk entries and
+//    then the records of each chunk in chunk order, in the image record
+//    format. The checksum of a chunk chains MurmurHash3 over its records.
+//===========================================================================
+struct CHashTrieSnapshotHeader
+{
+    static constexpr uint32 VERSION = 1;
+    static constexpr uint32 CHUNK_COUNT = 1024;
+
+    char    magic[8];       // HASH_TRIE_SNAPSHOT_MAGIC
+    uint32  version;
+    uint32  count;          // of entries
+    uint32  chunkCount;     // CHUNK_COUNT
+    uint32  reserved;
+    uint64  size;           // of the file
+};
+
+struct CHashTrieSnapshotChunk
+{
+    uint64  offset;         // of the first record. The chunk ends where the next begins.
+    uint32  count;          // of records
+    uint32  checksum;
+};
+
+static constexpr char HASH_TRIE_SNAPSHOT_MAGIC[8] = { 'H', 'A', 'M', 'T', 'S', 'N', 'P', 0 };
+static constexpr uint64 HASH_TRIE_SNAPSHOT_DATA_OFFSET = sizeof(CHashTrieSnapshotHeader)
+    + CHashTrieSnapshotHeader::CHUNK_COUNT * sizeof(CHashTrieSnapshotChunk);
+
+
+//===========================================================================
+//    THashTrieSnapshot
+//===========================================================================
+template <class T, class K>
+class THashTrieSnapshot
+{
+private:
+    typedef THashTrie<T, K>                     Trie;
+    typedef THashTrieParallel<T, K>             Parallel;
+    typedef typename Trie::ArrayMappedTrie      ArrayMappedTrie;
+    typedef typename Trie::BatchItem            BatchItem;
+
+    static constexpr uint32 CHUNK_COUNT = CHashTrieSnapshotHeader::CHUNK_COUNT;
+    static_assert(CHUNK_COUNT == Parallel::PARTITION_COUNT, "Chunks must be the partitions of THashTrieParallel.");
+
+    static uint32 GetChunk(uint32 hash) noexcept { return (uint32)(Trie::GetTrieOrder(hash) >> Parallel::PARTITION_SHIFT); }
+
+    static bool ReadHeader(const char path[], CHashTrieSnapshotHeader& header, CHashTrieSnapshotChunk chunks[]) noexcept;
+    template <class Make>
+    static bool LoadChunk(const uint8 data[], uint64 size, const CHashTrieSnapshotChunk& chunk, uint32 index, uint32 first,
+        Make& make, T* nodes[], std::vector<BatchItem>& items);
+
+public:
+    // Write the entries of trie to a snapshot file at path and wait until it
+    // is on disk. getValue(const T&) returns the CByteRange of an entry's
+    // value. Returns false on I/O errors.
+    template <class GetValue>
+    static bool Write(Trie& trie, const char path[], GetValue getValue);
+
+    // Load a snapshot into the empty trie using up to threadCount threads
+    // (0: one per hardware thread). make(CByteRange key, CByteRange value)
+    // returns a new'ed T for the stored bytes and is called concurrently; it
+    // must hash keys as the writer did. Returns false if the file cannot be
+    // read or is damaged. If make throws, the entries made so far are
+    // deleted and the first exception is rethrown.
+    template <class Make>
+    static bool Load(Trie& trie, const char path[], Make& make, uint32 threadCount = 0);
+};
+
+template <class T, class K>
+template <class GetValue>
+bool THashTrieSnapshot<T, K>::Write(Trie& trie, const char path[], GetValue getValue)
+{
+    CFileWriter file;
+    if (!file.Open(path))
+        return false;
+
+    CHashTrieSnapshotHeader header = {};
+    std::vector<CHashTrieSnapshotChunk> chunks((uint32)CHUNK_COUNT, CHashTrieSnapshotChunk());
+    file.WriteZeros((size_t)HASH_TRIE_SNAPSHOT_DATA_OFFSET);
+
+    // Entries come in trie order, so chunk by chunk
+    std::vector<uint8> record;
+    uint32 next = 0;
+    trie.ForEach([&](T* entry) {
+        const uint32 hash = entry->GetHash();
+        const uint32 chunk = GetChunk(hash);
+        assert(chunk + 1 >= next);
+        while (next <= chunk)
+            chunks[next++].offset = file.GetOffset();
+
+        const CByteRange key = GetKeyBytes(static_cast<const K&>(*entry));
+        const CByteRange value = getValue(*entry);
+        record.assign((size_t)CHashTrieRecord::GetSize(key.size, value.size), 0);
+        CHashTrieRecord* head = (CHashTrieRecord *)record.data();
+        head->hash      = hash;
+        head->keySize   = key.size;
+        head->valueSize = value.size;
+        if (key.size != 0)
+            memcpy(head + 1, key.data, key.size);
+        if (value.size != 0)
+            memcpy((uint8 *)(head + 1) + key.size, value.data, value.size);
+
+        chunks[chunk].count++;
+        chunks[chunk].checksum = MurmurHash3_x86_32(record.data(), (int)record.size(), chunks[chunk].checksum);
+        file.Write(record.data(), record.size());
+    });
+    while (next < CHUNK_COUNT)
+        chunks[next++].offset = file.GetOffset();
+
+    memcpy(header.magic, HASH_TRIE_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version    = CHashTrieSnapshotHeader::VERSION;
+    header.count      = trie.GetCount();
+    header.chunkCount = CHUNK_COUNT;
+    header.size       = file.GetOffset();
+    file.Seek(0);
+    file.Write(&header, sizeof(header));
+    file.Write(chunks.data(), chunks.size() * sizeof(CHashTrieSnapshotChunk));
+    bool synced = file.Sync();
+    return file.Close() && synced;
+}
+
+template <class T, class K>
+bool THashTrieSnapshot<T, K>::ReadHeader(const char path[], CHashTrieSnapshotHeader& header, CHashTrieSnapshotChunk chunks[]) noexcept
+{
+    uint64 fileSize;
+    CFileReader file;
+    if (!GetFileSize(path, fileSize)
+        || fileSize < HASH_TRIE_SNAPSHOT_DATA_OFFSET
+        || !file.Open(path)
+        || !file.Read(&header, sizeof(header))
+        || memcmp(header.magic, HASH_TRIE_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0
+        || header.version != CHashTrieSnapshotHeader::VERSION
+        || header.chunkCount != CHUNK_COUNT
+        || header.size != fileSize
+        || !file.Read(chunks, CHUNK_COUNT * sizeof(CHashTrieSnapshotChunk)))
+        return false;
+
+    // Chunks in order, and room for their records
+    if (chunks[0].offset != HASH_TRIE_SNAPSHOT_DATA_OFFSET)
+        return false;
+    uint64 count = 0;
+    for (uint32 i = 0; i < CHUNK_COUNT; i++)
+    {
+        const uint64 end = (i + 1 < CHUNK_COUNT) ? chunks[i + 1].offset : header.size;
+        if (end < chunks[i].offset || end > header.size
+            || (end - chunks[i].offset) / sizeof(CHashTrieRecord) < chunks[i].count)
+            return false;
+        count += chunks[i].count;
+    }
+    return count == header.count;
+}
+
+// Make the entries of chunk index from its records in data, as nodes[first ..]
+// and their items in trie order. Returns false if the records are damaged.
+template <class T, class K>
+template <class Make>
+bool THashTrieSnapshot<T, K>::LoadChunk(const uint8 data[], uint64 size, const CHashTrieSnapshotChunk& chunk, uint32 index, uint32 first,
+    Make& make, T* nodes[], std::vector<BatchItem>& items)
+{
+    uint32 checksum = 0;
+    uint64 offset = 0;
+    for (uint32 i = 0; i < chunk.count; i++)
+    {
+        const CHashTrieRecord* record = (const CHashTrieRecord *)(data + offset);
+        if (size - offset < sizeof(CHashTrieRecord))
+            return false;
+        const uint64 recordSize = CHashTrieRecord::GetSize(record->keySize, record->valueSize);
+        if (size - offset < recordSize || GetChunk(record->hash) != index)
+            return false;
+        checksum = MurmurHash3_x86_32(record, (int)recordSize, checksum);
+        offset += recordSize;
+    }
+    if (offset != size || checksum != chunk.checksum)
+        return false;
+
+    items.resize(chunk.count);
+    offset = 0;
+    for (uint32 i = 0; i < chunk.count; i++)
+    {
+        const CHashTrieRecord* record = (const CHashTrieRecord *)(data + offset);
+        T* node = make(record->GetKey(), record->GetValue());
+        nodes[first + i] = node;
+        assert(node->GetHash() == record->hash);
+
+        BatchItem& item = items[i];
+        item.order = Trie::GetTrieOrder(record->hash);
+        item.hash  = record->hash;
+        item.index = first + i;
+        offset += CHashTrieRecord::GetSize(record->keySize, record->valueSize);
+    }
+    std::sort(items.begin(), items.end());
+    return true;
+}
+
+template <class T, class K>
+template <class Make>
+bool THashTrieSnapshot<T, K>::Load(Trie& trie, const char path[], Make& make, uint32 threadCount)
+{
+    assert(trie.m_root == nullptr);
+    CHashTrieSnapshotHeader header;
+    std::vector<CHashTrieSnapshotChunk> chunks(CHUNK_COUNT + 1);
+    if (!ReadHeader(path, header, chunks.data()))
+        return false;
+    chunks[CHUNK_COUNT].offset = header.size;
+
+    if (threadCount == 0)
+        threadCount = GetDefaultThreadCount();
+    if (threadCount > header.count / Parallel::MIN_THREAD_ENTRIES)
+        threadCount = header.count / Parallel::MIN_THREAD_ENTRIES;
+    if (threadCount == 0)
+        threadCount = 1;
+
+    std::vector<T *> nodes(header.count, nullptr);
+    std::vector<T *> subtries((uint32)CHUNK_COUNT, nullptr);
+    std::vector<uint32> counts((uint32)CHUNK_COUNT, 0);
+    std::vector<uint32> firsts((uint32)CHUNK_COUNT, 0);
+    for (uint32 i = 1; i < CHUNK_COUNT; i++)
+        firsts[i] = firsts[i - 1] + chunks[i - 1].count;
+
+    // Contiguous runs of chunks with about the same number of bytes, so each
+    // thread reads one sequential range of the file
+    std::vector<uint32> runs(threadCount + 1, (uint32)CHUNK_COUNT);
+    const uint64 dataSize = header.size - HASH_TRIE_SNAPSHOT_DATA_OFFSET;
+    for (uint32 thread = 0, chunk = 0; thread < threadCount; thread++)
+    {
+        const uint64 start = HASH_TRIE_SNAPSHOT_DATA_OFFSET + dataSize * thread / threadCount;
+        while (chunk < CHUNK_COUNT && chunks[chunk].offset < start)
+            chunk++;
+        runs[thread] = (thread == 0) ? 0 : chunk;
+    }
+
+    std::atomic<bool> failed(false);
+    std::atomic<bool> damaged(false);
+    std::exception_ptr error;
+    auto loadRun = [&](uint32 thread)
+    {
+        try
+        {
+            CFileReader file;
+            if (!file.Open(path) || !file.Seek(chunks[runs[thread]].offset))
+            {
+                damaged = true;
+                failed = true;
+                return;
+            }
+
+            std::vector<uint8> data;
+            std::vector<BatchItem> items;
+            for (uint32 chunk = runs[thread]; chunk < runs[thread + 1] && !failed.load(std::memory_order_relaxed); chunk++)
+            {
+                const uint64 size = chunks[chunk + 1].offset - chunks[chunk].offset;
+                data.resize((size_t)size);
+                if (!file.Read(data.data(), (size_t)size)
+                    || !LoadChunk(data.data(), size, chunks[chunk], chunk, firsts[chunk], make, nodes.data(), items))
+                {
+                    damaged = true;
+                    failed = true;
+                    return;
+                }
+                subtries[chunk] = Trie::BuildSubtrie(items.data(), chunks[chunk].count, nodes.data(), Parallel::PARTITION_DEPTH, nullptr);
+                counts[chunk] = chunks[chunk].count;
+            }
+        }
+        catch (...)
+        {
+            if (!failed.exchange(true))
+                error = std::current_exception();
+        }
+    };
+    RunOnThreads(threadCount, loadRun);
+
+    if (!failed)
+    {
+        Parallel::AttachPartitions(trie, subtries.data(), counts.data(), true);
+        return true;
+    }
+
+    // Entries of the built subtries go with them, the others one by one
+    for (uint32 chunk = 0; chunk < CHUNK_COUNT; chunk++)
+    {
+        if (counts[chunk] != 0)
+        {
+            ArrayMappedTrie::DestroyAll((ArrayMappedTrie *)subtries[chunk], Parallel::PARTITION_DEPTH);
+            continue;
+        }
+        for (uint32 i = 0; i < chunks[chunk].count; i++)
+            delete nodes[firsts[chunk] + i];
+    }
+    if (error && !damaged)
+        std::rethrow_exception(error);
+    return false;
+}
+
+template <class T, class K, class GetValue>
+inline bool WriteHashTrieSnapshot(THashTrie<T, K>& trie, const char path[], GetValue getValue)
+{
+    return THashTrieSnapshot<T, K>::Write(trie, path, getValue);
+}
+
+template <class T, class K>
+inline bool WriteHashTrieSnapshot(THashTrie<T, K>& trie, const char path[])
+{
+    return THashTrieSnapshot<T, K>::Write(trie, path, CNoValue());
+}
+
+template <class T, class K, class Make>
+inline bool LoadHashTrieSnapshot(THashTrie<T, K>& trie, const char path[], Make make, uint32 threadCount = 0)
+{
+    return THashTrieSnapshot<T, K>::Load(trie, path, make, threadCount);
+}
+
+#endif // __HASH_TRIE_SNAPSHOT_H__
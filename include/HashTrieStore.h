@@ -0,0 +1,453 @@
+/**
+ *      File: HashTrieStore.h
+ *    Author: CS Lim
+ *   Purpose: Crash-consistent file-backed HAMT key/value store
+ *   History:
+ *
+ *  Records and nodes use the image encoding (see HashTrieFile.h) and are
+ *  never changed once committed. An update copies the path from the changed
+ *  record up to the root into an append-only region, and Commit() makes the
+ *  new root current by writing it to the header after the appended data is
+ *  on disk. Compact() rewrites the file with the live records and nodes only.
+ */
+
+#ifndef __HASH_TRIE_STORE_H__
+#define __HASH_TRIE_STORE_H__
+
+#include <HashTrieFile.h>
+#include <string>
+
+//===========================================================================
+//    Store format
+//
+//    CHashTrieStoreHeader, padded to HASH_TRIE_STORE_DATA_OFFSET, then the
+//    records and nodes of all committed versions. Of the two root slots in
+//    the header Commit() always writes the one not in use, so a torn write
+//    leaves the other intact. Open() uses the valid slot with the highest
+//    sequence number.
+//===========================================================================
+struct CHashTrieStoreRoot
+{
+    uint64  sequence;
+    uint64  root;           // slot
+    uint64  size;           // of the committed data, including the header
+    uint64  deadBytes;      // of records and nodes no longer in use
+    uint32  count;          // of records
+    uint32  checksum;       // of the fields above
+
+    uint32 GetChecksum() const noexcept { return MurmurHash3_x86_32(this, (int)offsetof(CHashTrieStoreRoot, checksum), 0); }
+};
+
+struct CHashTrieStoreHeader
+{
+    static constexpr uint32 VERSION = 1;
+
+    char                magic[8];   // HASH_TRIE_STORE_MAGIC
+    uint32              version;
+    uint32              reserved;
+    CHashTrieStoreRoot  roots[2];
+};
+
+static constexpr char HASH_TRIE_STORE_MAGIC[8] = { 'H', 'A', 'M', 'T', 'K', 'V', 'S', 0 };
+static constexpr uint64 HASH_TRIE_STORE_DATA_OFFSET = 128;
+static_assert(sizeof(CHashTrieStoreHeader) <= HASH_TRIE_STORE_DATA_OFFSET, "Store header is too large.");
+
+
+//===========================================================================
+//    THashTrieCopyOnWrite
+//    (Copy-on-write updates of image encoded tries. Derived provides the
+//     storage:
+//       const void* At(uint64 offset) const      address of a record or node
+//       uint64 Append(uint64 size)               new block (a multiple of 8)
+//       bool IsPending(uint64 offset) const      appended since the root was
+//                                                last made visible
+//       void Discard(uint64 slot)                record or node no longer in use
+//     Pending nodes are not seen by readers yet and are changed in place.)
+//===========================================================================
+template <class Derived>
+class THashTrieCopyOnWrite
+{
+public:
+    // Record with the key or nullptr. The record is valid until the next change.
+    template <class Q>
+    const CHashTrieRecord* Find(const Q& key) const noexcept
+    {
+        return FindHashTrieRecord(m_root, key, Resolver{ This() });
+    }
+
+    // Add key with value or replace the value. Returns true if key was added.
+    template <class Q>
+    bool Put(const Q& key, CByteRange value);
+
+    // Returns true if key was removed
+    template <class Q>
+    bool Remove(const Q& key);
+
+    // Call fn(const CHashTrieRecord&) for every record
+    template <class F>
+    void ForEach(F fn) const
+    {
+        ForEachHashTrieRecord(m_root, Resolver{ This() }, fn);
+    }
+
+    uint32 GetCount() const noexcept { return m_count; }
+
+protected:
+    static constexpr uint32 MAX_DEPTH = CHashTrieImageNode::MAX_DEPTH;
+
+    struct Resolver
+    {
+        const Derived* store;
+        const void* operator()(uint64 offset) const noexcept { return store->At(offset); }
+    };
+
+    Derived* This() noexcept { return static_cast<Derived *>(this); }
+    const Derived* This() const noexcept { return static_cast<const Derived *>(this); }
+
+    const CHashTrieRecord* GetRecord(uint64 slot) const noexcept { return (const CHashTrieRecord *)This()->At(slot); }
+    const CHashTrieImageNode* GetNode(uint64 slot) const noexcept { return (const CHashTrieImageNode *)This()->At(slot & ~HASH_TRIE_IMAGE_NODE_BIT); }
+    CHashTrieImageNode* GetPendingNode(uint64 slot) noexcept { return const_cast<CHashTrieImageNode *>(GetNode(slot)); }
+    // Size of the record or node at slot
+    uint64 GetSlotSize(uint64 slot) const noexcept
+    {
+        return (slot & HASH_TRIE_IMAGE_NODE_BIT)
+            ? CHashTrieImageNode::GetSize(GetNode(slot)->count)
+            : CHashTrieRecord::GetSize(GetRecord(slot)->keySize, GetRecord(slot)->valueSize);
+    }
+
+    uint64 AppendRecord(uint32 hash, CByteRange key, CByteRange value);
+    uint64 AppendNode(uint32 bitmap, uint32 count);
+    uint64 MakeNode2(uint64 slot1, uint32 hash1, uint64 slot2, uint32 hash2, uint32 depth);
+    uint64 ReplaceSlot(uint64 slot, uint32 pos, uint64 child);
+    uint64 InsertSlot(uint64 slot, uint32 pos, uint64 child, uint32 bitmap);
+    uint64 RemoveSlot(uint64 slot, uint32 pos, uint32 bitmap);
+
+    template <class Q>
+    uint64 PutAt(uint64 slot, uint32 depth, uint32 hash, const Q& key, uint64 record, bool& added);
+    template <class Q>
+    uint64 RemoveAt(uint64 slot, uint32 depth, uint32 hash, const Q& key, bool& removed);
+
+    uint64                  m_root{ 0 };
+    uint32                  m_count{ 0 };
+};
+
+template <class Derived>
+template <class Q>
+bool THashTrieCopyOnWrite<Derived>::Put(const Q& key, CByteRange value)
+{
+    const uint32 hash = key.GetHash();
+    uint64 record = AppendRecord(hash, GetKeyBytes(key), value);
+    bool added = false;
+    m_root = PutAt(m_root, 0, hash, key, record, added);
+    if (added)
+        m_count++;
+    return added;
+}
+
+template <class Derived>
+template <class Q>
+bool THashTrieCopyOnWrite<Derived>::Remove(const Q& key)
+{
+    bool removed = false;
+    m_root = RemoveAt(m_root, 0, key.GetHash(), key, removed);
+    if (removed)
+        m_count--;
+    return removed;
+}
+
+template <class Derived>
+uint64 THashTrieCopyOnWrite<Derived>::AppendRecord(uint32 hash, CByteRange key, CByteRange value)
+{
+    uint64 offset = This()->Append(CHashTrieRecord::GetSize(key.size, value.size));
+    CHashTrieRecord* record = const_cast<CHashTrieRecord *>(GetRecord(offset));
+    record->hash      = hash;
+    record->keySize   = key.size;
+    record->valueSize = value.size;
+    record->reserved  = 0;
+    if (key.size != 0)
+        memcpy(record + 1, key.data, key.size);
+    if (value.size != 0)
+        memcpy((uint8 *)(record + 1) + key.size, value.data, value.size);
+    return offset;
+}
+
+// New node with count slots to fill in. Returns its slot.
+template <class Derived>
+uint64 THashTrieCopyOnWrite<Derived>::AppendNode(uint32 bitmap, uint32 count)
+{
+    uint64 slot = This()->Append(CHashTrieImageNode::GetSize(count)) | HASH_TRIE_IMAGE_NODE_BIT;
+    CHashTrieImageNode* node = GetPendingNode(slot);
+    node->bitmap = bitmap;
+    node->count = count;
+    return slot;
+}
+
+// Node for two records (or subtries) whose hashes agree up to depth
+template <class Derived>
+uint64 THashTrieCopyOnWrite<Derived>::MakeNode2(uint64 slot1, uint32 hash1, uint64 slot2, uint32 hash2, uint32 depth)
+{
+    if (depth >= MAX_DEPTH)
+    {
+        // Consumed all hash bits. Collision bucket.
+        uint64 node = AppendNode(2, 2);
+        GetPendingNode(node)->slots[0] = slot1;
+        GetPendingNode(node)->slots[1] = slot2;
+        return node;
+    }
+
+    uint32 index1 = CHashTrieImageNode::GetHashIndex(hash1, depth);
+    uint32 index2 = CHashTrieImageNode::GetHashIndex(hash2, depth);
+    if (index1 == index2)
+    {
+        uint64 child = MakeNode2(slot1, hash1, slot2, hash2, depth + 1);
+        uint64 node = AppendNode((uint32)1 << index1, 1);
+        GetPendingNode(node)->slots[0] = child;
+        return node;
+    }
+
+    uint64 node = AppendNode(((uint32)1 << index1) | ((uint32)1 << index2), 2);
+    GetPendingNode(node)->slots[index1 > index2] = slot1;
+    GetPendingNode(node)->slots[index1 < index2] = slot2;
+    return node;
+}
+
+// The node at slot with slots[pos] = child. Pending nodes are changed in place.
+template <class Derived>
+uint64 THashTrieCopyOnWrite<Derived>::ReplaceSlot(uint64 slot, uint32 pos, uint64 child)
+{
+    if (This()->IsPending(slot & ~HASH_TRIE_IMAGE_NODE_BIT))
+    {
+        GetPendingNode(slot)->slots[pos] = child;
+        return slot;
+    }
+
+    const uint32 count = GetNode(slot)->count;
+    uint64 copy = AppendNode(GetNode(slot)->bitmap, count);
+    memcpy(GetPendingNode(copy)->slots, GetNode(slot)->slots, count * sizeof(uint64));
+    GetPendingNode(copy)->slots[pos] = child;
+    This()->Discard(slot);
+    return copy;
+}
+
+// Copy of the node at slot with child inserted at pos
+template <class Derived>
+uint64 THashTrieCopyOnWrite<Derived>::InsertSlot(uint64 slot, uint32 pos, uint64 child, uint32 bitmap)
+{
+    const uint32 count = GetNode(slot)->count;
+    uint64 copy = AppendNode(bitmap, count + 1);
+    const uint64* src = GetNode(slot)->slots;
+    uint64* dst = GetPendingNode(copy)->slots;
+    memcpy(dst, src, pos * sizeof(uint64));
+    dst[pos] = child;
+    memcpy(dst + pos + 1, src + pos, (count - pos) * sizeof(uint64));
+    This()->Discard(slot);
+    return copy;
+}
+
+// Copy of the node at slot without slots[pos]
+template <class Derived>
+uint64 THashTrieCopyOnWrite<Derived>::RemoveSlot(uint64 slot, uint32 pos, uint32 bitmap)
+{
+    const uint32 count = GetNode(slot)->count;
+    uint64 copy = AppendNode(bitmap, count - 1);
+    const uint64* src = GetNode(slot)->slots;
+    uint64* dst = GetPendingNode(copy)->slots;
+    memcpy(dst, src, pos * sizeof(uint64));
+    memcpy(dst + pos, src + pos + 1, (count - pos - 1) * sizeof(uint64));
+    This()->Discard(slot);
+    return copy;
+}
+
+// Returns the new slot for slot with record put below it. Node pointers are
+// not kept across appends, which may move the storage.
+template <class Derived>
+template <class Q>
+uint64 THashTrieCopyOnWrite<Derived>::PutAt(uint64 slot, uint32 depth, uint32 hash, const Q& key, uint64 record, bool& added)
+{
+    if (slot == 0)
+    {
+        added = true;
+        return record;
+    }
+
+    if ((slot & HASH_TRIE_IMAGE_NODE_BIT) == 0)
+    {
+        const CHashTrieRecord* old = GetRecord(slot);
+        if (old->hash == hash && KeyBytesEqual(key, old->GetKey()))
+        {
+            This()->Discard(slot);
+            return record;
+        }
+        added = true;
+        return MakeNode2(slot, old->hash, record, hash, depth);
+    }
+
+    const CHashTrieImageNode* node = GetNode(slot);
+    const uint32 bitmap = node->bitmap;
+    if (depth >= MAX_DEPTH)
+    {
+        // Collision bucket
+        for (uint32 i = 0; i < node->count; i++)
+        {
+            const CHashTrieRecord* old = GetRecord(node->slots[i]);
+            if (old->hash == hash && KeyBytesEqual(key, old->GetKey()))
+            {
+                This()->Discard(node->slots[i]);
+                return ReplaceSlot(slot, i, record);
+            }
+        }
+        added = true;
+        return InsertSlot(slot, node->count, record, bitmap + 1);
+    }
+
+    const uint32 bit = (uint32)1 << CHashTrieImageNode::GetHashIndex(hash, depth);
+    const uint32 pos = GetBitCount(bitmap & (bit - 1));
+    if ((bitmap & bit) == 0)
+    {
+        added = true;
+        return InsertSlot(slot, pos, record, bitmap | bit);
+    }
+
+    uint64 child = PutAt(node->slots[pos], depth + 1, hash, key, record, added);
+    return ReplaceSlot(slot, pos, child);
+}
+
+// Returns the new slot for slot with key removed below it
+template <class Derived>
+template <class Q>
+uint64 THashTrieCopyOnWrite<Derived>::RemoveAt(uint64 slot, uint32 depth, uint32 hash, const Q& key, bool& removed)
+{
+    if (slot == 0)
+        return 0;
+
+    if ((slot & HASH_TRIE_IMAGE_NODE_BIT) == 0)
+    {
+        const CHashTrieRecord* old = GetRecord(slot);
+        if (old->hash != hash || !KeyBytesEqual(key, old->GetKey()))
+            return slot;
+        removed = true;
+        This()->Discard(slot);
+        return 0;
+    }
+
+    const CHashTrieImageNode* node = GetNode(slot);
+    const uint32 bitmap = node->bitmap;
+    const uint32 count = node->count;
+    uint32 pos;
+    uint64 child;
+    if (depth >= MAX_DEPTH)
+    {
+        // Collision bucket
+        for (pos = 0; pos < count; pos++)
+        {
+            const CHashTrieRecord* old = GetRecord(node->slots[pos]);
+            if (old->hash == hash && KeyBytesEqual(key, old->GetKey()))
+                break;
+        }
+        if (pos == count)
+            return slot;
+        removed = true;
+        This()->Discard(node->slots[pos]);
+        child = 0;
+    }
+    else
+    {
+        const uint32 bit = (uint32)1 << CHashTrieImageNode::GetHashIndex(hash, depth);
+        if ((bitmap & bit) == 0)
+            return slot;
+        pos = GetBitCount(bitmap & (bit - 1));
+        child = RemoveAt(node->slots[pos], depth + 1, hash, key, removed);
+        if (!removed)
+            return slot;
+        node = GetNode(slot);
+    }
+
+    if (child != 0)
+    {
+        // A single record left below folds up into this node's parent
+        if (count == 1 && (child & HASH_TRIE_IMAGE_NODE_BIT) == 0)
+        {
+            This()->Discard(slot);
+            return child;
+        }
+        return ReplaceSlot(slot, pos, child);
+    }
+
+    if (count == 1)
+    {
+        This()->Discard(slot);
+        return 0;
+    }
+    if (count == 2 && (node->slots[1 - pos] & HASH_TRIE_IMAGE_NODE_BIT) == 0)
+    {
+        uint64 other = node->slots[1 - pos];
+        This()->Discard(slot);
+        return other;
+    }
+    return RemoveSlot(slot, pos, (depth >= MAX_DEPTH) ? bitmap - 1 : bitmap & ~((uint32)1 << CHashTrieImageNode::GetHashIndex(hash, depth)));
+}
+
+
+//===========================================================================
+//    CHashTrieStore
+//    (Keys are any key type with GetHash and KeyBytesEqual, as for
+//     CHashTrieImage. Use the same key type for a store throughout.)
+//===========================================================================
+class CHashTrieStore : public THashTrieCopyOnWrite<CHashTrieStore>
+{
+public:
+    CHashTrieStore() noexcept = default;
+    ~CHashTrieStore() noexcept { Close(); }
+    CHashTrieStore(CHashTrieStore const&) = delete;
+    CHashTrieStore& operator=(CHashTrieStore const&) = delete;
+
+    // Open the store at path, creating it if there is no file (or an empty
+    // one). Returns false if the file cannot be opened or is not a store.
+    bool Open(const char path[]);
+    // Uncommitted changes are dropped
+    void Close() noexcept;
+
+    // Find, Put, Remove, ForEach and GetCount as for THashTrieCopyOnWrite
+
+    // Make all changes durable. Returns false on I/O errors; the changes are
+    // kept and Commit() can be retried.
+    bool Commit() noexcept;
+    // Drop all changes since the last commit
+    void Rollback() noexcept;
+
+    // Commit, then rewrite the file with only the live records and nodes
+    bool Compact();
+
+    uint64 GetSize() const noexcept { return m_committedSize + m_pending.size() * sizeof(uint64); }
+    uint64 GetDeadBytes() const noexcept { return m_deadBytes; }
+    bool IsOpen() const noexcept { return m_file.GetData() != nullptr; }
+
+private:
+    friend class THashTrieCopyOnWrite<CHashTrieStore>;
+
+    // Committed offsets are in the mapped file, later ones in m_pending
+    bool IsPending(uint64 offset) const noexcept { return offset >= m_committedSize; }
+    const void* At(uint64 offset) const noexcept
+    {
+        return IsPending(offset)
+            ? (const void *)((const uint8 *)m_pending.data() + (offset - m_committedSize))
+            : (const void *)(m_file.GetData() + offset);
+    }
+    uint64 Append(uint64 size);
+    void Discard(uint64 slot) noexcept { m_deadBytes += GetSlotSize(slot); }
+
+    bool Create() noexcept;
+    bool WriteRoot(CFileWriter& file, const CHashTrieStoreRoot& root) noexcept;
+    uint64 CopyLive(CFileWriter& file, uint64 slot);
+
+    std::string             m_path;
+    CMappedFile             m_file;
+    CFileWriter             m_writer;
+    std::vector<uint64>     m_pending;          // Records and nodes appended since the last commit
+
+    uint64                  m_deadBytes{ 0 };
+    CHashTrieStoreRoot      m_committed{};      // Last committed root
+    uint64                  m_committedSize{ 0 };
+};
+
+#endif // __HASH_TRIE_STORE_H__
@@ -0,0 +1,964 @@
+/**
+ *      File: HashFunc.cpp
+ *    Author: CS Lim
+ *   Purpose: Optional hash functions for THashTrie hash policies
+ *            (wyhash, xxHash, CRC32C, AES-NI) and runtime CPU dispatch
+ *
+ */
+
+#include <stdint.h>
+#include <atomic>
+#include <HashTrie.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+    #define HAMT_X86 1
+#else
+    #define HAMT_X86 0
+#endif
+
+#if defined(_M_X64) || defined(__x86_64__)
+    #define HAMT_X64 1
+#else
+    #define HAMT_X64 0
+#endif
+
+// SSE2 is part of the x64 baseline
+#if HAMT_X64 || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define HAMT_SSE2 1
+#else
+    #define HAMT_SSE2 0
+#endif
+
+#if HAMT_X86
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+    #else
+        #include <cpuid.h>
+    #endif
+    #include <nmmintrin.h>  // SSE4.2
+    #include <wmmintrin.h>  // AES-NI
+    #include <immintrin.h>  // AVX2, AVX-512
+#endif
+
+// Functions using instructions that are selected at runtime must be
+// compiled for the target ISA on GCC/Clang. MSVC accepts intrinsics anywhere.
+#if defined(_MSC_VER)
+    #define HAMT_TARGET(isa)
+#else
+    #define HAMT_TARGET(isa)    __attribute__((target(isa)))
+#endif
+
+static inline uint64 Read64(const uint8* p) noexcept
+{
+    uint64 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32 Read32(const uint8* p) noexcept
+{
+    uint32 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64 Rotl64(uint64 x, int r) noexcept
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+
+//===========================================================================
+// CPU feature detection
+//===========================================================================
+
+#if HAMT_X86
+
+static void CpuId(uint32 leaf, uint32 regs[4]) noexcept
+{
+    regs[0] = regs[1] = regs[2] = regs[3] = 0;
+#if defined(_MSC_VER)
+    __cpuidex((int *)regs, (int)leaf, 0);
+#else
+    if (leaf <= __get_cpuid_max(0, nullptr))
+        __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Register state enabled by the OS (XCR0)
+static uint64 GetXcr0() noexcept
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    uint32 eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64)edx << 32) | eax;
+#endif
+}
+
+#endif // HAMT_X86
+
+static uint32 DetectCpuFeatures() noexcept
+{
+    uint32 features = 0;
+#if HAMT_X86
+    uint32 regs[4];  // eax, ebx, ecx, edx
+    CpuId(1, regs);
+    if (regs[2] & (1 << 20))
+        features |= CPU_FEATURE_SSE42;
+    if (regs[2] & (1 << 25))
+        features |= CPU_FEATURE_AES;
+
+    // AVX needs OSXSAVE and the OS saving YMM (and ZMM for AVX-512) state
+    const bool osxsave = (regs[2] & (1 << 27)) != 0;
+    const uint64 xcr0 = osxsave ? GetXcr0() : 0;
+    CpuId(7, regs);
+    if ((regs[1] & (1 << 5)) && (xcr0 & 0x06) == 0x06)
+        features |= CPU_FEATURE_AVX2;
+    if ((regs[1] & (1 << 16)) && (xcr0 & 0xE6) == 0xE6)
+        features |= CPU_FEATURE_AVX512;
+#endif
+    return features;
+}
+
+uint32 GetCpuFeatures() noexcept
+{
+    static const uint32 s_features = DetectCpuFeatures();
+    return s_features;
+}
+
+
+//===========================================================================
+// START of wyhash code
+//===========================================================================
+
+// wyhash is released into the public domain (The Unlicense)
+// https://github.com/wangyi-fudan/wyhash
+
+static const uint64 s_wyp[4] =
+{
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+};
+
+static inline uint64 WyMix(uint64 a, uint64 b) noexcept
+{
+    Mul128(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64 WyRead3(const uint8* p, size_t k) noexcept
+{
+    return (((uint64)p[0]) << 16) | (((uint64)p[k >> 1]) << 8) | p[k - 1];
+}
+
+uint64 WyHash64(const void* key, size_t len, uint64 seed) noexcept
+{
+    const uint8* p = (const uint8 *)key;
+    seed ^= WyMix(seed ^ s_wyp[0], s_wyp[1]);
+
+    uint64 a, b;
+    if (len <= 16)
+    {
+        if (len >= 4)
+        {
+            a = ((uint64)Read32(p) << 32) | Read32(p + ((len >> 3) << 2));
+            b = ((uint64)Read32(p + len - 4) << 32) | Read32(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if (len > 0)
+        {
+            a = WyRead3(p, len);
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        size_t i = len;
+        if (i >= 48)
+        {
+            uint64 see1 = seed, see2 = seed;
+            do
+            {
+                seed = WyMix(Read64(p) ^ s_wyp[1], Read64(p + 8) ^ seed);
+                see1 = WyMix(Read64(p + 16) ^ s_wyp[2], Read64(p + 24) ^ see1);
+                see2 = WyMix(Read64(p + 32) ^ s_wyp[3], Read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i >= 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16)
+        {
+            seed = WyMix(Read64(p) ^ s_wyp[1], Read64(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = Read64(p + i - 16);
+        b = Read64(p + i - 8);
+    }
+
+    a ^= s_wyp[1];
+    b ^= seed;
+    Mul128(&a, &b);
+    return WyMix(a ^ s_wyp[0] ^ len, b ^ s_wyp[1]);
+}
+
+//===========================================================================
+// END of wyhash code
+//===========================================================================
+
+
+//===========================================================================
+// START of xxHash code
+//===========================================================================
+
+// xxHash is under BSD 2-Clause license
+// https://github.com/Cyan4973/xxHash
+
+static const uint64 XXH_PRIME64_1 = 0x9E3779B185EBCA87ull;
+static const uint64 XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4Full;
+static const uint64 XXH_PRIME64_3 = 0x165667B19E3779F9ull;
+static const uint64 XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ull;
+static const uint64 XXH_PRIME64_5 = 0x27D4EB2F165667C5ull;
+
+static inline uint64 XXH64Round(uint64 acc, uint64 input) noexcept
+{
+    acc += input * XXH_PRIME64_2;
+    acc = Rotl64(acc, 31);
+    acc *= XXH_PRIME64_1;
+    return acc;
+}
+
+static inline uint64 XXH64MergeRound(uint64 acc, uint64 val) noexcept
+{
+    val = XXH64Round(0, val);
+    acc ^= val;
+    acc = acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+    return acc;
+}
+
+uint64 XXHash64(const void* key, size_t len, uint64 seed) noexcept
+{
+    const uint8* p = (const uint8 *)key;
+    const uint8* const end = p + len;
+    uint64 h64;
+
+    if (len >= 32)
+    {
+        const uint8* const limit = end - 32;
+        uint64 v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64 v2 = seed + XXH_PRIME64_2;
+        uint64 v3 = seed + 0;
+        uint64 v4 = seed - XXH_PRIME64_1;
+
+        do
+        {
+            v1 = XXH64Round(v1, Read64(p));      p += 8;
+            v2 = XXH64Round(v2, Read64(p));      p += 8;
+            v3 = XXH64Round(v3, Read64(p));      p += 8;
+            v4 = XXH64Round(v4, Read64(p));      p += 8;
+        } while (p <= limit);
+
+        h64 = Rotl64(v1, 1) + Rotl64(v2, 7) + Rotl64(v3, 12) + Rotl64(v4, 18);
+        h64 = XXH64MergeRound(h64, v1);
+        h64 = XXH64MergeRound(h64, v2);
+        h64 = XXH64MergeRound(h64, v3);
+        h64 = XXH64MergeRound(h64, v4);
+    }
+    else
+    {
+        h64 = seed + XXH_PRIME64_5;
+    }
+
+    h64 += (uint64)len;
+
+    for (; p + 8 <= end; p += 8)
+    {
+        h64 ^= XXH64Round(0, Read64(p));
+        h64 = Rotl64(h64, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+
+    if (p + 4 <= end)
+    {
+        h64 ^= (uint64)Read32(p) * XXH_PRIME64_1;
+        h64 = Rotl64(h64, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+
+    for (; p < end; p++)
+    {
+        h64 ^= (*p) * XXH_PRIME64_5;
+        h64 = Rotl64(h64, 11) * XXH_PRIME64_1;
+    }
+
+    h64 ^= h64 >> 33;
+    h64 *= XXH_PRIME64_2;
+    h64 ^= h64 >> 29;
+    h64 *= XXH_PRIME64_3;
+    h64 ^= h64 >> 32;
+    return h64;
+}
+
+//===========================================================================
+// END of xxHash code
+//===========================================================================
+
+
+//===========================================================================
+// START of CRC32C code
+//===========================================================================
+
+// Castagnoli polynomial (reversed)
+static const uint32 CRC32C_POLY = 0x82F63B78;
+
+struct CCrc32cTable
+{
+    uint32 table[256];
+
+    CCrc32cTable() noexcept
+    {
+        for (uint32 i = 0; i < 256; i++)
+        {
+            uint32 crc = i;
+            for (int j = 0; j < 8; j++)
+                crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+            table[i] = crc;
+        }
+    }
+};
+
+static uint32 Crc32cSoftware(const void* key, size_t len, uint32 crc) noexcept
+{
+    static const CCrc32cTable s_table;
+    const uint8* p = (const uint8 *)key;
+    for (size_t i = 0; i < len; i++)
+        crc = s_table.table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#if HAMT_X86
+
+HAMT_TARGET("sse4.2")
+static uint32 Crc32cHardware(const void* key, size_t len, uint32 crc) noexcept
+{
+    const uint8* p = (const uint8 *)key;
+#if HAMT_X64
+    uint64 crc64 = crc;
+    for (; len >= 8; len -= 8, p += 8)
+        crc64 = _mm_crc32_u64(crc64, Read64(p));
+    crc = (uint32)crc64;
+#endif
+    for (; len >= 4; len -= 4, p += 4)
+        crc = _mm_crc32_u32(crc, Read32(p));
+    for (; len > 0; len--, p++)
+        crc = _mm_crc32_u8(crc, *p);
+    return crc;
+}
+
+#endif // HAMT_X86
+
+typedef uint32 (*Crc32cFunc)(const void* key, size_t len, uint32 crc);
+
+static uint32 Crc32cResolve(const void* key, size_t len, uint32 crc) noexcept;
+static std::atomic<Crc32cFunc> s_crc32c(Crc32cResolve);
+
+// First call picks the implementation for this CPU and replaces itself
+static uint32 Crc32cResolve(const void* key, size_t len, uint32 crc) noexcept
+{
+    Crc32cFunc func = Crc32cSoftware;
+#if HAMT_X86
+    if (GetCpuFeatures() & CPU_FEATURE_SSE42)
+        func = Crc32cHardware;
+#endif
+    s_crc32c.store(func, std::memory_order_relaxed);
+    return func(key, len, crc);
+}
+
+uint32 Crc32c(const void* key, size_t len, uint32 crc) noexcept
+{
+    return s_crc32c.load(std::memory_order_relaxed)(key, len, crc);
+}
+
+uint32 Crc32c(uint32 key, uint32 crc) noexcept
+{
+    return s_crc32c.load(std::memory_order_relaxed)(&key, sizeof(key), crc);
+}
+
+uint32 Crc32c(uint64 key, uint32 crc) noexcept
+{
+    return s_crc32c.load(std::memory_order_relaxed)(&key, sizeof(key), crc);
+}
+
+//===========================================================================
+// END of CRC32C code
+//===========================================================================
+
+
+//===========================================================================
+// START of AES-NI hash code
+//===========================================================================
+
+// Two independent AES lanes consume 32 bytes per iteration. Every block
+// goes through one AES round keyed with the running state, and the result
+// is finished with three more rounds so every input bit affects every
+// output bit.
+
+#if HAMT_X64
+
+HAMT_TARGET("aes,sse4.1")
+static uint64 AesHashHardware(const void* key, size_t len, uint64 seed) noexcept
+{
+    const uint8* p = (const uint8 *)key;
+    const __m128i k0 = _mm_set_epi64x((int64)s_wyp[0], (int64)s_wyp[1]);
+    const __m128i k1 = _mm_set_epi64x((int64)s_wyp[2], (int64)s_wyp[3]);
+
+    __m128i s0 = _mm_xor_si128(_mm_set_epi64x((int64)len, (int64)seed), k0);
+    __m128i s1 = _mm_xor_si128(_mm_set_epi64x((int64)seed, (int64)len), k1);
+
+    // Short keys: single lane
+    if (len <= 16)
+    {
+        uint8 block[16] = { 0 };
+        memcpy(block, p, len);
+        __m128i h = _mm_aesenc_si128(_mm_xor_si128(s0, _mm_loadu_si128((const __m128i *)block)), k0);
+        h = _mm_aesenc_si128(h, s1);
+        h = _mm_aesenc_si128(h, k0);
+        return (uint64)_mm_extract_epi64(h, 0) ^ (uint64)_mm_extract_epi64(h, 1);
+    }
+
+    size_t i = len;
+    for (; i >= 32; i -= 32, p += 32)
+    {
+        __m128i b0 = _mm_loadu_si128((const __m128i *)p);
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(p + 16));
+        s0 = _mm_aesenc_si128(_mm_xor_si128(s0, b0), k0);
+        s1 = _mm_aesenc_si128(_mm_xor_si128(s1, b1), k1);
+    }
+
+    if (i > 0)
+    {
+        // Tail: last (up to) 32 bytes, zero padded
+        uint8 tail[32] = { 0 };
+        memcpy(tail, p, i);
+        __m128i b0 = _mm_loadu_si128((const __m128i *)tail);
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(tail + 16));
+        s0 = _mm_aesenc_si128(_mm_xor_si128(s0, b0), k0);
+        s1 = _mm_aesenc_si128(_mm_xor_si128(s1, b1), k1);
+    }
+
+    __m128i h = _mm_aesenc_si128(s0, s1);
+    h = _mm_aesenc_si128(h, k1);
+    h = _mm_aesenc_si128(h, k0);
+    return (uint64)_mm_extract_epi64(h, 0) ^ (uint64)_mm_extract_epi64(h, 1);
+}
+
+#endif // HAMT_X64
+
+typedef uint64 (*AesHashFunc)(const void* key, size_t len, uint64 seed);
+
+static uint64 AesHashResolve(const void* key, size_t len, uint64 seed) noexcept;
+static std::atomic<AesHashFunc> s_aesHash(AesHashResolve);
+
+static uint64 AesHashResolve(const void* key, size_t len, uint64 seed) noexcept
+{
+    AesHashFunc func = WyHash64;
+#if HAMT_X64
+    if ((GetCpuFeatures() & (CPU_FEATURE_AES | CPU_FEATURE_SSE42)) == (CPU_FEATURE_AES | CPU_FEATURE_SSE42))
+        func = AesHashHardware;
+#endif
+    s_aesHash.store(func, std::memory_order_relaxed);
+    return func(key, len, seed);
+}
+
+uint64 AesHash64(const void* key, size_t len, uint64 seed) noexcept
+{
+    return s_aesHash.load(std::memory_order_relaxed)(key, len, seed);
+}
+
+//===========================================================================
+// END of AES-NI hash code
+//===========================================================================
+
+
+//===========================================================================
+// START of batch hash code
+//===========================================================================
+
+// All lanes run the same scalar algorithm as CHasherDefault and
+// MurmurHash3_x86_32, so batch results are bit-identical to one-by-one
+// hashing. Lanes beyond count are padded and their results discarded.
+
+static void WangHashBatchScalar(const uint32 keys[], uint32 hashes[], size_t count) noexcept
+{
+    for (size_t i = 0; i < count; i++)
+        hashes[i] = CHasherDefault::Hash(keys[i]);
+}
+
+static void WangHashBatchScalar(const uint64 keys[], uint32 hashes[], size_t count) noexcept
+{
+    for (size_t i = 0; i < count; i++)
+        hashes[i] = CHasherDefault::Hash(keys[i]);
+}
+
+static void MurmurHash3_x86_32_BatchScalar(
+    const void* const   keys[],
+    const int           lens[],
+    const uint32        seeds[],
+    uint32              hashes[],
+    size_t              count) noexcept
+{
+    for (size_t i = 0; i < count; i++)
+        hashes[i] = MurmurHash3_x86_32(keys[i], lens[i], seeds[i]);
+}
+
+#if HAMT_X64
+
+static const uint8 s_zeroKey[4] = { 0 };
+
+// Read the tail bytes of a MurmurHash3 key (len & 3) in the scalar code order
+static inline uint32 MurmurTail(const uint8* data, int len) noexcept
+{
+    const uint8* tail = data + (len & ~3);
+    uint32 k1 = 0;
+    switch (len & 3)
+    {
+        case 3: k1 ^= tail[2] << 16;
+        case 2: k1 ^= tail[1] << 8;
+        case 1: k1 ^= tail[0];
+    }
+    return k1;
+}
+
+//
+// AVX2: 8 x 32 bit lanes
+//
+
+HAMT_TARGET("avx2")
+static inline __m256i Rotl32x8(__m256i x, int r) noexcept
+{
+    return _mm256_or_si256(_mm256_slli_epi32(x, r), _mm256_srli_epi32(x, 32 - r));
+}
+
+HAMT_TARGET("avx2")
+static void WangHashBatchAvx2(const uint32 keys[], uint32 hashes[], size_t count) noexcept
+{
+    const __m256i ones = _mm256_set1_epi32(-1);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i k = _mm256_loadu_si256((const __m256i *)(keys + i));
+        k = _mm256_add_epi32(_mm256_xor_si256(k, ones), _mm256_slli_epi32(k, 15));
+        k = _mm256_xor_si256(k, _mm256_srli_epi32(k, 12));
+        k = _mm256_add_epi32(k, _mm256_slli_epi32(k, 2));
+        k = _mm256_xor_si256(k, _mm256_srli_epi32(k, 4));
+        k = _mm256_mullo_epi32(k, _mm256_set1_epi32(2057));
+        k = _mm256_xor_si256(k, _mm256_srli_epi32(k, 16));
+        _mm256_storeu_si256((__m256i *)(hashes + i), k);
+    }
+    WangHashBatchScalar(keys + i, hashes + i, count - i);
+}
+
+HAMT_TARGET("avx2")
+static void WangHashBatchAvx2(const uint64 keys[], uint32 hashes[], size_t count) noexcept
+{
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    const __m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256i k = _mm256_loadu_si256((const __m256i *)(keys + i));
+        k = _mm256_add_epi64(_mm256_xor_si256(k, ones), _mm256_slli_epi64(k, 18));
+        k = _mm256_xor_si256(k, _mm256_srli_epi64(k, 31));
+        k = _mm256_add_epi64(_mm256_add_epi64(k, _mm256_slli_epi64(k, 2)), _mm256_slli_epi64(k, 4)); // k * 21
+        k = _mm256_xor_si256(k, _mm256_srli_epi64(k, 11));
+        k = _mm256_add_epi64(k, _mm256_slli_epi64(k, 6));
+        k = _mm256_xor_si256(k, _mm256_srli_epi64(k, 22));
+
+        // Keep the low 32 bits of every lane
+        k = _mm256_permutevar8x32_epi32(k, pack);
+        _mm_storeu_si128((__m128i *)(hashes + i), _mm256_castsi256_si128(k));
+    }
+    WangHashBatchScalar(keys + i, hashes + i, count - i);
+}
+
+HAMT_TARGET("avx2")
+static void MurmurHash3_x86_32_BatchAvx2(
+    const void* const   keys[],
+    const int           lens[],
+    const uint32        seeds[],
+    uint32              hashes[],
+    size_t              count) noexcept
+{
+    const __m256i c1 = _mm256_set1_epi32((int)0xcc9e2d51);
+    const __m256i c2 = _mm256_set1_epi32((int)0x1b873593);
+
+    for (size_t base = 0; base < count; base += 8)
+    {
+        const size_t lanes = (count - base < 8) ? count - base : 8;
+
+        const uint8* data[8];
+        alignas(32) int32  len[8];
+        alignas(32) uint32 seed[8];
+        alignas(32) uint32 tail[8];
+        int maxBlocks = 0;
+        for (size_t l = 0; l < 8; l++)
+        {
+            data[l] = (l < lanes) ? (const uint8 *)keys[base + l] : s_zeroKey;
+            len[l]  = (l < lanes) ? lens[base + l] : 0;
+            seed[l] = (l < lanes) ? seeds[base + l] : 0;
+            tail[l] = MurmurTail(data[l], len[l]);
+            if (len[l] / 4 > maxBlocks)
+                maxBlocks = len[l] / 4;
+        }
+
+        const __m256i vlen    = _mm256_load_si256((const __m256i *)len);
+        const __m256i nblocks = _mm256_srli_epi32(vlen, 2);
+        __m256i h1 = _mm256_load_si256((const __m256i *)seed);
+
+        // body: lanes that ran out of blocks keep their state
+        for (int i = 0; i < maxBlocks; i++)
+        {
+            alignas(32) uint32 block[8];
+            for (size_t l = 0; l < 8; l++)
+                block[l] = (i < len[l] / 4) ? Read32(data[l] + i * 4) : 0;
+
+            __m256i k1 = _mm256_load_si256((const __m256i *)block);
+            k1 = _mm256_mullo_epi32(k1, c1);
+            k1 = Rotl32x8(k1, 15);
+            k1 = _mm256_mullo_epi32(k1, c2);
+
+            __m256i h = _mm256_xor_si256(h1, k1);
+            h = Rotl32x8(h, 13);
+            h = _mm256_add_epi32(_mm256_add_epi32(h, _mm256_slli_epi32(h, 2)), _mm256_set1_epi32((int)0xe6546b64));
+
+            const __m256i active = _mm256_cmpgt_epi32(nblocks, _mm256_set1_epi32(i));
+            h1 = _mm256_blendv_epi8(h1, h, active);
+        }
+
+        // tail (a zero tail leaves h1 unchanged)
+        __m256i k1 = _mm256_load_si256((const __m256i *)tail);
+        k1 = _mm256_mullo_epi32(k1, c1);
+        k1 = Rotl32x8(k1, 15);
+        k1 = _mm256_mullo_epi32(k1, c2);
+        h1 = _mm256_xor_si256(h1, k1);
+
+        // finalization
+        h1 = _mm256_xor_si256(h1, vlen);
+        h1 = _mm256_xor_si256(h1, _mm256_srli_epi32(h1, 16));
+        h1 = _mm256_mullo_epi32(h1, _mm256_set1_epi32((int)0x85ebca6b));
+        h1 = _mm256_xor_si256(h1, _mm256_srli_epi32(h1, 13));
+        h1 = _mm256_mullo_epi32(h1, _mm256_set1_epi32((int)0xc2b2ae35));
+        h1 = _mm256_xor_si256(h1, _mm256_srli_epi32(h1, 16));
+
+        alignas(32) uint32 result[8];
+        _mm256_store_si256((__m256i *)result, h1);
+        memcpy(hashes + base, result, lanes * sizeof(uint32));
+    }
+}
+
+//
+// AVX-512: 16 x 32 bit lanes
+//
+
+HAMT_TARGET("avx512f")
+static void WangHashBatchAvx512(const uint32 keys[], uint32 hashes[], size_t count) noexcept
+{
+    const __m512i ones = _mm512_set1_epi32(-1);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m512i k = _mm512_loadu_si512((const void *)(keys + i));
+        k = _mm512_add_epi32(_mm512_xor_si512(k, ones), _mm512_slli_epi32(k, 15));
+        k = _mm512_xor_si512(k, _mm512_srli_epi32(k, 12));
+        k = _mm512_add_epi32(k, _mm512_slli_epi32(k, 2));
+        k = _mm512_xor_si512(k, _mm512_srli_epi32(k, 4));
+        k = _mm512_mullo_epi32(k, _mm512_set1_epi32(2057));
+        k = _mm512_xor_si512(k, _mm512_srli_epi32(k, 16));
+        _mm512_storeu_si512((void *)(hashes + i), k);
+    }
+    WangHashBatchScalar(keys + i, hashes + i, count - i);
+}
+
+HAMT_TARGET("avx512f")
+static void WangHashBatchAvx512(const uint64 keys[], uint32 hashes[], size_t count) noexcept
+{
+    const __m512i ones = _mm512_set1_epi64(-1);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m512i k = _mm512_loadu_si512((const void *)(keys + i));
+        k = _mm512_add_epi64(_mm512_xor_si512(k, ones), _mm512_slli_epi64(k, 18));
+        k = _mm512_xor_si512(k, _mm512_srli_epi64(k, 31));
+        k = _mm512_add_epi64(_mm512_add_epi64(k, _mm512_slli_epi64(k, 2)), _mm512_slli_epi64(k, 4)); // k * 21
+        k = _mm512_xor_si512(k, _mm512_srli_epi64(k, 11));
+        k = _mm512_add_epi64(k, _mm512_slli_epi64(k, 6));
+        k = _mm512_xor_si512(k, _mm512_srli_epi64(k, 22));
+        _mm256_storeu_si256((__m256i *)(hashes + i), _mm512_cvtepi64_epi32(k));
+    }
+    WangHashBatchScalar(keys + i, hashes + i, count - i);
+}
+
+HAMT_TARGET("avx512f")
+static void MurmurHash3_x86_32_BatchAvx512(
+    const void* const   keys[],
+    const int           lens[],
+    const uint32        seeds[],
+    uint32              hashes[],
+    size_t              count) noexcept
+{
+    const __m512i c1 = _mm512_set1_epi32((int)0xcc9e2d51);
+    const __m512i c2 = _mm512_set1_epi32((int)0x1b873593);
+
+    for (size_t base = 0; base < count; base += 16)
+    {
+        const size_t lanes = (count - base < 16) ? count - base : 16;
+
+        const uint8* data[16];
+        alignas(64) int32  len[16];
+        alignas(64) uint32 seed[16];
+        alignas(64) uint32 tail[16];
+        int maxBlocks = 0;
+        for (size_t l = 0; l < 16; l++)
+        {
+            data[l] = (l < lanes) ? (const uint8 *)keys[base + l] : s_zeroKey;
+            len[l]  = (l < lanes) ? lens[base + l] : 0;
+            seed[l] = (l < lanes) ? seeds[base + l] : 0;
+            tail[l] = MurmurTail(data[l], len[l]);
+            if (len[l] / 4 > maxBlocks)
+                maxBlocks = len[l] / 4;
+        }
+
+        const __m512i vlen    = _mm512_load_si512((const void *)len);
+        const __m512i nblocks = _mm512_srli_epi32(vlen, 2);
+        __m512i h1 = _mm512_load_si512((const void *)seed);
+
+        // body: lanes that ran out of blocks keep their state
+        for (int i = 0; i < maxBlocks; i++)
+        {
+            alignas(64) uint32 block[16];
+            for (size_t l = 0; l < 16; l++)
+                block[l] = (i < len[l] / 4) ? Read32(data[l] + i * 4) : 0;
+
+            __m512i k1 = _mm512_load_si512((const void *)block);
+            k1 = _mm512_mullo_epi32(k1, c1);
+            k1 = _mm512_rol_epi32(k1, 15);
+            k1 = _mm512_mullo_epi32(k1, c2);
+
+            __m512i h = _mm512_xor_si512(h1, k1);
+            h = _mm512_rol_epi32(h, 13);
+            h = _mm512_add_epi32(_mm512_add_epi32(h, _mm512_slli_epi32(h, 2)), _mm512_set1_epi32((int)0xe6546b64));
+
+            const __mmask16 active = _mm512_cmpgt_epi32_mask(nblocks, _mm512_set1_epi32(i));
+            h1 = _mm512_mask_mov_epi32(h1, active, h);
+        }
+
+        // tail (a zero tail leaves h1 unchanged)
+        __m512i k1 = _mm512_load_si512((const void *)tail);
+        k1 = _mm512_mullo_epi32(k1, c1);
+        k1 = _mm512_rol_epi32(k1, 15);
+        k1 = _mm512_mullo_epi32(k1, c2);
+        h1 = _mm512_xor_si512(h1, k1);
+
+        // finalization
+        h1 = _mm512_xor_si512(h1, vlen);
+        h1 = _mm512_xor_si512(h1, _mm512_srli_epi32(h1, 16));
+        h1 = _mm512_mullo_epi32(h1, _mm512_set1_epi32((int)0x85ebca6b));
+        h1 = _mm512_xor_si512(h1, _mm512_srli_epi32(h1, 13));
+        h1 = _mm512_mullo_epi32(h1, _mm512_set1_epi32((int)0xc2b2ae35));
+        h1 = _mm512_xor_si512(h1, _mm512_srli_epi32(h1, 16));
+
+        alignas(64) uint32 result[16];
+        _mm512_store_si512((void *)result, h1);
+        memcpy(hashes + base, result, lanes * sizeof(uint32));
+    }
+}
+
+#endif // HAMT_X64
+
+//
+// Runtime dispatch
+//
+
+typedef void (*WangHashBatch32Func)(const uint32 keys[], uint32 hashes[], size_t count);
+typedef void (*WangHashBatch64Func)(const uint64 keys[], uint32 hashes[], size_t count);
+typedef void (*MurmurHashBatchFunc)(const void* const keys[], const int lens[], const uint32 seeds[], uint32 hashes[], size_t count);
+
+struct CHashBatchFuncs
+{
+    WangHashBatch32Func     wang32;
+    WangHashBatch64Func     wang64;
+    MurmurHashBatchFunc     murmur;
+
+    CHashBatchFuncs() noexcept
+    {
+        wang32 = WangHashBatchScalar;
+        wang64 = WangHashBatchScalar;
+        murmur = MurmurHash3_x86_32_BatchScalar;
+#if HAMT_X64
+        const uint32 features = GetCpuFeatures();
+        if (features & CPU_FEATURE_AVX512)
+        {
+            wang32 = WangHashBatchAvx512;
+            wang64 = WangHashBatchAvx512;
+            murmur = MurmurHash3_x86_32_BatchAvx512;
+        }
+        else if (features & CPU_FEATURE_AVX2)
+        {
+            wang32 = WangHashBatchAvx2;
+            wang64 = WangHashBatchAvx2;
+            murmur = MurmurHash3_x86_32_BatchAvx2;
+        }
+#endif
+    }
+};
+
+static const CHashBatchFuncs& GetHashBatchFuncs() noexcept
+{
+    static const CHashBatchFuncs s_funcs;
+    return s_funcs;
+}
+
+void WangHashBatch(const uint32 keys[], uint32 hashes[], size_t count) noexcept
+{
+    GetHashBatchFuncs().wang32(keys, hashes, count);
+}
+
+void WangHashBatch(const uint64 keys[], uint32 hashes[], size_t count) noexcept
+{
+    GetHashBatchFuncs().wang64(keys, hashes, count);
+}
+
+void MurmurHash3_x86_32_Batch(
+    const void* const   keys[],
+    const int           lens[],
+    const uint32        seeds[],
+    uint32              hashes[],
+    size_t              count) noexcept
+{
+    GetHashBatchFuncs().murmur(keys, lens, seeds, hashes, count);
+}
+
+//===========================================================================
+// END of batch hash code
+//===========================================================================
+
+
+//===========================================================================
+// START of case folding code
+//===========================================================================
+
+#if HAMT_SSE2
+
+// 'A'-'Z' to 'a'-'z' in 16 bytes. Bytes >= 0x80 compare negative and stay unchanged.
+static inline __m128i FoldCase16(__m128i x) noexcept
+{
+    __m128i upper = _mm_and_si128(
+        _mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)),
+        _mm_cmplt_epi8(x, _mm_set1_epi8('Z' + 1)));
+    return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+#endif // HAMT_SSE2
+
+void StrFoldCase(char dest[], const char src[], size_t len) noexcept
+{
+    size_t i = 0;
+#if HAMT_SSE2
+    for (; i + 16 <= len; i += 16)
+        _mm_storeu_si128((__m128i *)(dest + i), FoldCase16(_mm_loadu_si128((const __m128i *)(src + i))));
+#endif
+    for (; i < len; i++)
+        dest[i] = FoldCase(src[i]);
+}
+
+bool StrEqualFoldCase(const char str1[], const char str2[], size_t len) noexcept
+{
+    size_t i = 0;
+#if HAMT_SSE2
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i a = FoldCase16(_mm_loadu_si128((const __m128i *)(str1 + i)));
+        __m128i b = FoldCase16(_mm_loadu_si128((const __m128i *)(str2 + i)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xFFFF)
+            return false;
+    }
+#endif
+    for (; i < len; i++)
+    {
+        if (FoldCase(str1[i]) != FoldCase(str2[i]))
+            return false;
+    }
+    return true;
+}
+
+static inline uint32 Rotl32(uint32 x, int r) noexcept
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+static inline uint32 MurmurBlock(uint32 h1, uint32 k1) noexcept
+{
+    k1 *= 0xcc9e2d51;
+    k1 = Rotl32(k1, 15);
+    k1 *= 0x1b873593;
+    h1 ^= k1;
+    h1 = Rotl32(h1, 13);
+    return h1 * 5 + 0xe6546b64;
+}
+
+// MurmurHash3_x86_32 of the case folded key without a folded copy
+uint32 MurmurHash3_x86_32_FoldCase(const void* key, int len, uint32 seed) noexcept
+{
+    const char* data = (const char *)key;
+    uint32 h1 = seed;
+    int i = 0;
+
+#if HAMT_SSE2
+    for (; i + 16 <= len; i += 16)
+    {
+        uint32 blocks[4];
+        _mm_storeu_si128((__m128i *)blocks, FoldCase16(_mm_loadu_si128((const __m128i *)(data + i))));
+        h1 = MurmurBlock(h1, blocks[0]);
+        h1 = MurmurBlock(h1, blocks[1]);
+        h1 = MurmurBlock(h1, blocks[2]);
+        h1 = MurmurBlock(h1, blocks[3]);
+    }
+#endif
+
+    char folded[4];
+    for (; i + 4 <= len; i += 4)
+    {
+        folded[0] = FoldCase(data[i]);
+        folded[1] = FoldCase(data[i + 1]);
+        folded[2] = FoldCase(data[i + 2]);
+        folded[3] = FoldCase(data[i + 3]);
+        h1 = MurmurBlock(h1, Read32((const uint8 *)folded));
+    }
+
+    // Tail
+    uint32 k1 = 0;
+    switch (len & 3)
+    {
+        case 3: k1 ^= (uint8)FoldCase(data[i + 2]) << 16;
+        case 2: k1 ^= (uint8)FoldCase(data[i + 1]) << 8;
+        case 1: k1 ^= (uint8)FoldCase(data[i]);
+                k1 *= 0xcc9e2d51; k1 = Rotl32(k1, 15); k1 *= 0x1b873593; h1 ^= k1;
+    }
+
+    // Finalization
+    h1 ^= (uint32)len;
+    h1 ^= h1 >> 16;
+    h1 *= 0x85ebca6b;
+    h1 ^= h1 >> 13;
+    h1 *= 0xc2b2ae35;
+    h1 ^= h1 >> 16;
+    return h1;
+}
+
+//===========================================================================
+// END of case folding code
+//===========================================================================
@@ -0,0 +1,266 @@
+/**
+ *      File: HashTrieCodec.cpp
+ *    Author: CS Lim
+ *   Purpose: Blocks and block compression of encoded THashTrie snapshots
+ *
+ */
+
+#include <stdint.h>
+#include <HashTrieCodec.h>
+
+//===========================================================================
+//    Block compression
+//===========================================================================
+static constexpr uint32 LZ_MIN_MATCH    = 4;
+static constexpr uint32 LZ_MAX_DISTANCE = 0xffff;
+static constexpr uint32 LZ_HASH_BITS    = 12;
+static constexpr uint32 LZ_RUN_MASK     = 15;       // Token nibble for runs continued in a varint
+
+static inline uint32 Read32(const uint8* p) noexcept
+{
+    uint32 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32 LzHash(uint32 value) noexcept
+{
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Token, literals and, unless distance is 0, the match. Returns nullptr if
+// there is no room for them.
+static uint8* PutSequence(uint8* out, const uint8* outEnd, const uint8 literals[], uint32 literalCount, uint32 distance, uint32 matchLength) noexcept
+{
+    if ((uint64)(outEnd - out) < (uint64)literalCount + 3 + 2 * MAX_VARINT_SIZE)
+        return nullptr;
+
+    const uint32 matchRun = (distance != 0) ? matchLength - LZ_MIN_MATCH : 0;
+    *out++ = (uint8)((std::min(literalCount, LZ_RUN_MASK) << 4) | std::min(matchRun, LZ_RUN_MASK));
+    if (literalCount >= LZ_RUN_MASK)
+        out = PutVarint(out, literalCount - LZ_RUN_MASK);
+    memcpy(out, literals, literalCount);
+    out += literalCount;
+    if (distance == 0)
+        return out;
+
+    *out++ = (uint8)distance;
+    *out++ = (uint8)(distance >> 8);
+    if (matchRun >= LZ_RUN_MASK)
+        out = PutVarint(out, matchRun - LZ_RUN_MASK);
+    return out;
+}
+
+uint32 CompressBlock(const uint8 src[], uint32 size, uint8 dst[], uint32 capacity) noexcept
+{
+    if (size < 2 * LZ_MIN_MATCH)
+        return 0;
+
+    uint32 table[1 << LZ_HASH_BITS] = {};    // Last position + 1 with the hash
+    uint8* out = dst;
+    const uint8* outEnd = dst + capacity;
+    uint32 anchor = 0;
+    for (uint32 i = 0; i + LZ_MIN_MATCH <= size; )
+    {
+        const uint32 bytes = Read32(src + i);
+        uint32& entry = table[LzHash(bytes)];
+        const uint32 candidate = entry;
+        entry = i + 1;
+        if (candidate == 0 || i - (candidate - 1) > LZ_MAX_DISTANCE || Read32(src + candidate - 1) != bytes)
+        {
+            i++;
+            continue;
+        }
+
+        const uint32 match = candidate - 1;
+        uint32 length = LZ_MIN_MATCH;
+        while (i + length < size && src[match + length] == src[i + length])
+            length++;
+
+        out = PutSequence(out, outEnd, src + anchor, i - anchor, i - match, length);
+        if (out == nullptr)
+            return 0;
+        i += length;
+        anchor = i;
+    }
+
+    out = PutSequence(out, outEnd, src + anchor, size - anchor, 0, 0);
+    if (out == nullptr || (uint32)(out - dst) >= size)
+        return 0;
+    return (uint32)(out - dst);
+}
+
+bool DecompressBlock(const uint8 src[], uint32 srcSize, uint8 dst[], uint32 size) noexcept
+{
+    const uint8* p = src;
+    const uint8* end = src + srcSize;
+    uint8* out = dst;
+    uint8* const outEnd = dst + size;
+    while (p < end)
+    {
+        const uint8 token = *p++;
+        uint64 literalCount = token >> 4;
+        uint64 run;
+        if (literalCount == LZ_RUN_MASK)
+        {
+            if (!GetVarint(p, end, run))
+                return false;
+            literalCount += run;
+        }
+        if (literalCount > (uint64)(end - p) || literalCount > (uint64)(outEnd - out))
+            return false;
+        memcpy(out, p, (size_t)literalCount);
+        out += literalCount;
+        p += literalCount;
+        if (p == end)
+            break;
+
+        if (end - p < 2)
+            return false;
+        const uint32 distance = p[0] | ((uint32)p[1] << 8);
+        p += 2;
+        uint64 length = token & LZ_RUN_MASK;
+        if (length == LZ_RUN_MASK)
+        {
+            if (!GetVarint(p, end, run))
+                return false;
+            length += run;
+        }
+        length += LZ_MIN_MATCH;
+        if (distance == 0 || distance > (uint64)(out - dst) || length > (uint64)(outEnd - out))
+            return false;
+
+        // Byte by byte: the match may overlap what it produces
+        const uint8* from = out - distance;
+        for (uint64 i = 0; i < length; i++)
+            out[i] = from[i];
+        out += length;
+    }
+    return out == outEnd;
+}
+
+
+//===========================================================================
+//    CHashTrieBlockWriter
+//===========================================================================
+bool CHashTrieBlockWriter::Open(const char path[], uint32 keyType, uint32 keySize, bool compress) noexcept
+{
+    if (!m_file.Open(path))
+        return false;
+
+    m_header = CHashTrieCodecHeader();
+    memcpy(m_header.magic, HASH_TRIE_CODEC_MAGIC, sizeof(m_header.magic));
+    m_header.version = CHashTrieCodecHeader::VERSION;
+    m_header.keyType = keyType;
+    m_header.keySize = keySize;
+    m_size = 0;
+    m_blockCount = 0;
+    m_compress = compress;
+    return m_file.Write(&m_header, sizeof(m_header));
+}
+
+bool CHashTrieBlockWriter::Close() noexcept
+{
+    WriteBlock();
+    m_file.Seek(0);
+    m_file.Write(&m_header, sizeof(m_header));
+    bool synced = m_file.Sync();
+    return m_file.Close() && synced;
+}
+
+uint8* CHashTrieBlockWriter::Reserve(size_t size)
+{
+    if (m_block.size() < m_size + size)
+    {
+        m_block.resize(std::max(m_size + size, (size_t)BLOCK_SIZE * 2));
+        // Room for any block that is compressed, even if the first one was
+        // too large to be
+        if (m_compress && m_compressed.size() < MAX_COMPRESSED_SIZE)
+            m_compressed.resize(std::min(m_block.size(), (size_t)MAX_COMPRESSED_SIZE));
+    }
+    return m_block.data() + m_size;
+}
+
+bool CHashTrieBlockWriter::WriteBlock() noexcept
+{
+    if (m_blockCount == 0)
+        return m_file.IsOk();
+
+    CHashTrieCodecBlock block;
+    block.size       = m_size;
+    block.storedSize = m_size;
+    block.count      = m_blockCount;
+    block.checksum   = MurmurHash3_x86_32(m_block.data(), (int)m_size, 0);
+
+    const uint8* data = m_block.data();
+    if (m_compress && m_size <= MAX_COMPRESSED_SIZE)
+    {
+        uint32 compressed = CompressBlock(m_block.data(), m_size, m_compressed.data(), m_size);
+        if (compressed != 0)
+        {
+            block.storedSize = compressed;
+            data = m_compressed.data();
+        }
+    }
+
+    m_file.Write(&block, sizeof(block));
+    m_file.Write(data, block.storedSize);
+    m_size = 0;
+    m_blockCount = 0;
+    return m_file.IsOk();
+}
+
+
+//===========================================================================
+//    CHashTrieBlockReader
+//===========================================================================
+bool CHashTrieBlockReader::Open(const char path[]) noexcept
+{
+    m_count = 0;
+    m_done = false;
+    return GetFileSize(path, m_fileSize)
+        && m_file.Open(path)
+        && m_file.Read(&m_header, sizeof(m_header))
+        && memcmp(m_header.magic, HASH_TRIE_CODEC_MAGIC, sizeof(m_header.magic)) == 0
+        && m_header.version == CHashTrieCodecHeader::VERSION;
+}
+
+bool CHashTrieBlockReader::NextBlock(const uint8*& data, uint32& size, uint32& count)
+{
+    if (m_file.GetOffset() == m_fileSize)
+    {
+        m_done = (m_count == m_header.count);
+        return false;
+    }
+
+    CHashTrieCodecBlock block;
+    if (m_fileSize - m_file.GetOffset() < sizeof(block) || !m_file.Read(&block, sizeof(block)))
+        return false;
+    const bool compressed = (block.storedSize != block.size);
+    if (block.storedSize > m_fileSize - m_file.GetOffset()
+        || (compressed && block.size > CHashTrieBlockWriter::MAX_COMPRESSED_SIZE)
+        || block.count > block.size
+        || block.count > m_header.count - m_count)
+        return false;
+
+    m_block.resize(block.size);
+    if (compressed)
+    {
+        m_compressed.resize(block.storedSize);
+        if (!m_file.Read(m_compressed.data(), block.storedSize)
+            || !DecompressBlock(m_compressed.data(), block.storedSize, m_block.data(), block.size))
+            return false;
+    }
+    else if (!m_file.Read(m_block.data(), block.size))
+    {
+        return false;
+    }
+    if (MurmurHash3_x86_32(m_block.data(), (int)block.size, 0) != block.checksum)
+        return false;
+
+    m_count += block.count;
+    data  = m_block.data();
+    size  = block.size;
+    count = block.count;
+    return true;
+}
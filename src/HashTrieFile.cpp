@@ -0,0 +1,327 @@
+/**
+ *      File: HashTrieFile.cpp
+ *    Author: CS Lim
+ *   Purpose: File mapping and output for THashTrie files
+ *
+ */
+
+#include <stdint.h>
+#include <HashTrieFile.h>
+
+#if _MSC_VER
+    #define WIN32_LEAN_AND_MEAN
+    #include <windows.h>
+    #include <io.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+//===========================================================================
+//    CMappedFile
+//===========================================================================
+bool CMappedFile::Open(const char path[]) noexcept
+{
+    Close();
+
+#if _MSC_VER
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (mapping == nullptr)
+        return false;
+
+    void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (data == nullptr)
+    {
+        CloseHandle(mapping);
+        return false;
+    }
+
+    m_mapping = mapping;
+    m_data = (const uint8 *)data;
+    m_size = (uint64)size.QuadPart;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    m_data = (const uint8 *)data;
+    m_size = (uint64)st.st_size;
+#endif
+    return true;
+}
+
+void CMappedFile::Close() noexcept
+{
+    if (m_data == nullptr)
+        return;
+
+#if _MSC_VER
+    UnmapViewOfFile(m_data);
+    CloseHandle(m_mapping);
+    m_mapping = nullptr;
+#else
+    munmap(const_cast<uint8 *>(m_data), (size_t)m_size);
+#endif
+    m_data = nullptr;
+    m_size = 0;
+}
+
+
+//===========================================================================
+//    CFileWriter
+//===========================================================================
+static constexpr size_t FILE_WRITER_BUFFER_SIZE = 1 << 20;
+
+bool CFileWriter::Open(const char path[], bool truncate) noexcept
+{
+    Close();
+
+    const char* mode = truncate ? "wb" : "r+b";
+#if _MSC_VER
+    if (fopen_s(&m_file, path, mode) != 0)
+        m_file = nullptr;
+#else
+    m_file = fopen(path, mode);
+#endif
+    if (m_file == nullptr)
+        return false;
+
+    // Large sequential writes
+    setvbuf(m_file, nullptr, _IOFBF, FILE_WRITER_BUFFER_SIZE);
+    m_offset = 0;
+    m_failed = false;
+    if (!truncate)
+    {
+#if _MSC_VER
+        m_failed = _fseeki64(m_file, 0, SEEK_END) != 0;
+        m_offset = (uint64)_ftelli64(m_file);
+#else
+        m_failed = fseeko(m_file, 0, SEEK_END) != 0;
+        m_offset = (uint64)ftello(m_file);
+#endif
+    }
+    return !m_failed;
+}
+
+bool CFileWriter::Close() noexcept
+{
+    if (m_file == nullptr)
+        return false;
+
+    bool ok = !m_failed;
+    if (fclose(m_file) != 0)
+        ok = false;
+    m_file = nullptr;
+    return ok;
+}
+
+bool CFileWriter::Write(const void* data, size_t size) noexcept
+{
+    if (!IsOk())
+        return false;
+    if (size != 0 && fwrite(data, 1, size, m_file) != size)
+        m_failed = true;
+    m_offset += size;
+    return !m_failed;
+}
+
+bool CFileWriter::WriteZeros(size_t size) noexcept
+{
+    static const uint8 zeros[64] = {};
+    while (size > 0)
+    {
+        size_t n = (size < sizeof(zeros)) ? size : sizeof(zeros);
+        if (!Write(zeros, n))
+            return false;
+        size -= n;
+    }
+    return IsOk();
+}
+
+bool CFileWriter::Seek(uint64 offset) noexcept
+{
+    if (!IsOk())
+        return false;
+#if _MSC_VER
+    if (_fseeki64(m_file, (int64)offset, SEEK_SET) != 0)
+#else
+    if (fseeko(m_file, (off_t)offset, SEEK_SET) != 0)
+#endif
+        m_failed = true;
+    m_offset = offset;
+    return !m_failed;
+}
+
+bool CFileWriter::Flush() noexcept
+{
+    if (IsOk() && fflush(m_file) != 0)
+        m_failed = true;
+    return IsOk();
+}
+
+bool CFileWriter::Sync() noexcept
+{
+    if (!Flush())
+        return false;
+#if _MSC_VER
+    if (_commit(_fileno(m_file)) != 0)
+#else
+    if (fsync(fileno(m_file)) != 0)
+#endif
+        m_failed = true;
+    return !m_failed;
+}
+
+
+//===========================================================================
+//    CFileReader
+//===========================================================================
+bool CFileReader::Open(const char path[]) noexcept
+{
+    Close();
+#if _MSC_VER
+    if (fopen_s(&m_file, path, "rb") != 0)
+        m_file = nullptr;
+#else
+    m_file = fopen(path, "rb");
+#endif
+    if (m_file == nullptr)
+        return false;
+
+    // Reads are large, so they go to the caller's buffer directly
+    setvbuf(m_file, nullptr, _IONBF, 0);
+    m_offset = 0;
+    m_failed = false;
+    return true;
+}
+
+void CFileReader::Close() noexcept
+{
+    if (m_file == nullptr)
+        return;
+    fclose(m_file);
+    m_file = nullptr;
+}
+
+bool CFileReader::Read(void* data, size_t size) noexcept
+{
+    if (!IsOk())
+        return false;
+    if (size != 0 && fread(data, 1, size, m_file) != size)
+        m_failed = true;
+    m_offset += size;
+    return !m_failed;
+}
+
+bool CFileReader::Seek(uint64 offset) noexcept
+{
+    if (!IsOk())
+        return false;
+#if _MSC_VER
+    if (_fseeki64(m_file, (int64)offset, SEEK_SET) != 0)
+#else
+    if (fseeko(m_file, (off_t)offset, SEEK_SET) != 0)
+#endif
+        m_failed = true;
+    m_offset = offset;
+    return !m_failed;
+}
+
+
+bool RenameFile(const char from[], const char to[]) noexcept
+{
+#if _MSC_VER
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(from, to) == 0;
+#endif
+}
+
+bool GetFileSize(const char path[], uint64& size) noexcept
+{
+#if _MSC_VER
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &data))
+        return false;
+    size = ((uint64)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return false;
+    size = (uint64)st.st_size;
+#endif
+    return true;
+}
+
+bool TruncateFile(const char path[], uint64 size) noexcept
+{
+#if _MSC_VER
+    HANDLE file = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER offset;
+    offset.QuadPart = (LONGLONG)size;
+    bool ok = SetFilePointerEx(file, offset, nullptr, FILE_BEGIN) && SetEndOfFile(file);
+    CloseHandle(file);
+    return ok;
+#else
+    return truncate(path, (off_t)size) == 0;
+#endif
+}
+
+
+//===========================================================================
+//    CHashTrieImage
+//===========================================================================
+bool CHashTrieImage::Open(const char path[]) noexcept
+{
+    Close();
+    if (!m_file.Open(path))
+        return false;
+
+    const CHashTrieImageHeader* header = (const CHashTrieImageHeader *)m_file.GetData();
+    if (m_file.GetSize() < sizeof(CHashTrieImageHeader)
+        || memcmp(header->magic, HASH_TRIE_IMAGE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != CHashTrieImageHeader::VERSION
+        || header->size != m_file.GetSize()
+        || header->root >= header->size)
+    {
+        m_file.Close();
+        return false;
+    }
+
+    m_header = header;
+    return true;
+}
+
+void CHashTrieImage::Close() noexcept
+{
+    m_file.Close();
+    m_header = nullptr;
+}
@@ -0,0 +1,469 @@
+/**
+ *      File: HashTrieShared.cpp
+ *    Author: CS Lim
+ *   Purpose: HAMT in shared memory: one writer process, lock-free readers
+ *
+ */
+
+#include <stdint.h>
+#include <HashTrieShared.h>
+#include <new>
+
+#if _MSC_VER
+    #define WIN32_LEAN_AND_MEAN
+    #include <windows.h>
+#else
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <signal.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+//===========================================================================
+//    CSharedMemory
+//===========================================================================
+bool CSharedMemory::Create(const char name[], uint64 size) noexcept
+{
+    Close();
+
+#if _MSC_VER
+    HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, name);
+    if (mapping == nullptr)
+        return false;
+    if (GetLastError() == ERROR_ALREADY_EXISTS)
+    {
+        // Named mappings live while they are open and cannot be replaced
+        CloseHandle(mapping);
+        return false;
+    }
+
+    void* data = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (data == nullptr)
+    {
+        CloseHandle(mapping);
+        return false;
+    }
+    m_mapping = mapping;
+#else
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return false;
+    if (ftruncate(fd, (off_t)size) != 0)
+    {
+        close(fd);
+        shm_unlink(name);
+        return false;
+    }
+
+    void* data = mmap(nullptr, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return false;
+    }
+#endif
+    m_data = (uint8 *)data;
+    m_size = size;
+    return true;
+}
+
+bool CSharedMemory::Open(const char name[]) noexcept
+{
+    Close();
+
+#if _MSC_VER
+    HANDLE mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name);
+    if (mapping == nullptr)
+        return false;
+
+    void* data = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    MEMORY_BASIC_INFORMATION info;
+    if (data == nullptr || VirtualQuery(data, &info, sizeof(info)) == 0)
+    {
+        if (data != nullptr)
+            UnmapViewOfFile(data);
+        CloseHandle(mapping);
+        return false;
+    }
+    m_mapping = mapping;
+    m_size = (uint64)info.RegionSize;
+#else
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    m_size = (uint64)st.st_size;
+#endif
+    m_data = (uint8 *)data;
+    return true;
+}
+
+void CSharedMemory::Close() noexcept
+{
+    if (m_data == nullptr)
+        return;
+
+#if _MSC_VER
+    UnmapViewOfFile(m_data);
+    CloseHandle(m_mapping);
+    m_mapping = nullptr;
+#else
+    munmap(m_data, (size_t)m_size);
+#endif
+    m_data = nullptr;
+    m_size = 0;
+}
+
+void CSharedMemory::Remove(const char name[]) noexcept
+{
+#if _MSC_VER
+    (void)name;
+#else
+    shm_unlink(name);
+#endif
+}
+
+uint32 GetProcessId() noexcept
+{
+#if _MSC_VER
+    return (uint32)GetCurrentProcessId();
+#else
+    return (uint32)getpid();
+#endif
+}
+
+bool IsProcessAlive(uint32 id) noexcept
+{
+#if _MSC_VER
+    HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, (DWORD)id);
+    if (process == nullptr)
+        return GetLastError() == ERROR_ACCESS_DENIED;
+    bool alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+    CloseHandle(process);
+    return alive;
+#else
+    return kill((pid_t)id, 0) == 0 || errno == EPERM;
+#endif
+}
+
+
+//===========================================================================
+//    CHashTrieSharedWriter
+//===========================================================================
+bool CHashTrieSharedWriter::Create(const char name[], uint64 size)
+{
+    Close();
+    if (size < HASH_TRIE_SHARED_DATA_OFFSET + MAX_UPDATE_SIZE || !m_memory.Create(name, size))
+        return false;
+
+    CHashTrieSharedHeader* header = new (m_memory.GetData()) CHashTrieSharedHeader();
+    memcpy(header->magic, HASH_TRIE_SHARED_MAGIC, sizeof(header->magic));
+    header->version = CHashTrieSharedHeader::VERSION;
+    header->size    = size;
+    header->used    = HASH_TRIE_SHARED_DATA_OFFSET;
+    for (CHashTrieSharedReaderSlot& slot : header->readers)
+    {
+        slot.owner.store(0);
+        slot.sequence.store(0);
+    }
+    header->writer.store(GetProcessId());
+
+    // The empty root
+    m_header = header;
+    m_data = m_memory.GetData();
+    m_reusedBits.resize((size_t)((size / sizeof(uint64) + 63) / 64));
+    m_freeBySize.resize(MAX_SMALL_BLOCK_SIZE / sizeof(uint64) + 1);
+    const uint64 current = Append(sizeof(CHashTrieSharedRoot));
+    CHashTrieSharedRoot* root = (CHashTrieSharedRoot *)(m_data + current);
+    root->sequence = 1;
+    root->root     = 0;
+    root->count    = 0;
+    root->reserved = 0;
+    m_publishedUsed = header->used;
+    m_current = current;
+    header->current.store(current);
+    header->sequence.store(1);
+    return true;
+}
+
+bool CHashTrieSharedWriter::Open(const char name[])
+{
+    Close();
+    if (!m_memory.Open(name))
+        return false;
+
+    CHashTrieSharedHeader* header = (CHashTrieSharedHeader *)m_memory.GetData();
+    if (m_memory.GetSize() < HASH_TRIE_SHARED_DATA_OFFSET
+        || memcmp(header->magic, HASH_TRIE_SHARED_MAGIC, sizeof(header->magic)) != 0
+        || header->version != CHashTrieSharedHeader::VERSION
+        || header->size > m_memory.GetSize())
+    {
+        m_memory.Close();
+        return false;
+    }
+
+    // Take over from a writer that is gone
+    const uint32 self = GetProcessId();
+    uint32 writer = header->writer.load();
+    do
+    {
+        if (writer != 0 && (writer == self || IsProcessAlive(writer)))
+        {
+            m_memory.Close();
+            return false;
+        }
+    } while (!header->writer.compare_exchange_weak(writer, self));
+
+    m_header  = header;
+    m_data    = m_memory.GetData();
+    m_current = header->current.load();
+    m_publishedUsed = header->used;
+    m_reusedBits.resize((size_t)((header->size / sizeof(uint64) + 63) / 64));
+    m_freeBySize.resize(MAX_SMALL_BLOCK_SIZE / sizeof(uint64) + 1);
+    const CHashTrieSharedRoot* root = (const CHashTrieSharedRoot *)(m_data + m_current);
+    m_root  = root->root;
+    m_count = root->count;
+    return true;
+}
+
+void CHashTrieSharedWriter::Close() noexcept
+{
+    if (m_header != nullptr)
+        m_header->writer.store(0);
+    m_memory.Close();
+    m_header = nullptr;
+    m_data = nullptr;
+    m_current = 0;
+    m_root = 0;
+    m_count = 0;
+    m_publishedUsed = 0;
+    m_reused.clear();
+    std::vector<uint64>().swap(m_reusedBits);
+    m_discarded.clear();
+    m_retired.clear();
+    m_retiredStart = 0;
+    m_freeBySize.clear();
+    m_free.clear();
+    m_freeBytes = 0;
+    m_oldestReaderCalls = 0;
+}
+
+void CHashTrieSharedWriter::Publish()
+{
+    assert(IsOpen());
+    if (m_publishedUsed == m_header->used && m_reused.empty() && m_discarded.empty())
+        return;
+
+    // 1. The new root block
+    const uint64 sequence = m_header->sequence.load() + 1;
+    const uint64 current = Append(sizeof(CHashTrieSharedRoot));
+    CHashTrieSharedRoot* root = (CHashTrieSharedRoot *)(m_data + current);
+    root->sequence = sequence;
+    root->root     = m_root;
+    root->count    = m_count;
+    root->reserved = 0;
+
+    // 2. Readers that load the sequence number find this root or a later one
+    m_header->current.store(current);
+    m_header->sequence.store(sequence);
+
+    // 3. The blocks of the old version wait until no reader can see them
+    m_discarded.push_back({ 0, m_current, sizeof(CHashTrieSharedRoot) });
+    for (Retired& retired : m_discarded)
+    {
+        retired.sequence = sequence;
+        m_retired.push_back(retired);
+    }
+    m_discarded.clear();
+    for (uint64 offset : m_reused)
+        SetReused(offset, false);
+    m_reused.clear();
+    m_publishedUsed = m_header->used;
+    m_current = current;
+
+    const uint64 oldest = GetOldestReader();
+    for (; m_retiredStart < m_retired.size() && m_retired[m_retiredStart].sequence <= oldest; m_retiredStart++)
+        Free(m_retired[m_retiredStart].offset, m_retired[m_retiredStart].size);
+    if (m_retiredStart == m_retired.size() || m_retiredStart >= m_retired.size() / 2)
+    {
+        m_retired.erase(m_retired.begin(), m_retired.begin() + m_retiredStart);
+        m_retiredStart = 0;
+    }
+}
+
+// Lowest root sequence a reader may still be reading. Slots of readers
+// whose process is gone are freed: always when they would hold blocks
+// back, and every READER_SWEEP_INTERVAL calls whatever their sequence, so
+// readers that died idle do not use up the slots.
+uint64 CHashTrieSharedWriter::GetOldestReader() noexcept
+{
+    const bool sweep = (++m_oldestReaderCalls % READER_SWEEP_INTERVAL) == 0;
+    uint64 oldest = m_header->sequence.load();
+    for (CHashTrieSharedReaderSlot& slot : m_header->readers)
+    {
+        const uint32 owner = slot.owner.load();
+        if (owner == 0)
+            continue;
+        const uint64 sequence = slot.sequence.load();
+        const bool holds = (sequence != 0 && sequence < oldest);
+        if (!holds && !sweep)
+            continue;
+
+        if (!IsProcessAlive(owner))
+        {
+            slot.sequence.store(0);
+            slot.owner.store(0);
+        }
+        else if (holds)
+        {
+            oldest = sequence;
+        }
+    }
+    return oldest;
+}
+
+// Throw before an update of size bytes for hash that might not fit. The
+// check comes before any change, so a failed update leaves no blocks
+// discarded. Free blocks are not counted: they are reused by exact size,
+// and which sizes the update needs is only known while it runs.
+void CHashTrieSharedWriter::CheckRoom(uint64 size, uint32 hash) const
+{
+    assert(IsOpen());
+    size += MAX_UPDATE_SIZE;
+
+    // The collision bucket on the path of hash is copied with one more slot
+    uint64 slot = m_root;
+    for (uint32 depth = 0; slot & HASH_TRIE_IMAGE_NODE_BIT; depth++)
+    {
+        const CHashTrieImageNode* node = GetNode(slot);
+        if (depth >= CHashTrieImageNode::MAX_DEPTH)
+        {
+            size += CHashTrieImageNode::GetSize(node->count + 1);
+            break;
+        }
+        const uint32 bit = (uint32)1 << CHashTrieImageNode::GetHashIndex(hash, depth);
+        if ((node->bitmap & bit) == 0)
+            break;
+        slot = node->slots[GetBitCount(node->bitmap & (bit - 1))];
+    }
+
+    if (m_header->size - m_header->used < size)
+        throw std::bad_alloc();
+}
+
+// Block of size bytes (a multiple of 8) that readers do not see
+uint64 CHashTrieSharedWriter::Append(uint64 size)
+{
+    assert(size % sizeof(uint64) == 0);
+    uint64 offset;
+    std::vector<uint64>& free = GetFreeList(size);
+    if (!free.empty())
+    {
+        offset = free.back();
+        free.pop_back();
+        m_freeBytes -= size;
+        m_reused.push_back(offset);
+        SetReused(offset, true);
+    }
+    else
+    {
+        if (m_header->size - m_header->used < size)
+            throw std::bad_alloc();
+        offset = m_header->used;
+        m_header->used += size;
+    }
+    return offset;
+}
+
+// Blocks readers have not seen are reused at once
+void CHashTrieSharedWriter::Discard(uint64 slot)
+{
+    const uint64 offset = slot & ~HASH_TRIE_IMAGE_NODE_BIT;
+    const uint64 size = GetSlotSize(slot);
+    if (IsPending(offset))
+    {
+        SetReused(offset, false);
+        Free(offset, size);
+    }
+    else
+    {
+        m_discarded.push_back({ 0, offset, size });
+    }
+}
+
+void CHashTrieSharedWriter::Free(uint64 offset, uint64 size)
+{
+    GetFreeList(size).push_back(offset);
+    m_freeBytes += size;
+}
+
+std::vector<uint64>& CHashTrieSharedWriter::GetFreeList(uint64 size)
+{
+    if (size <= MAX_SMALL_BLOCK_SIZE)
+        return m_freeBySize[(size_t)(size / sizeof(uint64))];
+    return m_free[size];
+}
+
+
+//===========================================================================
+//    CHashTrieSharedReader
+//===========================================================================
+bool CHashTrieSharedReader::Open(const char name[]) noexcept
+{
+    Close();
+    if (!m_memory.Open(name))
+        return false;
+
+    CHashTrieSharedHeader* header = (CHashTrieSharedHeader *)m_memory.GetData();
+    if (m_memory.GetSize() < HASH_TRIE_SHARED_DATA_OFFSET
+        || memcmp(header->magic, HASH_TRIE_SHARED_MAGIC, sizeof(header->magic)) != 0
+        || header->version != CHashTrieSharedHeader::VERSION
+        || header->size > m_memory.GetSize())
+    {
+        m_memory.Close();
+        return false;
+    }
+
+    const uint32 self = GetProcessId();
+    for (uint32 i = 0; i < CHashTrieSharedHeader::MAX_READERS; i++)
+    {
+        uint32 owner = 0;
+        if (header->readers[i].owner.compare_exchange_strong(owner, self))
+        {
+            m_header = header;
+            m_data = m_memory.GetData();
+            m_slot = i;
+            return true;
+        }
+    }
+    m_memory.Close();
+    return false;
+}
+
+void CHashTrieSharedReader::Close() noexcept
+{
+    if (m_header != nullptr)
+    {
+        m_header->readers[m_slot].sequence.store(0);
+        m_header->readers[m_slot].owner.store(0);
+    }
+    m_memory.Close();
+    m_header = nullptr;
+    m_data = nullptr;
+    m_slot = 0;
+}
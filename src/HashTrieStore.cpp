@@ -0,0 +1,236 @@
+/**
+ *      File: HashTrieStore.cpp
+ *    Author: CS Lim
+ *   Purpose: Crash-consistent file-backed HAMT key/value store
+ *
+ */
+
+#include <stdint.h>
+#include <HashTrieStore.h>
+
+//===========================================================================
+//    Opening and closing
+//===========================================================================
+bool CHashTrieStore::Open(const char path[])
+{
+    Close();
+    m_path = path;
+
+    if (!m_file.Open(path))
+    {
+        // No file or an empty one: start a new store
+        CFileWriter file;
+        if (file.Open(path, false) && file.GetOffset() != 0)
+            return false;
+        file.Close();
+        if (!Create() || !m_file.Open(path))
+            return false;
+    }
+
+    const CHashTrieStoreHeader* header = (const CHashTrieStoreHeader *)m_file.GetData();
+    if (m_file.GetSize() < HASH_TRIE_STORE_DATA_OFFSET
+        || memcmp(header->magic, HASH_TRIE_STORE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != CHashTrieStoreHeader::VERSION)
+    {
+        m_file.Close();
+        return false;
+    }
+
+    // The valid root slot with the highest sequence number. Data past its
+    // size is from a commit that did not finish and will be overwritten.
+    const CHashTrieStoreRoot* current = nullptr;
+    for (const CHashTrieStoreRoot& root : header->roots)
+    {
+        if (root.checksum != root.GetChecksum()
+            || root.size < HASH_TRIE_STORE_DATA_OFFSET
+            || root.size > m_file.GetSize()
+            || root.root >= root.size)
+            continue;
+        if (current == nullptr || root.sequence > current->sequence)
+            current = &root;
+    }
+    if (current == nullptr || !m_writer.Open(path, false))
+    {
+        m_file.Close();
+        return false;
+    }
+
+    m_committed     = *current;
+    m_committedSize = current->size;
+    m_root          = current->root;
+    m_count         = current->count;
+    m_deadBytes     = current->deadBytes;
+    return true;
+}
+
+void CHashTrieStore::Close() noexcept
+{
+    m_writer.Close();
+    m_file.Close();
+    std::vector<uint64>().swap(m_pending);
+    m_root = 0;
+    m_count = 0;
+    m_deadBytes = 0;
+    m_committed = CHashTrieStoreRoot();
+    m_committedSize = 0;
+}
+
+// Write the header of an empty store
+bool CHashTrieStore::Create() noexcept
+{
+    CFileWriter file;
+    if (!file.Open(m_path.c_str()))
+        return false;
+
+    CHashTrieStoreHeader header = {};
+    memcpy(header.magic, HASH_TRIE_STORE_MAGIC, sizeof(header.magic));
+    header.version = CHashTrieStoreHeader::VERSION;
+    file.Write(&header, sizeof(header));
+    file.WriteZeros((size_t)(HASH_TRIE_STORE_DATA_OFFSET - sizeof(header)));
+
+    CHashTrieStoreRoot root = {};
+    root.sequence = 1;
+    root.size = HASH_TRIE_STORE_DATA_OFFSET;
+    return WriteRoot(file, root) && file.Close();
+}
+
+// Write root to the slot for its sequence number and wait until it is on disk
+bool CHashTrieStore::WriteRoot(CFileWriter& file, const CHashTrieStoreRoot& root) noexcept
+{
+    CHashTrieStoreRoot slot = root;
+    slot.checksum = slot.GetChecksum();
+    file.Seek(offsetof(CHashTrieStoreHeader, roots) + (root.sequence & 1) * sizeof(CHashTrieStoreRoot));
+    file.Write(&slot, sizeof(slot));
+    return file.Sync();
+}
+
+
+//===========================================================================
+//    Commit
+//===========================================================================
+bool CHashTrieStore::Commit() noexcept
+{
+    if (!IsOpen())
+        return false;
+    if (m_pending.empty() && m_root == m_committed.root)
+        return true;
+
+    // After an error the writer is reopened for the retry
+    if (!m_writer.IsOk() && !m_writer.Open(m_path.c_str(), false))
+        return false;
+
+    // 1. The new records and nodes
+    const uint64 pendingSize = m_pending.size() * sizeof(uint64);
+    m_writer.Seek(m_committedSize);
+    m_writer.Write(m_pending.data(), (size_t)pendingSize);
+    if (!m_writer.Sync())
+        return false;
+
+    // 2. The root that refers to them
+    CHashTrieStoreRoot root = {};
+    root.sequence  = m_committed.sequence + 1;
+    root.root      = m_root;
+    root.size      = m_committedSize + pendingSize;
+    root.deadBytes = m_deadBytes;
+    root.count     = m_count;
+    if (!WriteRoot(m_writer, root))
+        return false;
+
+    m_committed = root;
+    m_committedSize = root.size;
+    m_pending.clear();
+    return m_file.Open(m_path.c_str());
+}
+
+void CHashTrieStore::Rollback() noexcept
+{
+    m_pending.clear();
+    m_root = m_committed.root;
+    m_count = m_committed.count;
+    m_deadBytes = m_committed.deadBytes;
+}
+
+
+//===========================================================================
+//    Compaction
+//===========================================================================
+
+// Copy the records and nodes under slot to file, children first.
+// Returns the slot in the new file.
+uint64 CHashTrieStore::CopyLive(CFileWriter& file, uint64 slot)
+{
+    if ((slot & HASH_TRIE_IMAGE_NODE_BIT) == 0)
+    {
+        const CHashTrieRecord* record = GetRecord(slot);
+        uint64 offset = file.GetOffset();
+        file.Write(record, (size_t)CHashTrieRecord::GetSize(record->keySize, record->valueSize));
+        return offset;
+    }
+
+    const CHashTrieImageNode* node = GetNode(slot);
+    std::vector<uint64> copy((size_t)(CHashTrieImageNode::GetSize(node->count) / sizeof(uint64)));
+    memcpy(copy.data(), node, copy.size() * sizeof(uint64));
+
+    CHashTrieImageNode* newNode = (CHashTrieImageNode *)copy.data();
+    for (uint32 i = 0; i < newNode->count; i++)
+        newNode->slots[i] = CopyLive(file, newNode->slots[i]);
+
+    uint64 offset = file.GetOffset();
+    file.Write(copy.data(), copy.size() * sizeof(uint64));
+    return offset | HASH_TRIE_IMAGE_NODE_BIT;
+}
+
+bool CHashTrieStore::Compact()
+{
+    if (!Commit())
+        return false;
+
+    const std::string path = m_path;
+    const std::string temp = path + ".compact";
+    {
+        CFileWriter file;
+        if (!file.Open(temp.c_str()))
+            return false;
+
+        CHashTrieStoreHeader header = {};
+        memcpy(header.magic, HASH_TRIE_STORE_MAGIC, sizeof(header.magic));
+        header.version = CHashTrieStoreHeader::VERSION;
+        file.Write(&header, sizeof(header));
+        file.WriteZeros((size_t)(HASH_TRIE_STORE_DATA_OFFSET - sizeof(header)));
+
+        CHashTrieStoreRoot root = {};
+        root.sequence = m_committed.sequence + 1;
+        root.root     = (m_root != 0) ? CopyLive(file, m_root) : 0;
+        root.size     = file.GetOffset();
+        root.count    = m_count;
+        if (!WriteRoot(file, root) || !file.Close())
+        {
+            remove(temp.c_str());
+            return false;
+        }
+    }
+
+    // The file is replaced at once, so a crash leaves either version
+    Close();
+    if (!RenameFile(temp.c_str(), path.c_str()))
+    {
+        remove(temp.c_str());
+        Open(path.c_str());
+        return false;
+    }
+    return Open(path.c_str());
+}
+
+
+//===========================================================================
+//    Copy-on-write updates
+//===========================================================================
+
+// Reserve size bytes (a multiple of 8) at the end. Returns their offset.
+uint64 CHashTrieStore::Append(uint64 size)
+{
+    assert(size % sizeof(uint64) == 0);
+    uint64 offset = GetSize();
+    m_pending.resize(m_pending.size() + (size_t)(size / sizeof(uint64)));
+    return offset;
+}